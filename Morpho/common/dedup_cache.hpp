@@ -0,0 +1,97 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <stb_ds.h>
+#include "common/generational_arena.hpp"
+#include "common/utils.hpp"
+
+namespace Morpho {
+
+struct DedupCacheStats {
+    uint32_t entry_count;
+    uint64_t hit_count;
+};
+
+// Reference counted handles of objects created from equal keys.
+// Keys are compared bytewise, so they have to be canonical: padding and fields that don't matter zeroed.
+// A key whose hash collides with a cached one stays uncached, its object just isn't shared.
+// NOTE: zeroed memory is an empty cache.
+template<typename T, typename K>
+class DedupCache {
+public:
+    // Adds a reference to the object created from key, null if there is none.
+    Handle<T> acquire(const K& key);
+    // The object created from key starts with a single reference.
+    void add(const K& key, Handle<T> handle);
+    // Returns true if it was the last reference and the object has to be destroyed, uncached ones always are.
+    bool release(Handle<T> handle);
+    DedupCacheStats get_stats() const;
+    void destroy();
+private:
+    struct Entry {
+        K key;
+        Handle<T> handle;
+        uint32_t ref_count;
+    };
+    // stb_ds hash maps, entries by key hash and key hashes by handle index.
+    struct { uint64_t key; Entry value; }* entries;
+    struct { uint32_t key; uint64_t value; }* key_hashes;
+    uint64_t hit_count;
+};
+
+template<typename T, typename K>
+Handle<T> DedupCache<T, K>::acquire(const K& key) {
+    uint64_t hash = hash_bytes(&key, sizeof(K));
+    auto* item = hmgetp_null(entries, hash);
+    if (item == nullptr || memcmp(&item->value.key, &key, sizeof(K)) != 0) {
+        return Handle<T>::null();
+    }
+    item->value.ref_count++;
+    hit_count++;
+    return item->value.handle;
+}
+
+template<typename T, typename K>
+void DedupCache<T, K>::add(const K& key, Handle<T> handle) {
+    uint64_t hash = hash_bytes(&key, sizeof(K));
+    if (hmgetp_null(entries, hash) != nullptr) {
+        return;
+    }
+    Entry entry = { .key = key, .handle = handle, .ref_count = 1, };
+    hmput(entries, hash, entry);
+    uint32_t index = handle.index;
+    hmput(key_hashes, index, hash);
+}
+
+template<typename T, typename K>
+bool DedupCache<T, K>::release(Handle<T> handle) {
+    uint32_t index = handle.index;
+    auto* key_hash = hmgetp_null(key_hashes, index);
+    if (key_hash == nullptr) {
+        return true;
+    }
+    uint64_t hash = key_hash->value;
+    auto* item = hmgetp_null(entries, hash);
+    assert(item != nullptr && item->value.handle == handle && item->value.ref_count != 0);
+    if (--item->value.ref_count != 0) {
+        return false;
+    }
+    hmdel(entries, hash);
+    hmdel(key_hashes, index);
+    return true;
+}
+
+template<typename T, typename K>
+DedupCacheStats DedupCache<T, K>::get_stats() const {
+    return { .entry_count = (uint32_t)hmlen(entries), .hit_count = hit_count, };
+}
+
+template<typename T, typename K>
+void DedupCache<T, K>::destroy() {
+    hmfree(entries);
+    hmfree(key_hashes);
+    hit_count = 0;
+}
+
+}
@@ -1,65 +1,505 @@
 #include "common/draw_stream.hpp"
+#include "vulkan/resource_manager.hpp"
+#include <string.h>
+#include <stb_ds.h>
 
 namespace Morpho {
 
-DrawStream::DrawCall DrawStream::DrawCall::null() {
-    Handle<Vulkan::DescriptorSet> null_ds = Handle<Vulkan::DescriptorSet>::null();
-    Handle<Vulkan::Buffer> null_buffer = Handle<Vulkan::Buffer>::null();
-    return {
-        .descriptor_sets = { null_ds, null_ds, null_ds },
-        .pipeline = Handle<Vulkan::Pipeline>::null(),
-        .index_buffer = null_buffer,
-        .vertex_buffers = { null_buffer, null_buffer, null_buffer, null_buffer, },
-        .index_offset = 0,
-        .index_count = 0,
-    };
+template<typename T>
+void DrawStream::write(const T& value) {
+    uint8_t** target = recording_segment != 0 ? &segments[recording_segment - 1].stream : &stream;
+    uint64_t stream_size = arrlen(*target);
+    if (target == &stream && stream_size == 0) {
+        stream_size = sizeof(Header);
+    }
+    arrsetlen(*target, stream_size + sizeof(T));
+    memcpy(&(*target)[stream_size], &value, sizeof(T));
 }
 
-void DrawStream::draw_indexed(uint32_t index_count, uint32_t index_offset) {
-    current_draw_call.index_count = index_count;
-    current_draw_call.index_offset = index_offset;
-    uint64_t stream_size = arrlen(stream);
-    arrsetlen(stream, stream_size + sizeof(current_draw_call));
-    memcpy(&stream[stream_size], &current_draw_call, sizeof(current_draw_call));
+template<typename U, typename I>
+void DrawStream::write_draw_parameters(const DrawState& state, uint32_t mask) {
+    if (mask & INDEX_COUNT) {
+        write((U)state.index_count);
+    }
+    if (mask & FIRST_INDEX) {
+        write((U)state.first_index);
+    }
+    if (mask & VERTEX_OFFSET) {
+        write((I)state.vertex_offset);
+    }
+    if (mask & INSTANCE_COUNT) {
+        write((U)state.instance_count);
+    }
+    if (mask & FIRST_INSTANCE) {
+        write((U)state.first_instance);
+    }
+}
+
+// Stable LSD radix sort by key, 8 bits per pass. Passes where every key has the same digit are skipped.
+void DrawStream::radix_sort(SortItem* items, SortItem* scratch, uint32_t count) {
+    uint32_t histograms[8][256] = {};
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t pass = 0; pass < 8; pass++) {
+            histograms[pass][(items[i].key >> (pass * 8)) & 0xFF]++;
+        }
+    }
+    SortItem* src = items;
+    SortItem* dst = scratch;
+    for (uint32_t pass = 0; pass < 8; pass++) {
+        uint32_t shift = pass * 8;
+        uint32_t* histogram = histograms[pass];
+        if (histogram[(src[0].key >> shift) & 0xFF] == count) {
+            continue;
+        }
+        uint32_t offset = 0;
+        for (uint32_t digit = 0; digit < 256; digit++) {
+            uint32_t digit_count = histogram[digit];
+            histogram[digit] = offset;
+            offset += digit_count;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            dst[histogram[(src[i].key >> shift) & 0xFF]++] = src[i];
+        }
+        SortItem* tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (src != items) {
+        memcpy(items, src, count * sizeof(SortItem));
+    }
+}
+
+// Non-negative floats compare the same way as their bit patterns, so the top bits are a monotonic quantization.
+static uint64_t quantize_depth(float depth, uint32_t bits) {
+    if (!(depth > 0.0f)) {
+        return 0;
+    }
+    uint32_t depth_bits;
+    memcpy(&depth_bits, &depth, sizeof(depth_bits));
+    return depth_bits >> (32 - bits);
+}
+
+uint64_t DrawStream::make_sort_key() const {
+    uint64_t pipeline = handles.pipeline.index & 0x3FF;
+    uint64_t material = handles.descriptor_sets[1].index & 0xFFF;
+    uint64_t set_3 = handles.descriptor_sets[2].index & 0xFFF;
+    if (sort_policy == SortPolicy::FRONT_TO_BACK) {
+        return quantize_depth(sort_depth, 16) << 48
+            | pipeline << 38
+            | material << 26
+            | set_3 << 14
+            | (uint64_t)(handles.vertex_buffers[0].index & 0x7F) << 7
+            | (uint64_t)(handles.index_buffer.index & 0x7F);
+    }
+    return pipeline << 54
+        | material << 42
+        | set_3 << 30
+        | (uint64_t)(handles.vertex_buffers[0].index & 0xFF) << 22
+        | (uint64_t)(handles.index_buffer.index & 0xFF) << 14
+        | quantize_depth(sort_depth, 14);
+}
+
+void DrawStream::draw_indexed(
+    uint32_t index_count,
+    uint32_t first_index,
+    int32_t vertex_offset,
+    uint32_t instance_count,
+    uint32_t first_instance
+) {
+    current.index_count = index_count;
+    current.first_index = first_index;
+    current.vertex_offset = vertex_offset;
+    current.instance_count = instance_count;
+    current.first_instance = first_instance;
+    record(false, 0);
+}
+
+void DrawStream::draw_instance(uint32_t index_count, uint32_t first_index, int32_t vertex_offset, uint32_t payload) {
+    current.index_count = index_count;
+    current.first_index = first_index;
+    current.vertex_offset = vertex_offset;
+    assert(recording_segment == 0);
+    record(true, payload);
+}
+
+void DrawStream::record(bool is_instance, uint32_t payload) {
+    // Bound pipeline is still compiling and has no ready fallback.
+    if (current.pipeline == VK_NULL_HANDLE && handles.pipeline != Handle<Vulkan::Pipeline>::null()) {
+        return;
+    }
+    if (sort_policy == SortPolicy::NONE) {
+        encode_draw(current, is_instance, payload);
+        return;
+    }
+    // Every pending draw keeps its full state, so reordering never leaks state between draws.
+    arrput(sort_items, (SortItem{ .key = make_sort_key(), .index = (uint32_t)arrlen(pending) }));
+    arrput(pending, (PendingDraw{ .state = current, .payload = payload, .is_instance = is_instance, }));
+}
+
+static bool is_same_draw(const DrawStream::DrawState& lhs, const DrawStream::DrawState& rhs) {
+    if (
+        lhs.pipeline != rhs.pipeline
+        || lhs.index_buffer != rhs.index_buffer
+        || lhs.index_buffer_offset != rhs.index_buffer_offset
+        || lhs.index_type != rhs.index_type
+        || lhs.index_count != rhs.index_count
+        || lhs.first_index != rhs.first_index
+        || lhs.vertex_offset != rhs.vertex_offset
+    ) {
+        return false;
+    }
+    for (uint32_t i = 0; i < DrawStream::descriptor_set_count; i++) {
+        if (lhs.descriptor_sets[i] != rhs.descriptor_sets[i]) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < DrawStream::vertex_buffer_count; i++) {
+        if (lhs.vertex_buffers[i] != rhs.vertex_buffers[i] || lhs.vertex_buffer_offsets[i] != rhs.vertex_buffer_offsets[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void DrawStream::encode_draw(const DrawState& state, bool is_instance, uint32_t payload) {
+    if (!is_instance) {
+        close_instances();
+        encode(state);
+        return;
+    }
+    if (has_open_instances && is_same_draw(open_instances, state)) {
+        open_instances.instance_count++;
+    } else {
+        close_instances();
+        open_instances = state;
+        open_instances.instance_count = 1;
+        open_instances.first_instance = (uint32_t)arrlen(instance_payloads);
+        has_open_instances = true;
+    }
+    arrput(instance_payloads, payload);
+}
+
+void DrawStream::close_instances() {
+    if (has_open_instances) {
+        encode(open_instances);
+        has_open_instances = false;
+    }
+}
+
+void DrawStream::flush() {
+    uint32_t count = (uint32_t)arrlen(sort_items);
+    if (count != 0) {
+        arrsetlen(sort_scratch, count);
+        radix_sort(sort_items, sort_scratch, count);
+        for (uint32_t i = 0; i < count; i++) {
+            const PendingDraw& draw = pending[sort_items[i].index];
+            encode_draw(draw.state, draw.is_instance, draw.payload);
+        }
+        arrsetlen(sort_items, 0);
+        arrsetlen(pending, 0);
+    }
+    close_instances();
+}
+
+void DrawStream::set_sort_policy(SortPolicy policy) {
+    flush();
+    sort_policy = policy;
+}
+
+void DrawStream::set_sort_depth(float depth) {
+    sort_depth = depth;
+}
+
+void DrawStream::encode(const DrawState& state) {
+    uint32_t mask = 0;
+    if (force_full_state) {
+        mask = all_fields;
+        force_full_state = false;
+    }
+    if (state.pipeline != encoded.pipeline) {
+        mask |= PIPELINE;
+    }
+    for (uint32_t i = 0; i < descriptor_set_count; i++) {
+        if (state.descriptor_sets[i] != encoded.descriptor_sets[i]) {
+            mask |= DESCRIPTOR_SET_1 << i;
+        }
+    }
+    if (state.index_buffer != encoded.index_buffer) {
+        mask |= INDEX_BUFFER;
+    }
+    if (state.index_buffer_offset != encoded.index_buffer_offset) {
+        mask |= INDEX_BUFFER_OFFSET;
+    }
+    if (state.index_type != encoded.index_type) {
+        mask |= INDEX_TYPE;
+    }
+    for (uint32_t i = 0; i < vertex_buffer_count; i++) {
+        if (state.vertex_buffers[i] != encoded.vertex_buffers[i]) {
+            mask |= VERTEX_BUFFER_0 << i;
+        }
+        if (state.vertex_buffer_offsets[i] != encoded.vertex_buffer_offsets[i]) {
+            mask |= VERTEX_BUFFER_OFFSET_0 << i;
+        }
+    }
+    if (state.index_count != encoded.index_count) {
+        mask |= INDEX_COUNT;
+    }
+    if (state.first_index != encoded.first_index) {
+        mask |= FIRST_INDEX;
+    }
+    if (state.vertex_offset != encoded.vertex_offset) {
+        mask |= VERTEX_OFFSET;
+    }
+    if (state.instance_count != encoded.instance_count) {
+        mask |= INSTANCE_COUNT;
+    }
+    if (state.first_instance != encoded.first_instance) {
+        mask |= FIRST_INSTANCE;
+    }
+    mask &= ~excluded_fields;
+    bool is_compact = (mask & draw_parameter_fields) != 0
+        && (!(mask & INDEX_COUNT) || state.index_count <= UINT16_MAX)
+        && (!(mask & FIRST_INDEX) || state.first_index <= UINT16_MAX)
+        && (!(mask & VERTEX_OFFSET) || (state.vertex_offset >= INT16_MIN && state.vertex_offset <= INT16_MAX))
+        && (!(mask & INSTANCE_COUNT) || state.instance_count <= UINT16_MAX)
+        && (!(mask & FIRST_INSTANCE) || state.first_instance <= UINT16_MAX);
+    if (is_compact) {
+        mask |= COMPACT_DRAW_PARAMETERS;
+    }
+
+    write(mask);
+    if (mask & PIPELINE) {
+        write(state.pipeline);
+        write(state.pipeline_layout);
+    }
+    for (uint32_t i = 0; i < descriptor_set_count; i++) {
+        if (mask & (DESCRIPTOR_SET_1 << i)) {
+            write(state.descriptor_sets[i]);
+        }
+    }
+    if (mask & INDEX_BUFFER) {
+        write(state.index_buffer);
+    }
+    if (mask & INDEX_BUFFER_OFFSET) {
+        write(state.index_buffer_offset);
+    }
+    if (mask & INDEX_TYPE) {
+        write(state.index_type);
+    }
+    for (uint32_t i = 0; i < vertex_buffer_count; i++) {
+        if (mask & (VERTEX_BUFFER_0 << i)) {
+            write(state.vertex_buffers[i]);
+        }
+    }
+    for (uint32_t i = 0; i < vertex_buffer_count; i++) {
+        if (mask & (VERTEX_BUFFER_OFFSET_0 << i)) {
+            write(state.vertex_buffer_offsets[i]);
+        }
+    }
+    if (is_compact) {
+        write_draw_parameters<uint16_t, int16_t>(state, mask);
+    } else {
+        write_draw_parameters<uint32_t, int32_t>(state, mask);
+    }
+    encoded = state;
+    if (recording_segment != 0) {
+        segments[recording_segment - 1].draw_count++;
+    } else {
+        draw_count++;
+    }
+}
+
+void DrawStream::begin_segment(uint32_t segment) {
+    assert(recording_segment == 0);
+    flush();
+    uint32_t segment_count = (uint32_t)arrlen(segments);
+    if (segment >= segment_count) {
+        arrsetlen(segments, segment + 1);
+        memset(&segments[segment_count], 0, (segment + 1 - segment_count) * sizeof(Segment));
+    }
+    arrsetlen(segments[segment].stream, 0);
+    segments[segment].draw_count = 0;
+    segments[segment].is_valid = false;
+    recording_segment = segment + 1;
+    force_full_state = true;
+    is_stream_stale = true;
+}
+
+void DrawStream::end_segment() {
+    assert(recording_segment != 0);
+    flush();
+    segments[recording_segment - 1].is_valid = true;
+    recording_segment = 0;
+    force_full_state = false;
+}
+
+void DrawStream::invalidate_segment(uint32_t segment) {
+    if (segment < arrlen(segments) && segments[segment].is_valid) {
+        segments[segment].is_valid = false;
+        is_stream_stale = true;
+    }
+}
+
+void DrawStream::invalidate() {
+    for (uint32_t i = 0; i < arrlen(segments); i++) {
+        invalidate_segment(i);
+    }
+}
+
+bool DrawStream::is_segment_valid(uint32_t segment) const {
+    return segment < arrlen(segments) && segments[segment].is_valid;
+}
+
+void DrawStream::build_stream() {
+    if (!is_stream_stale) {
+        return;
+    }
+    arrsetlen(stream, sizeof(Header));
+    draw_count = 0;
+    for (uint32_t i = 0; i < arrlen(segments); i++) {
+        const Segment& segment = segments[i];
+        if (!segment.is_valid) {
+            continue;
+        }
+        uint64_t stream_size = arrlen(stream);
+        uint64_t segment_size = arrlen(segment.stream);
+        arrsetlen(stream, stream_size + segment_size);
+        memcpy(&stream[stream_size], segment.stream, segment_size);
+        draw_count += segment.draw_count;
+    }
+    if (draw_count == 0) {
+        arrsetlen(stream, 0);
+    }
+    is_stream_stale = false;
+}
+
+void DrawStream::write_header() {
+    if (arrlen(stream) == 0) {
+        return;
+    }
+    Header header = { .fields = all_fields & ~excluded_fields, .draw_count = draw_count, };
+    memcpy(stream, &header, sizeof(header));
+}
+
+void DrawStream::set_fields(uint32_t fields) {
+    assert((fields & (INDEX_COUNT | FIRST_INDEX)) == (INDEX_COUNT | FIRST_INDEX));
+    uint32_t excluded = all_fields & ~fields;
+    if (excluded == excluded_fields) {
+        return;
+    }
+    assert(recording_segment == 0);
+    flush();
+    assert(draw_count == 0 || arrlen(segments) != 0);
+    excluded_fields = excluded;
+    invalidate();
 }
 
 void DrawStream::bind_descriptor_set(Handle<Vulkan::DescriptorSet> ds, uint32_t set_index) {
-    assert(set_index != 0);
-    current_draw_call.descriptor_sets[set_index - 1] = ds;
+    assert(set_index != 0 && set_index <= descriptor_set_count);
+    if (handles.descriptor_sets[set_index - 1] == ds) {
+        return;
+    }
+    handles.descriptor_sets[set_index - 1] = ds;
+    current.descriptor_sets[set_index - 1] = Vulkan::ResourceManager::get()->get_vk_descriptor_set(ds);
 }
 
 void DrawStream::bind_vertex_buffer(Handle<Vulkan::Buffer> buffer, uint32_t binding, uint32_t offset) {
-    current_draw_call.vertex_buffers[binding] = buffer;
-    current_draw_call.vertex_buffer_offsets[binding] = offset;
+    assert(binding < vertex_buffer_count);
+    current.vertex_buffer_offsets[binding] = offset;
+    if (handles.vertex_buffers[binding] == buffer) {
+        return;
+    }
+    handles.vertex_buffers[binding] = buffer;
+    current.vertex_buffers[binding] = Vulkan::ResourceManager::get()->get_vk_buffer(buffer);
 }
 
-void DrawStream::bind_index_buffer(Handle<Vulkan::Buffer> buffer, uint32_t offset) {
-    current_draw_call.index_buffer = buffer;
-    current_draw_call.index_buffer_offset = offset;
+void DrawStream::bind_index_buffer(Handle<Vulkan::Buffer> buffer, uint32_t offset, VkIndexType index_type) {
+    current.index_buffer_offset = offset;
+    current.index_type = index_type;
+    if (handles.index_buffer == buffer) {
+        return;
+    }
+    handles.index_buffer = buffer;
+    current.index_buffer = Vulkan::ResourceManager::get()->get_vk_buffer(buffer);
 }
 
 void DrawStream::bind_pipeline(Handle<Vulkan::Pipeline> pipeline) {
-    current_draw_call.pipeline = pipeline;
+    if (handles.pipeline == pipeline) {
+        return;
+    }
+    Vulkan::ResourceManager* rm = Vulkan::ResourceManager::get();
+    handles.pipeline = pipeline;
+    current.pipeline = rm->get_vk_pipeline(pipeline);
+    current.pipeline_layout = rm->get_vk_pipeline_layout(pipeline);
 }
 
 void DrawStream::clear_state() {
-    current_draw_call = DrawCall::null();
+    handles = {};
+    current = {};
+    sort_depth = 0.0f;
 }
 
 uint8_t* DrawStream::get_stream() {
+    flush();
+    build_stream();
+    write_header();
     return stream;
 }
 
 uint64_t DrawStream::get_size() {
+    flush();
+    build_stream();
     return arrlen(stream);
 }
 
+uint32_t DrawStream::get_draw_count() {
+    flush();
+    build_stream();
+    return draw_count;
+}
+
+const uint32_t* DrawStream::get_instance_payloads() {
+    flush();
+    return instance_payloads;
+}
+
+uint32_t DrawStream::get_instance_payload_count() {
+    flush();
+    return (uint32_t)arrlen(instance_payloads);
+}
+
 void DrawStream::destroy() {
     arrfree(stream);
+    arrfree(sort_items);
+    arrfree(sort_scratch);
+    arrfree(pending);
+    arrfree(instance_payloads);
+    for (uint32_t i = 0; i < arrlen(segments); i++) {
+        arrfree(segments[i].stream);
+    }
+    arrfree(segments);
 }
 
 void DrawStream::reset() {
     arrsetlen(stream, 0);
+    arrsetlen(sort_items, 0);
+    arrsetlen(pending, 0);
+    arrsetlen(instance_payloads, 0);
+    // Segments stay allocated, reset streams are reused every frame and only destroy frees them.
+    for (uint32_t i = 0; i < arrlen(segments); i++) {
+        arrsetlen(segments[i].stream, 0);
+        segments[i].draw_count = 0;
+        segments[i].is_valid = false;
+    }
+    recording_segment = 0;
+    force_full_state = false;
+    is_stream_stale = false;
+    excluded_fields = 0;
+    has_open_instances = false;
+    draw_count = 0;
+    encoded = {};
+    sort_policy = SortPolicy::NONE;
+    clear_state();
 }
 
 }
@@ -1,39 +1,257 @@
+#pragma once
 #include "vulkan/resources.hpp"
+#include <string.h>
+#include <bit>
 
 namespace Morpho {
 
-// NOTE: Unoptimized stream implementaiton.
+// Every draw in the stream is a 32-bit mask of Field bits
+// followed only by the fields that changed since the previous draw (in bit order).
+// Handles are resolved to Vulkan objects at record time, so decoding never touches ResourceManager.
+// Retained streams are recorded in segments that outlive the frame, see begin_segment.
 class DrawStream {
 public:
     DrawStream() = default;
 
-    void draw_indexed(uint32_t index_count, uint32_t index_offset);
+    // How draws recorded after set_sort_policy are reordered before they are encoded.
+    // Draws are only reordered within a run of the same policy, so passes sharing a stream keep their order.
+    enum class SortPolicy {
+        NONE,
+        // pipeline > material (set 2) > set 3 > buffers > depth
+        STATE,
+        // depth > pipeline > material (set 2) > set 3 > buffers
+        FRONT_TO_BACK,
+    };
+
+    enum Field : uint32_t {
+        PIPELINE = 1u << 0,                 // VkPipeline, VkPipelineLayout
+        DESCRIPTOR_SET_1 = 1u << 1,         // VkDescriptorSet
+        DESCRIPTOR_SET_2 = 1u << 2,
+        DESCRIPTOR_SET_3 = 1u << 3,
+        INDEX_BUFFER = 1u << 4,             // VkBuffer
+        INDEX_BUFFER_OFFSET = 1u << 5,      // uint32_t
+        INDEX_TYPE = 1u << 6,               // VkIndexType
+        VERTEX_BUFFER_0 = 1u << 7,          // VkBuffer
+        VERTEX_BUFFER_1 = 1u << 8,
+        VERTEX_BUFFER_2 = 1u << 9,
+        VERTEX_BUFFER_3 = 1u << 10,
+        VERTEX_BUFFER_OFFSET_0 = 1u << 11,  // uint32_t
+        VERTEX_BUFFER_OFFSET_1 = 1u << 12,
+        VERTEX_BUFFER_OFFSET_2 = 1u << 13,
+        VERTEX_BUFFER_OFFSET_3 = 1u << 14,
+        INDEX_COUNT = 1u << 15,             // uint32_t or uint16_t
+        FIRST_INDEX = 1u << 16,             // uint32_t or uint16_t
+        VERTEX_OFFSET = 1u << 17,           // int32_t or int16_t
+        INSTANCE_COUNT = 1u << 18,          // uint32_t or uint16_t
+        FIRST_INSTANCE = 1u << 19,          // uint32_t or uint16_t
+        // Not a field: every draw parameter in this record is stored in 16 bits.
+        COMPACT_DRAW_PARAMETERS = 1u << 31,
+    };
+
+    static const uint32_t descriptor_set_count = 3;
+    static const uint32_t vertex_buffer_count = 4;
+    // Instance payloads are read through an instance rate vertex buffer bound right after the mesh bindings.
+    static const uint32_t instance_buffer_binding = vertex_buffer_count;
+    static const uint32_t descriptor_set_fields = DESCRIPTOR_SET_1 | DESCRIPTOR_SET_2 | DESCRIPTOR_SET_3;
+    static const uint32_t vertex_buffer_fields = VERTEX_BUFFER_0 | VERTEX_BUFFER_1 | VERTEX_BUFFER_2 | VERTEX_BUFFER_3;
+    static const uint32_t vertex_buffer_offset_fields = VERTEX_BUFFER_OFFSET_0 | VERTEX_BUFFER_OFFSET_1
+        | VERTEX_BUFFER_OFFSET_2 | VERTEX_BUFFER_OFFSET_3;
+    static const uint32_t draw_parameter_fields = INDEX_COUNT | FIRST_INDEX | VERTEX_OFFSET
+        | INSTANCE_COUNT | FIRST_INSTANCE;
+    static const uint32_t all_fields = (FIRST_INSTANCE << 1) - 1;
+    // Field sets with stock specialized decoders.
+    // Material (set 2) is bound outside of the stream or not used at all.
+    static const uint32_t no_material_change_fields = all_fields & ~DESCRIPTOR_SET_2;
+    // Positions only, in vertex buffer 0.
+    static const uint32_t depth_only_fields = (no_material_change_fields
+        & ~(vertex_buffer_fields | vertex_buffer_offset_fields))
+        | VERTEX_BUFFER_0 | VERTEX_BUFFER_OFFSET_0;
+
+    // Written at the start of every non-empty stream.
+    struct Header {
+        // Fields the draws may contain, decoders are picked by it.
+        uint32_t fields;
+        uint32_t draw_count;
+    };
+
+    void draw_indexed(
+        uint32_t index_count,
+        uint32_t first_index,
+        int32_t vertex_offset = 0,
+        uint32_t instance_count = 1,
+        uint32_t first_instance = 0
+    );
+    // Consecutive instances with identical state are merged into one draw,
+    // payload lands in get_instance_payloads() at the instance's gl_InstanceIndex.
+    void draw_instance(uint32_t index_count, uint32_t first_index, int32_t vertex_offset, uint32_t payload);
     void bind_descriptor_set(Handle<Vulkan::DescriptorSet> ds, uint32_t set_index);
     void bind_vertex_buffer(Handle<Vulkan::Buffer> buffer, uint32_t binding, uint32_t offset);
-    void bind_index_buffer(Handle<Vulkan::Buffer> buffer, uint32_t offset);
+    void bind_index_buffer(Handle<Vulkan::Buffer> buffer, uint32_t offset, VkIndexType index_type = VK_INDEX_TYPE_UINT16);
     void bind_pipeline(Handle<Vulkan::Pipeline> pipeline);
     void clear_state();
+    // Changes to fields outside of the set are dropped by the encoder, so streams stay decodable by smaller decoders.
+    // Retained segments recorded with other fields are invalidated.
+    void set_fields(uint32_t fields);
+    // Encodes pending sorted draws and switches the policy for the following draws.
+    void set_sort_policy(SortPolicy policy);
+    // View space depth of the following draws, only used for sort keys.
+    void set_sort_depth(float depth);
+    void flush();
     uint8_t* get_stream();
     uint64_t get_size();
+    uint32_t get_draw_count();
+    // Has to be uploaded by the owner of the stream and passed to the decoder as DrawPassInfo::instance_buffer.
+    const uint32_t* get_instance_payloads();
+    uint32_t get_instance_payload_count();
+    // Segments are independently re-recordable ranges of a retained stream, the stream is their concatenation.
+    // First draw of a segment carries the full state, so segments never depend on their neighbours.
+    // Draws are sorted within a segment and instanced draws can't be retained.
+    void begin_segment(uint32_t segment);
+    void end_segment();
+    // Invalid segments are left out of the stream until they are recorded again.
+    void invalidate_segment(uint32_t segment);
+    void invalidate();
+    bool is_segment_valid(uint32_t segment) const;
     void destroy();
     void reset();
 
-    // just keep it public for simplicity for now
-    struct DrawCall {
-        Handle<Vulkan::DescriptorSet> descriptor_sets[3];
-        Handle<Vulkan::Pipeline> pipeline;
-        Handle<Vulkan::Buffer> index_buffer;
-        uint32_t index_buffer_offset;
-        Handle<Vulkan::Buffer> vertex_buffers[4];
-        uint32_t vertex_buffer_offsets[4];
-        uint16_t index_offset;
-        uint16_t index_count;
+    enum class HandleType {
+        PIPELINE,
+        PIPELINE_LAYOUT,
+        DESCRIPTOR_SET,
+        BUFFER,
+    };
 
-        static DrawCall null();
+    // Replaces every Vulkan handle in an encoded stream with fn(HandleType, uint64_t handle).
+    // Used to move streams between devices, see DrawCaptureRecorder.
+    template<typename LambdaT>
+    static void remap_handles(uint8_t* stream, uint64_t size, LambdaT&& fn);
+
+    // Resolved state of a single draw. Decoders keep one of these and apply masks to it.
+    struct DrawState {
+        VkPipeline pipeline;
+        VkPipelineLayout pipeline_layout;
+        VkDescriptorSet descriptor_sets[descriptor_set_count];
+        VkBuffer index_buffer;
+        uint32_t index_buffer_offset;
+        VkIndexType index_type;
+        VkBuffer vertex_buffers[vertex_buffer_count];
+        uint32_t vertex_buffer_offsets[vertex_buffer_count];
+        uint32_t index_count;
+        uint32_t first_index;
+        int32_t vertex_offset;
+        uint32_t instance_count;
+        uint32_t first_instance;
     };
 private:
+    struct SortItem {
+        uint64_t key;
+        uint32_t index;
+    };
+
+    struct Segment {
+        uint8_t* stream;
+        uint32_t draw_count;
+        bool is_valid;
+    };
+
+    struct PendingDraw {
+        DrawState state;
+        uint32_t payload;
+        bool is_instance;
+    };
+
+    // Handles of the current state, only to skip resolving the same handle twice in a row.
+    struct BoundHandles {
+        Handle<Vulkan::Pipeline> pipeline;
+        Handle<Vulkan::DescriptorSet> descriptor_sets[descriptor_set_count];
+        Handle<Vulkan::Buffer> index_buffer;
+        Handle<Vulkan::Buffer> vertex_buffers[vertex_buffer_count];
+    };
+
+    // NOTE: instances are calloc'ed by the pools, so zeroed memory has to be a valid state.
     uint8_t* stream = nullptr;
-    DrawCall current_draw_call = DrawCall::null();
+    uint32_t draw_count = 0;
+    BoundHandles handles{};
+    DrawState current{};
+    DrawState encoded{};
+    SortPolicy sort_policy = SortPolicy::NONE;
+    float sort_depth = 0.0f;
+    // Complement of the field set, so zeroed memory means all fields.
+    uint32_t excluded_fields = 0;
+    SortItem* sort_items = nullptr;
+    SortItem* sort_scratch = nullptr;
+    PendingDraw* pending = nullptr;
+    // Draw that following instances with the same state are merged into, not encoded until it is closed.
+    DrawState open_instances{};
+    bool has_open_instances = false;
+    uint32_t* instance_payloads = nullptr;
+    Segment* segments = nullptr;
+    // 1-based index of the segment being recorded, 0 means draws go straight into stream.
+    uint32_t recording_segment = 0;
+    bool force_full_state = false;
+    bool is_stream_stale = false;
+
+    template<typename T>
+    void write(const T& value);
+    template<typename U, typename I>
+    void write_draw_parameters(const DrawState& state, uint32_t mask);
+    void record(bool is_instance, uint32_t payload);
+    void encode_draw(const DrawState& state, bool is_instance, uint32_t payload);
+    void close_instances();
+    void encode(const DrawState& state);
+    void build_stream();
+    void write_header();
+    uint64_t make_sort_key() const;
+    static void radix_sort(SortItem* items, SortItem* scratch, uint32_t count);
+    template<typename LambdaT>
+    static uint8_t* remap_handle(uint8_t* it, HandleType type, LambdaT& fn);
 };
 
+template<typename LambdaT>
+uint8_t* DrawStream::remap_handle(uint8_t* it, HandleType type, LambdaT& fn) {
+    static_assert(sizeof(VkPipeline) == sizeof(uint64_t) && sizeof(VkBuffer) == sizeof(uint64_t));
+    uint64_t handle;
+    memcpy(&handle, it, sizeof(handle));
+    handle = fn(type, handle);
+    memcpy(it, &handle, sizeof(handle));
+    return it + sizeof(handle);
+}
+
+template<typename LambdaT>
+void DrawStream::remap_handles(uint8_t* stream, uint64_t size, LambdaT&& fn) {
+    if (size == 0) {
+        return;
+    }
+    uint8_t* it = stream + sizeof(Header);
+    uint8_t* end = stream + size;
+    while (it < end) {
+        uint32_t mask;
+        memcpy(&mask, it, sizeof(mask));
+        it += sizeof(mask);
+        if (mask & PIPELINE) {
+            it = remap_handle(it, HandleType::PIPELINE, fn);
+            it = remap_handle(it, HandleType::PIPELINE_LAYOUT, fn);
+        }
+        for (uint32_t i = 0; i < descriptor_set_count; i++) {
+            if (mask & (DESCRIPTOR_SET_1 << i)) {
+                it = remap_handle(it, HandleType::DESCRIPTOR_SET, fn);
+            }
+        }
+        if (mask & INDEX_BUFFER) {
+            it = remap_handle(it, HandleType::BUFFER, fn);
+        }
+        it += (mask & INDEX_BUFFER_OFFSET) ? sizeof(uint32_t) : 0;
+        it += (mask & INDEX_TYPE) ? sizeof(VkIndexType) : 0;
+        for (uint32_t i = 0; i < vertex_buffer_count; i++) {
+            if (mask & (VERTEX_BUFFER_0 << i)) {
+                it = remap_handle(it, HandleType::BUFFER, fn);
+            }
+        }
+        uint32_t parameter_size = (mask & COMPACT_DRAW_PARAMETERS) ? sizeof(uint16_t) : sizeof(uint32_t);
+        it += std::popcount(mask & vertex_buffer_offset_fields) * sizeof(uint32_t);
+        it += std::popcount(mask & draw_parameter_fields) * parameter_size;
+    }
+}
+
 }
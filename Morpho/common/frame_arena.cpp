@@ -0,0 +1,93 @@
+#include "common/frame_arena.hpp"
+#include "common/utils.hpp"
+#include <stdlib.h>
+#include <assert.h>
+
+namespace Morpho {
+
+std::atomic<uint64_t> FrameArena::growth_count{0};
+
+void FrameArena::init(FrameArena* arena, uint32_t frame_count, uint64_t block_size) {
+    assert(frame_count != 0 && frame_count <= max_frame_count);
+    memset(arena->slots, 0, sizeof(arena->slots));
+    arena->frame_count = frame_count;
+    // The first next_frame lands on slot 0, so callers rewinding at frame start stay in step with their frame index.
+    arena->frame = frame_count - 1;
+    arena->block_size = block_size;
+}
+
+void FrameArena::destroy() {
+    for (uint32_t i = 0; i < frame_count; i++) {
+        Block* block = slots[i].first;
+        while (block != nullptr) {
+            Block* next = block->next;
+            free(block);
+            block = next;
+        }
+        slots[i] = {};
+    }
+}
+
+void* FrameArena::allocate(uint64_t size, uint64_t alignment) {
+    // malloc only guarantees 16 bytes.
+    assert(is_pow2(alignment) && alignment <= 16);
+    Slot& slot = slots[frame];
+    const uint64_t header_size = align_up_pow2(sizeof(Block), 16);
+    uint64_t offset = align_up_pow2(slot.offset, alignment);
+    while (slot.current == nullptr || offset + size > slot.current->size) {
+        Block* next = slot.current != nullptr ? slot.current->next : slot.first;
+        if (next == nullptr || next->size < size) {
+            // Too small blocks are left in the chain, they are reused once the frame shrinks back.
+            uint64_t data_size = max(block_size, size);
+            Block* block = (Block*)malloc(header_size + data_size);
+            block->size = data_size;
+            block->next = next;
+            if (slot.current != nullptr) {
+                slot.current->next = block;
+            } else {
+                slot.first = block;
+            }
+            next = block;
+            count_growth();
+        }
+        slot.current = next;
+        offset = 0;
+    }
+    slot.offset = offset + size;
+    uint8_t* ptr = (uint8_t*)slot.current + header_size + offset;
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+void FrameArena::reserve(uint64_t size) {
+    const uint64_t header_size = align_up_pow2(sizeof(Block), 16);
+    for (uint32_t i = 0; i < frame_count; i++) {
+        Slot& slot = slots[i];
+        if (slot.first != nullptr && slot.first->size >= size) {
+            continue;
+        }
+        // The old blocks stay behind it, a slot in use keeps allocating from its current block.
+        uint64_t data_size = max(block_size, size);
+        Block* block = (Block*)malloc(header_size + data_size);
+        block->size = data_size;
+        block->next = slot.first;
+        slot.first = block;
+        count_growth();
+    }
+}
+
+void FrameArena::next_frame() {
+    frame = (frame + 1) % frame_count;
+    slots[frame].current = nullptr;
+    slots[frame].offset = 0;
+}
+
+uint64_t FrameArena::get_growth_count() {
+    return growth_count.load(std::memory_order_relaxed);
+}
+
+void FrameArena::count_growth() {
+    growth_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+namespace Morpho {
+
+// Linear allocator for data that lives until the GPU is done with the frame it was made for.
+// Each frame slot keeps its blocks, next_frame rewinds the slot that comes around again, so once
+// the slots have grown to what a frame needs, frames don't touch the heap.
+// Not thread-safe, every recording thread owns its arena.
+// NOTE: zeroed memory is an uninitialized arena, init before use.
+class FrameArena {
+public:
+    static const uint32_t max_frame_count = 4;
+    static const uint64_t default_block_size = 64 * 1024;
+
+    static void init(FrameArena* arena, uint32_t frame_count, uint64_t block_size = default_block_size);
+    void destroy();
+    // Memory is zeroed.
+    void* allocate(uint64_t size, uint64_t alignment = 16);
+    template<typename T>
+    T* allocate(uint32_t count = 1);
+    // Makes the first block of every slot hold at least size bytes, so frames allocating up to that
+    // from a rewound slot don't grow it.
+    void reserve(uint64_t size);
+    // Rewinds the next slot, the GPU must be done with the frame that used it.
+    void next_frame();
+
+    // Blocks grown by every arena, plus whatever pooled per-frame objects their users count
+    // (command buffers). Other heap traffic (stb_ds arrays, std containers) isn't tracked.
+    // See Context::expect_no_frame_growth.
+    static uint64_t get_growth_count();
+    static void count_growth();
+private:
+    struct Block {
+        Block* next;
+        uint64_t size;
+    };
+
+    struct Slot {
+        Block* first;
+        Block* current;
+        uint64_t offset;
+    };
+
+    Slot slots[max_frame_count];
+    uint32_t frame_count;
+    uint32_t frame;
+    uint64_t block_size;
+
+    static std::atomic<uint64_t> growth_count;
+};
+
+template<typename T>
+T* FrameArena::allocate(uint32_t count) {
+    return (T*)allocate(sizeof(T) * count, alignof(T));
+}
+
+}
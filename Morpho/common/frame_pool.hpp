@@ -1,4 +1,7 @@
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
 #include <stb_ds.h>
 
 namespace Morpho {
@@ -28,20 +31,22 @@ public:
     template<typename LambdaT>
     void destroy(LambdaT&& destroy_object);
     bool try_get(T* value);
+    // Takes up to count pooled items, returns how many were taken.
+    uint32_t try_get(T* values, uint32_t count);
     template<typename LambdaT>
     T get_or_add(LambdaT&& add);
     T get_or_add();
+    void get_or_add(T* values, uint32_t count);
+    // Returns items taken this frame that the GPU never saw, they don't wait for the frame to come around.
+    // Looks for them from the most recently taken one, so releasing what was just taken is cheap.
+    void release(const T* values, uint32_t count);
     void next_frame();
 private:
-    struct UsedResource {
-        uint32_t frame;
-        T resource;
-    };
-
     uint32_t frame;
     uint32_t frame_count;
     T* pool;
-    UsedResource* used;
+    // Items taken per frame slot, all of them go back to the pool when their slot comes around.
+    T** used;
     add_fn add;
     reset_fn reset;
     void* user_data;
@@ -53,7 +58,7 @@ void FramePool<T>::init(FramePool<T>* pool, const FramePool<T>::FramePoolInfo& i
     pool->frame = 0;
     pool->frame_count = info.frames_in_flight_count;
     pool->pool = nullptr;
-    pool->used = nullptr;
+    pool->used = (T**)calloc(info.frames_in_flight_count, sizeof(T*));
     pool->add = info.add;
     pool->reset = info.reset;
     pool->user_data = info.user_data;
@@ -62,27 +67,44 @@ void FramePool<T>::init(FramePool<T>* pool, const FramePool<T>::FramePoolInfo& i
 template<typename T>
 void FramePool<T>::destroy() {
     arrfree(pool);
-    arrfree(used);
+    for (uint32_t i = 0; i < frame_count; i++) {
+        arrfree(used[i]);
+    }
+    free(used);
+    used = nullptr;
 }
 
 template<typename T>
 template<typename LambdaT>
 void FramePool<T>::destroy(LambdaT&& destroy_object) {
-    for (uint32_t i = 0; i < arrsize(pool); i++) {
+    for (uint32_t i = 0; i < arrlen(pool); i++) {
         destroy_object(pool[i]);
     }
+    for (uint32_t i = 0; i < frame_count; i++) {
+        for (uint32_t j = 0; j < arrlen(used[i]); j++) {
+            destroy_object(used[i][j]);
+        }
+    }
     destroy();
 }
 
 template<typename T>
 bool FramePool<T>::try_get(T* value) {
-    if (arrlen(pool) != 0) {
-        UsedResource used_resource = { .frame = frame, .resource = arrlast(pool), };
-        arrput(used, used_resource);
-        *value = arrpop(pool);
-         return true;
+    return try_get(value, 1) == 1;
+}
+
+template<typename T>
+uint32_t FramePool<T>::try_get(T* values, uint32_t count) {
+    uint32_t available = (uint32_t)arrlen(pool);
+    count = count < available ? count : available;
+    if (count == 0) {
+        return 0;
     }
-    return false;
+    const T* taken = pool + available - count;
+    memcpy(values, taken, count * sizeof(T));
+    memcpy(arraddnptr(used[frame], count), taken, count * sizeof(T));
+    arrsetlen(pool, available - count);
+    return count;
 }
 
 template<typename T>
@@ -93,36 +115,68 @@ T FramePool<T>::get_or_add(LambdaT&& add) {
         return value;
     }
     value = add();
-    UsedResource used_resource = { .frame = frame, .resource = value, };
-    arrput(used, used_resource);
+    arrput(used[frame], value);
     return value;
 }
 
 template<typename T>
 T FramePool<T>::get_or_add() {
     T value;
-    if (try_get(&value)) {
-        return value;
-    }
-    value = add(user_data);
-    UsedResource used_resource = { .frame = frame, .resource = value, };
-    arrput(used, used_resource);
+    get_or_add(&value, 1);
     return value;
 }
 
+template<typename T>
+void FramePool<T>::get_or_add(T* values, uint32_t count) {
+    uint32_t taken_count = try_get(values, count);
+    for (uint32_t i = taken_count; i < count; i++) {
+        values[i] = add(user_data);
+        arrput(used[frame], values[i]);
+    }
+}
+
+template<typename T>
+void FramePool<T>::release(const T* values, uint32_t count) {
+    T* bucket = used[frame];
+    for (uint32_t i = 0; i < count; i++) {
+        int32_t index = (int32_t)arrlen(bucket) - 1;
+        while (index >= 0 && memcmp(&bucket[index], &values[i], sizeof(T)) != 0) {
+            index--;
+        }
+        assert(index >= 0 && "Item wasn't taken this frame.");
+        if (index < 0) {
+            continue;
+        }
+        arrdelswap(bucket, index);
+        arrput(pool, values[i]);
+        if (reset != nullptr) {
+            reset(&arrlast(pool), user_data);
+        }
+    }
+    used[frame] = bucket;
+}
+
 template<typename T>
 void FramePool<T>::next_frame() {
     frame = (frame + 1) % frame_count;
-    for (int32_t i = 0; i < arrlen(used); i++) {
-        if (used[i].frame == frame) {
-            arrput(pool, used[i].resource);
-            if (reset != nullptr) {
-                reset(&arrlast(pool), user_data);
-            }
-            arrdelswap(used, i);
-            i--;
+    T* bucket = used[frame];
+    uint32_t count = (uint32_t)arrlen(bucket);
+    if (count == 0) {
+        return;
+    }
+    if (reset != nullptr) {
+        for (uint32_t i = 0; i < count; i++) {
+            reset(&bucket[i], user_data);
         }
     }
+    // The whole slot goes back at once, by swapping arrays when the pool ran dry.
+    if (arrlen(pool) == 0) {
+        used[frame] = pool;
+        pool = bucket;
+    } else {
+        memcpy(arraddnptr(pool, count), bucket, count * sizeof(T));
+        arrsetlen(bucket, 0);
+    }
 }
 
 }
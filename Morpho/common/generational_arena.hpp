@@ -1,16 +1,32 @@
 #pragma once
 #include <stdint.h>
-#include <stb_ds.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <atomic>
+#include <new>
+
+// Bits of a 32-bit handle spent on the index, the rest is the generation.
+// More index bits allow more live objects, more generation bits make a reused slot
+// take longer to alias a stale handle.
+#ifndef MORPHO_HANDLE_INDEX_BITS
+#define MORPHO_HANDLE_INDEX_BITS 20
+#endif
 
 namespace Morpho {
 
+static const uint32_t handle_index_bits = MORPHO_HANDLE_INDEX_BITS;
+static const uint32_t handle_generation_bits = 32 - handle_index_bits;
+static_assert(handle_index_bits >= 10 && handle_generation_bits >= 4);
+
 template<typename T>
 struct Handle
 {
     static Handle<T> null();
 
-    uint16_t index;
-    uint16_t gen;
+    uint32_t index : handle_index_bits;
+    // Never 0 for a live object, so null is never valid.
+    uint32_t gen : handle_generation_bits;
 };
 
 template<typename T>
@@ -30,58 +46,333 @@ bool operator!=(const Handle<T>& lhs, const Handle<T>& rhs)
     return !(lhs == rhs);
 }
 
+struct ArenaStats {
+    uint32_t live_count;
+    // Slots handed out at least once, live or free.
+    uint32_t used_count;
+    // Slots in allocated chunks.
+    uint32_t capacity;
+    uint32_t chunk_count;
+    // Chunks without a single live object that still hold memory.
+    uint32_t empty_chunk_count;
+    uint64_t memory_size;
+    // live_count / capacity.
+    float occupancy;
+    // Free slots below the high-water mark relative to it, 0 when live objects are packed.
+    float fragmentation;
+};
+
+// Lookups are lock-free and can run on any thread, add and remove can too but briefly lock the dense list.
+// Storage grows in chunks that are never moved or freed before destroy, so get_ptr stays valid while the object lives.
+// Live objects are also kept in a dense list of indices (swap-removed, sparse set style) for iteration.
+// Resolving a handle while another thread removes it is a race on the object, try_get only guarantees
+// it never returns a value that was removed before the call finished.
+// NOTE: zeroed memory is an empty arena, ResourceManager is memset instead of constructed.
 template<typename T>
 class GenerationalArena {
 public:
-    GenerationalArena();
+    static const uint32_t chunk_size = 1024;
+    static const uint32_t max_count = 1u << handle_index_bits;
+    static const uint32_t max_chunk_count = max_count / chunk_size;
 
     Handle<T> add(T data);
     T get(Handle<T> handle);
+    T* get_ptr(Handle<T> handle);
     bool try_get(Handle<T> handle, T* value);
     bool is_valid(Handle<T> handle);
     void remove(Handle<T> handle);
+    uint32_t get_count();
+    // Visits live objects through the dense list, fn(Handle<T>, T&) may remove the handle it is given.
+    // Must not race with add or remove from other threads.
+    template<typename LambdaT>
+    void for_each(LambdaT&& fn);
+    ArenaStats get_stats();
+    // Not thread-safe.
+    void destroy();
 private:
-    T* data = nullptr;
-    uint16_t* free_list = nullptr;
-    uint16_t* gens = nullptr;
+    struct Slot {
+        std::atomic<uint32_t> gen;
+        // 1-based index of the next free slot, only meaningful while the slot is free.
+        std::atomic<uint32_t> next_free;
+        // Position in the dense list while live, guarded by dense_lock.
+        uint32_t dense_index;
+        T value;
+    };
+
+    std::atomic<Slot*> chunks[max_chunk_count];
+    // Treiber stack of free slots: 1-based index in the low half, ABA tag in the high half.
+    std::atomic<uint64_t> free_head;
+    // Slots below it have been handed out at least once.
+    std::atomic<uint32_t> next_index;
+    // Indices of live slots, packed.
+    uint32_t* dense;
+    uint32_t dense_count;
+    uint32_t dense_capacity;
+    std::atomic<bool> dense_lock;
+
+    Slot* get_slot(uint32_t index);
+    Slot* get_or_create_slot(uint32_t index);
+    uint32_t pop_free();
+    void push_free(uint32_t index);
+    void lock_dense();
+    void unlock_dense();
+    static uint32_t next_gen(uint32_t gen);
 };
 
+template<typename T>
+typename GenerationalArena<T>::Slot* GenerationalArena<T>::get_slot(uint32_t index) {
+    Slot* chunk = chunks[index / chunk_size].load(std::memory_order_acquire);
+    assert(chunk != nullptr);
+    return &chunk[index % chunk_size];
+}
+
+template<typename T>
+typename GenerationalArena<T>::Slot* GenerationalArena<T>::get_or_create_slot(uint32_t index) {
+    std::atomic<Slot*>& chunk_ptr = chunks[index / chunk_size];
+    Slot* chunk = chunk_ptr.load(std::memory_order_acquire);
+    if (chunk == nullptr) {
+        Slot* new_chunk = (Slot*)calloc(chunk_size, sizeof(Slot));
+        for (uint32_t i = 0; i < chunk_size; i++) {
+            new (&new_chunk[i].gen) std::atomic<uint32_t>(1u);
+            new (&new_chunk[i].next_free) std::atomic<uint32_t>(0u);
+        }
+        // Threads crossing into a new chunk at once race to publish it, losers drop theirs.
+        if (chunk_ptr.compare_exchange_strong(chunk, new_chunk, std::memory_order_acq_rel)) {
+            chunk = new_chunk;
+        } else {
+            free(new_chunk);
+        }
+    }
+    return &chunk[index % chunk_size];
+}
+
+template<typename T>
+uint32_t GenerationalArena<T>::pop_free() {
+    uint64_t head = free_head.load(std::memory_order_acquire);
+    while ((uint32_t)head != 0) {
+        uint32_t index = (uint32_t)head - 1;
+        uint32_t next = get_slot(index)->next_free.load(std::memory_order_relaxed);
+        uint64_t new_head = ((head >> 32) + 1) << 32 | next;
+        if (free_head.compare_exchange_weak(head, new_head, std::memory_order_acq_rel)) {
+            return index;
+        }
+    }
+    return UINT32_MAX;
+}
+
+template<typename T>
+void GenerationalArena<T>::push_free(uint32_t index) {
+    Slot* slot = get_slot(index);
+    uint64_t head = free_head.load(std::memory_order_relaxed);
+    uint64_t new_head;
+    do {
+        slot->next_free.store((uint32_t)head, std::memory_order_relaxed);
+        new_head = ((head >> 32) + 1) << 32 | (index + 1);
+    } while (!free_head.compare_exchange_weak(head, new_head, std::memory_order_release, std::memory_order_relaxed));
+}
+
+template<typename T>
+void GenerationalArena<T>::lock_dense() {
+    while (dense_lock.exchange(true, std::memory_order_acquire)) {
+        while (dense_lock.load(std::memory_order_relaxed));
+    }
+}
+
+template<typename T>
+void GenerationalArena<T>::unlock_dense() {
+    dense_lock.store(false, std::memory_order_release);
+}
+
+template<typename T>
+uint32_t GenerationalArena<T>::next_gen(uint32_t gen) {
+    uint32_t next = (gen + 1) & ((1u << handle_generation_bits) - 1);
+    return next == 0 ? 1 : next;
+}
+
 template<typename T>
 Handle<T> GenerationalArena<T>::add(T value) {
-    if (arrlen(free_list) != 0) {
-        uint16_t index = arrpop(free_list);
-        return { .index = index, .gen = gens[index], };
+    uint32_t index = pop_free();
+    Slot* slot;
+    if (index != UINT32_MAX) {
+        slot = get_slot(index);
+    } else {
+        index = next_index.fetch_add(1, std::memory_order_relaxed);
+        // The index wouldn't fit the handle and its chunk is past the end of chunks, so release builds stop too.
+        if (index >= max_count) {
+            fprintf(stderr, "Out of handles, raise MORPHO_HANDLE_INDEX_BITS.\n");
+            abort();
+        }
+        slot = get_or_create_slot(index);
+    }
+    slot->value = value;
+    lock_dense();
+    if (dense_count == dense_capacity) {
+        dense_capacity = dense_capacity == 0 ? chunk_size : dense_capacity * 2;
+        dense = (uint32_t*)realloc(dense, dense_capacity * sizeof(uint32_t));
     }
-    arrput(data, value);
-    arrput(gens, 1u);
-    return { .index = (uint16_t)(arrlenu(data) - 1u), .gen = (uint16_t)1u };
+    slot->dense_index = dense_count;
+    dense[dense_count++] = index;
+    unlock_dense();
+    // Generation was advanced by remove, the slot only has to be published with its new value.
+    uint32_t gen = slot->gen.load(std::memory_order_relaxed);
+    slot->gen.store(gen, std::memory_order_release);
+    return { .index = index, .gen = gen };
 }
 
 template<typename T>
 T GenerationalArena<T>::get(Handle<T> handle) {
-    return data[handle.index];
+    return *get_ptr(handle);
+}
+
+template<typename T>
+T* GenerationalArena<T>::get_ptr(Handle<T> handle) {
+    Slot* slot = get_slot(handle.index);
+    assert(slot->gen.load(std::memory_order_acquire) == handle.gen);
+    return &slot->value;
 }
 
 template<typename T>
 bool GenerationalArena<T>::try_get(Handle<T> handle, T* value) {
-    if (handle.index >= arrlen(data) || gens[handle.index] != handle.gen) {
+    if (!is_valid(handle)) {
         return false;
     }
-    *value = data[handle.index];
-    return true;
+    Slot* slot = get_slot(handle.index);
+    *value = slot->value;
+    // Generation only moves on remove, so if it still matches the copy is not of a reused slot.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot->gen.load(std::memory_order_relaxed) == handle.gen;
 }
 
 template<typename T>
 bool GenerationalArena<T>::is_valid(Handle<T> handle) {
-    return handle.index < arrlen(data) && gens[handle.index] == handle.gen;
+    if (handle.gen == 0) {
+        return false;
+    }
+    // Index may be handed out while its chunk is still being published.
+    Slot* chunk = chunks[handle.index / chunk_size].load(std::memory_order_acquire);
+    return chunk != nullptr && chunk[handle.index % chunk_size].gen.load(std::memory_order_acquire) == handle.gen;
 }
 
 template<typename T>
 void GenerationalArena<T>::remove(Handle<T> handle) {
-    assert(is_correct(handle));
-    gens[handle.index]++;
-    arrput(free_list, handle.gen);
+    Slot* slot = get_slot(handle.index);
+    uint32_t gen = handle.gen;
+    // Double removes are caught here instead of corrupting the free list.
+    bool is_removed = slot->gen.compare_exchange_strong(gen, next_gen(gen), std::memory_order_acq_rel);
+    assert(is_removed && "Handle is stale or removed twice.");
+    if (is_removed) {
+        lock_dense();
+        uint32_t last = dense[--dense_count];
+        dense[slot->dense_index] = last;
+        get_slot(last)->dense_index = slot->dense_index;
+        unlock_dense();
+        // Only after leaving the dense list, a reused slot gets a new dense_index.
+        push_free(handle.index);
+    }
+}
+
+template<typename T>
+uint32_t GenerationalArena<T>::get_count() {
+    lock_dense();
+    uint32_t count = dense_count;
+    unlock_dense();
+    return count;
+}
+
+template<typename T>
+template<typename LambdaT>
+void GenerationalArena<T>::for_each(LambdaT&& fn) {
+    // Backwards, so swap-removing the visited object moves an already visited one into its place.
+    for (uint32_t i = dense_count; i-- > 0;) {
+        uint32_t index = dense[i];
+        Slot* slot = get_slot(index);
+        Handle<T> handle = { .index = index, .gen = slot->gen.load(std::memory_order_relaxed) };
+        fn(handle, slot->value);
+    }
+}
+
+template<typename T>
+ArenaStats GenerationalArena<T>::get_stats() {
+    uint32_t chunk_live_counts[max_chunk_count]{};
+    ArenaStats stats{};
+    lock_dense();
+    for (uint32_t i = 0; i < dense_count; i++) {
+        chunk_live_counts[dense[i] / chunk_size]++;
+    }
+    stats.live_count = dense_count;
+    stats.memory_size = dense_capacity * sizeof(uint32_t);
+    unlock_dense();
+    stats.used_count = next_index.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < max_chunk_count; i++) {
+        if (chunks[i].load(std::memory_order_acquire) == nullptr) {
+            continue;
+        }
+        stats.chunk_count++;
+        stats.empty_chunk_count += chunk_live_counts[i] == 0;
+    }
+    stats.capacity = stats.chunk_count * chunk_size;
+    stats.memory_size += (uint64_t)stats.capacity * sizeof(Slot);
+    stats.occupancy = stats.capacity > 0 ? (float)stats.live_count / stats.capacity : 0.0f;
+    stats.fragmentation = stats.used_count > 0 ? (float)(stats.used_count - stats.live_count) / stats.used_count : 0.0f;
+    return stats;
 }
 
+template<typename T>
+void GenerationalArena<T>::destroy() {
+    for (uint32_t i = 0; i < max_chunk_count; i++) {
+        free(chunks[i].exchange(nullptr, std::memory_order_relaxed));
+    }
+    free(dense);
+    dense = nullptr;
+    dense_count = 0;
+    dense_capacity = 0;
+    free_head.store(0, std::memory_order_relaxed);
+    next_index.store(0, std::memory_order_relaxed);
+}
+
+// A hot field of arena objects kept apart from them (SoA), so hot paths only touch the values they need.
+// Indexed like the arena and set when the object is added, lookups are lock-free and don't check generations,
+// callers validate against the arena in debug builds.
+// NOTE: zeroed memory is an empty column.
+template<typename T, typename V>
+class HandleColumn {
+public:
+    static const uint32_t chunk_size = GenerationalArena<T>::chunk_size;
+    static const uint32_t max_chunk_count = GenerationalArena<T>::max_chunk_count;
+
+    void set(Handle<T> handle, V value);
+    V get(Handle<T> handle);
+    // Not thread-safe.
+    void destroy();
+private:
+    std::atomic<V*> chunks[max_chunk_count];
+};
+
+template<typename T, typename V>
+void HandleColumn<T, V>::set(Handle<T> handle, V value) {
+    std::atomic<V*>& chunk_ptr = chunks[handle.index / chunk_size];
+    V* chunk = chunk_ptr.load(std::memory_order_acquire);
+    if (chunk == nullptr) {
+        V* new_chunk = (V*)calloc(chunk_size, sizeof(V));
+        if (chunk_ptr.compare_exchange_strong(chunk, new_chunk, std::memory_order_acq_rel)) {
+            chunk = new_chunk;
+        } else {
+            free(new_chunk);
+        }
+    }
+    chunk[handle.index % chunk_size] = value;
+}
+
+template<typename T, typename V>
+V HandleColumn<T, V>::get(Handle<T> handle) {
+    return chunks[handle.index / chunk_size].load(std::memory_order_acquire)[handle.index % chunk_size];
+}
+
+template<typename T, typename V>
+void HandleColumn<T, V>::destroy() {
+    for (uint32_t i = 0; i < max_chunk_count; i++) {
+        free(chunks[i].exchange(nullptr, std::memory_order_relaxed));
+    }
+}
 
 }
@@ -0,0 +1,88 @@
+#include "common/job_system.hpp"
+#include <assert.h>
+
+namespace Morpho {
+
+void JobSystem::init(JobSystem* job_system, uint32_t worker_count) {
+    job_system->worker_count = worker_count;
+    job_system->is_running = true;
+    job_system->next_index.store(0, std::memory_order_relaxed);
+    job_system->workers = new std::thread[worker_count];
+    for (uint32_t i = 0; i < worker_count; i++) {
+        job_system->workers[i] = std::thread(&JobSystem::worker_loop, job_system, i + 1);
+    }
+}
+
+void JobSystem::destroy() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        is_running = false;
+    }
+    batch_ready.notify_all();
+    for (uint32_t i = 0; i < worker_count; i++) {
+        workers[i].join();
+    }
+    delete[] workers;
+    workers = nullptr;
+    worker_count = 0;
+}
+
+void JobSystem::parallel_for(uint32_t count, void* user_data, job_fn job) {
+    if (count == 0) {
+        return;
+    }
+    if (worker_count == 0 || count == 1) {
+        for (uint32_t i = 0; i < count; i++) {
+            job(user_data, i, 0);
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        assert(busy_workers == 0);
+        batch = { .job = job, .user_data = user_data, .count = count, };
+        next_index.store(0, std::memory_order_relaxed);
+        busy_workers = worker_count;
+        batch_id++;
+    }
+    batch_ready.notify_all();
+    run_batch(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    batch_done.wait(lock, [this] { return busy_workers == 0; });
+}
+
+uint32_t JobSystem::get_thread_count() const {
+    return worker_count + 1;
+}
+
+void JobSystem::worker_loop(uint32_t thread_index) {
+    uint64_t last_batch_id = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            batch_ready.wait(lock, [&] { return !is_running || batch_id != last_batch_id; });
+            if (!is_running) {
+                return;
+            }
+            last_batch_id = batch_id;
+        }
+        run_batch(thread_index);
+        bool is_last;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            is_last = --busy_workers == 0;
+        }
+        if (is_last) {
+            batch_done.notify_one();
+        }
+    }
+}
+
+void JobSystem::run_batch(uint32_t thread_index) {
+    uint32_t index;
+    while ((index = next_index.fetch_add(1, std::memory_order_relaxed)) < batch.count) {
+        batch.job(batch.user_data, index, thread_index);
+    }
+}
+
+}
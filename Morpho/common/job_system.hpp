@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace Morpho {
+
+// Fixed set of worker threads for fork-join style work.
+// The thread that calls parallel_for participates as thread 0, workers are 1..worker_count.
+class JobSystem {
+public:
+    typedef void (*job_fn)(void* user_data, uint32_t index, uint32_t thread_index);
+
+    JobSystem(const JobSystem&) = delete;
+    JobSystem &operator=(const JobSystem&) = delete;
+    JobSystem(JobSystem&&) = delete;
+    JobSystem &operator=(JobSystem&&) = delete;
+    JobSystem() = default;
+    ~JobSystem() = default;
+
+    static void init(JobSystem* job_system, uint32_t worker_count);
+    void destroy();
+    // Runs job for every index in [0, count) and returns when all of them are done.
+    // Not reentrant: jobs must not call parallel_for themselves.
+    void parallel_for(uint32_t count, void* user_data, job_fn job);
+    uint32_t get_thread_count() const;
+private:
+    struct Batch {
+        job_fn job;
+        void* user_data;
+        uint32_t count;
+    };
+
+    std::thread* workers = nullptr;
+    uint32_t worker_count = 0;
+    std::mutex mutex;
+    std::condition_variable batch_ready;
+    std::condition_variable batch_done;
+    Batch batch{};
+    uint64_t batch_id = 0;
+    uint32_t busy_workers = 0;
+    std::atomic<uint32_t> next_index;
+    bool is_running = false;
+
+    void worker_loop(uint32_t thread_index);
+    void run_batch(uint32_t thread_index);
+};
+
+}
@@ -0,0 +1,256 @@
+#include "common/offset_allocator.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <bit>
+
+namespace Morpho {
+
+static const uint32_t mantissa_bit_count = 3;
+static const uint32_t mantissa_value = 1 << mantissa_bit_count;
+static const uint32_t mantissa_mask = mantissa_value - 1;
+
+// Size classes are 8 linear steps per power of two, every size in a bin is >= the bin's class.
+static uint32_t size_to_bin_round_up(uint32_t size) {
+    if (size < mantissa_value) {
+        return size;
+    }
+    uint32_t highest_bit = 31 - std::countl_zero(size);
+    uint32_t mantissa_start = highest_bit - mantissa_bit_count;
+    uint32_t exponent = mantissa_start + 1;
+    uint32_t mantissa = (size >> mantissa_start) & mantissa_mask;
+    if ((size & ((1u << mantissa_start) - 1)) != 0) {
+        // Carry lands in the exponent.
+        mantissa++;
+    }
+    return (exponent << mantissa_bit_count) + mantissa;
+}
+
+static uint32_t size_to_bin_round_down(uint32_t size) {
+    if (size < mantissa_value) {
+        return size;
+    }
+    uint32_t highest_bit = 31 - std::countl_zero(size);
+    uint32_t mantissa_start = highest_bit - mantissa_bit_count;
+    uint32_t exponent = mantissa_start + 1;
+    uint32_t mantissa = (size >> mantissa_start) & mantissa_mask;
+    return (exponent << mantissa_bit_count) | mantissa;
+}
+
+// Lowest set bit at or after start_bit, no_space if there is none.
+static uint32_t find_lowest_bit_after(uint32_t mask, uint32_t start_bit) {
+    if (start_bit >= 32) {
+        return OffsetAllocator::no_space;
+    }
+    uint32_t masked = mask & ~((1u << start_bit) - 1);
+    return masked != 0 ? std::countr_zero(masked) : OffsetAllocator::no_space;
+}
+
+void OffsetAllocator::init(OffsetAllocator* allocator, uint32_t size, uint32_t max_allocation_count) {
+    assert(size != 0 && max_allocation_count != 0);
+    // Free ranges never outnumber allocations by more than one.
+    uint32_t max_node_count = max_allocation_count * 2 + 1;
+    allocator->nodes = (Node*)malloc(sizeof(Node) * max_node_count);
+    allocator->free_nodes = (uint32_t*)malloc(sizeof(uint32_t) * max_node_count);
+    for (uint32_t i = 0; i < max_node_count; i++) {
+        allocator->free_nodes[i] = max_node_count - i - 1;
+    }
+    allocator->free_node_count = max_node_count;
+    allocator->max_node_count = max_node_count;
+    allocator->size = size;
+    allocator->free_size = 0;
+    allocator->allocation_count = 0;
+    allocator->used_top_bins = 0;
+    memset(allocator->used_leaf_bins, 0, sizeof(allocator->used_leaf_bins));
+    memset(allocator->bin_heads, 0xff, sizeof(allocator->bin_heads));
+    allocator->insert_node(0, size);
+}
+
+void OffsetAllocator::destroy() {
+    ::free(nodes);
+    ::free(free_nodes);
+    nodes = nullptr;
+    free_nodes = nullptr;
+}
+
+OffsetAllocation OffsetAllocator::allocate(uint32_t size) {
+    assert(size != 0);
+    // The remainder of a split needs a node of its own.
+    if (free_node_count < 2) {
+        return { .offset = no_space, .node = no_space, };
+    }
+    // Round up, so whatever is found in the bin fits.
+    uint32_t min_bin = size_to_bin_round_up(size);
+    uint32_t min_top_bin = min_bin / bins_per_leaf;
+    uint32_t min_leaf_bin = min_bin % bins_per_leaf;
+    uint32_t top_bin = min_top_bin;
+    uint32_t leaf_bin = no_space;
+    if (used_top_bins & (1u << top_bin)) {
+        leaf_bin = find_lowest_bit_after(used_leaf_bins[top_bin], min_leaf_bin);
+    }
+    if (leaf_bin == no_space) {
+        top_bin = find_lowest_bit_after(used_top_bins, min_top_bin + 1);
+        if (top_bin != no_space) {
+            // Any leaf of a larger top bin fits.
+            leaf_bin = std::countr_zero((uint32_t)used_leaf_bins[top_bin]);
+        }
+    }
+    if (top_bin == no_space) {
+        // Ranges are binned rounded down, so the bin below min_bin may still hold one that fits,
+        // an arena filled to exactly its size ends on one. Only its head is checked to stay O(1).
+        uint32_t fallback_bin = size_to_bin_round_down(size);
+        uint32_t head = bin_heads[fallback_bin];
+        if (head == no_space || nodes[head].size < size) {
+            return { .offset = no_space, .node = no_space, };
+        }
+        top_bin = fallback_bin / bins_per_leaf;
+        leaf_bin = fallback_bin % bins_per_leaf;
+    }
+    uint32_t bin = top_bin * bins_per_leaf + leaf_bin;
+
+    uint32_t node_index = bin_heads[bin];
+    Node& node = nodes[node_index];
+    uint32_t node_size = node.size;
+    bin_heads[bin] = node.bin_next;
+    if (node.bin_next != no_space) {
+        nodes[node.bin_next].bin_prev = no_space;
+    } else {
+        used_leaf_bins[top_bin] &= ~(1u << leaf_bin);
+        if (used_leaf_bins[top_bin] == 0) {
+            used_top_bins &= ~(1u << top_bin);
+        }
+    }
+    free_size -= node_size;
+    node.size = size;
+    node.used = true;
+    node.bin_prev = node.bin_next = no_space;
+    allocation_count++;
+
+    uint32_t remainder_size = node_size - size;
+    if (remainder_size > 0) {
+        uint32_t remainder = insert_node(node.offset + size, remainder_size);
+        Node& inserted = nodes[remainder];
+        // nodes is never reallocated, node stays valid.
+        if (node.neighbor_next != no_space) {
+            nodes[node.neighbor_next].neighbor_prev = remainder;
+        }
+        inserted.neighbor_prev = node_index;
+        inserted.neighbor_next = node.neighbor_next;
+        node.neighbor_next = remainder;
+    }
+    return { .offset = node.offset, .node = node_index, };
+}
+
+void OffsetAllocator::free(OffsetAllocation allocation) {
+    assert(allocation.node != no_space && allocation.node < max_node_count);
+    Node& node = nodes[allocation.node];
+    assert(node.used);
+    uint32_t offset = node.offset;
+    uint32_t size = node.size;
+    uint32_t neighbor_prev = node.neighbor_prev;
+    uint32_t neighbor_next = node.neighbor_next;
+    if (neighbor_prev != no_space && !nodes[neighbor_prev].used) {
+        Node& prev = nodes[neighbor_prev];
+        offset = prev.offset;
+        size += prev.size;
+        neighbor_prev = prev.neighbor_prev;
+        remove_node(node.neighbor_prev);
+    }
+    if (neighbor_next != no_space && !nodes[neighbor_next].used) {
+        Node& next = nodes[neighbor_next];
+        size += next.size;
+        neighbor_next = next.neighbor_next;
+        remove_node(node.neighbor_next);
+    }
+    free_nodes[free_node_count++] = allocation.node;
+    allocation_count--;
+
+    uint32_t merged = insert_node(offset, size);
+    nodes[merged].neighbor_prev = neighbor_prev;
+    nodes[merged].neighbor_next = neighbor_next;
+    if (neighbor_prev != no_space) {
+        nodes[neighbor_prev].neighbor_next = merged;
+    }
+    if (neighbor_next != no_space) {
+        nodes[neighbor_next].neighbor_prev = merged;
+    }
+}
+
+uint32_t OffsetAllocator::get_allocation_size(OffsetAllocation allocation) const {
+    assert(allocation.node != no_space && nodes[allocation.node].used);
+    return nodes[allocation.node].size;
+}
+
+OffsetAllocatorStats OffsetAllocator::get_stats() const {
+    OffsetAllocatorStats stats = {
+        .size = size,
+        .free_size = free_size,
+        .allocation_count = allocation_count,
+        .free_range_count = max_node_count - free_node_count - allocation_count,
+    };
+    if (used_top_bins != 0) {
+        uint32_t top_bin = 31 - std::countl_zero(used_top_bins);
+        uint32_t leaf_bin = 31 - std::countl_zero((uint32_t)used_leaf_bins[top_bin]);
+        // Sizes within a bin differ, the largest free range is somewhere in the top one.
+        for (uint32_t i = bin_heads[top_bin * bins_per_leaf + leaf_bin]; i != no_space; i = nodes[i].bin_next) {
+            stats.largest_free_size = stats.largest_free_size > nodes[i].size ? stats.largest_free_size : nodes[i].size;
+        }
+    }
+    return stats;
+}
+
+uint32_t OffsetAllocator::insert_node(uint32_t offset, uint32_t size) {
+    // Round down, so the bin's class never exceeds what the range holds.
+    uint32_t bin = size_to_bin_round_down(size);
+    uint32_t top_bin = bin / bins_per_leaf;
+    uint32_t leaf_bin = bin % bins_per_leaf;
+    if (bin_heads[bin] == no_space) {
+        used_leaf_bins[top_bin] |= 1u << leaf_bin;
+        used_top_bins |= 1u << top_bin;
+    }
+    assert(free_node_count != 0);
+    uint32_t head = bin_heads[bin];
+    uint32_t node_index = free_nodes[--free_node_count];
+    nodes[node_index] = {
+        .offset = offset,
+        .size = size,
+        .bin_prev = no_space,
+        .bin_next = head,
+        .neighbor_prev = no_space,
+        .neighbor_next = no_space,
+        .used = false,
+    };
+    if (head != no_space) {
+        nodes[head].bin_prev = node_index;
+    }
+    bin_heads[bin] = node_index;
+    free_size += size;
+    return node_index;
+}
+
+void OffsetAllocator::remove_node(uint32_t node_index) {
+    Node& node = nodes[node_index];
+    if (node.bin_prev != no_space) {
+        nodes[node.bin_prev].bin_next = node.bin_next;
+        if (node.bin_next != no_space) {
+            nodes[node.bin_next].bin_prev = node.bin_prev;
+        }
+    } else {
+        uint32_t bin = size_to_bin_round_down(node.size);
+        uint32_t top_bin = bin / bins_per_leaf;
+        uint32_t leaf_bin = bin % bins_per_leaf;
+        bin_heads[bin] = node.bin_next;
+        if (node.bin_next != no_space) {
+            nodes[node.bin_next].bin_prev = no_space;
+        } else {
+            used_leaf_bins[top_bin] &= ~(1u << leaf_bin);
+            if (used_leaf_bins[top_bin] == 0) {
+                used_top_bins &= ~(1u << top_bin);
+            }
+        }
+    }
+    free_nodes[free_node_count++] = node_index;
+    free_size -= node.size;
+}
+
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+
+namespace Morpho {
+
+struct OffsetAllocation {
+    uint32_t offset;
+    // Allocator node, OffsetAllocator::no_space if the allocation failed.
+    uint32_t node;
+};
+
+struct OffsetAllocatorStats {
+    uint32_t size;
+    uint32_t free_size;
+    uint32_t largest_free_size;
+    uint32_t allocation_count;
+    uint32_t free_range_count;
+};
+
+// Hands out ranges of an abstract [0, size) space (bytes, vertices, indices...), backing memory is owned elsewhere.
+// Two-level segregated fit: free ranges are binned by a float-like size class with 3 mantissa bits,
+// allocate and free are O(1) with two bitmask scans, freed ranges are merged with free neighbours right away.
+// NOTE: zeroed memory is an uninitialized allocator, init before use.
+class OffsetAllocator {
+public:
+    static const uint32_t no_space = UINT32_MAX;
+    static const uint32_t default_max_allocation_count = 64 * 1024;
+
+    static void init(OffsetAllocator* allocator, uint32_t size, uint32_t max_allocation_count = default_max_allocation_count);
+    void destroy();
+    // Check result.node against no_space.
+    OffsetAllocation allocate(uint32_t size);
+    void free(OffsetAllocation allocation);
+    uint32_t get_allocation_size(OffsetAllocation allocation) const;
+    OffsetAllocatorStats get_stats() const;
+private:
+    static const uint32_t top_bin_count = 32;
+    static const uint32_t bins_per_leaf = 8;
+    static const uint32_t leaf_bin_count = top_bin_count * bins_per_leaf;
+
+    struct Node {
+        uint32_t offset;
+        uint32_t size;
+        // Free list of the bin.
+        uint32_t bin_prev;
+        uint32_t bin_next;
+        // Adjacent ranges, free or used.
+        uint32_t neighbor_prev;
+        uint32_t neighbor_next;
+        bool used;
+    };
+
+    Node* nodes;
+    uint32_t* free_nodes;
+    uint32_t free_node_count;
+    uint32_t max_node_count;
+    uint32_t size;
+    uint32_t free_size;
+    uint32_t allocation_count;
+    uint32_t used_top_bins;
+    uint8_t used_leaf_bins[top_bin_count];
+    uint32_t bin_heads[leaf_bin_count];
+
+    uint32_t insert_node(uint32_t offset, uint32_t size);
+    void remove_node(uint32_t node);
+};
+
+}
@@ -22,6 +22,16 @@ namespace Morpho {
         return (value & (value - 1)) == 0;
     }
 
+    // FNV-1a
+    inline uint64_t hash_bytes(const void* data, uint64_t size) {
+        const uint8_t* bytes = (const uint8_t*)data;
+        uint64_t hash = 14695981039346656037ull;
+        for (uint64_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+        return hash;
+    }
+
     template<typename T>
     inline T max(T lhs, T rhs) {
         return lhs < rhs ? rhs : lhs;
@@ -4,6 +4,8 @@
 #include "vulkan/resource_manager.hpp"
 // Again, use it like this for now for simplicity
 #include "common/draw_stream.hpp"
+#include "vulkan/stream_decoder.hpp"
+#include <algorithm>
 
 namespace Morpho::Vulkan {
 
@@ -12,8 +14,14 @@ VkCommandBuffer CommandBuffer::get_vulkan_handle() const {
 }
 
 
-void CommandBuffer::init(VkCommandBuffer cmd) {
+void CommandBuffer::init(
+    VkCommandBuffer cmd,
+    const DrawCapabilities* draw_capabilities,
+    const StreamDecoderRegistry* stream_decoders
+) {
     command_buffer = cmd;
+    this->draw_capabilities = draw_capabilities;
+    this->stream_decoders = stream_decoders;
 }
 
 void CommandBuffer::end_render_pass() {
@@ -38,13 +46,13 @@ void CommandBuffer::draw_indexed(
 void CommandBuffer::blit(const BlitInfo& info) {
     VkImageBlit regions[128]{};
     ResourceManager* rm = ResourceManager::get();
-    Texture src_texture = rm->get_texture(info.src_texture);
-    Texture dst_texture = rm->get_texture(info.dst_texture);
+    const Texture* src_texture = rm->get_texture_ptr(info.src_texture);
+    const Texture* dst_texture = rm->get_texture_ptr(info.dst_texture);
     for (uint32_t i = 0; i < info.regions.size(); i++) {
         VkImageBlit& vk_region = regions[i];
         const TextureBlit& region = info.regions[i];
         vk_region.srcSubresource = {
-            .aspectMask = src_texture.aspect,
+            .aspectMask = src_texture->aspect,
             .mipLevel = region.src_subresource.mip_level,
             .baseArrayLayer = region.src_subresource.base_array_layer,
             .layerCount = region.src_subresource.layer_count,
@@ -52,7 +60,7 @@ void CommandBuffer::blit(const BlitInfo& info) {
         vk_region.srcOffsets[0] = info.regions[i].src_offsets[0];
         vk_region.srcOffsets[1] = info.regions[i].src_offsets[1];
         vk_region.dstSubresource = {
-            .aspectMask = dst_texture.aspect,
+            .aspectMask = dst_texture->aspect,
             .mipLevel = region.dst_subresource.mip_level,
             .baseArrayLayer = region.dst_subresource.base_array_layer,
             .layerCount = region.dst_subresource.layer_count,
@@ -62,9 +70,9 @@ void CommandBuffer::blit(const BlitInfo& info) {
     }
     vkCmdBlitImage(
         command_buffer,
-        src_texture.image,
+        src_texture->image,
         info.src_texture_layout,
-        dst_texture.image,
+        dst_texture->image,
         info.dst_texture_layout,
         info.regions.size(),
         regions,
@@ -73,12 +81,12 @@ void CommandBuffer::blit(const BlitInfo& info) {
 }
 
 void CommandBuffer::bind_vertex_buffer(Handle<Buffer> vertex_buffer, uint32_t binding, VkDeviceSize offset) {
-    VkBuffer vk_buffer = ResourceManager::get()->get_buffer(vertex_buffer).buffer;
+    VkBuffer vk_buffer = ResourceManager::get()->get_vk_buffer(vertex_buffer);
     vkCmdBindVertexBuffers(command_buffer, binding, 1, &vk_buffer, &offset);
 }
 
 void CommandBuffer::bind_index_buffer(Handle<Buffer> index_buffer, VkIndexType index_type, VkDeviceSize offset) {
-    VkBuffer vk_buffer = ResourceManager::get()->get_buffer(index_buffer).buffer;
+    VkBuffer vk_buffer = ResourceManager::get()->get_vk_buffer(index_buffer);
     vkCmdBindIndexBuffer(command_buffer, vk_buffer, offset, index_type);
 }
 
@@ -163,10 +171,10 @@ void CommandBuffer::barrier(
     }
     for (uint32_t i = 0; i < texture_barriers.size(); i++) {
         const TextureBarrier& barrier = texture_barriers[i];
-        Texture texture = ResourceManager::get()->get_texture(barrier.texture);
+        const Texture* texture = ResourceManager::get()->get_texture_ptr(barrier.texture);
         VkImageMemoryBarrier& vk_barrier = image_barriers[i];
         vk_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        vk_barrier.image = texture.image;
+        vk_barrier.image = texture->image;
         vk_barrier.oldLayout = barrier.old_layout;
         vk_barrier.newLayout = barrier.new_layout;
         vk_barrier.srcAccessMask = barrier.src_access;
@@ -175,7 +183,7 @@ void CommandBuffer::barrier(
         dst_stages |= barrier.dst_stages;
         vk_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
         vk_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        vk_barrier.subresourceRange.aspectMask = texture.aspect;
+        vk_barrier.subresourceRange.aspectMask = texture->aspect;
         vk_barrier.subresourceRange.baseMipLevel = barrier.base_mip_level;
         vk_barrier.subresourceRange.levelCount = barrier.mip_level_count;
         vk_barrier.subresourceRange.baseArrayLayer = barrier.base_layer;
@@ -216,7 +224,7 @@ void CommandBuffer::begin_render_pass(
     begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     begin_info.clearValueCount = (uint32_t)clear_values.size();
     begin_info.pClearValues = clear_values.begin();
-    begin_info.renderPass = rm->get_render_pass(render_pass).render_pass;
+    begin_info.renderPass = rm->get_vk_render_pass(render_pass);
     begin_info.framebuffer = framebuffer.framebuffer;
     begin_info.renderArea = render_area;
     current_render_pass = render_pass;
@@ -224,34 +232,72 @@ void CommandBuffer::begin_render_pass(
 }
 
 void CommandBuffer::bind_pipeline(Handle<Pipeline> pipeline) {
-    vkCmdBindPipeline(this->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, ResourceManager::get()->get_pipeline(pipeline).pipeline);
+    VkPipeline vk_pipeline = ResourceManager::get()->get_vk_pipeline(pipeline);
+    // Nothing to drop the following draws here, unlike in draw streams.
+    assert(vk_pipeline != VK_NULL_HANDLE);
+    vkCmdBindPipeline(this->command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_pipeline);
 }
 
 void CommandBuffer::bind_descriptor_set(Handle<DescriptorSet> set_handle) {
-    DescriptorSet set = ResourceManager::get()->get_descriptor_set(set_handle);
+    const DescriptorSet* set = ResourceManager::get()->get_descriptor_set_ptr(set_handle);
     vkCmdBindDescriptorSets(
         this->command_buffer,
         VK_PIPELINE_BIND_POINT_GRAPHICS,
-        set.pipeline_layout,
-        set.set_index,
+        set->pipeline_layout,
+        set->set_index,
         1,
-        &set.descriptor_set,
+        &set->descriptor_set,
         0,
         nullptr
     );
 }
 
 void CommandBuffer::decode_stream(DrawPassInfo draw_pass_info) {
+    begin_draw_pass(draw_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+    set_draw_pass_state(draw_pass_info);
+    decode_draws(draw_pass_info.stream, draw_pass_info.indirect_commands, draw_pass_info.stats);
+    end_render_pass();
+}
+
+void CommandBuffer::begin_secondary_pass(const DrawPassInfo& draw_pass_info) {
+    begin_draw_pass(draw_pass_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+}
+
+void CommandBuffer::decode_stream_secondary(const DrawPassInfo& draw_pass_info) {
+    current_render_pass = draw_pass_info.render_pass;
+    set_draw_pass_state(draw_pass_info);
+    decode_draws(draw_pass_info.stream, draw_pass_info.indirect_commands, draw_pass_info.stats);
+}
+
+void CommandBuffer::execute_secondaries(Span<CommandBuffer* const> secondaries) {
+    VkCommandBuffer vk_cmds[128];
+    for (uint32_t offset = 0; offset < secondaries.size(); offset += 128) {
+        uint32_t count = std::min((uint32_t)secondaries.size() - offset, 128u);
+        for (uint32_t i = 0; i < count; i++) {
+            vk_cmds[i] = secondaries[offset + i]->get_vulkan_handle();
+        }
+        vkCmdExecuteCommands(command_buffer, count, vk_cmds);
+    }
+}
+
+void CommandBuffer::end() {
+    vkEndCommandBuffer(command_buffer);
+}
+
+void CommandBuffer::begin_draw_pass(const DrawPassInfo& draw_pass_info, VkSubpassContents contents) {
     ResourceManager* rm = ResourceManager::get();
     VkRenderPassBeginInfo begin_info{};
     begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     begin_info.clearValueCount = (uint32_t)draw_pass_info.clear_values.size();
     begin_info.pClearValues = draw_pass_info.clear_values.data();
-    begin_info.renderPass = rm->get_render_pass(draw_pass_info.render_pass).render_pass;
+    begin_info.renderPass = rm->get_vk_render_pass(draw_pass_info.render_pass);
     begin_info.framebuffer = draw_pass_info.framebuffer.framebuffer;
     begin_info.renderArea = draw_pass_info.render_area;
     current_render_pass = draw_pass_info.render_pass;
-    vkCmdBeginRenderPass(command_buffer, &begin_info, VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdBeginRenderPass(command_buffer, &begin_info, contents);
+}
+
+void CommandBuffer::set_draw_pass_state(const DrawPassInfo& draw_pass_info) {
     const VkRect2D rect = draw_pass_info.render_area;
     set_viewport({
         .x = (float)rect.offset.x,
@@ -262,56 +308,36 @@ void CommandBuffer::decode_stream(DrawPassInfo draw_pass_info) {
         .maxDepth = 1.0f,
     });
     set_scissor(rect);
-    bind_descriptor_set(draw_pass_info.global_ds);
-    Span<const DrawStream::DrawCall> stream = make_const_span(
-        (DrawStream::DrawCall*)draw_pass_info.stream.data(),
-        draw_pass_info.stream.size() / sizeof(DrawStream::DrawCall)
-    );
-    DrawStream::DrawCall current_dc = DrawStream::DrawCall::null();
-    VkCommandBuffer vk_cmd = this->command_buffer;
-    for (uint32_t i = 0; i < stream.size(); i++) {
-        const DrawStream::DrawCall& dc = stream[i];
-        if (current_dc.pipeline != dc.pipeline) {
-            vkCmdBindPipeline(vk_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, rm->get_pipeline(dc.pipeline).pipeline);
-            current_dc.pipeline = dc.pipeline;
-        }
-        for (uint32_t i = 0; i < 3; i++) {
-            if (current_dc.descriptor_sets[i] != dc.descriptor_sets[i]) {
-                DescriptorSet set = rm->get_descriptor_set(dc.descriptor_sets[i]);
-                vkCmdBindDescriptorSets(
-                    vk_cmd,
-                    VK_PIPELINE_BIND_POINT_GRAPHICS,
-                    set.pipeline_layout,
-                    i + 1,
-                    1,
-                    &set.descriptor_set,
-                    0,
-                    nullptr
-                );
-                current_dc.descriptor_sets[i] = dc.descriptor_sets[i];
-            }
-        }
-        if (current_dc.index_buffer != dc.index_buffer || current_dc.index_buffer_offset != dc.index_buffer_offset) {
-            Buffer buffer = rm->get_buffer(dc.index_buffer);
-            vkCmdBindIndexBuffer(command_buffer, buffer.buffer, dc.index_buffer_offset, VK_INDEX_TYPE_UINT16);
-            current_dc.index_buffer = dc.index_buffer;
-            current_dc.index_buffer_offset = dc.index_buffer_offset;
-        }
-        for (uint32_t i = 0; i < 4; i++) {
-            if (
-                current_dc.vertex_buffers[i] != dc.vertex_buffers[i]
-                || current_dc.vertex_buffer_offsets[i] != dc.vertex_buffer_offsets[i]
-            ) {
-                Buffer buffer = rm->get_buffer(dc.vertex_buffers[i]);
-                uint64_t offset = dc.vertex_buffer_offsets[i];
-                vkCmdBindVertexBuffers(command_buffer, i, 1, &buffer.buffer, &offset);
-                current_dc.vertex_buffers[i] = dc.vertex_buffers[i];
-                current_dc.vertex_buffer_offsets[i] = dc.vertex_buffer_offsets[i];
-            }
-        }
-        vkCmdDrawIndexed(vk_cmd, dc.index_count, 1, dc.index_offset, 0, 0);
+    if (draw_pass_info.global_ds != Handle<DescriptorSet>::null()) {
+        bind_descriptor_set(draw_pass_info.global_ds);
     }
-    vkCmdEndRenderPass(vk_cmd);
+    if (draw_pass_info.instance_buffer != Handle<Buffer>::null()) {
+        bind_vertex_buffer(
+            draw_pass_info.instance_buffer,
+            DrawStream::instance_buffer_binding,
+            draw_pass_info.instance_buffer_offset
+        );
+    }
+}
+
+void CommandBuffer::decode_draws(
+    Span<const uint8_t> draws,
+    const IndirectCommandRange& indirect_commands,
+    DrawStreamStats* stats
+) {
+    if (draws.size() == 0) {
+        return;
+    }
+    const uint8_t* stream = draws.data();
+    DrawStream::Header header = read_stream<DrawStream::Header>(&stream);
+    const StreamDecoder* decoder = stream_decoders->find(header.fields);
+    decoder->decode(
+        command_buffer,
+        draw_capabilities,
+        indirect_commands,
+        make_const_span(stream, draws.size() - sizeof(DrawStream::Header)),
+        stats
+    );
 }
 
 }
@@ -46,6 +46,26 @@ struct BlitInfo {
     Span<const TextureBlit> regions;
 };
 
+// Optional device functionality used by the stream decoder, filled by Context once the device is created.
+struct DrawCapabilities {
+    bool multi_draw_indirect;
+    // 0 when VK_EXT_multi_draw is not enabled.
+    uint32_t max_multi_draw_count;
+    PFN_vkCmdDrawMultiIndexedEXT cmd_draw_multi_indexed;
+};
+
+// Mapped per-frame memory the decoder writes VkDrawIndexedIndirectCommands into.
+struct IndirectCommandRange {
+    Handle<Buffer> buffer;
+    VkDeviceSize offset;
+    uint8_t* mapped;
+    // In commands, a stream never needs more than its draw count.
+    uint32_t capacity;
+};
+
+class StreamDecoderRegistry;
+struct DrawStreamStats;
+
 struct DrawPassInfo {
     Handle<RenderPass> render_pass;
     Framebuffer framebuffer;
@@ -53,12 +73,24 @@ struct DrawPassInfo {
     Handle<DescriptorSet> global_ds;
     Span<const VkClearValue> clear_values;
     Span<const uint8_t> stream;
+    // Holds DrawStream instance payloads, only needed if the stream has instanced draws.
+    Handle<Buffer> instance_buffer = Handle<Buffer>::null();
+    VkDeviceSize instance_buffer_offset = 0;
+    // If set, runs of draws that differ only in draw parameters are issued as one indirect draw.
+    // VK_EXT_multi_draw is preferred when available and doesn't need it.
+    IndirectCommandRange indirect_commands{};
+    // If set, decoding adds what the stream cost to it.
+    DrawStreamStats* stats = nullptr;
 };
 
 class CommandBuffer {
 public:
     VkCommandBuffer get_vulkan_handle() const;
-    void init(VkCommandBuffer cmd);
+    void init(
+        VkCommandBuffer cmd,
+        const DrawCapabilities* draw_capabilities,
+        const StreamDecoderRegistry* stream_decoders
+    );
     void end_render_pass();
     void bind_vertex_buffer(Handle<Buffer> vertex_buffer, uint32_t binding, VkDeviceSize offset = 0);
     void bind_index_buffer(Handle<Buffer> index_buffer, VkIndexType index_type, VkDeviceSize offset = 0);
@@ -91,17 +123,26 @@ public:
     void set_scissor(VkRect2D scissor);
     void bind_descriptor_set(Handle<DescriptorSet> set_handle);
 
-    // NOTE: right now there is hard-coded stream type.
-    // Ultimately there should be no DrawStreamInfo.
-    // Any per-stream information can be encoded inside the stream itself (like a Header).
-    // Stream decoding routine can be registered:
-    // Handle<StreamDecoder> sd_handle = context->register_encoder(some_function);
-    // ...
-    // cmd.decode_stream(sd_handle, Span(stream_ptr, size));
+    // Stream is decoded by the registered decoder that fits DrawStream::Header best,
+    // see Context::register_stream_decoder.
     void decode_stream(DrawPassInfo draw_pass_info);
+    // Multi-threaded variant: the primary begins the pass with begin_secondary_pass,
+    // each secondary (see CmdPool::allocate_secondary) decodes its part of the pass with decode_stream_secondary
+    // and is ended with end, then the primary runs them with execute_secondaries and calls end_render_pass.
+    void begin_secondary_pass(const DrawPassInfo& draw_pass_info);
+    void decode_stream_secondary(const DrawPassInfo& draw_pass_info);
+    void execute_secondaries(Span<CommandBuffer* const> secondaries);
+    void end();
 private:
     VkCommandBuffer command_buffer;
+    const DrawCapabilities* draw_capabilities;
+    const StreamDecoderRegistry* stream_decoders;
     Handle<RenderPass> current_render_pass = Handle<RenderPass>::null();
+
+    void begin_draw_pass(const DrawPassInfo& draw_pass_info, VkSubpassContents contents);
+    // Dynamic state and bindings are not inherited by secondaries, so every command buffer sets them itself.
+    void set_draw_pass_state(const DrawPassInfo& draw_pass_info);
+    void decode_draws(Span<const uint8_t> stream, const IndirectCommandRange& indirect_commands, DrawStreamStats* stats);
 };
 
 }
@@ -2,8 +2,13 @@
 #include <cassert>
 #include <optional>
 #include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <filesystem>
 #include <vulkan/vulkan_core.h>
 #include "resource_manager.hpp"
+#include "common/utils.hpp"
+#include <stb_ds.h>
 
 namespace Morpho::Vulkan {
 
@@ -32,11 +37,27 @@ VkResult CreateDebugUtilsMessengerEXT(
     }
 }
 
-void Context::init(GLFWwindow* window) {
+Context::~Context() {
+    // Lazily created pipelines may still be compiling through the cache.
+    if (ResourceManager* rm = ResourceManager::get(); rm != nullptr) {
+        rm->wait_pipelines();
+    }
+    if (pipeline_cache != VK_NULL_HANDLE) {
+        vkDestroyPipelineCache(device, pipeline_cache, nullptr);
+    }
+}
+
+void Context::init(GLFWwindow* window, const char* pipeline_cache_path) {
     this->window = window;
-    uint32_t wsi_extension_count;
-    auto wsi_extensions = glfwGetRequiredInstanceExtensions(&wsi_extension_count);
-    std::vector<const char*> extensions(wsi_extensions, wsi_extensions + wsi_extension_count);
+    if (pipeline_cache_path != nullptr) {
+        this->pipeline_cache_path = pipeline_cache_path;
+    }
+    std::vector<const char*> extensions;
+    if (window != nullptr) {
+        uint32_t wsi_extension_count;
+        auto wsi_extensions = glfwGetRequiredInstanceExtensions(&wsi_extension_count);
+        extensions.assign(wsi_extensions, wsi_extensions + wsi_extension_count);
+    }
 
     std::vector<const char*> layers;
     if (enable_validation_layers) {
@@ -46,8 +67,9 @@ void Context::init(GLFWwindow* window) {
 
     VK_CHECK(try_create_instance(extensions, layers), "Unable to create instance.")
 
-
-    create_surface();
+    if (window != nullptr) {
+        create_surface();
+    }
 
     if (enable_validation_layers) {
         auto messenger_info = get_default_messenger_create_info();
@@ -73,7 +95,15 @@ void Context::init(GLFWwindow* window) {
 
     vmaCreateAllocator(&allocatorInfo, &allocator);
 
-    ResourceManager::create(this);
+    create_pipeline_cache();
+    ResourceManager::create(
+        this,
+        staging_budget != 0 ? staging_budget : ResourceManager::default_staging_budget
+    );
+
+    register_stream_decoder(make_stream_decoder<DrawStream::all_fields>());
+    register_stream_decoder(make_stream_decoder<DrawStream::no_material_change_fields>());
+    register_stream_decoder(make_stream_decoder<DrawStream::depth_only_fields>());
 
     VkDescriptorPoolSize pool_sizes[] =
     {
@@ -87,9 +117,9 @@ void Context::init(GLFWwindow* window) {
     pool_info.pPoolSizes = pool_sizes;
     VK_CHECK(vkCreateDescriptorPool(device, &pool_info, nullptr, &imgui_descriptor_pool), "Can't create descriptor pool.");
 
-
-    create_swapchain();
-
+    if (window != nullptr) {
+        create_swapchain();
+    }
 }
 
 VKAPI_ATTR VkBool32 VKAPI_CALL Context::debug_callback(
@@ -128,9 +158,8 @@ VkPhysicalDevice Context::select_gpu() {
 }
 
 void Context::query_gpu_properties() {
-    VkPhysicalDeviceProperties properties;
-    vkGetPhysicalDeviceProperties(gpu, &properties);
-    min_uniform_buffer_offset_alignment = properties.limits.minUniformBufferOffsetAlignment;
+    vkGetPhysicalDeviceProperties(gpu, &gpu_properties);
+    min_uniform_buffer_offset_alignment = gpu_properties.limits.minUniformBufferOffsetAlignment;
 }
 
 VkResult Context::try_create_instance(std::vector<const char*>& extensions, std::vector<const char*>& layers) {
@@ -188,6 +217,7 @@ uint32_t Context::score_gpu(VkPhysicalDevice gpu) {
         return 2;
         break;
     case VK_PHYSICAL_DEVICE_TYPE_OTHER:
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
         return 1;
         break;
     default:
@@ -204,41 +234,228 @@ VkResult Context::try_create_device() {
     auto required = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_TRANSFER_BIT;
     for (uint32_t i = 0; i < queue_families.size(); i++) {
         auto properties = queue_families[i];
-        VkBool32 is_present_supported = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(gpu, i, surface, &is_present_supported);
+        VkBool32 is_present_supported = surface == VK_NULL_HANDLE;
+        if (surface != VK_NULL_HANDLE) {
+            vkGetPhysicalDeviceSurfaceSupportKHR(gpu, i, surface, &is_present_supported);
+        }
         if ((properties.queueFlags & required) == required && is_present_supported) {
             graphics_queue_family_index = i;
             break;
         }
     }
+    // Transfer only families are DMA engines, copies there run alongside rendering.
+    uint32_t dedicated_transfer_family_index = UINT32_MAX;
+    for (uint32_t i = 0; i < queue_families.size(); i++) {
+        auto flags = queue_families[i].queueFlags;
+        if ((flags & VK_QUEUE_TRANSFER_BIT) == 0 || (flags & VK_QUEUE_GRAPHICS_BIT) != 0) {
+            continue;
+        }
+        bool is_compute = (flags & VK_QUEUE_COMPUTE_BIT) != 0;
+        if (dedicated_transfer_family_index == UINT32_MAX || !is_compute) {
+            dedicated_transfer_family_index = i;
+        }
+        if (!is_compute) {
+            break;
+        }
+    }
 
     float priority = 1.0f;
-    VkDeviceQueueCreateInfo queue_info{};
-    queue_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queue_info.queueCount = 1;
-    queue_info.queueFamilyIndex = graphics_queue_family_index;
-    queue_info.pQueuePriorities = &priority;
+    VkDeviceQueueCreateInfo queue_infos[2]{};
+    uint32_t queue_info_count = 1;
+    queue_infos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queue_infos[0].queueCount = 1;
+    queue_infos[0].queueFamilyIndex = graphics_queue_family_index;
+    queue_infos[0].pQueuePriorities = &priority;
+
+    std::vector<const char*> extensions = { VK_KHR_SHADER_NON_SEMANTIC_INFO_EXTENSION_NAME, };
+    if (surface != VK_NULL_HANDLE) {
+        extensions.push_back("VK_KHR_swapchain");
+    }
 
-    std::array<const char *, 2> extensions = { "VK_KHR_swapchain", VK_KHR_SHADER_NON_SEMANTIC_INFO_EXTENSION_NAME, };
+    uint32_t available_extension_count;
+    vkEnumerateDeviceExtensionProperties(gpu, nullptr, &available_extension_count, nullptr);
+    std::vector<VkExtensionProperties> available_extensions(available_extension_count);
+    vkEnumerateDeviceExtensionProperties(gpu, nullptr, &available_extension_count, available_extensions.data());
+    const char* timeline_semaphore_extension_name = "VK_KHR_timeline_semaphore";
+    const char* pipeline_creation_feedback_extension_name = "VK_EXT_pipeline_creation_feedback";
+    bool has_multi_draw = false;
+    bool has_timeline_semaphore_extension = false;
+    for (const auto& extension : available_extensions) {
+        has_multi_draw |= strcmp(extension.extensionName, VK_EXT_MULTI_DRAW_EXTENSION_NAME) == 0;
+        has_timeline_semaphore_extension |= strcmp(extension.extensionName, timeline_semaphore_extension_name) == 0;
+        has_pipeline_creation_feedback |= strcmp(extension.extensionName, pipeline_creation_feedback_extension_name) == 0;
+    }
+    if (has_pipeline_creation_feedback) {
+        extensions.push_back(pipeline_creation_feedback_extension_name);
+    }
 
     VkPhysicalDeviceFeatures2 features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, };
+    VkPhysicalDeviceMultiDrawFeaturesEXT multi_draw_features = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTI_DRAW_FEATURES_EXT, };
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_semaphore_features = {
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+    };
+    if (has_multi_draw) {
+        multi_draw_features.pNext = features.pNext;
+        features.pNext = &multi_draw_features;
+    }
+    if (has_timeline_semaphore_extension) {
+        timeline_semaphore_features.pNext = features.pNext;
+        features.pNext = &timeline_semaphore_features;
+    }
     vkGetPhysicalDeviceFeatures2(gpu, &features);
+    has_multi_draw = has_multi_draw && multi_draw_features.multiDraw;
+    has_timeline_semaphores = has_timeline_semaphore_extension && timeline_semaphore_features.timelineSemaphore;
+    // Same chain again with only what gets enabled.
+    features.pNext = nullptr;
+    if (has_multi_draw) {
+        extensions.push_back(VK_EXT_MULTI_DRAW_EXTENSION_NAME);
+        multi_draw_features.pNext = features.pNext;
+        features.pNext = &multi_draw_features;
+    }
+    if (has_timeline_semaphores) {
+        extensions.push_back(timeline_semaphore_extension_name);
+        timeline_semaphore_features.pNext = features.pNext;
+        features.pNext = &timeline_semaphore_features;
+    }
+    // Uploads on another queue are only awaited with timeline semaphores, without them they stay on the graphics queue.
+    transfer_queue_family_index = graphics_queue_family_index;
+    if (has_timeline_semaphores && dedicated_transfer_family_index != UINT32_MAX) {
+        transfer_queue_family_index = dedicated_transfer_family_index;
+        queue_infos[1] = queue_infos[0];
+        queue_infos[1].queueFamilyIndex = transfer_queue_family_index;
+        queue_info_count = 2;
+    }
 
     VkDeviceCreateInfo info{};
     info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-    info.queueCreateInfoCount = 1;
-    info.pQueueCreateInfos = &queue_info;
+    info.queueCreateInfoCount = queue_info_count;
+    info.pQueueCreateInfos = queue_infos;
     info.enabledExtensionCount = (uint32_t)extensions.size();
     info.ppEnabledExtensionNames = extensions.data();
     info.pNext = &features;
 
+    VkResult result = vkCreateDevice(gpu, &info, nullptr, &device);
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    draw_capabilities.multi_draw_indirect = features.features.multiDrawIndirect;
+    if (has_timeline_semaphores) {
+        wait_semaphores = (PFN_vkWaitSemaphores)vkGetDeviceProcAddr(device, "vkWaitSemaphoresKHR");
+        get_semaphore_counter_value = (PFN_vkGetSemaphoreCounterValue)vkGetDeviceProcAddr(
+            device,
+            "vkGetSemaphoreCounterValueKHR"
+        );
+    }
+    if (has_multi_draw) {
+        VkPhysicalDeviceMultiDrawPropertiesEXT multi_draw_properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTI_DRAW_PROPERTIES_EXT, };
+        VkPhysicalDeviceProperties2 properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2, };
+        properties.pNext = &multi_draw_properties;
+        vkGetPhysicalDeviceProperties2(gpu, &properties);
+        draw_capabilities.max_multi_draw_count = multi_draw_properties.maxMultiDrawCount;
+        draw_capabilities.cmd_draw_multi_indexed = (PFN_vkCmdDrawMultiIndexedEXT)vkGetDeviceProcAddr(
+            device,
+            "vkCmdDrawMultiIndexedEXT"
+        );
+    }
+    return result;
+}
+
+// Prepended to the vkGetPipelineCacheData blob. The blob has its own header with the device UUID,
+// the driver version and a checksum are on top since drivers aren't required to validate the rest.
+struct PipelineCacheFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint32_t driver_version;
+    uint8_t pipeline_cache_uuid[VK_UUID_SIZE];
+    uint32_t padding;
+    uint64_t data_size;
+    uint64_t data_hash;
+};
+
+static const uint32_t pipeline_cache_file_magic = 0x4850524d; // "MRPH"
+static const uint32_t pipeline_cache_file_version = 1;
+
+static PipelineCacheFileHeader make_pipeline_cache_file_header(const VkPhysicalDeviceProperties& properties) {
+    PipelineCacheFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = pipeline_cache_file_magic;
+    header.version = pipeline_cache_file_version;
+    header.vendor_id = properties.vendorID;
+    header.device_id = properties.deviceID;
+    header.driver_version = properties.driverVersion;
+    memcpy(header.pipeline_cache_uuid, properties.pipelineCacheUUID, VK_UUID_SIZE);
+    return header;
+}
+
+// Anything that doesn't match the current device and driver starts over with an empty cache.
+void Context::create_pipeline_cache() {
+    std::vector<uint8_t> data;
+    FILE* f = pipeline_cache_path.empty() ? nullptr : fopen(pipeline_cache_path.c_str(), "rb");
+    if (f != nullptr) {
+        PipelineCacheFileHeader expected = make_pipeline_cache_file_header(gpu_properties);
+        PipelineCacheFileHeader header;
+        bool is_valid = fread(&header, sizeof(header), 1, f) == 1
+            && memcmp(&header, &expected, offsetof(PipelineCacheFileHeader, data_size)) == 0;
+        if (is_valid) {
+            data.resize(header.data_size);
+            is_valid = fread(data.data(), 1, data.size(), f) == data.size()
+                && hash_bytes(data.data(), data.size()) == header.data_hash;
+        }
+        fclose(f);
+        if (!is_valid) {
+            data.clear();
+        }
+    }
 
-    return vkCreateDevice(gpu, &info, nullptr, &device);
+    VkPipelineCacheCreateInfo info = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO, };
+    info.initialDataSize = data.size();
+    info.pInitialData = data.data();
+    if (vkCreatePipelineCache(device, &info, nullptr, &pipeline_cache) != VK_SUCCESS && !data.empty()) {
+        info.initialDataSize = 0;
+        info.pInitialData = nullptr;
+        VK_CHECK(vkCreatePipelineCache(device, &info, nullptr, &pipeline_cache), "Can't create pipeline cache.")
+    }
 }
 
+bool Context::save_pipeline_cache() {
+    if (pipeline_cache_path.empty()) {
+        return false;
+    }
+    size_t size = 0;
+    VK_CHECK(vkGetPipelineCacheData(device, pipeline_cache, &size, nullptr), "Can't get pipeline cache data.")
+    std::vector<uint8_t> data(size);
+    // Pipelines created meanwhile on other threads can make it VK_INCOMPLETE, the size is updated then.
+    VkResult result = vkGetPipelineCacheData(device, pipeline_cache, &size, data.data());
+    if (result != VK_SUCCESS && result != VK_INCOMPLETE) {
+        return false;
+    }
+    PipelineCacheFileHeader header = make_pipeline_cache_file_header(gpu_properties);
+    header.data_size = size;
+    header.data_hash = hash_bytes(data.data(), size);
+
+    std::string temp_path = pipeline_cache_path + ".tmp";
+    FILE* f = fopen(temp_path.c_str(), "wb");
+    if (f == nullptr) {
+        return false;
+    }
+    bool is_ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(data.data(), 1, size, f) == size;
+    is_ok = fclose(f) == 0 && is_ok;
+    std::error_code error;
+    if (is_ok) {
+        std::filesystem::rename(temp_path, pipeline_cache_path, error);
+    }
+    if (!is_ok || error) {
+        std::filesystem::remove(temp_path, error);
+        return false;
+    }
+    return true;
+}
 
 void Context::retrieve_queues() {
     vkGetDeviceQueue(device, graphics_queue_family_index, 0, &graphics_queue);
+    vkGetDeviceQueue(device, transfer_queue_family_index, 0, &transfer_queue);
 }
 
 void Context::create_surface() {
@@ -330,9 +547,14 @@ void Context::create_swapchain() {
     }
 }
 
+void Context::set_staging_budget(uint64_t size) {
+    staging_budget = size;
+}
+
 void Context::set_frame_context_count(uint32_t count) {
     frame_context_count = count;
     frame_context_index = 0;
+    FrameArena::init(&frame_arena, count);
 
     VkCommandPoolCreateInfo command_pool_info{};
     command_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
@@ -360,8 +582,17 @@ void Context::begin_frame() {
     auto& frame_context = get_current_frame_context();
     vkWaitForFences(device, 1, &frame_context.render_finished_fence, VK_TRUE, 10000000000);
     vkResetFences(device, 1, &frame_context.render_finished_fence);
-    vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, frame_context.image_ready_semaphore, VK_NULL_HANDLE, &swapchain_image_index);
+    if (swapchain != VK_NULL_HANDLE) {
+        vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, frame_context.image_ready_semaphore, VK_NULL_HANDLE, &swapchain_image_index);
+    }
     vkResetCommandPool(device, frame_context.command_pool, VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT);
+    frame_context.used_command_buffer_count = 0;
+    frame_arena.next_frame();
+#ifndef NDEBUG
+    uint64_t growth_count = FrameArena::get_growth_count();
+    assert(!is_frame_growth_unexpected || growth_count == frame_growth_count);
+    frame_growth_count = growth_count;
+#endif
     for (auto it = frame_context.destructors.rbegin(); it != frame_context.destructors.rend(); it++) {
         (*it)();
     }
@@ -369,28 +600,34 @@ void Context::begin_frame() {
 }
 
 void Context::end_frame() {
-    VkPresentInfoKHR info{};
-    info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-    info.pImageIndices = &swapchain_image_index;
-    info.pSwapchains = &swapchain;
-    info.swapchainCount = 1;
-    info.waitSemaphoreCount = 1;
-    info.pWaitSemaphores = &get_current_frame_context().render_semaphore;
-
-
-    vkQueuePresentKHR(graphics_queue, &info);
+    if (swapchain != VK_NULL_HANDLE) {
+        VkPresentInfoKHR info{};
+        info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        info.pImageIndices = &swapchain_image_index;
+        info.pSwapchains = &swapchain;
+        info.swapchainCount = 1;
+        info.waitSemaphoreCount = 1;
+        info.pWaitSemaphores = &get_current_frame_context().render_semaphore;
+
+        vkQueuePresentKHR(graphics_queue, &info);
+    }
     frame_context_index = (frame_context_index + 1) % frame_context_count;
 }
 
 CommandBuffer* Context::acquire_command_buffer() {
-    VkCommandBuffer command_buffer;
-    VkCommandBufferAllocateInfo info{};
-    info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    info.commandPool = get_current_frame_context().command_pool;
-    info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    info.commandBufferCount = 1;
-
-    vkAllocateCommandBuffers(device, &info, &command_buffer);
+    FrameContext& frame_context = get_current_frame_context();
+    if (frame_context.used_command_buffer_count == arrlen(frame_context.command_buffers)) {
+        VkCommandBufferAllocateInfo info{};
+        info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        info.commandPool = frame_context.command_pool;
+        info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        info.commandBufferCount = 1;
+        VkCommandBuffer new_command_buffer;
+        vkAllocateCommandBuffers(device, &info, &new_command_buffer);
+        arrput(frame_context.command_buffers, new_command_buffer);
+        FrameArena::count_growth();
+    }
+    VkCommandBuffer command_buffer = frame_context.command_buffers[frame_context.used_command_buffer_count++];
 
     VkCommandBufferBeginInfo begin_info{};
     begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -398,15 +635,8 @@ CommandBuffer* Context::acquire_command_buffer() {
 
     vkBeginCommandBuffer(command_buffer, &begin_info);
 
-    CommandBuffer* cmd = (CommandBuffer*)calloc(1, sizeof(CommandBuffer));
-    cmd->init(command_buffer);
-
-    get_current_frame_context().destructors.push_back([device = device, cmd_pool = get_current_frame_context().command_pool, cmd] {
-        VkCommandBuffer vk_cmd = cmd->get_vulkan_handle();
-        vkFreeCommandBuffers(device, cmd_pool, 1, &vk_cmd);
-        free(cmd);
-    });
-
+    CommandBuffer* cmd = frame_arena.allocate<CommandBuffer>();
+    cmd->init(command_buffer, &draw_capabilities, &stream_decoders);
     return cmd;
 }
 
@@ -440,11 +670,14 @@ void Context::submit(CommandBuffer* command_buffer) {
     info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     info.commandBufferCount = 1;
     info.pCommandBuffers = &handle;
-    info.pWaitSemaphores = &frame_context.image_ready_semaphore;
-    info.waitSemaphoreCount = 1;
-    info.pWaitDstStageMask = wait_stages;
-    info.pSignalSemaphores = &frame_context.render_semaphore;
-    info.signalSemaphoreCount = 1;
+    // Headless contexts have nothing to acquire and present.
+    if (swapchain != VK_NULL_HANDLE) {
+        info.pWaitSemaphores = &frame_context.image_ready_semaphore;
+        info.waitSemaphoreCount = 1;
+        info.pWaitDstStageMask = wait_stages;
+        info.pSignalSemaphores = &frame_context.render_semaphore;
+        info.signalSemaphoreCount = 1;
+    }
 
     vkQueueSubmit(graphics_queue, 1, &info, frame_context.render_finished_fence);
 }
@@ -452,7 +685,7 @@ void Context::submit(CommandBuffer* command_buffer) {
 Framebuffer Context::acquire_framebuffer(const FramebufferInfo& info) {
     VkImageView image_views[FramebufferInfo::max_attachment_count];
     for (uint32_t i = 0; i < info.attachment_count; i++) {
-        image_views[i] = ResourceManager::get()->get_texture(info.attachments[i]).image_view;
+        image_views[i] = ResourceManager::get()->get_vk_image_view(info.attachments[i]);
     }
 
     VkFramebufferCreateInfo create_info{};
@@ -462,7 +695,7 @@ Framebuffer Context::acquire_framebuffer(const FramebufferInfo& info) {
     create_info.width = info.extent.width;
     create_info.height = info.extent.height;
     create_info.layers = 1;
-    create_info.renderPass = ResourceManager::get()->get_render_pass_layout(info.layout).render_pass;
+    create_info.renderPass = ResourceManager::get()->get_vk_render_pass(info.layout);
 
     VkFramebuffer vk_framebuffer;
     vkCreateFramebuffer(device, &create_info, nullptr, &vk_framebuffer);
@@ -488,6 +721,10 @@ uint64_t Context::get_uniform_buffer_alignment() const {
     return min_uniform_buffer_offset_alignment;
 }
 
+void Context::register_stream_decoder(const StreamDecoder& decoder) {
+    stream_decoders.add(decoder);
+}
+
 VkFormat Context::get_swapchain_format() const {
     return swapchain_format;
 }
@@ -496,6 +733,15 @@ void Context::wait_queue_idle() {
     vkQueueWaitIdle(graphics_queue);
 }
 
+void Context::expect_no_frame_growth(bool is_expected) {
+    is_frame_growth_unexpected = is_expected;
+    frame_growth_count = FrameArena::get_growth_count();
+}
+
+FrameArena* Context::get_frame_arena() {
+    return &frame_arena;
+}
+
 void Context::get_vulkans_guts(
     VkInstance* instance,
     VkPhysicalDevice* gpu,
@@ -514,9 +760,11 @@ void Context::get_vulkans_guts(
 
 
 void Context::create_cmd_pool(CmdPool** out_pool) {
-    CmdPool* pool = (CmdPool*)malloc(sizeof(CmdPool));
+    CmdPool* pool = (CmdPool*)calloc(1, sizeof(CmdPool));
     pool->current_frame = 0;
     pool->device = device;
+    pool->draw_capabilities = &draw_capabilities;
+    pool->stream_decoders = &stream_decoders;
     VkCommandPoolCreateInfo command_pool_info{};
     command_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
     command_pool_info.queueFamilyIndex = graphics_queue_family_index;
@@ -526,36 +774,90 @@ void Context::create_cmd_pool(CmdPool** out_pool) {
         VkResult result = vkCreateCommandPool(device, &command_pool_info, nullptr, &pool->cmd_pools[i]);
         VK_CHECK(result, "Unable to create VkCommandPool.");
     }
+    FrameArena::init(&pool->arena, MAX_FRAME_CONTEXTS);
     *out_pool = pool;
 }
 
 void Context::destroy_cmd_pool(CmdPool* pool) {
     for (uint32_t i = 0; i < MAX_FRAME_CONTEXTS; i++) {
         vkDestroyCommandPool(device, pool->cmd_pools[i], nullptr);
+        arrfree(pool->command_buffers[i][VK_COMMAND_BUFFER_LEVEL_PRIMARY]);
+        arrfree(pool->command_buffers[i][VK_COMMAND_BUFFER_LEVEL_SECONDARY]);
     }
+    pool->arena.destroy();
     free(pool);
 }
 
 
 CommandBuffer* CmdPool::allocate() {
-    VkCommandBufferAllocateInfo info{};
-    info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    info.commandPool = cmd_pools[current_frame];
-    info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    info.commandBufferCount = 1;
-    VkCommandBuffer vk_cmd;
-    vkAllocateCommandBuffers(device, &info, &vk_cmd);
+    return allocate(VK_COMMAND_BUFFER_LEVEL_PRIMARY, nullptr);
+}
+
+CommandBuffer* CmdPool::allocate_secondary(Handle<RenderPass> render_pass, Framebuffer framebuffer) {
+    VkCommandBufferInheritanceInfo inheritance{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO };
+    inheritance.renderPass = ResourceManager::get()->get_vk_render_pass(render_pass);
+    inheritance.subpass = 0;
+    inheritance.framebuffer = framebuffer.framebuffer;
+    return allocate(VK_COMMAND_BUFFER_LEVEL_SECONDARY, &inheritance);
+}
+
+void CmdPool::reserve_secondaries(uint32_t count) {
+    for (uint32_t i = 0; i < MAX_FRAME_CONTEXTS; i++) {
+        VkCommandBuffer*& secondaries = command_buffers[i][VK_COMMAND_BUFFER_LEVEL_SECONDARY];
+        uint32_t allocated_count = (uint32_t)arrlen(secondaries);
+        if (allocated_count >= count) {
+            continue;
+        }
+        arrsetlen(secondaries, count);
+        VkCommandBufferAllocateInfo info{};
+        info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        info.commandPool = cmd_pools[i];
+        info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        info.commandBufferCount = count - allocated_count;
+        vkAllocateCommandBuffers(device, &info, &secondaries[allocated_count]);
+        FrameArena::count_growth();
+    }
+    // Wrappers of both levels share the arena, leave room for as many primaries as a frame has used.
+    uint64_t primary_count = 0;
+    for (uint32_t i = 0; i < MAX_FRAME_CONTEXTS; i++) {
+        primary_count = max(primary_count, (uint64_t)arrlen(command_buffers[i][VK_COMMAND_BUFFER_LEVEL_PRIMARY]));
+    }
+    arena.reserve((count + primary_count) * align_up_pow2(sizeof(CommandBuffer), 16));
+}
+
+CommandBuffer* CmdPool::allocate(VkCommandBufferLevel level, const VkCommandBufferInheritanceInfo* inheritance) {
+    VkCommandBuffer*& level_command_buffers = command_buffers[current_frame][level];
+    uint32_t& used_count = used_command_buffer_counts[current_frame][level];
+    if (used_count == arrlen(level_command_buffers)) {
+        VkCommandBufferAllocateInfo info{};
+        info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        info.commandPool = cmd_pools[current_frame];
+        info.level = level;
+        info.commandBufferCount = 1;
+        VkCommandBuffer new_vk_cmd;
+        vkAllocateCommandBuffers(device, &info, &new_vk_cmd);
+        arrput(level_command_buffers, new_vk_cmd);
+        FrameArena::count_growth();
+    }
+    VkCommandBuffer vk_cmd = level_command_buffers[used_count++];
     VkCommandBufferBeginInfo begin_info{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
     begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    if (inheritance != nullptr) {
+        begin_info.flags |= VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+        begin_info.pInheritanceInfo = inheritance;
+    }
     vkBeginCommandBuffer(vk_cmd, &begin_info);
-    CommandBuffer* cmd = (CommandBuffer*)calloc(1, sizeof(CommandBuffer));
-    cmd->init(vk_cmd);
+    CommandBuffer* cmd = arena.allocate<CommandBuffer>();
+    cmd->init(vk_cmd, draw_capabilities, stream_decoders);
     return cmd;
 }
 
 void CmdPool::next_frame() {
     current_frame = (current_frame + 1) % MAX_FRAME_CONTEXTS;
     vkResetCommandPool(device, cmd_pools[current_frame], VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT);
+    used_command_buffer_counts[current_frame][VK_COMMAND_BUFFER_LEVEL_PRIMARY] = 0;
+    used_command_buffer_counts[current_frame][VK_COMMAND_BUFFER_LEVEL_SECONDARY] = 0;
+    arena.next_frame();
 }
 
 }
@@ -5,14 +5,17 @@
 #include <GLFW/glfw3.h>
 #include <stdexcept>
 #include <vector>
+#include <string>
 #include <iostream>
 #include <array>
 #include <functional>
 #include "resources.hpp"
 #include "command_buffer.hpp"
+#include "stream_decoder.hpp"
 #include "vma.hpp"
 #include "limits.hpp"
 #include "common/span.hpp"
+#include "common/frame_arena.hpp"
 
 namespace Morpho::Vulkan {
 
@@ -52,20 +55,35 @@ inline VkImageAspectFlags derive_aspect(VkFormat format) {
     }
 }
 
+// Command pools are externally synchronized, so every recording thread owns its CmdPool.
 struct CmdPool {
 public:
     friend class Context;
     CommandBuffer* allocate();
+    // Begins a secondary command buffer that continues subpass 0 of the render pass.
+    CommandBuffer* allocate_secondary(Handle<RenderPass> render_pass, Framebuffer framebuffer);
+    // Makes every frame able to hand out count secondaries without allocating.
+    void reserve_secondaries(uint32_t count);
     void next_frame();
 private:
     uint32_t current_frame;
     VkDevice device;
+    const DrawCapabilities* draw_capabilities;
+    const StreamDecoderRegistry* stream_decoders;
     VkCommandPool cmd_pools[MAX_FRAME_CONTEXTS];
+    // CommandBuffer wrappers handed out per frame, rewound with the pool.
+    FrameArena arena;
+    // Command buffers per frame and level, reset with the pool and handed out again.
+    VkCommandBuffer* command_buffers[MAX_FRAME_CONTEXTS][2];
+    uint32_t used_command_buffer_counts[MAX_FRAME_CONTEXTS][2];
+
+    CommandBuffer* allocate(VkCommandBufferLevel level, const VkCommandBufferInheritanceInfo* inheritance);
 };
 
 class Context {
 public:
     Context() = default;
+    // Doesn't write the pipeline cache back, save_pipeline_cache first.
     ~Context();
     Context(const Context &) = delete;
     Context &operator=(const Context &) = delete;
@@ -75,7 +93,11 @@ public:
     friend class ResourceManager;
     friend struct CmdPool;
 
-    void init(GLFWwindow *window);
+    // Null window creates a headless context: no surface and swapchain, end_frame doesn't present.
+    // Pipelines are created through a cache loaded from pipeline_cache_path, null keeps it in memory only.
+    void init(GLFWwindow *window, const char* pipeline_cache_path = nullptr);
+    // Size of the staging buffer uploads stream through, has to happen before init. Zero is the default.
+    void set_staging_budget(uint64_t size);
     void set_frame_context_count(uint32_t count);
     void begin_frame();
     void end_frame();
@@ -87,6 +109,8 @@ public:
     void destroy_cmd_pool(CmdPool* pool);
 
     uint64_t get_uniform_buffer_alignment() const;
+    // Has to happen before any stream is decoded, see make_stream_decoder.
+    void register_stream_decoder(const StreamDecoder& decoder);
 
     // public WSI stuff
     Handle<Texture> get_swapchain_texture() const;
@@ -94,8 +118,17 @@ public:
     VkFormat get_swapchain_format() const;
     // end of WSI stuff
 
+    // Writes the pipeline cache back to pipeline_cache_path, does nothing without one.
+    // The file is replaced only once fully written.
+    bool save_pipeline_cache();
+
     // debug
     void wait_queue_idle();
+    // Asserts in debug builds that frames don't grow FrameArenas or allocate command buffers anymore,
+    // see FrameArena::get_growth_count. Other heap allocations aren't checked.
+    void expect_no_frame_growth(bool is_expected);
+    // Arena of the current frame context, rewound in begin_frame once the GPU is done with it.
+    FrameArena* get_frame_arena();
 
     // temp for imgui
     void get_vulkans_guts(
@@ -123,8 +156,27 @@ private:
     VkDevice device = VK_NULL_HANDLE;
     VkQueue graphics_queue;
     uint32_t graphics_queue_family_index;
+    // Async uploads go here, see ResourceManager::create_buffer_async.
+    // Same as the graphics queue without a dedicated transfer queue family or timeline semaphores.
+    VkQueue transfer_queue;
+    uint32_t transfer_queue_family_index;
+    // VK_KHR_timeline_semaphore, the functions are null without it.
+    bool has_timeline_semaphores = false;
+    PFN_vkWaitSemaphores wait_semaphores = nullptr;
+    PFN_vkGetSemaphoreCounterValue get_semaphore_counter_value = nullptr;
+    // VK_EXT_pipeline_creation_feedback, pipelines are timed on the CPU without it.
+    bool has_pipeline_creation_feedback = false;
+    VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+    std::string pipeline_cache_path;
+    uint64_t staging_budget = 0;
     VmaAllocator allocator;
+    VkPhysicalDeviceProperties gpu_properties;
     uint64_t min_uniform_buffer_offset_alignment;
+    DrawCapabilities draw_capabilities{};
+    StreamDecoderRegistry stream_decoders{};
+    FrameArena frame_arena{};
+    bool is_frame_growth_unexpected = false;
+    uint64_t frame_growth_count = 0;
 
     // Should make descriptor management explicit.
     VkDescriptorPool imgui_descriptor_pool;
@@ -133,6 +185,9 @@ private:
         // Stays here for a while for simplicity
         std::vector<std::function<void(void)>> destructors;
         VkCommandPool command_pool;
+        // Reset with the pool and handed out again by acquire_command_buffer.
+        VkCommandBuffer* command_buffers = nullptr;
+        uint32_t used_command_buffer_count = 0;
         VkFence render_finished_fence;
         VkSemaphore render_semaphore, image_ready_semaphore;
 
@@ -158,6 +213,7 @@ private:
     static uint32_t score_gpu(VkPhysicalDevice gpu);
     VkResult try_create_device();
     void retrieve_queues();
+    void create_pipeline_cache();
     FrameContext& get_current_frame_context();
     // The safest way to release resources is on the start of
     // the frame context they were last used in.
@@ -165,9 +221,9 @@ private:
     void release_texture_on_frame_begin(Texture image);
 
     // WSI stuff that will soon migrate somewhere
-    GLFWwindow* window;
-    VkSurfaceKHR surface;
-    VkSwapchainKHR swapchain;
+    GLFWwindow* window = nullptr;
+    VkSurfaceKHR surface = VK_NULL_HANDLE;
+    VkSwapchainKHR swapchain = VK_NULL_HANDLE;
     std::vector<Handle<Texture>> swapchain_texture_handles;
     VkFormat swapchain_format;
     VkExtent2D swapchain_extent;
@@ -0,0 +1,413 @@
+#include "draw_capture.hpp"
+#include "resource_manager.hpp"
+#include "common/draw_stream.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <type_traits>
+
+namespace Morpho::Vulkan {
+
+// Same code reads and writes the file, so the two can't drift apart.
+struct CaptureFile {
+    FILE* file;
+    bool is_reading;
+    bool is_ok;
+
+    template<typename T>
+    void pod(T* value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (!is_ok) {
+            return;
+        }
+        size_t count = is_reading ? fread(value, sizeof(T), 1, file) : fwrite(value, sizeof(T), 1, file);
+        is_ok = count == 1;
+    }
+
+    template<typename T>
+    void array(std::vector<T>* values) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        uint64_t size = values->size();
+        pod(&size);
+        if (!is_ok) {
+            return;
+        }
+        if (is_reading) {
+            values->resize(size);
+        }
+        if (size == 0) {
+            return;
+        }
+        size_t count = is_reading
+            ? fread(values->data(), sizeof(T), size, file)
+            : fwrite(values->data(), sizeof(T), size, file);
+        is_ok = count == size;
+    }
+
+    template<typename T, typename F>
+    void objects(std::vector<T>* values, F&& serialize) {
+        uint64_t size = values->size();
+        pod(&size);
+        if (!is_ok) {
+            return;
+        }
+        if (is_reading) {
+            values->resize(size);
+        }
+        for (uint64_t i = 0; i < size && is_ok; i++) {
+            serialize(&(*values)[i]);
+        }
+    }
+};
+
+static bool serialize_capture(CaptureFile* file, DrawCapture* capture) {
+    uint32_t magic = DrawCapture::magic;
+    uint32_t version = DrawCapture::version;
+    file->pod(&magic);
+    file->pod(&version);
+    if (magic != DrawCapture::magic || version != DrawCapture::version) {
+        return false;
+    }
+    file->objects(&capture->shaders, [=](DrawCapture::Shader* shader) {
+        file->pod(&shader->stage);
+        file->array(&shader->code);
+    });
+    file->objects(&capture->pipeline_layouts, [=](DrawCapture::PipelineLayout* layout) {
+        for (uint32_t i = 0; i < Limits::MAX_DESCRIPTOR_SET_COUNT; i++) {
+            file->array(&layout->sets[i]);
+        }
+        file->pod(&layout->max_descriptor_set_counts);
+    });
+    file->objects(&capture->render_pass_layouts, [=](DrawCapture::RenderPassLayout* layout) {
+        file->array(&layout->formats);
+        file->array(&layout->color_attachments);
+        file->pod(&layout->depth_attachment);
+    });
+    file->objects(&capture->render_passes, [=](DrawCapture::RenderPass* render_pass) {
+        file->pod(&render_pass->layout);
+        file->array(&render_pass->attachments);
+    });
+    file->objects(&capture->pipelines, [=](DrawCapture::Pipeline* pipeline) {
+        file->pod(&pipeline->state);
+        file->array(&pipeline->shaders);
+        file->array(&pipeline->attributes);
+        file->array(&pipeline->bindings);
+    });
+    file->objects(&capture->buffers, [=](DrawCapture::Buffer* buffer) {
+        file->pod(&buffer->size);
+        file->pod(&buffer->usage);
+        file->array(&buffer->data);
+    });
+    file->array(&capture->textures);
+    file->array(&capture->samplers);
+    file->objects(&capture->descriptor_sets, [=](DrawCapture::DescriptorSet* set) {
+        file->pod(&set->pipeline_layout);
+        file->pod(&set->set_index);
+        file->array(&set->descriptors);
+    });
+    file->objects(&capture->passes, [=](DrawCapture::Pass* pass) {
+        file->array(&pass->name);
+        file->pod(&pass->render_pass);
+        file->pod(&pass->render_area);
+        file->pod(&pass->global_ds);
+        file->pod(&pass->instance_buffer);
+        file->pod(&pass->instance_buffer_offset);
+        file->pod(&pass->uses_indirect_commands);
+        file->array(&pass->clear_values);
+        file->objects(&pass->streams, [=](std::vector<uint8_t>* stream) {
+            file->array(stream);
+        });
+    });
+    return file->is_ok;
+}
+
+bool DrawCapture::write(const char* path) const {
+    FILE* f = fopen(path, "wb");
+    if (f == nullptr) {
+        return false;
+    }
+    CaptureFile file = { .file = f, .is_reading = false, .is_ok = true, };
+    // Writing doesn't modify the capture.
+    bool is_ok = serialize_capture(&file, const_cast<DrawCapture*>(this));
+    fclose(f);
+    return is_ok;
+}
+
+bool DrawCapture::read(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (f == nullptr) {
+        return false;
+    }
+    CaptureFile file = { .file = f, .is_reading = true, .is_ok = true, };
+    bool is_ok = serialize_capture(&file, this);
+    fclose(f);
+    return is_ok;
+}
+
+template<typename T>
+static uint64_t to_key(T handle) {
+    static_assert(sizeof(T) == sizeof(uint64_t));
+    uint64_t key;
+    memcpy(&key, &handle, sizeof(key));
+    return key;
+}
+
+template<typename T>
+uint32_t DrawCaptureRecorder::find_id(const std::unordered_map<uint64_t, uint32_t>& ids, T handle) {
+    auto it = ids.find(to_key(handle));
+    return it != ids.end() ? it->second : 0;
+}
+
+uint32_t DrawCaptureRecorder::get_buffer_id(Handle<Buffer> buffer) const {
+    if (buffer == Handle<Buffer>::null()) {
+        return 0;
+    }
+    return find_id(buffer_ids, ResourceManager::get()->get_vk_buffer(buffer));
+}
+
+void DrawCaptureRecorder::on_buffer(Handle<Buffer> handle, const Buffer& buffer, const BufferInfo& info) {
+    DrawCapture::Buffer description = { .size = info.size, .usage = info.usage, };
+    if (info.initial_data != nullptr) {
+        const uint8_t* data = (const uint8_t*)info.initial_data;
+        description.data.assign(data, data + info.initial_data_size);
+    }
+    capture.buffers.push_back(std::move(description));
+    uint32_t id = (uint32_t)capture.buffers.size();
+    buffer_ids[to_key(buffer.buffer)] = id;
+    if (info.map != BufferMap::NONE) {
+        mapped_buffers.push_back({ .handle = handle, .id = id, });
+    }
+}
+
+void DrawCaptureRecorder::on_buffer_update(const Buffer& buffer, uint64_t offset, const void* data, uint64_t size) {
+    uint32_t id = find_id(buffer_ids, buffer.buffer);
+    if (id == 0) {
+        return;
+    }
+    DrawCapture::Buffer& description = capture.buffers[id - 1];
+    if (description.data.size() < offset + size) {
+        description.data.resize(description.size);
+    }
+    memcpy(description.data.data() + offset, data, size);
+}
+
+void DrawCaptureRecorder::on_texture(const Texture& texture, const TextureInfo& info) {
+    capture.textures.push_back({
+        .format = info.format,
+        .extent = info.extent,
+        .array_layer_count = info.array_layer_count,
+        .mip_level_count = info.mip_level_count,
+        .flags = info.flags,
+    });
+    texture_ids[to_key(texture.image_view)] = (uint32_t)capture.textures.size();
+}
+
+void DrawCaptureRecorder::on_texture_view(const Texture& view, const Texture& texture, uint32_t layer_count) {
+    uint32_t id = find_id(texture_ids, texture.image_view);
+    if (id == 0) {
+        return;
+    }
+    DrawCapture::Texture description = capture.textures[id - 1];
+    description.array_layer_count = layer_count;
+    description.mip_level_count = 1;
+    description.flags = 0;
+    capture.textures.push_back(description);
+    texture_ids[to_key(view.image_view)] = (uint32_t)capture.textures.size();
+}
+
+void DrawCaptureRecorder::on_shader(const Shader& shader, const char* code, uint32_t size) {
+    DrawCapture::Shader description = { .stage = shader.stage, };
+    description.code.assign((const uint8_t*)code, (const uint8_t*)code + size);
+    capture.shaders.push_back(std::move(description));
+    shader_ids[to_key(shader.shader_module)] = (uint32_t)capture.shaders.size();
+}
+
+void DrawCaptureRecorder::on_render_pass_layout(const RenderPassLayout& layout) {
+    DrawCapture::RenderPassLayout description{};
+    for (uint32_t i = 0; i < layout.info.attachent_count; i++) {
+        description.formats.push_back(layout.info.attachments[i].format);
+    }
+    const SubpassInfo& subpass = layout.info.subpass;
+    description.color_attachments.assign(subpass.color_attachments, subpass.color_attachments + subpass.color_attachment_count);
+    description.depth_attachment = subpass.depth_attachment.value_or(UINT32_MAX);
+    capture.render_pass_layouts.push_back(std::move(description));
+    render_pass_layout_ids[to_key(layout.render_pass)] = (uint32_t)capture.render_pass_layouts.size();
+}
+
+void DrawCaptureRecorder::on_render_pass(const RenderPass& render_pass, const RenderPassInfo& info) {
+    VkRenderPass layout = ResourceManager::get()->get_vk_render_pass(info.layout);
+    DrawCapture::RenderPass description = { .layout = find_id(render_pass_layout_ids, layout), };
+    description.attachments.assign(info.attachments, info.attachments + info.attachent_count);
+    capture.render_passes.push_back(std::move(description));
+    render_pass_ids[to_key(render_pass.render_pass)] = (uint32_t)capture.render_passes.size();
+}
+
+void DrawCaptureRecorder::on_pipeline_layout(const PipelineLayout& layout, const PipelineLayoutInfo& info) {
+    DrawCapture::PipelineLayout description{};
+    for (uint32_t set = 0; set < Limits::MAX_DESCRIPTOR_SET_COUNT; set++) {
+        for (uint32_t i = 0; i < info.set_binding_count[set]; i++) {
+            const VkDescriptorSetLayoutBinding& binding = info.set_binding_infos[set][i];
+            description.sets[set].push_back({
+                .binding = binding.binding,
+                .type = binding.descriptorType,
+                .count = binding.descriptorCount,
+                .stages = binding.stageFlags,
+            });
+        }
+        description.max_descriptor_set_counts[set] = info.max_descriptor_set_counts[set];
+    }
+    capture.pipeline_layouts.push_back(std::move(description));
+    pipeline_layout_ids[to_key(layout.pipeline_layout)] = (uint32_t)capture.pipeline_layouts.size();
+}
+
+void DrawCaptureRecorder::on_descriptor_set(const DescriptorSet& set, VkPipelineLayout pipeline_layout, uint32_t set_index) {
+    // Empty sets share one VkDescriptorSet.
+    if (find_id(descriptor_set_ids, set.descriptor_set) != 0) {
+        return;
+    }
+    capture.descriptor_sets.push_back({
+        .pipeline_layout = find_id(pipeline_layout_ids, pipeline_layout),
+        .set_index = set_index,
+    });
+    descriptor_set_ids[to_key(set.descriptor_set)] = (uint32_t)capture.descriptor_sets.size();
+}
+
+void DrawCaptureRecorder::on_sampler(const Sampler& sampler, const SamplerInfo& info) {
+    capture.samplers.push_back(info);
+    sampler_ids[to_key(sampler.sampler)] = (uint32_t)capture.samplers.size();
+}
+
+void DrawCaptureRecorder::on_pipeline(const Pipeline& pipeline, const PipelineInfo& info) {
+    ResourceManager* rm = ResourceManager::get();
+    DrawCapture::Pipeline description{};
+    description.state = {
+        .primitive_topology = info.primitive_topology,
+        .cull_mode = info.cull_mode,
+        .front_face = info.front_face,
+        .depth_bias_constant_factor = info.depth_bias_constant_factor,
+        .depth_bias_slope_factor = info.depth_bias_slope_factor,
+        .depth_test_enabled = info.depth_test_enabled,
+        .depth_write_enabled = info.depth_write_enabled,
+        .depth_clamp_enabled = info.depth_clamp_enabled,
+        .depth_compare_op = info.depth_compare_op,
+        .blend_state = info.blend_state,
+        .render_pass_layout = find_id(render_pass_layout_ids, rm->get_vk_render_pass(info.render_pass_layout)),
+        .pipeline_layout = find_id(pipeline_layout_ids, rm->get_pipeline_layout(info.pipeline_layout).pipeline_layout),
+    };
+    for (uint32_t i = 0; i < info.shader_count; i++) {
+        description.shaders.push_back(find_id(shader_ids, rm->get_shader(info.shaders[i]).shader_module));
+    }
+    description.attributes.assign(info.attributes, info.attributes + info.attribute_count);
+    description.bindings.assign(info.bindings, info.bindings + info.binding_count);
+    capture.pipelines.push_back(std::move(description));
+    pipeline_ids[to_key(pipeline.pipeline)] = (uint32_t)capture.pipelines.size();
+}
+
+void DrawCaptureRecorder::on_descriptor_set_update(VkDescriptorSet set, Span<const DescriptorSetUpdateRequest> requests) {
+    uint32_t set_id = find_id(descriptor_set_ids, set);
+    if (set_id == 0) {
+        return;
+    }
+    ResourceManager* rm = ResourceManager::get();
+    std::vector<DrawCapture::Descriptor>& descriptors = capture.descriptor_sets[set_id - 1].descriptors;
+    for (uint32_t request_index = 0; request_index < requests.size(); request_index++) {
+        const DescriptorSetUpdateRequest& request = requests[request_index];
+        std::erase_if(descriptors, [&](const DrawCapture::Descriptor& d) { return d.binding == request.binding; });
+        bool is_buffer = request.descriptor_type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER
+            || request.descriptor_type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
+            || request.descriptor_type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC
+            || request.descriptor_type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+        // Both spans share the size.
+        for (uint32_t i = 0; i < request.texture_infos.size(); i++) {
+            DrawCapture::Descriptor descriptor = {
+                .binding = request.binding,
+                .array_element = i,
+                .type = request.descriptor_type,
+            };
+            if (is_buffer) {
+                const BufferDescriptorInfo& info = request.buffer_infos[i];
+                descriptor.buffer = get_buffer_id(info.buffer);
+                descriptor.offset = info.offset;
+                descriptor.range = info.range;
+            } else {
+                const TextureDescriptorInfo& info = request.texture_infos[i];
+                descriptor.texture = find_id(texture_ids, rm->get_vk_image_view(info.texture));
+                if (info.sampler != Handle<Sampler>::null()) {
+                    descriptor.sampler = find_id(sampler_ids, rm->get_sampler(info.sampler).sampler);
+                }
+            }
+            descriptors.push_back(descriptor);
+        }
+    }
+}
+
+void DrawCaptureRecorder::begin_capture() {
+    assert(!capturing);
+    capturing = true;
+    capture.passes.clear();
+}
+
+bool DrawCaptureRecorder::is_capturing() const {
+    return capturing;
+}
+
+uint32_t DrawCaptureRecorder::add_pass(const char* name, const DrawPassInfo& info) {
+    assert(capturing);
+    ResourceManager* rm = ResourceManager::get();
+    DrawCapture::Pass pass = {
+        .render_pass = find_id(render_pass_ids, rm->get_render_pass(info.render_pass).render_pass),
+        .render_area = info.render_area,
+        .instance_buffer = get_buffer_id(info.instance_buffer),
+        .instance_buffer_offset = info.instance_buffer_offset,
+        .uses_indirect_commands = info.indirect_commands.capacity != 0,
+    };
+    pass.name.assign(name, name + strlen(name) + 1);
+    if (info.global_ds != Handle<DescriptorSet>::null()) {
+        pass.global_ds = find_id(descriptor_set_ids, rm->get_vk_descriptor_set(info.global_ds));
+    }
+    pass.clear_values.assign(info.clear_values.data(), info.clear_values.data() + info.clear_values.size());
+    capture.passes.push_back(std::move(pass));
+    return (uint32_t)capture.passes.size() - 1;
+}
+
+void DrawCaptureRecorder::add_stream(uint32_t pass, Span<const uint8_t> stream) {
+    assert(capturing);
+    std::vector<uint8_t> copy(stream.data(), stream.data() + stream.size());
+    DrawStream::remap_handles(copy.data(), copy.size(), [this](DrawStream::HandleType type, uint64_t handle) {
+        switch (type) {
+        case DrawStream::HandleType::PIPELINE:
+            return (uint64_t)find_id(pipeline_ids, handle);
+        case DrawStream::HandleType::PIPELINE_LAYOUT:
+            return (uint64_t)find_id(pipeline_layout_ids, handle);
+        case DrawStream::HandleType::DESCRIPTOR_SET:
+            return (uint64_t)find_id(descriptor_set_ids, handle);
+        case DrawStream::HandleType::BUFFER:
+            return (uint64_t)find_id(buffer_ids, handle);
+        }
+        return (uint64_t)0;
+    });
+    capture.passes[pass].streams.push_back(std::move(copy));
+}
+
+bool DrawCaptureRecorder::end_capture(const char* path) {
+    assert(capturing);
+    capturing = false;
+    ResourceManager* rm = ResourceManager::get();
+    // Mapped buffers may have been created with initial data, it is restored after writing.
+    std::vector<std::vector<uint8_t>> initial_data(mapped_buffers.size());
+    for (uint32_t i = 0; i < mapped_buffers.size(); i++) {
+        DrawCapture::Buffer& buffer = capture.buffers[mapped_buffers[i].id - 1];
+        initial_data[i].swap(buffer.data);
+        const uint8_t* data = rm->map_buffer(mapped_buffers[i].handle);
+        buffer.data.assign(data, data + buffer.size);
+        rm->unmap_buffer(mapped_buffers[i].handle);
+    }
+    bool is_written = capture.write(path);
+    for (uint32_t i = 0; i < mapped_buffers.size(); i++) {
+        capture.buffers[mapped_buffers[i].id - 1].data.swap(initial_data[i]);
+    }
+    capture.passes.clear();
+    return is_written;
+}
+
+}
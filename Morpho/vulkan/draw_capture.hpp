@@ -0,0 +1,180 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <unordered_map>
+#include "resources.hpp"
+#include "command_buffer.hpp"
+#include "limits.hpp"
+#include "common/span.hpp"
+
+namespace Morpho::Vulkan {
+
+// A frame's draw passes with descriptions of every resource their streams may reference,
+// enough to decode the streams again on another device without the application.
+// Resources reference each other by index + 1, 0 is null. Streams hold these ids instead of Vulkan handles.
+// Texture contents are not captured. Buffers keep their initial data or what was mapped at capture time.
+struct DrawCapture {
+    static const uint32_t magic = 0x5043444d;
+    static const uint32_t version = 1;
+
+    struct Shader {
+        ShaderStage stage;
+        std::vector<uint8_t> code;
+    };
+
+    struct DescriptorBinding {
+        uint32_t binding;
+        VkDescriptorType type;
+        uint32_t count;
+        VkShaderStageFlags stages;
+    };
+
+    struct PipelineLayout {
+        std::vector<DescriptorBinding> sets[Limits::MAX_DESCRIPTOR_SET_COUNT];
+        uint32_t max_descriptor_set_counts[Limits::MAX_DESCRIPTOR_SET_COUNT];
+    };
+
+    struct RenderPassLayout {
+        std::vector<VkFormat> formats;
+        std::vector<uint32_t> color_attachments;
+        // UINT32_MAX if there is none.
+        uint32_t depth_attachment;
+    };
+
+    struct RenderPass {
+        uint32_t layout;
+        std::vector<RenderPassAttachmentInfo> attachments;
+    };
+
+    struct PipelineState {
+        VkPrimitiveTopology primitive_topology;
+        VkCullModeFlags cull_mode;
+        VkFrontFace front_face;
+        float depth_bias_constant_factor;
+        float depth_bias_slope_factor;
+        VkBool32 depth_test_enabled;
+        VkBool32 depth_write_enabled;
+        VkBool32 depth_clamp_enabled;
+        VkCompareOp depth_compare_op;
+        VkPipelineColorBlendAttachmentState blend_state;
+        uint32_t render_pass_layout;
+        uint32_t pipeline_layout;
+    };
+
+    struct Pipeline {
+        PipelineState state;
+        std::vector<uint32_t> shaders;
+        std::vector<VkVertexInputAttributeDescription> attributes;
+        std::vector<VkVertexInputBindingDescription> bindings;
+    };
+
+    struct Buffer {
+        VkDeviceSize size;
+        VkBufferUsageFlags usage;
+        // Empty means zeroed.
+        std::vector<uint8_t> data;
+    };
+
+    struct Texture {
+        VkFormat format;
+        VkExtent3D extent;
+        uint32_t array_layer_count;
+        uint32_t mip_level_count;
+        VkImageCreateFlags flags;
+    };
+
+    struct Descriptor {
+        uint32_t binding;
+        uint32_t array_element;
+        VkDescriptorType type;
+        uint32_t buffer;
+        uint64_t offset;
+        uint64_t range;
+        uint32_t texture;
+        uint32_t sampler;
+    };
+
+    struct DescriptorSet {
+        uint32_t pipeline_layout;
+        uint32_t set_index;
+        std::vector<Descriptor> descriptors;
+    };
+
+    struct Pass {
+        std::vector<char> name;
+        uint32_t render_pass;
+        VkRect2D render_area;
+        uint32_t global_ds;
+        uint32_t instance_buffer;
+        uint64_t instance_buffer_offset;
+        VkBool32 uses_indirect_commands;
+        std::vector<VkClearValue> clear_values;
+        std::vector<std::vector<uint8_t>> streams;
+    };
+
+    std::vector<Shader> shaders;
+    std::vector<PipelineLayout> pipeline_layouts;
+    std::vector<RenderPassLayout> render_pass_layouts;
+    std::vector<RenderPass> render_passes;
+    std::vector<Pipeline> pipelines;
+    std::vector<Buffer> buffers;
+    std::vector<Texture> textures;
+    std::vector<SamplerInfo> samplers;
+    std::vector<DescriptorSet> descriptor_sets;
+    std::vector<Pass> passes;
+
+    bool write(const char* path) const;
+    bool read(const char* path);
+};
+
+// Keeps descriptions of what ResourceManager creates while attached (see ResourceManager::set_capture_recorder),
+// so the passes added between begin_capture and end_capture can be written out as a DrawCapture.
+// Has to be attached before the resources referenced by captured streams are created.
+class DrawCaptureRecorder {
+public:
+    void on_buffer(Handle<Buffer> handle, const Buffer& buffer, const BufferInfo& info);
+    void on_buffer_update(const Buffer& buffer, uint64_t offset, const void* data, uint64_t size);
+    void on_texture(const Texture& texture, const TextureInfo& info);
+    void on_texture_view(const Texture& view, const Texture& texture, uint32_t layer_count);
+    void on_shader(const Shader& shader, const char* code, uint32_t size);
+    void on_render_pass_layout(const RenderPassLayout& layout);
+    void on_render_pass(const RenderPass& render_pass, const RenderPassInfo& info);
+    void on_pipeline_layout(const PipelineLayout& layout, const PipelineLayoutInfo& info);
+    void on_descriptor_set(const DescriptorSet& set, VkPipelineLayout pipeline_layout, uint32_t set_index);
+    void on_sampler(const Sampler& sampler, const SamplerInfo& info);
+    void on_pipeline(const Pipeline& pipeline, const PipelineInfo& info);
+    void on_descriptor_set_update(VkDescriptorSet set, Span<const DescriptorSetUpdateRequest> requests);
+
+    void begin_capture();
+    bool is_capturing() const;
+    uint32_t add_pass(const char* name, const DrawPassInfo& info);
+    // Stream is copied with its handles replaced by capture ids.
+    void add_stream(uint32_t pass, Span<const uint8_t> stream);
+    // Snapshots mapped buffers and writes everything recorded so far.
+    bool end_capture(const char* path);
+private:
+    struct MappedBuffer {
+        Handle<Buffer> handle;
+        uint32_t id;
+    };
+
+    DrawCapture capture;
+    std::vector<MappedBuffer> mapped_buffers;
+    // Vulkan handle -> capture id.
+    std::unordered_map<uint64_t, uint32_t> buffer_ids;
+    std::unordered_map<uint64_t, uint32_t> texture_ids;
+    std::unordered_map<uint64_t, uint32_t> shader_ids;
+    std::unordered_map<uint64_t, uint32_t> render_pass_layout_ids;
+    std::unordered_map<uint64_t, uint32_t> render_pass_ids;
+    std::unordered_map<uint64_t, uint32_t> pipeline_layout_ids;
+    std::unordered_map<uint64_t, uint32_t> sampler_ids;
+    std::unordered_map<uint64_t, uint32_t> descriptor_set_ids;
+    std::unordered_map<uint64_t, uint32_t> pipeline_ids;
+    bool capturing = false;
+
+    template<typename T>
+    static uint32_t find_id(const std::unordered_map<uint64_t, uint32_t>& ids, T handle);
+    uint32_t get_buffer_id(Handle<Buffer> buffer) const;
+};
+
+}
@@ -0,0 +1,102 @@
+#include "geometry_heap.hpp"
+#include "resource_manager.hpp"
+#include <stdlib.h>
+#include <assert.h>
+
+namespace Morpho::Vulkan {
+
+void GeometryHeap::init(GeometryHeap* heap, ResourceManager* resource_manager, const GeometryHeapInfo& info) {
+    assert(info.vertex_stream_count != 0 && info.vertex_stream_count <= max_vertex_stream_count);
+    heap->resource_manager = resource_manager;
+    heap->vertex_stream_count = info.vertex_stream_count;
+    for (uint32_t i = 0; i < info.vertex_stream_count; i++) {
+        heap->vertex_strides[i] = info.vertex_strides[i];
+        heap->vertex_buffers[i] = resource_manager->create_buffer({
+            .size = (VkDeviceSize)info.vertex_capacity * info.vertex_strides[i],
+            .usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        });
+    }
+    heap->index_buffer = resource_manager->create_buffer({
+        .size = (VkDeviceSize)info.index_capacity * sizeof(uint32_t),
+        .usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    });
+    OffsetAllocator::init(&heap->vertex_allocator, info.vertex_capacity, info.max_mesh_count);
+    OffsetAllocator::init(&heap->index_allocator, info.index_capacity, info.max_mesh_count);
+}
+
+void GeometryHeap::destroy() {
+    vertex_allocator.destroy();
+    index_allocator.destroy();
+}
+
+bool GeometryHeap::allocate(uint32_t vertex_count, uint32_t index_count, GeometryAllocation* allocation) {
+    OffsetAllocation vertices = vertex_allocator.allocate(vertex_count);
+    if (vertices.node == OffsetAllocator::no_space) {
+        return false;
+    }
+    OffsetAllocation indices = index_allocator.allocate(index_count);
+    if (indices.node == OffsetAllocator::no_space) {
+        vertex_allocator.free(vertices);
+        return false;
+    }
+    *allocation = {
+        .vertices = vertices,
+        .indices = indices,
+        .vertex_count = vertex_count,
+        .index_count = index_count,
+    };
+    return true;
+}
+
+void GeometryHeap::free(const GeometryAllocation& allocation) {
+    vertex_allocator.free(allocation.vertices);
+    index_allocator.free(allocation.indices);
+}
+
+void GeometryHeap::upload_vertices(const GeometryAllocation& allocation, uint32_t stream, const void* data) {
+    assert(stream < vertex_stream_count);
+    resource_manager->update_buffer(
+        vertex_buffers[stream],
+        (VkDeviceSize)allocation.vertices.offset * vertex_strides[stream],
+        data,
+        (VkDeviceSize)allocation.vertex_count * vertex_strides[stream]
+    );
+}
+
+void GeometryHeap::upload_indices(const GeometryAllocation& allocation, const void* data, VkIndexType index_type) {
+    VkDeviceSize offset = (VkDeviceSize)allocation.indices.offset * sizeof(uint32_t);
+    VkDeviceSize size = (VkDeviceSize)allocation.index_count * sizeof(uint32_t);
+    if (index_type == VK_INDEX_TYPE_UINT32) {
+        resource_manager->update_buffer(index_buffer, offset, data, size);
+        return;
+    }
+    assert(index_type == VK_INDEX_TYPE_UINT16);
+    uint32_t* widened = (uint32_t*)malloc(size);
+    for (uint32_t i = 0; i < allocation.index_count; i++) {
+        widened[i] = ((const uint16_t*)data)[i];
+    }
+    resource_manager->update_buffer(index_buffer, offset, widened, size);
+    ::free(widened);
+}
+
+Handle<Buffer> GeometryHeap::get_vertex_buffer(uint32_t stream) const {
+    assert(stream < vertex_stream_count);
+    return vertex_buffers[stream];
+}
+
+Handle<Buffer> GeometryHeap::get_index_buffer() const {
+    return index_buffer;
+}
+
+uint32_t GeometryHeap::get_vertex_stream_count() const {
+    return vertex_stream_count;
+}
+
+GeometryHeapStats GeometryHeap::get_stats() const {
+    return {
+        .vertices = vertex_allocator.get_stats(),
+        .indices = index_allocator.get_stats(),
+    };
+}
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include "resources.hpp"
+#include "common/offset_allocator.hpp"
+
+namespace Morpho::Vulkan {
+
+class ResourceManager;
+
+struct GeometryHeapInfo {
+    uint32_t vertex_stream_count;
+    // Bytes per vertex of each stream, streams are tightly packed.
+    uint32_t vertex_strides[4];
+    uint32_t vertex_capacity = 1 << 22;
+    uint32_t index_capacity = 1 << 24;
+    uint32_t max_mesh_count = OffsetAllocator::default_max_allocation_count;
+};
+
+// Vertex and index ranges of one mesh within the heap.
+// Draw with first_index = indices.offset and vertex_offset = vertices.offset.
+struct GeometryAllocation {
+    OffsetAllocation vertices;
+    OffsetAllocation indices;
+    uint32_t vertex_count;
+    uint32_t index_count;
+};
+
+struct GeometryHeapStats {
+    OffsetAllocatorStats vertices;
+    OffsetAllocatorStats indices;
+};
+
+// Vertex and index data of many meshes in a few large device local buffers:
+// one buffer per vertex stream addressed by vertex index and one VK_INDEX_TYPE_UINT32 index buffer.
+// Every mesh binds the same buffers, so draws differ only by draw parameters.
+// NOTE: zeroed memory is an uninitialized heap, init before use.
+class GeometryHeap {
+public:
+    static const uint32_t max_vertex_stream_count = 4;
+
+    static void init(GeometryHeap* heap, ResourceManager* resource_manager, const GeometryHeapInfo& info);
+    // Buffers stay alive until ResourceManager is destroyed.
+    void destroy();
+    // Returns false if either range doesn't fit.
+    bool allocate(uint32_t vertex_count, uint32_t index_count, GeometryAllocation* allocation);
+    // Ranges are reused right away, the GPU must be done with draws that read them.
+    void free(const GeometryAllocation& allocation);
+    // data holds allocation.vertex_count tightly packed vertices of the stream.
+    void upload_vertices(const GeometryAllocation& allocation, uint32_t stream, const void* data);
+    // VK_INDEX_TYPE_UINT16 indices are widened.
+    void upload_indices(const GeometryAllocation& allocation, const void* data, VkIndexType index_type);
+    Handle<Buffer> get_vertex_buffer(uint32_t stream) const;
+    Handle<Buffer> get_index_buffer() const;
+    uint32_t get_vertex_stream_count() const;
+    GeometryHeapStats get_stats() const;
+private:
+    ResourceManager* resource_manager;
+    Handle<Buffer> vertex_buffers[max_vertex_stream_count];
+    uint32_t vertex_strides[max_vertex_stream_count];
+    uint32_t vertex_stream_count;
+    Handle<Buffer> index_buffer;
+    OffsetAllocator vertex_allocator;
+    OffsetAllocator index_allocator;
+};
+
+}
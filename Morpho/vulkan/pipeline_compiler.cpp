@@ -0,0 +1,266 @@
+#include "pipeline_compiler.hpp"
+#include <stb_ds.h>
+#include <assert.h>
+#include <chrono>
+
+namespace Morpho::Vulkan {
+
+void PipelineCompiler::init(
+    PipelineCompiler* compiler,
+    uint32_t worker_count,
+    VkDevice device,
+    VkPipelineCache pipeline_cache,
+    bool has_creation_feedback
+) {
+    compiler->device = device;
+    compiler->pipeline_cache = pipeline_cache;
+    compiler->has_creation_feedback = has_creation_feedback;
+    compiler->worker_count = worker_count;
+    compiler->is_running = true;
+    compiler->workers = new std::thread[worker_count];
+    for (uint32_t i = 0; i < worker_count; i++) {
+        compiler->workers[i] = std::thread(&PipelineCompiler::worker_loop, compiler);
+    }
+}
+
+void PipelineCompiler::destroy() {
+    wait_idle();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        is_running = false;
+    }
+    work_ready.notify_all();
+    for (uint32_t i = 0; i < worker_count; i++) {
+        workers[i].join();
+    }
+    delete[] workers;
+    workers = nullptr;
+    worker_count = 0;
+    arrfree(queue);
+    arrfree(finished);
+}
+
+void PipelineCompiler::compile(PipelineBuild* build) const {
+    const PipelineInfo& info = build->info;
+    VkPipelineVertexInputStateCreateInfo vertex_input_state{};
+    vertex_input_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertex_input_state.vertexBindingDescriptionCount = info.binding_count;
+    vertex_input_state.pVertexBindingDescriptions = info.bindings;
+    vertex_input_state.vertexAttributeDescriptionCount = info.attribute_count;
+    vertex_input_state.pVertexAttributeDescriptions = info.attributes;
+
+    VkPipelineInputAssemblyStateCreateInfo input_assembly_state{};
+    input_assembly_state.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    input_assembly_state.pNext = nullptr;
+    input_assembly_state.flags = 0;
+    input_assembly_state.topology = info.primitive_topology;
+    input_assembly_state.primitiveRestartEnable = VK_FALSE;
+
+    VkDynamicState dynamic_states[] = {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR,
+    };
+
+    VkPipelineDynamicStateCreateInfo dynamic_state{};
+    dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamic_state.dynamicStateCount = 2;
+    dynamic_state.flags = 0;
+    dynamic_state.pNext = nullptr;
+    dynamic_state.pDynamicStates = dynamic_states;
+
+    VkPipelineViewportStateCreateInfo viewport_state{};
+    viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewport_state.pNext = nullptr;
+    viewport_state.scissorCount = 1;
+    viewport_state.pScissors = nullptr;
+    viewport_state.viewportCount = 1;
+    viewport_state.pViewports = nullptr;
+
+    VkPipelineRasterizationStateCreateInfo rasterization_state{};
+    rasterization_state.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterization_state.pNext = nullptr;
+    rasterization_state.flags = 0;
+    rasterization_state.depthClampEnable = VK_FALSE;
+    rasterization_state.rasterizerDiscardEnable = VK_FALSE;
+    rasterization_state.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterization_state.lineWidth = 1.0f;
+    rasterization_state.cullMode = info.cull_mode;
+    rasterization_state.frontFace = info.front_face;
+    rasterization_state.depthBiasEnable = info.depth_bias_constant_factor != 0.0f || info.depth_bias_slope_factor != 0.0f;
+    rasterization_state.depthBiasConstantFactor = info.depth_bias_constant_factor;
+    rasterization_state.depthBiasSlopeFactor = info.depth_bias_slope_factor;
+    rasterization_state.depthClampEnable = info.depth_clamp_enabled;
+
+    VkPipelineMultisampleStateCreateInfo multisample_state{};
+    multisample_state.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisample_state.pNext = nullptr;
+    multisample_state.flags = 0;
+    multisample_state.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    multisample_state.sampleShadingEnable = VK_FALSE;
+
+    VkPipelineDepthStencilStateCreateInfo depth_stencil_state{};
+    depth_stencil_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depth_stencil_state.depthTestEnable = info.depth_test_enabled;
+    depth_stencil_state.depthWriteEnable = info.depth_write_enabled;
+    depth_stencil_state.depthCompareOp = info.depth_compare_op;
+
+    VkPipelineColorBlendAttachmentState color_blend_attachment_state = info.blend_state;
+
+    VkPipelineColorBlendStateCreateInfo color_blend_state{};
+    color_blend_state.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    color_blend_state.pNext = nullptr;
+    color_blend_state.flags = 0;
+    color_blend_state.logicOpEnable = VK_FALSE;
+    color_blend_state.logicOp = VK_LOGIC_OP_COPY;
+    color_blend_state.attachmentCount = 1;
+    color_blend_state.pAttachments = &color_blend_attachment_state;
+    color_blend_state.blendConstants[0] = 0.0f;
+    color_blend_state.blendConstants[1] = 0.0f;
+    color_blend_state.blendConstants[2] = 0.0f;
+    color_blend_state.blendConstants[3] = 0.0f;
+
+    VkGraphicsPipelineCreateInfo vk_pipeline_info{};
+    vk_pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    vk_pipeline_info.stageCount = info.shader_count;
+    vk_pipeline_info.pStages = build->stages;
+    vk_pipeline_info.pVertexInputState = &vertex_input_state;
+    vk_pipeline_info.pInputAssemblyState = &input_assembly_state;
+    vk_pipeline_info.pTessellationState = nullptr;
+    vk_pipeline_info.pViewportState = &viewport_state;
+    vk_pipeline_info.pRasterizationState = &rasterization_state;
+    vk_pipeline_info.pMultisampleState = &multisample_state;
+    vk_pipeline_info.pDepthStencilState = &depth_stencil_state;
+    vk_pipeline_info.pColorBlendState = &color_blend_state;
+    vk_pipeline_info.pDynamicState = &dynamic_state;
+    vk_pipeline_info.layout = build->pipeline_layout;
+    vk_pipeline_info.renderPass = build->render_pass;
+    vk_pipeline_info.subpass = 0;
+    vk_pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
+    vk_pipeline_info.basePipelineIndex = 0;
+
+    VkPipelineCreationFeedback creation_feedback{};
+    VkPipelineCreationFeedback stage_creation_feedbacks[(uint32_t)ShaderStage::MAX_VALUE]{};
+    VkPipelineCreationFeedbackCreateInfo creation_feedback_info{};
+    if (has_creation_feedback) {
+        creation_feedback_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO;
+        creation_feedback_info.pPipelineCreationFeedback = &creation_feedback;
+        creation_feedback_info.pipelineStageCreationFeedbackCount = info.shader_count;
+        creation_feedback_info.pPipelineStageCreationFeedbacks = stage_creation_feedbacks;
+        vk_pipeline_info.pNext = &creation_feedback_info;
+    }
+
+    VkPipeline vk_pipeline{};
+    auto creation_start = std::chrono::steady_clock::now();
+    VkResult result = vkCreateGraphicsPipelines(device, pipeline_cache, 1, &vk_pipeline_info, nullptr, &vk_pipeline);
+    auto creation_end = std::chrono::steady_clock::now();
+    // Can't throw from workers, a pipeline that failed stays null and its draws are dropped.
+    assert(result == VK_SUCCESS);
+    build->pipeline = result == VK_SUCCESS ? vk_pipeline : VK_NULL_HANDLE;
+    build->duration_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(creation_end - creation_start).count();
+    build->is_cache_hit = false;
+    if (creation_feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT) {
+        build->duration_ns = creation_feedback.duration;
+        build->is_cache_hit = creation_feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT;
+    }
+}
+
+void PipelineCompiler::compile_all(PipelineBuild* const* builds, uint32_t count) {
+    std::unique_lock<std::mutex> lock(mutex);
+    // Ahead of enqueued builds, the caller is blocked on these.
+    for (uint32_t i = 0; i < count; i++) {
+        builds[i]->is_done = false;
+        builds[i]->is_enqueued = false;
+        arrins(queue, i, builds[i]);
+    }
+    pending_count += count;
+    work_ready.notify_all();
+    // Only helps with its own builds, enqueued ones are left to the workers.
+    for (uint32_t i = 0; i < count; i++) {
+        compile_queued(lock, builds[i]);
+    }
+    build_done.wait(lock, [&] {
+        for (uint32_t i = 0; i < count; i++) {
+            if (!builds[i]->is_done) {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+void PipelineCompiler::enqueue(PipelineBuild* build) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        build->is_done = false;
+        build->is_enqueued = true;
+        arrput(queue, build);
+        pending_count++;
+    }
+    work_ready.notify_one();
+}
+
+void PipelineCompiler::take_finished(PipelineBuild*** builds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (uint32_t i = 0; i < arrlen(finished); i++) {
+        arrput(*builds, finished[i]);
+    }
+    arrsetlen(finished, 0);
+}
+
+void PipelineCompiler::wait(PipelineBuild* build) {
+    std::unique_lock<std::mutex> lock(mutex);
+    compile_queued(lock, build);
+    build_done.wait(lock, [build] { return build->is_done; });
+}
+
+void PipelineCompiler::wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (compile_next(lock)) {
+    }
+    build_done.wait(lock, [this] { return pending_count == 0; });
+}
+
+void PipelineCompiler::worker_loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        work_ready.wait(lock, [this] { return !is_running || arrlen(queue) != 0; });
+        if (!is_running) {
+            return;
+        }
+        compile_next(lock);
+    }
+}
+
+bool PipelineCompiler::compile_next(std::unique_lock<std::mutex>& lock) {
+    if (arrlen(queue) == 0) {
+        return false;
+    }
+    compile_at(lock, 0);
+    return true;
+}
+
+bool PipelineCompiler::compile_queued(std::unique_lock<std::mutex>& lock, PipelineBuild* build) {
+    for (uint32_t i = 0; i < arrlen(queue); i++) {
+        if (queue[i] == build) {
+            compile_at(lock, i);
+            return true;
+        }
+    }
+    return false;
+}
+
+void PipelineCompiler::compile_at(std::unique_lock<std::mutex>& lock, uint32_t queue_index) {
+    PipelineBuild* build = queue[queue_index];
+    arrdel(queue, queue_index);
+    lock.unlock();
+    compile(build);
+    lock.lock();
+    build->is_done = true;
+    pending_count--;
+    if (build->is_enqueued) {
+        arrput(finished, build);
+    }
+    build_done.notify_all();
+}
+
+}
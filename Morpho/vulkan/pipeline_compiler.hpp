@@ -0,0 +1,87 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "resources.hpp"
+#include "limits.hpp"
+
+namespace Morpho::Vulkan {
+
+// PipelineInfo with every handle resolved up front, compiling it doesn't touch ResourceManager.
+// NOTE: pointers of info point into the build itself, so it stays where it was allocated.
+struct PipelineBuild {
+    PipelineInfo info;
+    Handle<Shader> shaders[(uint32_t)ShaderStage::MAX_VALUE];
+    VkPipelineShaderStageCreateInfo stages[(uint32_t)ShaderStage::MAX_VALUE];
+    VkVertexInputAttributeDescription attributes[Limits::MAX_VERTEX_ATTRIBUTE_DESCRIPTION_COUNT];
+    VkVertexInputBindingDescription bindings[Limits::MAX_VERTEX_INPUT_BINDING_COUNT];
+    VkPipelineLayout pipeline_layout;
+    VkRenderPass render_pass;
+    Handle<Pipeline> handle;
+    // Written by compile.
+    VkPipeline pipeline;
+    uint64_t duration_ns;
+    bool is_cache_hit;
+    bool is_done;
+    // Enqueued builds are handed back by take_finished, compile_all ones aren't.
+    bool is_enqueued;
+};
+
+// Worker threads creating pipelines through the context's pipeline cache, which is internally synchronized.
+class PipelineCompiler {
+public:
+    PipelineCompiler(const PipelineCompiler&) = delete;
+    PipelineCompiler &operator=(const PipelineCompiler&) = delete;
+    PipelineCompiler(PipelineCompiler&&) = delete;
+    PipelineCompiler &operator=(PipelineCompiler&&) = delete;
+    PipelineCompiler() = default;
+    ~PipelineCompiler() = default;
+
+    static void init(
+        PipelineCompiler* compiler,
+        uint32_t worker_count,
+        VkDevice device,
+        VkPipelineCache pipeline_cache,
+        bool has_creation_feedback
+    );
+    // Waits for enqueued builds, the finished ones are not handed back.
+    void destroy();
+    // On the calling thread.
+    void compile(PipelineBuild* build) const;
+    // Goes ahead of enqueued builds, the calling thread helps with these only. Returns when every one is done.
+    void compile_all(PipelineBuild* const* builds, uint32_t count);
+    void enqueue(PipelineBuild* build);
+    // Appends enqueued builds that are done to the stb_ds array.
+    void take_finished(PipelineBuild*** builds);
+    // Returns once the enqueued build is done, compiles it on the calling thread if no worker took it yet.
+    void wait(PipelineBuild* build);
+    // Returns once every enqueued build is done.
+    void wait_idle();
+private:
+    std::thread* workers = nullptr;
+    uint32_t worker_count = 0;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable build_done;
+    // stb_ds arrays, queue is in enqueue order.
+    PipelineBuild** queue = nullptr;
+    PipelineBuild** finished = nullptr;
+    // Queued and being compiled.
+    uint32_t pending_count = 0;
+    bool is_running = false;
+    VkDevice device = VK_NULL_HANDLE;
+    VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+    bool has_creation_feedback = false;
+
+    void worker_loop();
+    // Called with the mutex locked, which is released while compiling.
+    // Takes the oldest queued build and compiles it, false if there is none.
+    bool compile_next(std::unique_lock<std::mutex>& lock);
+    // Compiles build if no worker took it yet, false otherwise.
+    bool compile_queued(std::unique_lock<std::mutex>& lock, PipelineBuild* build);
+    void compile_at(std::unique_lock<std::mutex>& lock, uint32_t queue_index);
+};
+
+}
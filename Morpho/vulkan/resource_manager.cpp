@@ -1,5 +1,6 @@
 #include "resource_manager.hpp"
 #include "context.hpp"
+#include "draw_capture.hpp"
 #include <stb_ds.h>
 #include "common/utils.hpp"
 
@@ -119,6 +120,10 @@ Handle<Buffer> ResourceManager::create_buffer(const BufferInfo& info, uint8_t**
     );
     Buffer buffer = create_vk_buffer(info);
     Handle<Buffer> handle = buffers.add(buffer);
+    vk_buffers.set(handle, buffer.buffer);
+    if (capture_recorder != nullptr) {
+        capture_recorder->on_buffer(handle, buffer, info);
+    }
     bool create_mapped = mapped_ptr != nullptr && info.map != BufferMap::NONE;
     if (create_mapped) {
         map_buffer_helper(&buffer);
@@ -132,17 +137,7 @@ Handle<Buffer> ResourceManager::create_buffer(const BufferInfo& info, uint8_t**
     }
     assert(info.initial_data_size <= info.size);
     if (info.map == BufferMap::NONE) {
-        StagingBuffer* sb = acquire_staging_buffer(info.initial_data_size);
-        memcpy(sb->write_ptr, info.initial_data, info.initial_data_size);
-        post_cmd->copy_buffer(
-            sb->buffer,
-            buffer,
-            {
-                .srcOffset = sb->write_offset,
-                .dstOffset = 0,
-                .size = info.initial_data_size,
-            }
-        );
+        stream_to_buffer(staging_stream_commit, buffer.buffer, 0, info.initial_data, info.initial_data_size);
         memory_barrier.srcAccessMask |= VK_ACCESS_TRANSFER_WRITE_BIT;
         src_stages |= VK_PIPELINE_STAGE_TRANSFER_BIT;
         derive_stages_and_access_from_buffer_usage(info.usage, &dst_stages, &memory_barrier.dstAccessMask);
@@ -160,7 +155,72 @@ Handle<Buffer> ResourceManager::create_buffer(const BufferInfo& info, uint8_t**
 }
 
 Handle<Texture> ResourceManager::create_texture(const TextureInfo& texture_info) {
+    VkPipelineStageFlags texture_dst_stages{};
+    VkAccessFlags texture_dst_access{};
+    VkImageLayout final_layout{};
+    Handle<Texture> handle = create_vk_texture(texture_info, &final_layout, &texture_dst_stages, &texture_dst_access);
+    const Texture& texture = *textures.get_ptr(handle);
+    VkImageAspectFlags aspect = texture.aspect;
+
+    VkImageMemoryBarrier post_barrier{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+    post_barrier.subresourceRange.aspectMask = aspect;
+    post_barrier.subresourceRange.baseMipLevel = 0;
+    post_barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+    post_barrier.subresourceRange.baseArrayLayer = 0;
+    post_barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+    post_barrier.image = texture.image;
+
+    if (texture_info.initial_data == nullptr) {
+        src_stages |= VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        dst_stages |= texture_dst_stages;
+        post_barrier.srcAccessMask = 0;
+        post_barrier.dstAccessMask = texture_dst_access;
+        post_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        post_barrier.newLayout = final_layout;
+        post_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        post_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        arrput(post_barriers, post_barrier);
+
+        need_submit = 1;
+
+        return handle;
+    }
+
+    VkImageMemoryBarrier pre_barrier{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+    pre_barrier.subresourceRange.aspectMask = aspect;
+    pre_barrier.subresourceRange.baseMipLevel = 0;
+    pre_barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+    pre_barrier.subresourceRange.baseArrayLayer = 0;
+    pre_barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+    pre_barrier.image = texture.image;
+    pre_barrier.srcAccessMask = 0;
+    pre_barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    pre_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    pre_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    arrput(pre_barriers, pre_barrier);
+
+    need_submit = 1;
+    stream_to_texture(staging_stream_commit, texture, texture_info);
+    src_stages |= VK_PIPELINE_STAGE_TRANSFER_BIT;
+    dst_stages |= texture_dst_stages;
+    post_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    post_barrier.dstAccessMask = texture_dst_access;
+    post_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    post_barrier.newLayout = final_layout;
+
+    arrput(post_barriers, post_barrier);
+
+    return handle;
+}
+
+Handle<Texture> ResourceManager::create_vk_texture(
+    const TextureInfo& texture_info,
+    VkImageLayout* out_final_layout,
+    VkPipelineStageFlags* out_dst_stages,
+    VkAccessFlags* out_dst_access
+) {
     VkImageCreateInfo image_info{};
+
     image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     image_info.flags = texture_info.flags;
     image_info.extent = texture_info.extent;
@@ -236,67 +296,148 @@ Handle<Texture> ResourceManager::create_texture(const TextureInfo& texture_info)
     texture.aspect = aspect;
     texture.owns_image = true;
     Handle<Texture> handle = textures.add(texture);
+    vk_image_views.set(handle, texture.image_view);
+    if (capture_recorder != nullptr) {
+        capture_recorder->on_texture(texture, texture_info);
+    }
 
-    VkImageMemoryBarrier post_barrier{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
-    post_barrier.subresourceRange.aspectMask = aspect;
-    post_barrier.subresourceRange.baseMipLevel = 0;
-    post_barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
-    post_barrier.subresourceRange.baseArrayLayer = 0;
-    post_barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
-    post_barrier.image = texture.image;
-
-    if (texture_info.initial_data == nullptr) {
-        src_stages |= VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-        dst_stages |= texture_dst_stages;
-        post_barrier.srcAccessMask = 0;
-        post_barrier.dstAccessMask = texture_dst_access;
-        post_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        post_barrier.newLayout = final_layout;
-        post_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        post_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        arrput(post_barriers, post_barrier);
-
-        need_submit = 1;
+    *out_final_layout = final_layout;
+    *out_dst_stages = texture_dst_stages;
+    *out_dst_access = texture_dst_access;
+    return handle;
+}
 
-        return handle;
+Handle<Buffer> ResourceManager::create_buffer_async(const BufferInfo& info, UploadTicket* ticket) {
+    assert(info.map == BufferMap::NONE);
+    BufferInfo empty_info = info;
+    empty_info.initial_data = nullptr;
+    empty_info.initial_data_size = 0;
+    Handle<Buffer> handle = create_buffer(empty_info);
+    *ticket = {};
+    if (info.initial_data != nullptr) {
+        *ticket = update_buffer_async(handle, 0, info.initial_data, info.initial_data_size);
     }
+    return handle;
+}
 
-    VkImageMemoryBarrier pre_barrier{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
-    pre_barrier.subresourceRange.aspectMask = aspect;
-    pre_barrier.subresourceRange.baseMipLevel = 0;
-    pre_barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
-    pre_barrier.subresourceRange.baseArrayLayer = 0;
-    pre_barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
-    pre_barrier.image = texture.image;
-    pre_barrier.srcAccessMask = 0;
-    pre_barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    pre_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    pre_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    arrput(pre_barriers, pre_barrier);
+Handle<Texture> ResourceManager::create_texture_async(const TextureInfo& texture_info, UploadTicket* ticket) {
+    if (texture_info.initial_data == nullptr) {
+        *ticket = {};
+        return create_texture(texture_info);
+    }
+    return create_texture_upload(texture_info, no_staging_offset, ticket);
+}
 
-    need_submit = 1;
-    StagingBuffer* sb = acquire_staging_buffer(texture_info.initial_data_size);
-    memcpy(sb->write_ptr, texture_info.initial_data, texture_info.initial_data_size);
-    post_cmd->copy_buffer_to_image(
-        sb->buffer,
-        texture,
-        BufferTextureCopyRegion{
-            .buffer_offset = sb->write_offset,
-            .texture_extent = texture_info.extent,
-            .texture_subresource = {
-                .layer_count = texture_info.array_layer_count,
-            },
+bool ResourceManager::create_texture_staged(
+    const TextureInfo& texture_info,
+    Handle<Texture>* texture,
+    uint8_t** staging_data,
+    UploadTicket* ticket
+) {
+    assert(texture_info.initial_data == nullptr && texture_info.initial_data_size != 0);
+    VkDeviceSize size = texture_info.initial_data_size;
+    VkDeviceSize staging_offset;
+    VkDeviceSize allocated_size;
+    update_uploads();
+    while (!staging_ring.allocate(staging_stream_upload, size, size, &staging_offset, &allocated_size)) {
+        uint32_t stream;
+        uint64_t value;
+        // Ranges of the recording upload batch may still be written by the caller, submitting them isn't safe.
+        if (!staging_ring.get_oldest(&stream, &value) || (stream == staging_stream_upload && value == 0)) {
+            return false;
         }
+        wait_staging();
+    }
+    *staging_data = staging_buffer.mapped + staging_offset;
+    *texture = create_texture_upload(texture_info, staging_offset, ticket);
+    return true;
+}
+
+Handle<Texture> ResourceManager::create_texture_upload(
+    const TextureInfo& texture_info,
+    VkDeviceSize staging_offset,
+    UploadTicket* ticket
+) {
+    VkPipelineStageFlags texture_dst_stages{};
+    VkAccessFlags texture_dst_access{};
+    VkImageLayout final_layout{};
+    Handle<Texture> handle = create_vk_texture(texture_info, &final_layout, &texture_dst_stages, &texture_dst_access);
+    const Texture& texture = *textures.get_ptr(handle);
+    UploadBatch* batch = begin_upload_batch();
+
+    VkImageMemoryBarrier barrier{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+    barrier.subresourceRange.aspectMask = texture.aspect;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+    barrier.image = texture.image;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    vkCmdPipelineBarrier(
+        batch->cmd,
+        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0,
+        0,
+        nullptr,
+        0,
+        nullptr,
+        1,
+        &barrier
     );
-    src_stages |= VK_PIPELINE_STAGE_TRANSFER_BIT;
-    dst_stages |= texture_dst_stages;
-    post_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    post_barrier.dstAccessMask = texture_dst_access;
-    post_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    post_barrier.newLayout = final_layout;
 
-    arrput(post_barriers, post_barrier);
+    if (staging_offset == no_staging_offset) {
+        // May be split over several batches, batch always points to the one being recorded.
+        stream_to_texture(staging_stream_upload, texture, texture_info);
+    } else {
+        copy_staging_to_texture(batch->cmd, staging_offset, texture, texture_info);
+    }
 
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = final_layout;
+    if (has_dedicated_transfer_queue()) {
+        // Release here, the matching acquire goes to graphics once the batch completes.
+        barrier.dstAccessMask = 0;
+        barrier.srcQueueFamilyIndex = transfer_queue_family_index;
+        barrier.dstQueueFamilyIndex = graphics_queue_family_index;
+        vkCmdPipelineBarrier(
+            batch->cmd,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            0,
+            0,
+            nullptr,
+            0,
+            nullptr,
+            1,
+            &barrier
+        );
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = texture_dst_access;
+        arrput(batch->acquire_barriers, barrier);
+        batch->acquire_stages |= texture_dst_stages;
+    } else {
+        barrier.dstAccessMask = texture_dst_access;
+        vkCmdPipelineBarrier(
+            batch->cmd,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            texture_dst_stages,
+            0,
+            0,
+            nullptr,
+            0,
+            nullptr,
+            1,
+            &barrier
+        );
+    }
+    *ticket = { .value = batch->value, };
     return handle;
 }
 
@@ -330,8 +471,13 @@ Handle<Texture> ResourceManager::create_texture_view(
     view.aspect = texture.aspect;
     view.image = texture.image;
     view.image_view = vk_image_view;
+    if (capture_recorder != nullptr) {
+        capture_recorder->on_texture_view(view, texture, layer_count);
+    }
 
-    return textures.add(view);
+    Handle<Texture> handle = textures.add(view);
+    vk_image_views.set(handle, view.image_view);
+    return handle;
 }
 
 Handle<Shader> ResourceManager::create_shader(char* data, uint32_t size, Morpho::Vulkan::ShaderStage stage) {
@@ -346,6 +492,9 @@ Handle<Shader> ResourceManager::create_shader(char* data, uint32_t size, Morpho:
     Shader shader{};
     shader.shader_module = shader_module;
     shader.stage = stage;
+    if (capture_recorder != nullptr) {
+        capture_recorder->on_shader(shader, data, size);
+    }
     return shaders.add(shader);
 }
 
@@ -374,16 +523,36 @@ Handle<RenderPassLayout> ResourceManager::create_render_pass_layout(const Render
     RenderPassLayout render_pass_layout{};
     render_pass_layout.info = info;
     render_pass_layout.render_pass = render_pass;
-    return render_pass_layouts.add(render_pass_layout);
+    if (capture_recorder != nullptr) {
+        capture_recorder->on_render_pass_layout(render_pass_layout);
+    }
+    Handle<RenderPassLayout> handle = render_pass_layouts.add(render_pass_layout);
+    vk_render_pass_layouts.set(handle, render_pass);
+    return handle;
 }
 
 Handle<RenderPass> ResourceManager::create_render_pass(const RenderPassInfo& info) {
+    RenderPassKey key;
+    memset(&key, 0, sizeof(key));
+    memcpy(key.attachments, info.attachments, sizeof(RenderPassAttachmentInfo) * info.attachent_count);
+    key.attachment_count = info.attachent_count;
+    key.layout = info.layout;
+    Handle<RenderPass> shared = render_pass_dedup.acquire(key);
+    if (shared != Handle<RenderPass>::null()) {
+        return shared;
+    }
     VkRenderPass vk_render_pass;
-    vk_render_pass = create_vk_render_pass(info, get_render_pass_layout(info.layout).info);
+    vk_render_pass = create_vk_render_pass(info, get_render_pass_layout_ptr(info.layout)->info);
     RenderPass render_pass{};
     render_pass.layout = info.layout;
     render_pass.render_pass = vk_render_pass;
-    return render_passes.add(render_pass);
+    if (capture_recorder != nullptr) {
+        capture_recorder->on_render_pass(render_pass, info);
+    }
+    Handle<RenderPass> handle = render_passes.add(render_pass);
+    vk_render_passes.set(handle, vk_render_pass);
+    render_pass_dedup.add(key, handle);
+    return handle;
 }
 
 Handle<PipelineLayout> ResourceManager::create_pipeline_layout(const PipelineLayoutInfo& pipeline_layout_info)
@@ -439,6 +608,9 @@ Handle<PipelineLayout> ResourceManager::create_pipeline_layout(const PipelineLay
         vkCreatePipelineLayout(device, &vk_pipeline_layout_info, nullptr, &pipeline_layout.pipeline_layout),
         "Unable to create VkPipelineLayout"
     );
+    if (capture_recorder != nullptr) {
+        capture_recorder->on_pipeline_layout(pipeline_layout, pipeline_layout_info);
+    }
     return pipeline_layouts.add(pipeline_layout);
 }
 
@@ -447,8 +619,13 @@ Handle<DescriptorSet> ResourceManager::create_descriptor_set(Handle<PipelineLayo
     if (pipeline_layout.descriptor_set_layouts[set_index] == empty_descriptor_set_layout) {
         DescriptorSet set{};
         set.descriptor_set = empty_descriptor_set;
+        if (capture_recorder != nullptr) {
+            capture_recorder->on_descriptor_set(set, pipeline_layout.pipeline_layout, set_index);
+        }
         // TODO: return empty_ds_handle;
-        return descriptor_sets.add(set);
+        Handle<DescriptorSet> handle = descriptor_sets.add(set);
+        vk_descriptor_sets.set(handle, set.descriptor_set);
+        return handle;
     }
     auto descriptor_set_layout = pipeline_layout.descriptor_set_layouts[set_index];
     VkDescriptorSetAllocateInfo allocate_info{};
@@ -466,7 +643,12 @@ Handle<DescriptorSet> ResourceManager::create_descriptor_set(Handle<PipelineLayo
     descriptor_set.descriptor_set = vk_descriptor_set;
     descriptor_set.set_index = set_index;
     descriptor_set.pipeline_layout = pipeline_layout.pipeline_layout;
-    return descriptor_sets.add(descriptor_set);
+    if (capture_recorder != nullptr) {
+        capture_recorder->on_descriptor_set(descriptor_set, pipeline_layout.pipeline_layout, set_index);
+    }
+    Handle<DescriptorSet> handle = descriptor_sets.add(descriptor_set);
+    vk_descriptor_sets.set(handle, vk_descriptor_set);
+    return handle;
 }
 
 Handle<Sampler> ResourceManager::create_sampler(
@@ -490,135 +672,276 @@ Handle<Sampler> ResourceManager::create_sampler(
     vk_sampler_info.minLod = info.min_lod;
     vk_sampler_info.unnormalizedCoordinates = VK_FALSE;
 
+    // From the create info rather than SamplerInfo, fields it ignores don't split samplers.
+    SamplerKey key;
+    memset(&key, 0, sizeof(key));
+    key.address_modes[0] = vk_sampler_info.addressModeU;
+    key.address_modes[1] = vk_sampler_info.addressModeV;
+    key.address_modes[2] = vk_sampler_info.addressModeW;
+    key.min_filter = vk_sampler_info.minFilter;
+    key.mag_filter = vk_sampler_info.magFilter;
+    key.mipmap_mode = vk_sampler_info.mipmapMode;
+    key.anisotropy_enable = vk_sampler_info.anisotropyEnable;
+    key.max_anisotropy = vk_sampler_info.anisotropyEnable ? vk_sampler_info.maxAnisotropy : 0.0f;
+    key.compare_enable = vk_sampler_info.compareEnable;
+    key.compare_op = vk_sampler_info.compareEnable ? vk_sampler_info.compareOp : VK_COMPARE_OP_NEVER;
+    key.min_lod = vk_sampler_info.minLod;
+    key.max_lod = vk_sampler_info.maxLod;
+    Handle<Sampler> shared = sampler_dedup.acquire(key);
+    if (shared != Handle<Sampler>::null()) {
+        return shared;
+    }
+
     VkSampler vk_sampler;
     vkCreateSampler(device, &vk_sampler_info, nullptr, &vk_sampler);
 
     Sampler sampler{};
     sampler.sampler = vk_sampler;
-    return samplers.add(sampler);
+    if (capture_recorder != nullptr) {
+        capture_recorder->on_sampler(sampler, info);
+    }
+    Handle<Sampler> handle = samplers.add(sampler);
+    sampler_dedup.add(key, handle);
+    return handle;
 }
 
 Handle<Pipeline> ResourceManager::create_pipeline(const PipelineInfo &pipeline_info) {
-    VkPipelineShaderStageCreateInfo stages[(uint32_t)ShaderStage::MAX_VALUE];
-    ResourceManager* rm = ResourceManager::get();
-    for (uint32_t i = 0; i < pipeline_info.shader_count; i++) {
-        Shader shader = rm->get_shader(pipeline_info.shaders[i]);
-        stages[i].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-        stages[i].pNext = nullptr;
-        stages[i].flags = 0;
-        stages[i].stage = shader_stage_to_vulkan(shader.stage);
-        stages[i].module = shader.shader_module;
-        stages[i].pName = "main";
-        stages[i].pSpecializationInfo = nullptr;
-    }
-
-    VkPipelineVertexInputStateCreateInfo vertex_input_state{};
-    vertex_input_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertex_input_state.vertexBindingDescriptionCount = pipeline_info.binding_count;
-    vertex_input_state.pVertexBindingDescriptions = pipeline_info.bindings;
-    vertex_input_state.vertexAttributeDescriptionCount = pipeline_info.attribute_count;
-    vertex_input_state.pVertexAttributeDescriptions = pipeline_info.attributes;
-
-    VkPipelineInputAssemblyStateCreateInfo input_assembly_state{};
-    input_assembly_state.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    input_assembly_state.pNext = nullptr;
-    input_assembly_state.flags = 0;
-    input_assembly_state.topology = pipeline_info.primitive_topology;
-    input_assembly_state.primitiveRestartEnable = VK_FALSE;
-
-    VkDynamicState dynamic_states[] = {
-        VK_DYNAMIC_STATE_VIEWPORT,
-        VK_DYNAMIC_STATE_SCISSOR,
-    };
+    Handle<Pipeline> handle;
+    create_pipelines(Span<const PipelineInfo>(&pipeline_info), &handle);
+    return handle;
+}
+
+void ResourceManager::create_pipelines(Span<const PipelineInfo> infos, Handle<Pipeline>* pipelines) {
+    PipelineBuild** builds = (PipelineBuild**)malloc(sizeof(PipelineBuild*) * infos.size());
+    uint32_t build_count = 0;
+    for (uint32_t i = 0; i < infos.size(); i++) {
+        PipelineKey key = make_pipeline_key(infos[i]);
+        pipelines[i] = pipeline_dedup.acquire(key);
+        if (pipelines[i] != Handle<Pipeline>::null()) {
+            continue;
+        }
+        PipelineBuild* build = init_pipeline_build(infos[i], Handle<Pipeline>::null());
+        // Later duplicates in the batch share it too.
+        pipeline_dedup.add(key, build->handle);
+        pipelines[i] = build->handle;
+        builds[build_count++] = build;
+    }
+    if (build_count == 1) {
+        pipeline_compiler->compile(builds[0]);
+    } else if (build_count > 1) {
+        pipeline_compiler->compile_all(builds, build_count);
+    }
+    for (uint32_t i = 0; i < build_count; i++) {
+        finish_pipeline(builds[i]);
+    }
+    free(builds);
+    // Batch pipelines are ready on return, shared lazy ones may still be compiling in the background.
+    for (uint32_t i = 0; i < infos.size(); i++) {
+        if (!is_pipeline_ready(pipelines[i])) {
+            wait_pipeline(pipelines[i]);
+        }
+    }
+}
+
+Handle<Pipeline> ResourceManager::create_pipeline_lazy(const PipelineInfo& info, Handle<Pipeline> fallback) {
+    PipelineKey key = make_pipeline_key(info);
+    Handle<Pipeline> shared = pipeline_dedup.acquire(key);
+    if (shared != Handle<Pipeline>::null()) {
+        return shared;
+    }
+    PipelineBuild* build = init_pipeline_build(info, fallback);
+    Handle<Pipeline> handle = build->handle;
+    pipeline_dedup.add(key, handle);
+    arrput(pending_pipeline_builds, build);
+    pipeline_compiler->enqueue(build);
+    return handle;
+}
+
+void ResourceManager::release_sampler(Handle<Sampler> handle) {
+    assert(samplers.is_valid(handle));
+    if (!sampler_dedup.release(handle)) {
+        return;
+    }
+    VkSampler vk_sampler = samplers.get(handle).sampler;
+    samplers.remove(handle);
+    context->get_current_frame_context().destructors.push_back([=, this] {
+        vkDestroySampler(device, vk_sampler, nullptr);
+    });
+}
+
+void ResourceManager::release_render_pass(Handle<RenderPass> handle) {
+    assert(render_passes.is_valid(handle));
+    if (!render_pass_dedup.release(handle)) {
+        return;
+    }
+    VkRenderPass vk_render_pass = render_passes.get(handle).render_pass;
+    render_passes.remove(handle);
+    context->get_current_frame_context().destructors.push_back([=, this] {
+        vkDestroyRenderPass(device, vk_render_pass, nullptr);
+    });
+}
+
+void ResourceManager::release_pipeline(Handle<Pipeline> handle) {
+    assert(pipelines.is_valid(handle));
+    if (!pipeline_dedup.release(handle)) {
+        return;
+    }
+    if (!is_pipeline_ready(handle)) {
+        wait_pipeline(handle);
+    }
+    VkPipeline vk_pipeline = pipelines.get(handle).pipeline;
+    pipelines.remove(handle);
+    context->get_current_frame_context().destructors.push_back([=, this] {
+        vkDestroyPipeline(device, vk_pipeline, nullptr);
+    });
+}
+
+ResourceManager::PipelineKey ResourceManager::make_pipeline_key(const PipelineInfo& info) {
+    PipelineKey key;
+    memset(&key, 0, sizeof(key));
+    memcpy(key.shaders, info.shaders, sizeof(Handle<Shader>) * info.shader_count);
+    key.shader_count = info.shader_count;
+    memcpy(key.attributes, info.attributes, sizeof(VkVertexInputAttributeDescription) * info.attribute_count);
+    key.attribute_count = info.attribute_count;
+    memcpy(key.bindings, info.bindings, sizeof(VkVertexInputBindingDescription) * info.binding_count);
+    key.binding_count = info.binding_count;
+    key.primitive_topology = info.primitive_topology;
+    key.cull_mode = info.cull_mode;
+    key.front_face = info.front_face;
+    key.depth_bias_constant_factor = info.depth_bias_constant_factor;
+    key.depth_bias_slope_factor = info.depth_bias_slope_factor;
+    key.depth_test_enabled = info.depth_test_enabled;
+    key.depth_write_enabled = info.depth_write_enabled;
+    key.depth_clamp_enabled = info.depth_clamp_enabled;
+    key.depth_compare_op = info.depth_test_enabled ? info.depth_compare_op : VK_COMPARE_OP_NEVER;
+    key.blend_state.blendEnable = info.blend_state.blendEnable;
+    key.blend_state.colorWriteMask = info.blend_state.colorWriteMask;
+    if (info.blend_state.blendEnable) {
+        key.blend_state = info.blend_state;
+    }
+    key.render_pass_layout = info.render_pass_layout;
+    key.pipeline_layout = info.pipeline_layout;
+    return key;
+}
+
+bool ResourceManager::is_pipeline_ready(Handle<Pipeline> handle) {
+    assert(pipelines.is_valid(handle));
+    return pipelines.get_ptr(handle)->pipeline != VK_NULL_HANDLE;
+}
+
+void ResourceManager::wait_pipelines() {
+    pipeline_compiler->wait_idle();
+    update_pipelines();
+}
 
-    VkPipelineDynamicStateCreateInfo dynamic_state{};
-    dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-    dynamic_state.dynamicStateCount = 2;
-    dynamic_state.flags = 0;
-    dynamic_state.pNext = nullptr;
-    dynamic_state.pDynamicStates = dynamic_states;
-
-    VkPipelineViewportStateCreateInfo viewport_state{};
-    viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-    viewport_state.pNext = nullptr;
-    viewport_state.scissorCount = 1;
-    viewport_state.pScissors = nullptr;
-    viewport_state.viewportCount = 1;
-    viewport_state.pViewports = nullptr;
-
-    VkPipelineRasterizationStateCreateInfo rasterization_state{};
-    rasterization_state.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    rasterization_state.pNext = nullptr;
-    rasterization_state.flags = 0;
-    rasterization_state.depthClampEnable = VK_FALSE;
-    rasterization_state.rasterizerDiscardEnable = VK_FALSE;
-    rasterization_state.polygonMode = VK_POLYGON_MODE_FILL;
-    rasterization_state.lineWidth = 1.0f;
-    rasterization_state.cullMode = pipeline_info.cull_mode;
-    rasterization_state.frontFace = pipeline_info.front_face;
-    rasterization_state.depthBiasEnable = pipeline_info.depth_bias_constant_factor != 0.0f || pipeline_info.depth_bias_slope_factor != 0.0f;
-    rasterization_state.depthBiasConstantFactor = pipeline_info.depth_bias_constant_factor;
-    rasterization_state.depthBiasSlopeFactor = pipeline_info.depth_bias_slope_factor;
-    rasterization_state.depthClampEnable = pipeline_info.depth_clamp_enabled;
-
-    VkPipelineMultisampleStateCreateInfo multisample_state{};
-    multisample_state.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisample_state.pNext = nullptr;
-    multisample_state.flags = 0;
-    multisample_state.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-    multisample_state.sampleShadingEnable = VK_FALSE;
-
-    VkPipelineDepthStencilStateCreateInfo depth_stencil_state{};
-    depth_stencil_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    depth_stencil_state.depthTestEnable = pipeline_info.depth_test_enabled;
-    depth_stencil_state.depthWriteEnable = pipeline_info.depth_write_enabled;
-    depth_stencil_state.depthCompareOp = pipeline_info.depth_compare_op;
-
-    VkPipelineColorBlendAttachmentState color_blend_attachment_state = pipeline_info.blend_state;
-
-    VkPipelineColorBlendStateCreateInfo color_blend_state{};
-    color_blend_state.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    color_blend_state.pNext = nullptr;
-    color_blend_state.flags = 0;
-    color_blend_state.logicOpEnable = VK_FALSE;
-    color_blend_state.logicOp = VK_LOGIC_OP_COPY;
-    color_blend_state.attachmentCount = 1;
-    color_blend_state.pAttachments = &color_blend_attachment_state;
-    color_blend_state.blendConstants[0] = 0.0f;
-    color_blend_state.blendConstants[1] = 0.0f;
-    color_blend_state.blendConstants[2] = 0.0f;
-    color_blend_state.blendConstants[3] = 0.0f;
-
-    VkGraphicsPipelineCreateInfo vk_pipeline_info{};
-    vk_pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    vk_pipeline_info.stageCount = pipeline_info.shader_count;
-    vk_pipeline_info.pStages = stages;
-    vk_pipeline_info.pVertexInputState = &vertex_input_state;
-    vk_pipeline_info.pInputAssemblyState = &input_assembly_state;
-    vk_pipeline_info.pTessellationState = nullptr;
-    vk_pipeline_info.pViewportState = &viewport_state;
-    vk_pipeline_info.pRasterizationState = &rasterization_state;
-    vk_pipeline_info.pMultisampleState = &multisample_state;
-    vk_pipeline_info.pDepthStencilState = &depth_stencil_state;
-    vk_pipeline_info.pColorBlendState = &color_blend_state;
-    vk_pipeline_info.pDynamicState = &dynamic_state;
-    vk_pipeline_info.layout = rm->get_pipeline_layout(pipeline_info.pipeline_layout).pipeline_layout;
-    vk_pipeline_info.renderPass = rm->get_render_pass_layout(pipeline_info.render_pass_layout).render_pass;
-    vk_pipeline_info.subpass = 0;
-    vk_pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
-    vk_pipeline_info.basePipelineIndex = 0;
-
-    VkPipeline vk_pipeline{};
-    vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &vk_pipeline_info, nullptr, &vk_pipeline);
+void ResourceManager::wait_pipeline(Handle<Pipeline> handle) {
+    for (uint32_t i = 0; i < arrlen(pending_pipeline_builds); i++) {
+        if (pending_pipeline_builds[i]->handle == handle) {
+            pipeline_compiler->wait(pending_pipeline_builds[i]);
+            break;
+        }
+    }
+    update_pipelines();
+}
+
+uint32_t ResourceManager::get_pipeline_generation() const {
+    return pipeline_generation;
+}
+
+PipelineBuild* ResourceManager::init_pipeline_build(const PipelineInfo& info, Handle<Pipeline> fallback) {
+    assert(info.shader_count <= (uint32_t)ShaderStage::MAX_VALUE);
+    assert(info.attribute_count <= Limits::MAX_VERTEX_ATTRIBUTE_DESCRIPTION_COUNT);
+    assert(info.binding_count <= Limits::MAX_VERTEX_INPUT_BINDING_COUNT);
+    assert(fallback == Handle<Pipeline>::null() || pipelines.get_ptr(fallback)->pipeline_layout == info.pipeline_layout);
+    PipelineBuild* build = (PipelineBuild*)malloc(sizeof(PipelineBuild));
+    memset(build, 0, sizeof(PipelineBuild));
+    build->info = info;
+    build->info.shaders = build->shaders;
+    build->info.attributes = build->attributes;
+    build->info.bindings = build->bindings;
+    memcpy(build->attributes, info.attributes, sizeof(VkVertexInputAttributeDescription) * info.attribute_count);
+    memcpy(build->bindings, info.bindings, sizeof(VkVertexInputBindingDescription) * info.binding_count);
+    for (uint32_t i = 0; i < info.shader_count; i++) {
+        Shader shader = get_shader(info.shaders[i]);
+        build->shaders[i] = info.shaders[i];
+        build->stages[i].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        build->stages[i].stage = shader_stage_to_vulkan(shader.stage);
+        build->stages[i].module = shader.shader_module;
+        build->stages[i].pName = "main";
+    }
+    build->pipeline_layout = get_pipeline_layout(info.pipeline_layout).pipeline_layout;
+    build->render_pass = get_vk_render_pass(info.render_pass_layout);
 
     Pipeline pipeline{};
-    pipeline.pipeline = vk_pipeline;
-    pipeline.pipeline_layout = pipeline_info.pipeline_layout;
-    return pipelines.add(pipeline);
+    pipeline.pipeline_layout = info.pipeline_layout;
+    pipeline.fallback = fallback;
+    build->handle = pipelines.add(pipeline);
+    vk_pipelines.set(build->handle, resolve_pipeline(fallback));
+    vk_pipeline_layouts.set(build->handle, build->pipeline_layout);
+    return build;
+}
+
+void ResourceManager::finish_pipeline(PipelineBuild* build) {
+    Pipeline* pipeline = pipelines.get_ptr(build->handle);
+    pipeline->pipeline = build->pipeline;
+    pipeline->creation_duration_ns = build->duration_ns;
+    pipeline->is_cache_hit = build->is_cache_hit;
+    vk_pipelines.set(build->handle, resolve_pipeline(build->handle));
+    pipeline_creation_stats.pipeline_count++;
+    pipeline_creation_stats.cache_hit_count += pipeline->is_cache_hit;
+    if (pipeline->is_cache_hit) {
+        pipeline_creation_stats.warm_duration_ns += pipeline->creation_duration_ns;
+    } else {
+        pipeline_creation_stats.cold_duration_ns += pipeline->creation_duration_ns;
+    }
+    if (capture_recorder != nullptr && pipeline->pipeline != VK_NULL_HANDLE) {
+        capture_recorder->on_pipeline(*pipeline, build->info);
+    }
+    free(build);
+}
+
+VkPipeline ResourceManager::resolve_pipeline(Handle<Pipeline> handle) {
+    while (pipelines.is_valid(handle)) {
+        const Pipeline* pipeline = pipelines.get_ptr(handle);
+        if (pipeline->pipeline != VK_NULL_HANDLE) {
+            return pipeline->pipeline;
+        }
+        handle = pipeline->fallback;
+    }
+    return VK_NULL_HANDLE;
+}
+
+void ResourceManager::update_pipelines() {
+    if (arrlen(pending_pipeline_builds) == 0) {
+        return;
+    }
+    pipeline_compiler->take_finished(&finished_pipeline_builds);
+    if (arrlen(finished_pipeline_builds) == 0) {
+        return;
+    }
+    for (uint32_t i = 0; i < arrlen(finished_pipeline_builds); i++) {
+        PipelineBuild* build = finished_pipeline_builds[i];
+        for (uint32_t j = 0; j < arrlen(pending_pipeline_builds); j++) {
+            if (pending_pipeline_builds[j] == build) {
+                arrdelswap(pending_pipeline_builds, j);
+                break;
+            }
+        }
+        finish_pipeline(build);
+    }
+    arrsetlen(finished_pipeline_builds, 0);
+    // Fallbacks of the rest may have gotten ready.
+    for (uint32_t i = 0; i < arrlen(pending_pipeline_builds); i++) {
+        Handle<Pipeline> pending = pending_pipeline_builds[i]->handle;
+        vk_pipelines.set(pending, resolve_pipeline(pending));
+    }
+    pipeline_generation++;
 }
 
 Handle<Texture> ResourceManager::register_texture(Texture texture) {
-    return textures.add(texture);
+    Handle<Texture> handle = textures.add(texture);
+    vk_image_views.set(handle, texture.image_view);
+    return handle;
 }
 
 void ResourceManager::update_descriptor_set(
@@ -632,7 +955,10 @@ void ResourceManager::update_descriptor_set(
     uint32_t current_write_index = 0;
     uint32_t infos_offset = 0;
     ResourceManager* rm = ResourceManager::get();
-    VkDescriptorSet vk_ds = rm->get_descriptor_set(descriptor_set).descriptor_set;
+    VkDescriptorSet vk_ds = rm->get_vk_descriptor_set(descriptor_set);
+    if (capture_recorder != nullptr) {
+        capture_recorder->on_descriptor_set_update(vk_ds, update_requests);
+    }
     for (uint32_t request_index = 0; request_index < update_requests.size(); request_index++) {
         const DescriptorSetUpdateRequest& request = update_requests[request_index];
         VkWriteDescriptorSet* write = &writes[current_write_index];
@@ -664,7 +990,7 @@ void ResourceManager::update_descriptor_set(
                 for (uint32_t i = 0; i < slot_count; i++) {
                     VkDescriptorBufferInfo& vk_buffer_info = vk_buffer_infos[i];
                     const BufferDescriptorInfo& buffer_info = request.buffer_infos[current_texture_info + i];
-                    vk_buffer_info.buffer = rm->get_buffer(buffer_info.buffer).buffer;
+                    vk_buffer_info.buffer = rm->get_vk_buffer(buffer_info.buffer);
                     vk_buffer_info.offset = buffer_info.offset;
                     vk_buffer_info.range = buffer_info.range;
                 }
@@ -693,11 +1019,11 @@ void ResourceManager::update_descriptor_set(
                 for (uint32_t i = 0; i < slot_count; i++) {
                     VkDescriptorImageInfo& vk_image_info = vk_image_infos[i];
                     const TextureDescriptorInfo& texture_info = request.texture_infos[current_texture_info + i];
-                    Texture texture = rm->get_texture(texture_info.texture);
+                    const Texture* texture = rm->get_texture_ptr(texture_info.texture);
                     vk_image_info = {};
                     vk_image_info.sampler = get_sampler(texture_info.sampler).sampler;
-                    vk_image_info.imageView = texture.image_view;
-                    vk_image_info.imageLayout = is_depth_format(texture.format)
+                    vk_image_info.imageView = texture->image_view;
+                    vk_image_info.imageLayout = is_depth_format(texture->format)
                         ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL
                         : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
                 }
@@ -719,10 +1045,24 @@ void ResourceManager::update_descriptor_set(
 }
 
 void ResourceManager::commit() {
+    submit_uploads();
+    update_uploads();
     if (!need_submit) {
         return;
     }
+    submit_commands();
+    committed = 1;
+}
+
+void ResourceManager::flush_commands() {
+    submit_commands();
+    pre_cmd = cmd_pool->allocate();
+    post_cmd = cmd_pool->allocate();
+    memory_barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    src_stages = dst_stages = 0;
+}
 
+void ResourceManager::submit_commands() {
     VkCommandBuffer pre_vk_cmd = pre_cmd->get_vulkan_handle();
     if (arrlen(pre_barriers) != 0) {
         VkMemoryBarrier empty{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
@@ -743,28 +1083,52 @@ void ResourceManager::commit() {
 
     VkCommandBuffer post_vk_cmd = post_cmd->get_vulkan_handle();
 
-    vkCmdPipelineBarrier(
-        post_vk_cmd,
-        src_stages,
-        dst_stages,
-        0,
-        1,
-        &memory_barrier,
-        0,
-        nullptr,
-        arrlen(post_barriers),
-        post_barriers
-    );
+    // Flushed in the middle of an upload, the barrier of a later submit covers its copies.
+    if (src_stages != 0) {
+        vkCmdPipelineBarrier(
+            post_vk_cmd,
+            src_stages,
+            dst_stages,
+            0,
+            1,
+            &memory_barrier,
+            0,
+            nullptr,
+            arrlen(post_barriers),
+            post_barriers
+        );
+    }
     vkEndCommandBuffer(post_vk_cmd);
     VkCommandBuffer vk_cmds[2] = { pre_vk_cmd, post_vk_cmd, };
     VkSubmitInfo submit_info{};
     submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     submit_info.pCommandBuffers = vk_cmds;
     submit_info.commandBufferCount = 2;
-    vkQueueSubmit(queue, 1, &submit_info, VK_NULL_HANDLE);
+    // Already signaled, only orders acquires and reads after the transfer queue's writes.
+    VkTimelineSemaphoreSubmitInfo timeline_info{ VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO };
+    VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    if (upload_acquire_value > upload_waited_value) {
+        timeline_info.waitSemaphoreValueCount = 1;
+        timeline_info.pWaitSemaphoreValues = &upload_acquire_value;
+        submit_info.pNext = &timeline_info;
+        submit_info.waitSemaphoreCount = 1;
+        submit_info.pWaitSemaphores = &upload_semaphore;
+        submit_info.pWaitDstStageMask = &wait_stage;
+        upload_waited_value = upload_acquire_value;
+    }
+    VkFence fence;
+    if (arrlen(free_commit_fences) != 0) {
+        fence = arrpop(free_commit_fences);
+        vkResetFences(device, 1, &fence);
+    } else {
+        VkFenceCreateInfo fence_info{ VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+        vkCreateFence(device, &fence_info, nullptr, &fence);
+    }
+    vkQueueSubmit(queue, 1, &submit_info, fence);
+    arrput(commit_fences, fence);
+    staging_ring.submit(staging_stream_commit, ++commit_submitted_value);
     arrsetlen(pre_barriers, 0);
     arrsetlen(post_barriers, 0);
-    committed = 1;
     need_submit = 0;
 }
 
@@ -835,6 +1199,150 @@ uint64_t ResourceManager::get_buffer_size(Handle<Buffer> handle) {
     return info.size;
 }
 
+void ResourceManager::update_buffer(Handle<Buffer> handle, VkDeviceSize offset, const void* data, VkDeviceSize size) {
+    const Buffer* buffer = get_buffer_ptr(handle);
+    assert(buffer->usage & VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    if (capture_recorder != nullptr) {
+        capture_recorder->on_buffer_update(*buffer, offset, data, size);
+    }
+    stream_to_buffer(staging_stream_commit, buffer->buffer, offset, data, size);
+    memory_barrier.srcAccessMask |= VK_ACCESS_TRANSFER_WRITE_BIT;
+    src_stages |= VK_PIPELINE_STAGE_TRANSFER_BIT;
+    derive_stages_and_access_from_buffer_usage(buffer->usage, &dst_stages, &memory_barrier.dstAccessMask);
+    need_submit = 1;
+}
+
+UploadTicket ResourceManager::update_buffer_async(
+    Handle<Buffer> handle,
+    VkDeviceSize offset,
+    const void* data,
+    VkDeviceSize size
+) {
+    const Buffer* buffer = get_buffer_ptr(handle);
+    assert(buffer->usage & VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    if (capture_recorder != nullptr) {
+        capture_recorder->on_buffer_update(*buffer, offset, data, size);
+    }
+    stream_to_buffer(staging_stream_upload, buffer->buffer, offset, data, size);
+    UploadBatch* batch = &upload_batch;
+    // Buffers are shared concurrently with a dedicated transfer queue, the timeline wait makes writes visible.
+    derive_stages_and_access_from_buffer_usage(buffer->usage, &batch->buffer_dst_stages, &batch->buffer_dst_access);
+    return { .value = batch->value, };
+}
+
+void ResourceManager::submit_uploads() {
+    UploadBatch* batch = &upload_batch;
+    if (batch->cmd == VK_NULL_HANDLE) {
+        return;
+    }
+    if (!has_dedicated_transfer_queue() && batch->buffer_dst_stages != 0) {
+        VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = batch->buffer_dst_access;
+        vkCmdPipelineBarrier(
+            batch->cmd,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            batch->buffer_dst_stages,
+            0,
+            1,
+            &barrier,
+            0,
+            nullptr,
+            0,
+            nullptr
+        );
+    }
+    vkEndCommandBuffer(batch->cmd);
+    VkSubmitInfo submit_info{ VK_STRUCTURE_TYPE_SUBMIT_INFO };
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &batch->cmd;
+    VkTimelineSemaphoreSubmitInfo timeline_info{ VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO };
+    VkFence fence = VK_NULL_HANDLE;
+    if (upload_semaphore != VK_NULL_HANDLE) {
+        timeline_info.signalSemaphoreValueCount = 1;
+        timeline_info.pSignalSemaphoreValues = &batch->value;
+        submit_info.pNext = &timeline_info;
+        submit_info.signalSemaphoreCount = 1;
+        submit_info.pSignalSemaphores = &upload_semaphore;
+    } else {
+        vkResetFences(device, 1, &batch->fence);
+        fence = batch->fence;
+    }
+    // Staging ranges of the batch retire once it completes.
+    staging_ring.submit(staging_stream_upload, batch->value);
+    vkQueueSubmit(transfer_queue, 1, &submit_info, fence);
+    upload_submitted_value = batch->value;
+    arrput(submitted_upload_batches, *batch);
+    *batch = {};
+}
+
+bool ResourceManager::is_upload_complete(UploadTicket ticket) {
+    if (ticket.value <= upload_completed_value) {
+        return true;
+    }
+    if (ticket.value > upload_submitted_value) {
+        return false;
+    }
+    update_uploads();
+    return ticket.value <= upload_completed_value;
+}
+
+void ResourceManager::wait_upload(UploadTicket ticket) {
+    if (ticket.value <= upload_completed_value) {
+        return;
+    }
+    if (ticket.value > upload_submitted_value) {
+        submit_uploads();
+    }
+    if (upload_semaphore != VK_NULL_HANDLE) {
+        VkSemaphoreWaitInfo wait_info{ VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO };
+        wait_info.semaphoreCount = 1;
+        wait_info.pSemaphores = &upload_semaphore;
+        wait_info.pValues = &ticket.value;
+        context->wait_semaphores(device, &wait_info, UINT64_MAX);
+    } else {
+        for (uint32_t i = 0; i < arrlen(submitted_upload_batches); i++) {
+            if (submitted_upload_batches[i].value == ticket.value) {
+                vkWaitForFences(device, 1, &submitted_upload_batches[i].fence, VK_TRUE, UINT64_MAX);
+                break;
+            }
+        }
+    }
+    update_uploads();
+}
+
+ResourceStats ResourceManager::get_stats() {
+    ResourceStats stats{
+        .buffers = buffers.get_stats(),
+        .textures = textures.get_stats(),
+        .shaders = shaders.get_stats(),
+        .render_pass_layouts = render_pass_layouts.get_stats(),
+        .render_passes = render_passes.get_stats(),
+        .pipeline_layouts = pipeline_layouts.get_stats(),
+        .descriptor_sets = descriptor_sets.get_stats(),
+        .samplers = samplers.get_stats(),
+        .pipelines = pipelines.get_stats(),
+    };
+    VmaAllocationInfo info{};
+    buffers.for_each([&](Handle<Buffer>, Buffer& buffer) {
+        vmaGetAllocationInfo(allocator, buffer.allocation, &info);
+        stats.buffer_memory_size += info.size;
+    });
+    textures.for_each([&](Handle<Texture>, Texture& texture) {
+        if (texture.owns_image) {
+            stats.texture_memory_size += texture.allocation_info.size;
+        }
+    });
+    stats.staging = staging_ring.get_stats();
+    stats.pipeline_creation = pipeline_creation_stats;
+    stats.pipeline_creation.pending_count = (uint32_t)arrlen(pending_pipeline_builds);
+    stats.pipeline_creation.has_feedback = context->has_pipeline_creation_feedback;
+    stats.sampler_dedup = sampler_dedup.get_stats();
+    stats.render_pass_dedup = render_pass_dedup.get_stats();
+    stats.pipeline_dedup = pipeline_dedup.get_stats();
+    return stats;
+}
+
 void ResourceManager::next_frame() {
     if (!committed) {
         return;
@@ -845,57 +1353,232 @@ void ResourceManager::next_frame() {
     cmd_pool->next_frame();
     pre_cmd = cmd_pool->allocate();
     post_cmd = cmd_pool->allocate();
-    frame = (frame + 1) % 2;
-    for (int32_t i = arrlen(used_staging_buffers) - 1; i >= 0; i--) {
-        StagingBuffer* sb = &used_staging_buffers[i];
-        if (sb->frame_acquired == frame) {
-            sb->used_offset = sb->write_offset = 0;
-            sb->write_ptr = sb->buffer.mapped;
-            arrput(free_staging_buffers, *sb);
-            arrdelswap(used_staging_buffers, i);
+    update_uploads();
+    update_pipelines();
+    // Resumed coroutines may start waiting again.
+    for (uint32_t i = 0; i < arrlen(upload_waiters);) {
+        if (upload_waiters[i].value <= upload_completed_value) {
+            std::coroutine_handle<> handle = upload_waiters[i].handle;
+            arrdelswap(upload_waiters, i);
+            handle.resume();
+        } else {
+            i++;
         }
     }
 }
 
-ResourceManager::StagingBuffer* ResourceManager::acquire_staging_buffer(VkDeviceSize size) {
-    for (uint32_t i = 0; i < arrlen(used_staging_buffers); i++) {
-        StagingBuffer* sb = &used_staging_buffers[i];
-        if (sb->size - sb->used_offset >= size) {
-            sb->write_ptr = sb->buffer.mapped + sb->used_offset;
-            sb->write_offset = sb->used_offset;
-            sb->used_offset += size;
-            sb->frame_acquired = frame;
-            return sb;
+VkDeviceSize ResourceManager::acquire_staging(
+    uint32_t stream,
+    VkDeviceSize size,
+    VkDeviceSize min_size,
+    VkDeviceSize* offset
+) {
+    VkDeviceSize allocated_size;
+    while (!staging_ring.allocate(stream, size, min_size, offset, &allocated_size)) {
+        wait_staging();
+    }
+    if (stream == staging_stream_upload) {
+        begin_upload_batch();
+    } else {
+        need_submit = 1;
+    }
+    return allocated_size;
+}
+
+void ResourceManager::wait_staging() {
+    uint32_t stream;
+    uint64_t value;
+    bool has_ranges = staging_ring.get_oldest(&stream, &value);
+    assert(has_ranges && "Staging chunk is larger than the staging budget.");
+    if (value == 0) {
+        // Nothing else would submit it.
+        if (stream == staging_stream_commit) {
+            flush_commands();
+        } else {
+            submit_uploads();
         }
+        staging_ring.get_oldest(&stream, &value);
     }
-    for (uint32_t i = 0; i < arrlen(free_staging_buffers); i++) {
-        StagingBuffer* sb = &free_staging_buffers[i];
-        if (sb->size >= size) {
-            sb->write_ptr = sb->buffer.mapped + sb->used_offset;
-            sb->write_offset = sb->used_offset;
-            sb->used_offset += size;
-            sb->frame_acquired = frame;
-            arrput(used_staging_buffers, *sb);
-            arrdelswap(free_staging_buffers, i);
-            return &arrlast(used_staging_buffers);
+    if (stream == staging_stream_commit) {
+        vkWaitForFences(device, 1, &commit_fences[value - commit_completed_value - 1], VK_TRUE, UINT64_MAX);
+        update_uploads();
+    } else {
+        wait_upload({ .value = value, });
+    }
+}
+
+void ResourceManager::stream_to_buffer(
+    uint32_t stream,
+    VkBuffer buffer,
+    VkDeviceSize offset,
+    const void* data,
+    VkDeviceSize size
+) {
+    for (VkDeviceSize streamed_size = 0; streamed_size < size;) {
+        VkDeviceSize remaining_size = size - streamed_size;
+        VkDeviceSize staging_offset;
+        VkDeviceSize chunk_size = acquire_staging(
+            stream,
+            remaining_size,
+            min(remaining_size, min_staging_chunk_size),
+            &staging_offset
+        );
+        memcpy(staging_buffer.mapped + staging_offset, (const uint8_t*)data + streamed_size, chunk_size);
+        VkBufferCopy copy = {
+            .srcOffset = staging_offset,
+            .dstOffset = offset + streamed_size,
+            .size = chunk_size,
+        };
+        vkCmdCopyBuffer(get_staging_cmd(stream), staging_buffer.buffer, buffer, 1, &copy);
+        streamed_size += chunk_size;
+    }
+}
+
+void ResourceManager::stream_to_texture(uint32_t stream, const Texture& texture, const TextureInfo& info) {
+    // Mip 0 of every layer, tightly packed rows.
+    VkDeviceSize layer_size = info.initial_data_size / info.array_layer_count;
+    VkDeviceSize row_size = layer_size / info.extent.height;
+    const uint8_t* data = (const uint8_t*)info.initial_data;
+    VkDeviceSize staging_offset;
+    VkDeviceSize chunk_size = acquire_staging(stream, info.initial_data_size, row_size, &staging_offset);
+    if (chunk_size == info.initial_data_size) {
+        memcpy(staging_buffer.mapped + staging_offset, data, chunk_size);
+        copy_staging_to_texture(get_staging_cmd(stream), staging_offset, texture, info);
+        return;
+    }
+    // Doesn't fit in one go, stream whole rows of a layer at a time.
+    for (uint32_t layer = 0; layer < info.array_layer_count; layer++) {
+        for (uint32_t row = 0; row < info.extent.height;) {
+            if (chunk_size == 0) {
+                chunk_size = acquire_staging(
+                    stream,
+                    (info.extent.height - row) * row_size,
+                    row_size,
+                    &staging_offset
+                );
+            }
+            uint32_t row_count = min((uint32_t)(chunk_size / row_size), info.extent.height - row);
+            memcpy(staging_buffer.mapped + staging_offset, data + layer * layer_size + row * row_size, row_count * row_size);
+            VkBufferImageCopy region{};
+            region.bufferOffset = staging_offset;
+            region.imageSubresource.aspectMask = texture.aspect;
+            region.imageSubresource.baseArrayLayer = layer;
+            region.imageSubresource.layerCount = 1;
+            region.imageOffset = { 0, (int32_t)row, 0 };
+            region.imageExtent = { info.extent.width, row_count, 1 };
+            vkCmdCopyBufferToImage(
+                get_staging_cmd(stream),
+                staging_buffer.buffer,
+                texture.image,
+                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                1,
+                &region
+            );
+            row += row_count;
+            chunk_size = 0;
         }
     }
-    uint64_t adjusted_size = max(size, default_staging_buffer_size);
-    Buffer buffer = create_vk_buffer({
-        .size = adjusted_size,
-        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        .map = BufferMap::PERSISTENTLY_MAPPED,
-    });
-    StagingBuffer staging_buffer = {
-        .buffer = buffer,
-        .size = adjusted_size,
-        .write_ptr = (uint8_t*)buffer.mapped,
-        .write_offset = 0,
-        .used_offset = size,
-        .frame_acquired = frame,
-    };
-    arrput(used_staging_buffers, staging_buffer);
-    return &used_staging_buffers[arrlen(used_staging_buffers) - 1];
+}
+
+void ResourceManager::copy_staging_to_texture(
+    VkCommandBuffer cmd,
+    VkDeviceSize staging_offset,
+    const Texture& texture,
+    const TextureInfo& info
+) {
+    VkBufferImageCopy region{};
+    region.bufferOffset = staging_offset;
+    region.imageSubresource.aspectMask = texture.aspect;
+    region.imageSubresource.layerCount = info.array_layer_count;
+    region.imageExtent = info.extent;
+    vkCmdCopyBufferToImage(cmd, staging_buffer.buffer, texture.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+}
+
+VkCommandBuffer ResourceManager::get_staging_cmd(uint32_t stream) {
+    return stream == staging_stream_commit ? post_cmd->get_vulkan_handle() : upload_batch.cmd;
+}
+
+void ResourceManager::retire_staging() {
+    while (arrlen(commit_fences) != 0 && vkGetFenceStatus(device, commit_fences[0]) == VK_SUCCESS) {
+        arrput(free_commit_fences, commit_fences[0]);
+        arrdel(commit_fences, 0);
+        commit_completed_value++;
+    }
+    uint64_t completed_values[StagingRing::max_stream_count] = {};
+    completed_values[staging_stream_commit] = commit_completed_value;
+    completed_values[staging_stream_upload] = upload_completed_value;
+    staging_ring.retire(completed_values);
+}
+
+ResourceManager::UploadBatch* ResourceManager::begin_upload_batch() {
+    UploadBatch* batch = &upload_batch;
+    if (batch->cmd != VK_NULL_HANDLE) {
+        return batch;
+    }
+    if (arrlen(free_upload_batches) != 0) {
+        *batch = arrpop(free_upload_batches);
+    } else {
+        VkCommandBufferAllocateInfo allocate_info{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+        allocate_info.commandPool = upload_cmd_pool;
+        allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocate_info.commandBufferCount = 1;
+        vkAllocateCommandBuffers(device, &allocate_info, &batch->cmd);
+        if (upload_semaphore == VK_NULL_HANDLE) {
+            VkFenceCreateInfo fence_info{ VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+            vkCreateFence(device, &fence_info, nullptr, &batch->fence);
+        }
+    }
+    batch->value = upload_submitted_value + 1;
+    VkCommandBufferBeginInfo begin_info{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(batch->cmd, &begin_info);
+    return batch;
+}
+
+void ResourceManager::update_uploads() {
+    uint64_t completed_value = upload_completed_value;
+    if (upload_semaphore != VK_NULL_HANDLE) {
+        context->get_semaphore_counter_value(device, upload_semaphore, &completed_value);
+    } else {
+        for (uint32_t i = 0; i < arrlen(submitted_upload_batches); i++) {
+            if (vkGetFenceStatus(device, submitted_upload_batches[i].fence) != VK_SUCCESS) {
+                break;
+            }
+            completed_value = submitted_upload_batches[i].value;
+        }
+    }
+    uint32_t completed_count = 0;
+    while (
+        completed_count < arrlen(submitted_upload_batches)
+        && submitted_upload_batches[completed_count].value <= completed_value
+    ) {
+        UploadBatch* batch = &submitted_upload_batches[completed_count++];
+        for (uint32_t i = 0; i < arrlen(batch->acquire_barriers); i++) {
+            arrput(post_barriers, batch->acquire_barriers[i]);
+        }
+        if (has_dedicated_transfer_queue()) {
+            // Chains with the upload semaphore wait, so later graphics submits are ordered too.
+            src_stages |= VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+            dst_stages |= batch->acquire_stages | batch->buffer_dst_stages;
+            memory_barrier.dstAccessMask |= batch->buffer_dst_access;
+            upload_acquire_value = batch->value;
+            need_submit = 1;
+        }
+        arrsetlen(batch->acquire_barriers, 0);
+        batch->acquire_stages = 0;
+        batch->buffer_dst_stages = 0;
+        batch->buffer_dst_access = 0;
+        arrput(free_upload_batches, *batch);
+    }
+    if (completed_count != 0) {
+        arrdeln(submitted_upload_batches, 0, completed_count);
+    }
+    upload_completed_value = completed_value;
+    retire_staging();
+}
+
+bool ResourceManager::has_dedicated_transfer_queue() const {
+    return transfer_queue_family_index != graphics_queue_family_index;
 }
 
 Buffer ResourceManager::create_vk_buffer(const BufferInfo& info) {
@@ -903,6 +1586,14 @@ Buffer ResourceManager::create_vk_buffer(const BufferInfo& info) {
     buffer_create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     buffer_create_info.size = info.size;
     buffer_create_info.usage = info.usage;
+    // Async uploads write from the transfer queue family, concurrent sharing spares buffers ownership transfers.
+    uint32_t queue_family_indices[] = { graphics_queue_family_index, transfer_queue_family_index, };
+    if (has_dedicated_transfer_queue()
+        && (info.usage & (VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT)) != 0) {
+        buffer_create_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        buffer_create_info.queueFamilyIndexCount = 2;
+        buffer_create_info.pQueueFamilyIndices = queue_family_indices;
+    }
 
     VmaAllocationCreateInfo allocation_create_info{};
     allocation_create_info.usage = info.memory_usage;
@@ -929,6 +1620,7 @@ Buffer ResourceManager::create_vk_buffer(const BufferInfo& info) {
     buffer.buffer = vk_buffer;
     buffer.allocation = allocation;
     buffer.mapped = (uint8_t*)allocation_info.pMappedData;
+    buffer.usage = info.usage;
 
     return buffer;
 }
@@ -1019,9 +1711,13 @@ void ResourceManager::unmap_buffer_helper(Buffer* buffer) {
     buffer->mapped = nullptr;
 }
 
+void ResourceManager::set_capture_recorder(DrawCaptureRecorder* recorder) {
+    capture_recorder = recorder;
+}
+
 ResourceManager* g_resource_manager = nullptr;
 
-ResourceManager* ResourceManager::create(Context* context) {
+ResourceManager* ResourceManager::create(Context* context, uint64_t staging_budget) {
     ResourceManager* rm = (ResourceManager*)malloc(sizeof(ResourceManager));
     memset(rm, 0, sizeof(ResourceManager));
     context->create_cmd_pool(&rm->cmd_pool);
@@ -1030,6 +1726,36 @@ ResourceManager* ResourceManager::create(Context* context) {
     rm->next_frame();
     rm->queue = context->graphics_queue;
     rm->device = context->device;
+    rm->context = context;
+    rm->transfer_queue = context->transfer_queue;
+    rm->graphics_queue_family_index = context->graphics_queue_family_index;
+    rm->transfer_queue_family_index = context->transfer_queue_family_index;
+    VkCommandPoolCreateInfo upload_cmd_pool_info{ VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+    upload_cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    upload_cmd_pool_info.queueFamilyIndex = rm->transfer_queue_family_index;
+    vkCreateCommandPool(rm->device, &upload_cmd_pool_info, nullptr, &rm->upload_cmd_pool);
+    if (context->has_timeline_semaphores) {
+        VkSemaphoreTypeCreateInfo semaphore_type_info{ VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO };
+        semaphore_type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        semaphore_type_info.initialValue = 0;
+        VkSemaphoreCreateInfo semaphore_info{ VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+        semaphore_info.pNext = &semaphore_type_info;
+        vkCreateSemaphore(rm->device, &semaphore_info, nullptr, &rm->upload_semaphore);
+    }
+    StagingRing::init(&rm->staging_ring, staging_budget, staging_alignment);
+    rm->pipeline_compiler = new PipelineCompiler();
+    PipelineCompiler::init(
+        rm->pipeline_compiler,
+        min(max(std::thread::hardware_concurrency(), 2u) - 1, max_pipeline_compile_thread_count),
+        rm->device,
+        context->pipeline_cache,
+        context->has_pipeline_creation_feedback
+    );
+    rm->staging_buffer = rm->create_vk_buffer({
+        .size = staging_budget,
+        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        .map = BufferMap::PERSISTENTLY_MAPPED,
+    });
     VkDescriptorSetLayoutCreateInfo vk_descriptor_set_layout_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, };
     vkCreateDescriptorSetLayout(rm->device, &vk_descriptor_set_layout_info, nullptr, &rm->empty_descriptor_set_layout);
     VkDescriptorPoolCreateInfo vk_descriptor_pool_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO, };
@@ -1044,7 +1770,50 @@ ResourceManager* ResourceManager::create(Context* context) {
 }
 
 void ResourceManager::destroy(ResourceManager* rm) {
+    rm->wait_pipelines();
+    rm->pipeline_compiler->destroy();
+    delete rm->pipeline_compiler;
+    arrfree(rm->pending_pipeline_builds);
+    arrfree(rm->finished_pipeline_builds);
+    rm->sampler_dedup.destroy();
+    rm->render_pass_dedup.destroy();
+    rm->pipeline_dedup.destroy();
     rm->context->destroy_cmd_pool(rm->cmd_pool);
+    for (uint32_t i = 0; i < arrlen(rm->free_upload_batches); i++) {
+        vkDestroyFence(rm->device, rm->free_upload_batches[i].fence, nullptr);
+        arrfree(rm->free_upload_batches[i].acquire_barriers);
+    }
+    arrfree(rm->free_upload_batches);
+    arrfree(rm->submitted_upload_batches);
+    arrfree(rm->upload_waiters);
+    for (uint32_t i = 0; i < arrlen(rm->commit_fences); i++) {
+        vkDestroyFence(rm->device, rm->commit_fences[i], nullptr);
+    }
+    for (uint32_t i = 0; i < arrlen(rm->free_commit_fences); i++) {
+        vkDestroyFence(rm->device, rm->free_commit_fences[i], nullptr);
+    }
+    arrfree(rm->commit_fences);
+    arrfree(rm->free_commit_fences);
+    rm->staging_ring.destroy();
+    vmaDestroyBuffer(rm->allocator, rm->staging_buffer.buffer, rm->staging_buffer.allocation);
+    vkDestroySemaphore(rm->device, rm->upload_semaphore, nullptr);
+    vkDestroyCommandPool(rm->device, rm->upload_cmd_pool, nullptr);
+    rm->buffers.destroy();
+    rm->textures.destroy();
+    rm->shaders.destroy();
+    rm->render_pass_layouts.destroy();
+    rm->render_passes.destroy();
+    rm->pipeline_layouts.destroy();
+    rm->descriptor_sets.destroy();
+    rm->samplers.destroy();
+    rm->pipelines.destroy();
+    rm->vk_buffers.destroy();
+    rm->vk_image_views.destroy();
+    rm->vk_render_passes.destroy();
+    rm->vk_render_pass_layouts.destroy();
+    rm->vk_descriptor_sets.destroy();
+    rm->vk_pipelines.destroy();
+    rm->vk_pipeline_layouts.destroy();
     free(rm);
     g_resource_manager = nullptr;
 }
@@ -1053,4 +1822,20 @@ ResourceManager* ResourceManager::get() {
     return g_resource_manager;
 }
 
+bool UploadAwaiter::await_ready() const {
+    return ResourceManager::get()->is_upload_complete(ticket);
+}
+
+void UploadAwaiter::await_suspend(std::coroutine_handle<> handle) const {
+    ResourceManager* rm = ResourceManager::get();
+    // Nothing else would submit it.
+    rm->submit_uploads();
+    ResourceManager::UploadWaiter waiter = { .value = ticket.value, .handle = handle, };
+    arrput(rm->upload_waiters, waiter);
+}
+
+UploadAwaiter operator co_await(UploadTicket ticket) {
+    return { .ticket = ticket, };
+}
+
 }
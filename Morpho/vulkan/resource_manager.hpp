@@ -1,17 +1,73 @@
 #pragma once
 #include "resources.hpp"
+#include "staging_ring.hpp"
+#include "pipeline_compiler.hpp"
 #include <vulkan/vulkan.h>
+#include <assert.h>
+#include <coroutine>
 #include "common/generational_arena.hpp"
+#include "common/dedup_cache.hpp"
 
 namespace Morpho::Vulkan {
 
 class Context;
 struct CmdPool;
 class CommandBuffer;
+class DrawCaptureRecorder;
+
+// Totals since startup, cold pipelines missed the pipeline cache.
+struct PipelineCreationStats {
+    uint32_t pipeline_count;
+    uint32_t cache_hit_count;
+    uint64_t cold_duration_ns;
+    uint64_t warm_duration_ns;
+    // Lazily created ones still compiling.
+    uint32_t pending_count;
+    // Hits can only be told apart with VK_EXT_pipeline_creation_feedback.
+    bool has_feedback;
+};
+
+struct ResourceStats {
+    ArenaStats buffers;
+    ArenaStats textures;
+    ArenaStats shaders;
+    ArenaStats render_pass_layouts;
+    ArenaStats render_passes;
+    ArenaStats pipeline_layouts;
+    ArenaStats descriptor_sets;
+    ArenaStats samplers;
+    ArenaStats pipelines;
+    // Device memory allocated for live buffers and textures, views are not counted twice.
+    uint64_t buffer_memory_size;
+    uint64_t texture_memory_size;
+    StagingRingStats staging;
+    PipelineCreationStats pipeline_creation;
+    // Hits are creates that got an existing object.
+    DedupCacheStats sampler_dedup;
+    DedupCacheStats render_pass_dedup;
+    DedupCacheStats pipeline_dedup;
+};
+
+// Batch of async uploads, see ResourceManager::create_buffer_async. Zero is always complete.
+struct UploadTicket {
+    uint64_t value;
+};
+
+// co_await ticket resumes the coroutine from ResourceManager::next_frame once the upload is complete.
+struct UploadAwaiter {
+    UploadTicket ticket;
+
+    bool await_ready() const;
+    void await_suspend(std::coroutine_handle<> handle) const;
+    void await_resume() const {}
+};
+
+UploadAwaiter operator co_await(UploadTicket ticket);
 
 class ResourceManager {
 public:
     friend class Context;
+    friend struct UploadAwaiter;
     ResourceManager(const ResourceManager &) = delete;
     ResourceManager &operator=(const ResourceManager &) = delete;
     ResourceManager(ResourceManager &&) = delete;
@@ -19,13 +75,33 @@ public:
     ResourceManager() = delete;
     ~ResourceManager() = delete;
 
-    static ResourceManager* create(Context* context);
+    // Uploads share one staging buffer of staging_budget bytes, larger ones are streamed in chunks.
+    static const uint64_t default_staging_budget = 128 * 1024 * 1024;
+
+    static ResourceManager* create(Context* context, uint64_t staging_budget = default_staging_budget);
     static void destroy(ResourceManager* rm);
     // Temp solution.
     static ResourceManager* get();
 
     Handle<Buffer> create_buffer(const BufferInfo& info, uint8_t**mapped_ptr = nullptr);
     Handle<Texture> create_texture(const TextureInfo& info);
+    // Async uploads are recorded into a batch that commit() or submit_uploads() sends to the transfer queue,
+    // so with a dedicated transfer queue family they overlap rendering instead of stalling it.
+    // The GPU must not use the resource before the ticket completes.
+    Handle<Buffer> create_buffer_async(const BufferInfo& info, UploadTicket* ticket);
+    // Uploads mip 0 of every layer, the texture ends up in the same layout create_texture leaves it in.
+    Handle<Texture> create_texture_async(const TextureInfo& info, UploadTicket* ticket);
+    // Like create_texture_async, but the caller writes initial_data_size bytes of mip 0 into *staging_data,
+    // from any thread, so data doesn't have to be copied first. info.initial_data must be null.
+    // Everything that may submit uploads (submit_uploads, wait_upload, commit, other async uploads) has to wait
+    // until the data is written. Waits for submitted staging to retire, returns false if the texture doesn't fit
+    // before the recording upload batch is submitted, or doesn't fit at all.
+    bool create_texture_staged(
+        const TextureInfo& info,
+        Handle<Texture>* texture,
+        uint8_t** staging_data,
+        UploadTicket* ticket
+    );
     Handle<Texture> create_texture_view(
         Handle<Texture> texture,
         uint32_t base_array_layer,
@@ -38,9 +114,32 @@ public:
     Handle<DescriptorSet> create_descriptor_set(Handle<PipelineLayout> pipeline_layout, uint32_t set_index);
     Handle<Sampler> create_sampler(const SamplerInfo& info);
     Handle<Pipeline> create_pipeline(const PipelineInfo &pipeline_info);
+    // Compiled in parallel, returns once every pipeline is ready.
+    void create_pipelines(Span<const PipelineInfo> infos, Handle<Pipeline>* pipelines);
+    // The handle is valid right away, the pipeline compiles in the background and gets ready in next_frame.
+    // Until then draw streams bind the fallback instead, draws are dropped if there is no ready one.
+    // The fallback has to share the pipeline layout and the render pass layout, and outlive the pipeline.
+    // A shared pipeline keeps the fallback it was created with.
+    Handle<Pipeline> create_pipeline_lazy(
+        const PipelineInfo& info,
+        Handle<Pipeline> fallback = Handle<Pipeline>::null()
+    );
+    bool is_pipeline_ready(Handle<Pipeline> handle);
+    // Blocks until every lazily created pipeline is ready.
+    void wait_pipelines();
+    // Changes whenever lazily created pipelines get ready. Streams recorded before resolved them to fallbacks.
+    uint32_t get_pipeline_generation() const;
 
     Handle<Texture> register_texture(Texture texture);
 
+    // Samplers, render passes and pipelines created from equal infos are shared and reference counted,
+    // every create_sampler, create_render_pass and create_pipeline* has to be paired with a release.
+    // Destroyed once the last reference is released and the frame comes around.
+    void release_sampler(Handle<Sampler> handle);
+    void release_render_pass(Handle<RenderPass> handle);
+    // Waits for it if it was created lazily and isn't ready yet.
+    void release_pipeline(Handle<Pipeline> handle);
+
     void update_descriptor_set(
         Handle<DescriptorSet> descriptor_set,
         Span<const DescriptorSetUpdateRequest> update_requests
@@ -56,24 +155,106 @@ public:
     Sampler get_sampler(Handle<Sampler> handle);
     Pipeline get_pipeline(Handle<Pipeline> handle);
 
+    // Hot-path lookups, nothing is copied and handles are only validated in debug builds.
+    const Buffer* get_buffer_ptr(Handle<Buffer> handle);
+    const Texture* get_texture_ptr(Handle<Texture> handle);
+    const RenderPassLayout* get_render_pass_layout_ptr(Handle<RenderPassLayout> handle);
+    const DescriptorSet* get_descriptor_set_ptr(Handle<DescriptorSet> handle);
+    VkBuffer get_vk_buffer(Handle<Buffer> handle);
+    VkImageView get_vk_image_view(Handle<Texture> handle);
+    VkRenderPass get_vk_render_pass(Handle<RenderPass> handle);
+    VkRenderPass get_vk_render_pass(Handle<RenderPassLayout> handle);
+    VkDescriptorSet get_vk_descriptor_set(Handle<DescriptorSet> handle);
+    VkPipeline get_vk_pipeline(Handle<Pipeline> handle);
+    VkPipelineLayout get_vk_pipeline_layout(Handle<Pipeline> handle);
+
     uint8_t* map_buffer(Handle<Buffer> handle);
     void unmap_buffer(Handle<Buffer> handle);
     uint8_t* get_mapped_ptr(Handle<Buffer> handle);
     uint64_t get_buffer_size(Handle<Buffer> handle);
+    // Copies data into a range of a device local buffer through a staging buffer, lands before the next frame's work.
+    // The buffer needs VK_BUFFER_USAGE_TRANSFER_DST_BIT.
+    void update_buffer(Handle<Buffer> handle, VkDeviceSize offset, const void* data, VkDeviceSize size);
+    UploadTicket update_buffer_async(Handle<Buffer> handle, VkDeviceSize offset, const void* data, VkDeviceSize size);
+    void submit_uploads();
+    // Completed uploads are handed over to graphics by the following commit(),
+    // so call these between next_frame and commit.
+    bool is_upload_complete(UploadTicket ticket);
+    void wait_upload(UploadTicket ticket);
+    // Walks every live resource, not meant to be called on hot paths.
+    ResourceStats get_stats();
 
     void commit();
     void next_frame();
+    // Resources created while a recorder is attached can be referenced by captured draw streams.
+    void set_capture_recorder(DrawCaptureRecorder* recorder);
 private:
-    struct StagingBuffer {
-        Buffer buffer;
-        VkDeviceSize size;
-        uint8_t* write_ptr;
-        VkDeviceSize write_offset;
-        VkDeviceSize used_offset;
-        uint32_t frame_acquired;
+    // Staging ring streams, commit() submits and upload batches.
+    static const uint32_t staging_stream_commit = 0;
+    static const uint32_t staging_stream_upload = 1;
+    static const uint64_t min_staging_chunk_size = 64 * 1024;
+    static const uint64_t staging_alignment = 16;
+    static const VkDeviceSize no_staging_offset = UINT64_MAX;
+    static const uint32_t max_pipeline_compile_thread_count = 4;
+
+    struct UploadBatch {
+        VkCommandBuffer cmd;
+        // Signaled by the batch without timeline semaphores.
+        VkFence fence;
+        uint64_t value;
+        // Queue family ownership acquires of released textures, recorded on graphics once the batch completes.
+        VkImageMemoryBarrier* acquire_barriers;
+        VkPipelineStageFlags acquire_stages;
+        // Buffer writes made visible at the end of batches on the graphics queue.
+        VkPipelineStageFlags buffer_dst_stages;
+        VkAccessFlags buffer_dst_access;
+    };
+
+    // Canonical create infos, see DedupCache.
+    struct SamplerKey {
+        VkSamplerAddressMode address_modes[3];
+        VkFilter min_filter;
+        VkFilter mag_filter;
+        VkSamplerMipmapMode mipmap_mode;
+        VkBool32 anisotropy_enable;
+        float max_anisotropy;
+        VkBool32 compare_enable;
+        VkCompareOp compare_op;
+        float min_lod;
+        float max_lod;
     };
 
-    static const uint64_t default_staging_buffer_size = 128 * 1024 * 1024;
+    struct RenderPassKey {
+        RenderPassAttachmentInfo attachments[RenderPassInfo::max_attachment_count];
+        uint32_t attachment_count;
+        Handle<RenderPassLayout> layout;
+    };
+
+    struct PipelineKey {
+        Handle<Shader> shaders[(uint32_t)ShaderStage::MAX_VALUE];
+        uint32_t shader_count;
+        VkVertexInputAttributeDescription attributes[Limits::MAX_VERTEX_ATTRIBUTE_DESCRIPTION_COUNT];
+        uint32_t attribute_count;
+        VkVertexInputBindingDescription bindings[Limits::MAX_VERTEX_INPUT_BINDING_COUNT];
+        uint32_t binding_count;
+        VkPrimitiveTopology primitive_topology;
+        VkCullModeFlags cull_mode;
+        VkFrontFace front_face;
+        float depth_bias_constant_factor;
+        float depth_bias_slope_factor;
+        uint32_t depth_test_enabled;
+        uint32_t depth_write_enabled;
+        uint32_t depth_clamp_enabled;
+        VkCompareOp depth_compare_op;
+        VkPipelineColorBlendAttachmentState blend_state;
+        Handle<RenderPassLayout> render_pass_layout;
+        Handle<PipelineLayout> pipeline_layout;
+    };
+
+    struct UploadWaiter {
+        uint64_t value;
+        std::coroutine_handle<> handle;
+    };
 
     GenerationalArena<Buffer> buffers;
     GenerationalArena<Texture> textures;
@@ -84,10 +265,23 @@ private:
     GenerationalArena<DescriptorSet> descriptor_sets;
     GenerationalArena<Sampler> samplers;
     GenerationalArena<Pipeline> pipelines;
+    // Vulkan handles split out of the arenas above for get_vk_*.
+    HandleColumn<Buffer, VkBuffer> vk_buffers;
+    HandleColumn<Texture, VkImageView> vk_image_views;
+    HandleColumn<RenderPass, VkRenderPass> vk_render_passes;
+    HandleColumn<RenderPassLayout, VkRenderPass> vk_render_pass_layouts;
+    HandleColumn<DescriptorSet, VkDescriptorSet> vk_descriptor_sets;
+    HandleColumn<Pipeline, VkPipeline> vk_pipelines;
+    HandleColumn<Pipeline, VkPipelineLayout> vk_pipeline_layouts;
 
     VmaAllocator allocator = VK_NULL_HANDLE;
-    StagingBuffer* used_staging_buffers = nullptr;
-    StagingBuffer* free_staging_buffers = nullptr;
+    Buffer staging_buffer{};
+    StagingRing staging_ring{};
+    // Signaled by commit() submits in order, staging ranges of the commit stream retire with them.
+    VkFence* commit_fences = nullptr;
+    VkFence* free_commit_fences = nullptr;
+    uint64_t commit_submitted_value = 0;
+    uint64_t commit_completed_value = 0;
     Context* context = nullptr;
     VkDevice device = VK_NULL_HANDLE;
     VkQueue queue = VK_NULL_HANDLE;
@@ -103,16 +297,136 @@ private:
     VkDescriptorSetLayout empty_descriptor_set_layout;
     VkDescriptorPool empty_descriptor_pool;
     VkDescriptorSet empty_descriptor_set;
-    uint32_t frame = 0;
+    DrawCaptureRecorder* capture_recorder = nullptr;
+    PipelineCreationStats pipeline_creation_stats{};
+    PipelineCompiler* pipeline_compiler = nullptr;
+    DedupCache<Sampler, SamplerKey> sampler_dedup{};
+    DedupCache<RenderPass, RenderPassKey> render_pass_dedup{};
+    DedupCache<Pipeline, PipelineKey> pipeline_dedup{};
+    // Lazily created pipelines that aren't ready yet, owned by pipeline_compiler until it finishes them.
+    PipelineBuild** pending_pipeline_builds = nullptr;
+    PipelineBuild** finished_pipeline_builds = nullptr;
+    uint32_t pipeline_generation = 0;
+    // Async uploads, on the graphics queue unless the GPU has a dedicated transfer queue family.
+    VkQueue transfer_queue = VK_NULL_HANDLE;
+    uint32_t transfer_queue_family_index = 0;
+    uint32_t graphics_queue_family_index = 0;
+    VkCommandPool upload_cmd_pool = VK_NULL_HANDLE;
+    // Timeline, counts submitted batches. Null without timeline semaphores.
+    VkSemaphore upload_semaphore = VK_NULL_HANDLE;
+    // Being recorded, cmd is null if there is none.
+    UploadBatch upload_batch{};
+    // In submission order.
+    UploadBatch* submitted_upload_batches = nullptr;
+    UploadBatch* free_upload_batches = nullptr;
+    UploadWaiter* upload_waiters = nullptr;
+    uint64_t upload_submitted_value = 0;
+    uint64_t upload_completed_value = 0;
+    // Graphics submissions wait for the timeline up to it.
+    uint64_t upload_acquire_value = 0;
+    uint64_t upload_waited_value = 0;
     // flags
     uint32_t committed : 1;
     uint32_t need_submit : 1;
 
-    StagingBuffer* acquire_staging_buffer(VkDeviceSize size);
+    // Returns the allocated size, waits for older staging ranges to retire if min_size doesn't fit.
+    // Lives until the stream's current submit completes.
+    VkDeviceSize acquire_staging(uint32_t stream, VkDeviceSize size, VkDeviceSize min_size, VkDeviceSize* offset);
+    void wait_staging();
+    void stream_to_buffer(uint32_t stream, VkBuffer buffer, VkDeviceSize offset, const void* data, VkDeviceSize size);
+    // Layout has to be VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL.
+    void stream_to_texture(uint32_t stream, const Texture& texture, const TextureInfo& info);
+    void copy_staging_to_texture(
+        VkCommandBuffer cmd,
+        VkDeviceSize staging_offset,
+        const Texture& texture,
+        const TextureInfo& info
+    );
+    VkCommandBuffer get_staging_cmd(uint32_t stream);
+    // Streams info.initial_data without a staging_offset.
+    Handle<Texture> create_texture_upload(const TextureInfo& info, VkDeviceSize staging_offset, UploadTicket* ticket);
+    void submit_commands();
+    // Submits what is recorded so far in the middle of a frame, so its staging ranges can retire.
+    void flush_commands();
+    void retire_staging();
+    static PipelineKey make_pipeline_key(const PipelineInfo& info);
+    // Adds the pipeline, it stays unready until finish_pipeline.
+    PipelineBuild* init_pipeline_build(const PipelineInfo& info, Handle<Pipeline> fallback);
+    // Frees the build.
+    void finish_pipeline(PipelineBuild* build);
+    // First ready pipeline down the fallback chain.
+    VkPipeline resolve_pipeline(Handle<Pipeline> handle);
+    void update_pipelines();
+    // Blocks until the lazily created pipeline is ready, leaves other pending ones compiling.
+    void wait_pipeline(Handle<Pipeline> handle);
+    UploadBatch* begin_upload_batch();
+    void update_uploads();
+    bool has_dedicated_transfer_queue() const;
+    Handle<Texture> create_vk_texture(
+        const TextureInfo& info,
+        VkImageLayout* final_layout,
+        VkPipelineStageFlags* dst_stages,
+        VkAccessFlags* dst_access
+    );
     Buffer create_vk_buffer(const BufferInfo& info);
     VkRenderPass create_vk_render_pass(const RenderPassInfo& info, const RenderPassLayoutInfo& layout_info);
     void map_buffer_helper(Buffer* buffer);
     void unmap_buffer_helper(Buffer* buffer);
 };
 
+inline const Buffer* ResourceManager::get_buffer_ptr(Handle<Buffer> handle) {
+    assert(buffers.is_valid(handle));
+    return buffers.get_ptr(handle);
+}
+
+inline const Texture* ResourceManager::get_texture_ptr(Handle<Texture> handle) {
+    assert(textures.is_valid(handle));
+    return textures.get_ptr(handle);
+}
+
+inline const RenderPassLayout* ResourceManager::get_render_pass_layout_ptr(Handle<RenderPassLayout> handle) {
+    assert(render_pass_layouts.is_valid(handle));
+    return render_pass_layouts.get_ptr(handle);
+}
+
+inline const DescriptorSet* ResourceManager::get_descriptor_set_ptr(Handle<DescriptorSet> handle) {
+    assert(descriptor_sets.is_valid(handle));
+    return descriptor_sets.get_ptr(handle);
+}
+
+inline VkBuffer ResourceManager::get_vk_buffer(Handle<Buffer> handle) {
+    assert(buffers.is_valid(handle));
+    return vk_buffers.get(handle);
+}
+
+inline VkImageView ResourceManager::get_vk_image_view(Handle<Texture> handle) {
+    assert(textures.is_valid(handle));
+    return vk_image_views.get(handle);
+}
+
+inline VkRenderPass ResourceManager::get_vk_render_pass(Handle<RenderPass> handle) {
+    assert(render_passes.is_valid(handle));
+    return vk_render_passes.get(handle);
+}
+
+inline VkRenderPass ResourceManager::get_vk_render_pass(Handle<RenderPassLayout> handle) {
+    assert(render_pass_layouts.is_valid(handle));
+    return vk_render_pass_layouts.get(handle);
+}
+
+inline VkDescriptorSet ResourceManager::get_vk_descriptor_set(Handle<DescriptorSet> handle) {
+    assert(descriptor_sets.is_valid(handle));
+    return vk_descriptor_sets.get(handle);
+}
+
+inline VkPipeline ResourceManager::get_vk_pipeline(Handle<Pipeline> handle) {
+    assert(pipelines.is_valid(handle));
+    return vk_pipelines.get(handle);
+}
+
+inline VkPipelineLayout ResourceManager::get_vk_pipeline_layout(Handle<Pipeline> handle) {
+    assert(pipelines.is_valid(handle));
+    return vk_pipeline_layouts.get(handle);
+}
+
 }
@@ -36,6 +36,7 @@ struct Buffer {
     VkBuffer buffer;
     VmaAllocation allocation;
     uint8_t* mapped;
+    VkBufferUsageFlags usage;
 };
 
 struct TextureInfo {
@@ -276,6 +277,12 @@ struct Pipeline {
     VkPipeline pipeline;
     // TODO: Remove
     Handle<PipelineLayout> pipeline_layout;
+    // Bound instead while pipeline is null, see ResourceManager::create_pipeline_lazy.
+    Handle<Pipeline> fallback;
+    // Reported by VK_EXT_pipeline_creation_feedback, otherwise measured around vkCreateGraphicsPipelines.
+    uint64_t creation_duration_ns;
+    // Always false without VK_EXT_pipeline_creation_feedback.
+    bool is_cache_hit;
 };
 
 }
@@ -0,0 +1,133 @@
+#include "staging_ring.hpp"
+#include <stb_ds.h>
+#include <assert.h>
+
+namespace Morpho::Vulkan {
+
+void StagingRing::init(StagingRing* ring, uint64_t size, uint64_t alignment) {
+    assert(size != 0 && alignment != 0 && (alignment & (alignment - 1)) == 0);
+    *ring = {};
+    ring->size = size;
+    ring->alignment = alignment;
+}
+
+void StagingRing::destroy() {
+    arrfree(ranges);
+}
+
+bool StagingRing::allocate(
+    uint32_t stream,
+    uint64_t requested_size,
+    uint64_t min_size,
+    uint64_t* offset,
+    uint64_t* out_size
+) {
+    assert(stream < max_stream_count && min_size != 0 && min_size <= requested_size);
+    if (used_size == size) {
+        return false;
+    }
+    if (used_size == 0) {
+        head = tail = 0;
+    }
+    uint64_t begin = (head + alignment - 1) & ~(alignment - 1);
+    uint64_t padding = begin - head;
+    uint64_t available;
+    if (head < tail) {
+        available = begin < tail ? tail - begin : 0;
+    } else {
+        available = begin < size ? size - begin : 0;
+        if (available < min_size) {
+            // Wrap, the end of the buffer stays unused until the range retires.
+            padding = size - head;
+            begin = 0;
+            available = tail;
+        }
+    }
+    if (available < min_size) {
+        return false;
+    }
+    uint64_t taken = requested_size < available ? requested_size : available;
+    head = begin + taken == size ? 0 : begin + taken;
+    used_size += padding + taken;
+    peak_used_size = peak_used_size > used_size ? peak_used_size : used_size;
+    allocated_size += taken;
+    allocation_count++;
+    partial_allocation_count += taken < requested_size;
+
+    Range* last = arrlen(ranges) != 0 ? &arrlast(ranges) : nullptr;
+    if (last != nullptr && last->stream == stream && last->value == 0) {
+        last->end = head;
+        last->size += padding + taken;
+    } else {
+        Range range = {
+            .end = head,
+            .size = padding + taken,
+            .value = 0,
+            .stream = stream,
+        };
+        arrput(ranges, range);
+    }
+    *offset = begin;
+    *out_size = taken;
+    return true;
+}
+
+void StagingRing::submit(uint32_t stream, uint64_t value) {
+    assert(value != 0);
+    // Open ranges of a stream are all after its last submitted one.
+    for (int32_t i = arrlen(ranges) - 1; i >= 0; i--) {
+        if (ranges[i].stream != stream) {
+            continue;
+        }
+        if (ranges[i].value != 0) {
+            break;
+        }
+        ranges[i].value = value;
+    }
+}
+
+void StagingRing::retire(const uint64_t* completed_values) {
+    uint32_t retired_count = 0;
+    while (retired_count < arrlen(ranges)) {
+        const Range& range = ranges[retired_count];
+        if (range.value == 0 || range.value > completed_values[range.stream]) {
+            break;
+        }
+        used_size -= range.size;
+        tail = range.end;
+        retired_count++;
+    }
+    if (retired_count != 0) {
+        arrdeln(ranges, 0, retired_count);
+    }
+    if (used_size == 0) {
+        head = tail = 0;
+    }
+}
+
+bool StagingRing::get_oldest(uint32_t* stream, uint64_t* value) const {
+    if (arrlen(ranges) == 0) {
+        return false;
+    }
+    *stream = ranges[0].stream;
+    *value = ranges[0].value;
+    return true;
+}
+
+uint64_t StagingRing::get_size() const {
+    return size;
+}
+
+StagingRingStats StagingRing::get_stats() const {
+    return {
+        .size = size,
+        .used_size = used_size,
+        .peak_used_size = peak_used_size,
+        .allocated_size = allocated_size,
+        .allocation_count = allocation_count,
+        .partial_allocation_count = partial_allocation_count,
+        .range_count = (uint32_t)arrlen(ranges),
+    };
+}
+
+}
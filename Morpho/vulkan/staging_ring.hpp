@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+
+namespace Morpho::Vulkan {
+
+struct StagingRingStats {
+    uint64_t size;
+    // Includes alignment and wrap padding.
+    uint64_t used_size;
+    uint64_t peak_used_size;
+    uint64_t allocated_size;
+    uint64_t allocation_count;
+    // Allocations that got less than asked for, the rest was streamed in later chunks.
+    uint64_t partial_allocation_count;
+    uint32_t range_count;
+};
+
+// Offsets into a fixed size staging buffer, reclaimed in allocation order.
+// Allocations belong to a stream of submits, consecutive ones of a stream share a range
+// that retires once the stream completes the submit it was recorded into.
+// Streams number their submits with increasing values starting at 1.
+// NOTE: zeroed memory is an uninitialized ring, init before use.
+class StagingRing {
+public:
+    static const uint32_t max_stream_count = 2;
+
+    static void init(StagingRing* ring, uint64_t size, uint64_t alignment);
+    void destroy();
+    // Contiguous, at least min_size and at most requested_size bytes.
+    // Returns false if min_size doesn't fit until older ranges retire.
+    bool allocate(uint32_t stream, uint64_t requested_size, uint64_t min_size, uint64_t* offset, uint64_t* out_size);
+    // Everything the stream allocated since the previous submit retires with value.
+    void submit(uint32_t stream, uint64_t value);
+    // completed_values[stream] is the last completed submit of the stream.
+    void retire(const uint64_t* completed_values);
+    // Stream of the oldest live range and the submit it waits for, zero if it isn't submitted yet.
+    // Returns false if the ring is empty.
+    bool get_oldest(uint32_t* stream, uint64_t* value) const;
+    uint64_t get_size() const;
+    StagingRingStats get_stats() const;
+private:
+    struct Range {
+        uint64_t end;
+        uint64_t size;
+        uint64_t value;
+        uint32_t stream;
+    };
+
+    // stb_ds array, oldest first.
+    Range* ranges;
+    uint64_t size;
+    uint64_t alignment;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t used_size;
+    uint64_t peak_used_size;
+    uint64_t allocated_size;
+    uint64_t allocation_count;
+    uint64_t partial_allocation_count;
+};
+
+}
@@ -0,0 +1,174 @@
+#include "stream_decoder.hpp"
+#include "vulkan/resource_manager.hpp"
+#include <stb_ds.h>
+#include <bit>
+
+namespace Morpho::Vulkan {
+
+void StreamDecoderRegistry::add(const StreamDecoder& decoder) {
+    assert(decoder.decode != nullptr);
+    arrput(decoders, decoder);
+}
+
+const StreamDecoder* StreamDecoderRegistry::find(uint32_t fields) const {
+    const StreamDecoder* best = nullptr;
+    for (uint32_t i = 0; i < arrlen(decoders); i++) {
+        const StreamDecoder* decoder = &decoders[i];
+        if ((fields & ~decoder->fields) != 0) {
+            continue;
+        }
+        if (best == nullptr || std::popcount(decoder->fields) < std::popcount(best->fields)) {
+            best = decoder;
+        }
+    }
+    assert(best != nullptr);
+    return best;
+}
+
+void StreamDecoderRegistry::destroy() {
+    arrfree(decoders);
+}
+
+void DrawStreamStats::add(const DrawStreamStats& other) {
+    draws += other.draws;
+    draw_commands += other.draw_commands;
+    pipeline_binds += other.pipeline_binds;
+    for (uint32_t i = 0; i < DrawStream::descriptor_set_count; i++) {
+        descriptor_set_binds[i] += other.descriptor_set_binds[i];
+    }
+    index_buffer_binds += other.index_buffer_binds;
+    vertex_buffer_binds += other.vertex_buffer_binds;
+    triangles += other.triangles;
+    redundant_binds_avoided += other.redundant_binds_avoided;
+}
+
+DrawBatcher::DrawBatcher(
+    VkCommandBuffer cmd,
+    const DrawCapabilities* capabilities,
+    const IndirectCommandRange& indirect
+): cmd(cmd), capabilities(capabilities), indirect(indirect) {
+    if (capabilities == nullptr) {
+        return;
+    }
+    if (capabilities->max_multi_draw_count > 1 && capabilities->cmd_draw_multi_indexed != nullptr) {
+        mode = Mode::MULTI_DRAW;
+    } else if (capabilities->multi_draw_indirect && indirect.mapped != nullptr && indirect.capacity != 0) {
+        mode = Mode::INDIRECT;
+        indirect_buffer = ResourceManager::get()->get_vk_buffer(indirect.buffer);
+    }
+}
+
+uint32_t DrawBatcher::get_run_break_fields() const {
+    switch (mode) {
+        case Mode::MULTI_DRAW:
+            // Instance count and first instance are shared by the whole vkCmdDrawMultiIndexedEXT.
+            return ~(DrawStream::INDEX_COUNT
+                | DrawStream::FIRST_INDEX
+                | DrawStream::VERTEX_OFFSET
+                | DrawStream::COMPACT_DRAW_PARAMETERS);
+        case Mode::INDIRECT:
+            return ~(DrawStream::draw_parameter_fields | DrawStream::COMPACT_DRAW_PARAMETERS);
+        default:
+            return ~0u;
+    }
+}
+
+void DrawBatcher::add(const DrawStream::DrawState& state) {
+    switch (mode) {
+        case Mode::DIRECT:
+            command_count++;
+            vkCmdDrawIndexed(
+                cmd,
+                state.index_count,
+                state.instance_count,
+                state.first_index,
+                state.vertex_offset,
+                state.first_instance
+            );
+            return;
+        case Mode::MULTI_DRAW:
+            if (run_count == max_multi_draw_batch_size || run_count == capabilities->max_multi_draw_count) {
+                flush();
+            }
+            multi_draws[run_count++] = {
+                .firstIndex = state.first_index,
+                .indexCount = state.index_count,
+                .vertexOffset = state.vertex_offset,
+            };
+            run_state = state;
+            return;
+        case Mode::INDIRECT: {
+            if (indirect_used == indirect.capacity) {
+                // Out of indirect memory, the rest of the stream is drawn directly.
+                flush();
+                command_count++;
+                vkCmdDrawIndexed(
+                    cmd,
+                    state.index_count,
+                    state.instance_count,
+                    state.first_index,
+                    state.vertex_offset,
+                    state.first_instance
+                );
+                return;
+            }
+            VkDrawIndexedIndirectCommand command = {
+                .indexCount = state.index_count,
+                .instanceCount = state.instance_count,
+                .firstIndex = state.first_index,
+                .vertexOffset = state.vertex_offset,
+                .firstInstance = state.first_instance,
+            };
+            memcpy(indirect.mapped + indirect_used * sizeof(command), &command, sizeof(command));
+            if (run_count == 0) {
+                run_first = indirect_used;
+            }
+            indirect_used++;
+            run_count++;
+            run_state = state;
+            return;
+        }
+    }
+}
+
+uint32_t DrawBatcher::get_command_count() const {
+    return command_count;
+}
+
+void DrawBatcher::flush() {
+    if (run_count == 0) {
+        return;
+    }
+    command_count++;
+    if (run_count == 1) {
+        vkCmdDrawIndexed(
+            cmd,
+            run_state.index_count,
+            run_state.instance_count,
+            run_state.first_index,
+            run_state.vertex_offset,
+            run_state.first_instance
+        );
+    } else if (mode == Mode::MULTI_DRAW) {
+        capabilities->cmd_draw_multi_indexed(
+            cmd,
+            run_count,
+            multi_draws,
+            run_state.instance_count,
+            run_state.first_instance,
+            sizeof(VkMultiDrawIndexedInfoEXT),
+            nullptr
+        );
+    } else {
+        vkCmdDrawIndexedIndirect(
+            cmd,
+            indirect_buffer,
+            indirect.offset + run_first * sizeof(VkDrawIndexedIndirectCommand),
+            run_count,
+            sizeof(VkDrawIndexedIndirectCommand)
+        );
+    }
+    run_count = 0;
+}
+
+}
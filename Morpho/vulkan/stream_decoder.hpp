@@ -0,0 +1,277 @@
+#pragma once
+#include "command_buffer.hpp"
+#include "common/draw_stream.hpp"
+#include <bit>
+#include <string.h>
+#include <type_traits>
+
+namespace Morpho::Vulkan {
+
+// What a decoded stream cost, accumulated per pass by the caller.
+struct DrawStreamStats {
+    uint32_t draws;
+    // Draw commands actually recorded, lower than draws when runs were batched.
+    uint32_t draw_commands;
+    uint32_t pipeline_binds;
+    uint32_t descriptor_set_binds[DrawStream::descriptor_set_count]; // set 1, 2, 3
+    uint32_t index_buffer_binds;
+    // vkCmdBindVertexBuffers calls, one per run of bound bindings a draw changed.
+    uint32_t vertex_buffer_binds;
+    // Assumes triangle lists.
+    uint64_t triangles;
+    // Binds a recorder without state tracking would issue on every draw, minus the binds that were issued.
+    uint32_t redundant_binds_avoided;
+
+    void add(const DrawStreamStats& other);
+};
+
+// Decodes the draws of a stream, the header is already consumed. stats may be null.
+typedef void (*decode_stream_fn)(
+    VkCommandBuffer cmd,
+    const DrawCapabilities* capabilities,
+    const IndirectCommandRange& indirect_commands,
+    Span<const uint8_t> draws,
+    DrawStreamStats* stats
+);
+
+struct StreamDecoder {
+    // DrawStream::Field bits the decoder reads, fields outside of it are never branched on.
+    uint32_t fields;
+    decode_stream_fn decode;
+};
+
+// Streams describe their fields in DrawStream::Header,
+// find picks the decoder with the fewest fields that still covers all of them.
+// Decoders are registered once at startup, lookups are not synchronized against add.
+class StreamDecoderRegistry {
+public:
+    void add(const StreamDecoder& decoder);
+    const StreamDecoder* find(uint32_t fields) const;
+    void destroy();
+private:
+    StreamDecoder* decoders = nullptr;
+};
+
+template<typename T>
+static inline T read_stream(const uint8_t** stream) {
+    T value;
+    memcpy(&value, *stream, sizeof(T));
+    *stream += sizeof(T);
+    return value;
+}
+
+// Draw parameters are 16 bits wide in records with DrawStream::COMPACT_DRAW_PARAMETERS.
+template<typename T>
+static inline T read_draw_parameter(const uint8_t** stream, bool is_compact) {
+    if (is_compact) {
+        return (T)read_stream<std::conditional_t<std::is_signed_v<T>, int16_t, uint16_t>>(stream);
+    }
+    return read_stream<T>(stream);
+}
+
+// Collects consecutive draws that share all bound state and issues them with as few commands as possible.
+class DrawBatcher {
+public:
+    DrawBatcher(VkCommandBuffer cmd, const DrawCapabilities* capabilities, const IndirectCommandRange& indirect);
+
+    // Stream fields that can't change inside of a run, the current run has to be flushed before they are applied.
+    uint32_t get_run_break_fields() const;
+    uint32_t get_command_count() const;
+    void add(const DrawStream::DrawState& state);
+    void flush();
+private:
+    enum class Mode {
+        DIRECT,
+        MULTI_DRAW,
+        INDIRECT,
+    };
+
+    static const uint32_t max_multi_draw_batch_size = 256;
+
+    VkCommandBuffer cmd;
+    const DrawCapabilities* capabilities;
+    Mode mode = Mode::DIRECT;
+    IndirectCommandRange indirect;
+    VkBuffer indirect_buffer = VK_NULL_HANDLE;
+    uint32_t indirect_used = 0;
+    uint32_t run_first = 0;
+    uint32_t run_count = 0;
+    uint32_t command_count = 0;
+    // Last draw of the run, runs of one draw are issued directly.
+    DrawStream::DrawState run_state{};
+    VkMultiDrawIndexedInfoEXT multi_draws[max_multi_draw_batch_size];
+};
+
+// Decode loop specialized for a field set, everything outside of fields is compiled out.
+template<uint32_t fields>
+void decode_stream(
+    VkCommandBuffer cmd,
+    const DrawCapabilities* capabilities,
+    const IndirectCommandRange& indirect_commands,
+    Span<const uint8_t> draws,
+    DrawStreamStats* stats
+) {
+    constexpr uint32_t descriptor_set_fields = fields & DrawStream::descriptor_set_fields;
+    constexpr uint32_t index_buffer_fields = DrawStream::INDEX_BUFFER | DrawStream::INDEX_BUFFER_OFFSET
+        | DrawStream::INDEX_TYPE;
+    constexpr uint32_t vertex_fields = fields & (DrawStream::vertex_buffer_fields | DrawStream::vertex_buffer_offset_fields);
+    // Bindings past the last one a stream can change are never touched.
+    constexpr uint32_t vertex_binding_count = std::bit_width(
+        ((fields & DrawStream::vertex_buffer_fields) / DrawStream::VERTEX_BUFFER_0)
+        | ((fields & DrawStream::vertex_buffer_offset_fields) / DrawStream::VERTEX_BUFFER_OFFSET_0)
+    );
+    const uint8_t* stream = draws.data();
+    const uint8_t* stream_end = stream + draws.size();
+    // Streams without instancing fields never carry them.
+    DrawStream::DrawState state{ .instance_count = 1, };
+    VkDeviceSize vertex_buffer_offsets[DrawStream::vertex_buffer_count]{};
+    DrawBatcher batcher(cmd, capabilities, indirect_commands);
+    uint32_t run_break_fields = batcher.get_run_break_fields();
+    // Counting is cheaper than branching on stats in the loop.
+    DrawStreamStats counts{};
+    while (stream < stream_end) {
+        uint32_t mask = read_stream<uint32_t>(&stream);
+        assert((mask & ~(fields | DrawStream::COMPACT_DRAW_PARAMETERS)) == 0);
+        if (mask & run_break_fields) {
+            batcher.flush();
+        }
+        if constexpr ((fields & DrawStream::PIPELINE) != 0) {
+            if (mask & DrawStream::PIPELINE) {
+                state.pipeline = read_stream<VkPipeline>(&stream);
+                state.pipeline_layout = read_stream<VkPipelineLayout>(&stream);
+                vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipeline);
+                counts.pipeline_binds++;
+            }
+        }
+        if constexpr (descriptor_set_fields != 0) {
+            if (mask & descriptor_set_fields) {
+                for (uint32_t i = 0; i < DrawStream::descriptor_set_count; i++) {
+                    if ((descriptor_set_fields & (DrawStream::DESCRIPTOR_SET_1 << i)) == 0) {
+                        continue;
+                    }
+                    if (mask & (DrawStream::DESCRIPTOR_SET_1 << i)) {
+                        state.descriptor_sets[i] = read_stream<VkDescriptorSet>(&stream);
+                        vkCmdBindDescriptorSets(
+                            cmd,
+                            VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            state.pipeline_layout,
+                            i + 1,
+                            1,
+                            &state.descriptor_sets[i],
+                            0,
+                            nullptr
+                        );
+                        counts.descriptor_set_binds[i]++;
+                    }
+                }
+            }
+        }
+        if constexpr ((fields & index_buffer_fields) != 0) {
+            if (mask & index_buffer_fields) {
+                if (mask & DrawStream::INDEX_BUFFER) {
+                    state.index_buffer = read_stream<VkBuffer>(&stream);
+                }
+                if (mask & DrawStream::INDEX_BUFFER_OFFSET) {
+                    state.index_buffer_offset = read_stream<uint32_t>(&stream);
+                }
+                if constexpr ((fields & DrawStream::INDEX_TYPE) != 0) {
+                    if (mask & DrawStream::INDEX_TYPE) {
+                        state.index_type = read_stream<VkIndexType>(&stream);
+                    }
+                }
+                vkCmdBindIndexBuffer(cmd, state.index_buffer, state.index_buffer_offset, state.index_type);
+                counts.index_buffer_binds++;
+            }
+        }
+        if constexpr (vertex_fields != 0) {
+            uint32_t buffer_mask = (mask & DrawStream::vertex_buffer_fields) / DrawStream::VERTEX_BUFFER_0;
+            uint32_t offset_mask = (mask & DrawStream::vertex_buffer_offset_fields) / DrawStream::VERTEX_BUFFER_OFFSET_0;
+            if ((buffer_mask | offset_mask) != 0) {
+                for (uint32_t i = 0; i < vertex_binding_count; i++) {
+                    if (buffer_mask & (1u << i)) {
+                        state.vertex_buffers[i] = read_stream<VkBuffer>(&stream);
+                    }
+                }
+                for (uint32_t i = 0; i < vertex_binding_count; i++) {
+                    if (offset_mask & (1u << i)) {
+                        state.vertex_buffer_offsets[i] = read_stream<uint32_t>(&stream);
+                        vertex_buffer_offsets[i] = state.vertex_buffer_offsets[i];
+                    }
+                }
+                // Rebinding unchanged buffers in between is cheaper than issuing separate calls,
+                // but unbound ones split the range, null buffers are invalid without nullDescriptor.
+                uint32_t changed = buffer_mask | offset_mask;
+                uint32_t end = std::bit_width(changed);
+                while (changed != 0) {
+                    uint32_t first = std::countr_zero(changed);
+                    uint32_t last = first;
+                    while (last < end && state.vertex_buffers[last] != VK_NULL_HANDLE) {
+                        last++;
+                    }
+                    if (last == first) {
+                        changed &= changed - 1;
+                        continue;
+                    }
+                    vkCmdBindVertexBuffers(
+                        cmd,
+                        first,
+                        last - first,
+                        &state.vertex_buffers[first],
+                        &vertex_buffer_offsets[first]
+                    );
+                    counts.vertex_buffer_binds++;
+                    changed &= ~((1u << last) - 1);
+                }
+            }
+        }
+        bool is_compact = (mask & DrawStream::COMPACT_DRAW_PARAMETERS) != 0;
+        if (mask & DrawStream::INDEX_COUNT) {
+            state.index_count = read_draw_parameter<uint32_t>(&stream, is_compact);
+        }
+        if (mask & DrawStream::FIRST_INDEX) {
+            state.first_index = read_draw_parameter<uint32_t>(&stream, is_compact);
+        }
+        if constexpr ((fields & DrawStream::VERTEX_OFFSET) != 0) {
+            if (mask & DrawStream::VERTEX_OFFSET) {
+                state.vertex_offset = read_draw_parameter<int32_t>(&stream, is_compact);
+            }
+        }
+        if constexpr ((fields & DrawStream::INSTANCE_COUNT) != 0) {
+            if (mask & DrawStream::INSTANCE_COUNT) {
+                state.instance_count = read_draw_parameter<uint32_t>(&stream, is_compact);
+            }
+        }
+        if constexpr ((fields & DrawStream::FIRST_INSTANCE) != 0) {
+            if (mask & DrawStream::FIRST_INSTANCE) {
+                state.first_instance = read_draw_parameter<uint32_t>(&stream, is_compact);
+            }
+        }
+        batcher.add(state);
+        counts.draws++;
+        counts.triangles += (uint64_t)(state.index_count / 3) * state.instance_count;
+    }
+    batcher.flush();
+    assert(stream == stream_end);
+    if (stats != nullptr) {
+        counts.draw_commands = batcher.get_command_count();
+        uint32_t binds_per_draw = ((fields & DrawStream::PIPELINE) != 0)
+            + std::popcount(descriptor_set_fields)
+            + ((fields & index_buffer_fields) != 0)
+            + (vertex_fields != 0);
+        uint32_t binds = counts.pipeline_binds + counts.index_buffer_binds + counts.vertex_buffer_binds;
+        for (uint32_t i = 0; i < DrawStream::descriptor_set_count; i++) {
+            binds += counts.descriptor_set_binds[i];
+        }
+        // Split vertex buffer runs can issue more than one bind per draw.
+        uint32_t naive_binds = counts.draws * binds_per_draw;
+        counts.redundant_binds_avoided = naive_binds > binds ? naive_binds - binds : 0;
+        stats->add(counts);
+    }
+}
+
+template<uint32_t fields>
+StreamDecoder make_stream_decoder() {
+    return { .fields = fields, .decode = decode_stream<fields> };
+}
+
+}
@@ -0,0 +1,578 @@
+#include "vulkan/context.hpp"
+#include "vulkan/resource_manager.hpp"
+#include "vulkan/draw_capture.hpp"
+#include "vulkan/stream_decoder.hpp"
+#include "common/draw_stream.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace Morpho;
+using namespace Morpho::Vulkan;
+
+// Decodes the draw streams of a capture written by DrawCaptureRecorder over and over without a window
+// and reports how long decoding took on the CPU and executing the passes took on the GPU,
+// along with encoded stream bytes and decode time per draw.
+// Replay <capture> [iteration count]
+// Afterwards resolves the capture's handles through the by-value and hot-path ResourceManager getters.
+
+// Capture ids resolved to resources of this device.
+struct ReplayResources {
+    std::vector<Handle<Shader>> shaders;
+    std::vector<Handle<PipelineLayout>> pipeline_layouts;
+    std::vector<Handle<RenderPassLayout>> render_pass_layouts;
+    std::vector<Handle<RenderPass>> render_passes;
+    std::vector<Handle<Pipeline>> pipelines;
+    std::vector<Handle<Buffer>> buffers;
+    std::vector<Handle<Texture>> textures;
+    std::vector<Handle<Sampler>> samplers;
+    std::vector<Handle<DescriptorSet>> descriptor_sets;
+    // Stand-ins for descriptors referencing resources that weren't captured.
+    Handle<Buffer> fallback_buffer;
+    Handle<Texture> fallback_texture;
+    Handle<Sampler> fallback_sampler;
+};
+
+struct ReplayPass {
+    const char* name;
+    DrawPassInfo info;
+    FramebufferInfo framebuffer_info;
+    std::vector<std::vector<uint8_t>> streams;
+    std::vector<IndirectCommandRange> indirect_commands;
+    // Headers included.
+    uint64_t stream_size;
+    DrawStreamStats stats;
+    double decode_seconds;
+    double gpu_seconds;
+};
+
+static const VkDeviceSize fallback_buffer_size = 64 * 1024;
+static const uint32_t lookup_count = 10 * 1000 * 1000;
+
+static bool is_buffer_descriptor(VkDescriptorType type) {
+    return type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER
+        || type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
+        || type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC
+        || type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+}
+
+template<typename T>
+static uint64_t to_u64(T handle) {
+    static_assert(sizeof(T) == sizeof(uint64_t));
+    uint64_t value;
+    memcpy(&value, &handle, sizeof(value));
+    return value;
+}
+
+static void create_resources(const DrawCapture& capture, ReplayResources* resources) {
+    ResourceManager* rm = ResourceManager::get();
+    for (const DrawCapture::Shader& shader : capture.shaders) {
+        resources->shaders.push_back(rm->create_shader((char*)shader.code.data(), (uint32_t)shader.code.size(), shader.stage));
+    }
+    for (const DrawCapture::PipelineLayout& layout : capture.pipeline_layouts) {
+        std::vector<VkDescriptorSetLayoutBinding> bindings[Limits::MAX_DESCRIPTOR_SET_COUNT];
+        PipelineLayoutInfo info{};
+        for (uint32_t set = 0; set < Limits::MAX_DESCRIPTOR_SET_COUNT; set++) {
+            for (const DrawCapture::DescriptorBinding& binding : layout.sets[set]) {
+                bindings[set].push_back({
+                    .binding = binding.binding,
+                    .descriptorType = binding.type,
+                    .descriptorCount = binding.count,
+                    .stageFlags = binding.stages,
+                });
+            }
+            info.set_binding_infos[set] = bindings[set].data();
+            info.set_binding_count[set] = (uint32_t)bindings[set].size();
+            info.max_descriptor_set_counts[set] = layout.max_descriptor_set_counts[set];
+        }
+        resources->pipeline_layouts.push_back(rm->create_pipeline_layout(info));
+    }
+    for (const DrawCapture::RenderPassLayout& layout : capture.render_pass_layouts) {
+        RenderPassLayoutInfo info{};
+        for (VkFormat format : layout.formats) {
+            info.attachments[info.attachent_count++].format = format;
+        }
+        for (uint32_t attachment : layout.color_attachments) {
+            info.subpass.color_attachments[info.subpass.color_attachment_count++] = attachment;
+        }
+        if (layout.depth_attachment != UINT32_MAX) {
+            info.subpass.depth_attachment = layout.depth_attachment;
+        }
+        resources->render_pass_layouts.push_back(rm->create_render_pass_layout(info));
+    }
+    for (const DrawCapture::RenderPass& render_pass : capture.render_passes) {
+        RenderPassInfo info{};
+        info.layout = resources->render_pass_layouts[render_pass.layout - 1];
+        for (RenderPassAttachmentInfo attachment : render_pass.attachments) {
+            // There is no swapchain to present to.
+            if (attachment.final_layout == VK_IMAGE_LAYOUT_PRESENT_SRC_KHR) {
+                attachment.final_layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+            }
+            info.attachments[info.attachent_count++] = attachment;
+        }
+        resources->render_passes.push_back(rm->create_render_pass(info));
+    }
+    for (const DrawCapture::Pipeline& pipeline : capture.pipelines) {
+        std::vector<Handle<Shader>> shaders;
+        for (uint32_t shader : pipeline.shaders) {
+            shaders.push_back(resources->shaders[shader - 1]);
+        }
+        const DrawCapture::PipelineState& state = pipeline.state;
+        PipelineInfo info = {
+            .shaders = shaders.data(),
+            .shader_count = (uint32_t)shaders.size(),
+            .primitive_topology = state.primitive_topology,
+            .attributes = (VkVertexInputAttributeDescription*)pipeline.attributes.data(),
+            .attribute_count = (uint32_t)pipeline.attributes.size(),
+            .bindings = (VkVertexInputBindingDescription*)pipeline.bindings.data(),
+            .binding_count = (uint32_t)pipeline.bindings.size(),
+            .cull_mode = state.cull_mode,
+            .front_face = state.front_face,
+            .depth_bias_constant_factor = state.depth_bias_constant_factor,
+            .depth_bias_slope_factor = state.depth_bias_slope_factor,
+            .depth_test_enabled = state.depth_test_enabled != VK_FALSE,
+            .depth_write_enabled = state.depth_write_enabled != VK_FALSE,
+            .depth_clamp_enabled = state.depth_clamp_enabled != VK_FALSE,
+            .depth_compare_op = state.depth_compare_op,
+            .blend_state = state.blend_state,
+            .render_pass_layout = resources->render_pass_layouts[state.render_pass_layout - 1],
+            .pipeline_layout = resources->pipeline_layouts[state.pipeline_layout - 1],
+        };
+        resources->pipelines.push_back(rm->create_pipeline(info));
+    }
+    std::vector<uint8_t> zeros;
+    for (const DrawCapture::Buffer& buffer : capture.buffers) {
+        if (buffer.data.empty()) {
+            zeros.assign(buffer.size, 0);
+        }
+        const std::vector<uint8_t>& data = buffer.data.empty() ? zeros : buffer.data;
+        resources->buffers.push_back(rm->create_buffer({
+            .size = buffer.size,
+            .usage = buffer.usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            .initial_data = (void*)data.data(),
+            .initial_data_size = data.size(),
+        }));
+    }
+    for (const DrawCapture::Texture& texture : capture.textures) {
+        bool is_depth = (derive_aspect(texture.format) & VK_IMAGE_ASPECT_DEPTH_BIT) != 0;
+        resources->textures.push_back(rm->create_texture({
+            .extent = texture.extent,
+            .format = texture.format,
+            .image_usage = VK_IMAGE_USAGE_SAMPLED_BIT,
+            .array_layer_count = texture.array_layer_count,
+            .mip_level_count = texture.mip_level_count,
+            .flags = texture.flags,
+            .initial_layout = is_depth ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED,
+        }));
+    }
+    for (const SamplerInfo& sampler : capture.samplers) {
+        resources->samplers.push_back(rm->create_sampler(sampler));
+    }
+    zeros.assign(fallback_buffer_size, 0);
+    resources->fallback_buffer = rm->create_buffer({
+        .size = fallback_buffer_size,
+        .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        .initial_data = zeros.data(),
+        .initial_data_size = zeros.size(),
+    });
+    resources->fallback_texture = rm->create_texture({
+        .extent = { 1, 1, 1, },
+        .format = VK_FORMAT_R8G8B8A8_UNORM,
+        .image_usage = VK_IMAGE_USAGE_SAMPLED_BIT,
+    });
+    resources->fallback_sampler = rm->create_sampler({});
+    for (const DrawCapture::DescriptorSet& set : capture.descriptor_sets) {
+        Handle<DescriptorSet> handle = rm->create_descriptor_set(
+            resources->pipeline_layouts[set.pipeline_layout - 1],
+            set.set_index
+        );
+        resources->descriptor_sets.push_back(handle);
+        // Descriptors of a binding are recorded next to each other.
+        for (uint32_t first = 0; first < set.descriptors.size();) {
+            uint32_t last = first;
+            while (last < set.descriptors.size() && set.descriptors[last].binding == set.descriptors[first].binding) {
+                last++;
+            }
+            std::vector<BufferDescriptorInfo> buffer_infos;
+            std::vector<TextureDescriptorInfo> texture_infos;
+            DescriptorSetUpdateRequest request = {
+                .binding = set.descriptors[first].binding,
+                .descriptor_type = set.descriptors[first].type,
+            };
+            for (uint32_t i = first; i < last; i++) {
+                const DrawCapture::Descriptor& descriptor = set.descriptors[i];
+                if (is_buffer_descriptor(request.descriptor_type)) {
+                    buffer_infos.push_back(descriptor.buffer != 0
+                        ? BufferDescriptorInfo{ resources->buffers[descriptor.buffer - 1], descriptor.offset, descriptor.range, }
+                        : BufferDescriptorInfo{ resources->fallback_buffer, 0, VK_WHOLE_SIZE, });
+                } else {
+                    texture_infos.push_back({
+                        .texture = descriptor.texture != 0 ? resources->textures[descriptor.texture - 1] : resources->fallback_texture,
+                        .sampler = descriptor.sampler != 0 ? resources->samplers[descriptor.sampler - 1] : resources->fallback_sampler,
+                    });
+                }
+            }
+            if (is_buffer_descriptor(request.descriptor_type)) {
+                request.buffer_infos = make_const_span(buffer_infos.data(), buffer_infos.size());
+            } else {
+                request.texture_infos = make_const_span(texture_infos.data(), texture_infos.size());
+            }
+            rm->update_descriptor_set(handle, { request });
+            first = last;
+        }
+    }
+}
+
+// Returns lookups per second.
+template<typename T, typename LambdaT>
+static double measure_lookups(const std::vector<Handle<T>>& handles, uint64_t* sink, LambdaT&& lookup) {
+    if (handles.empty()) {
+        return 0.0;
+    }
+    uint32_t round_count = lookup_count / (uint32_t)handles.size() + 1;
+    uint64_t sum = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (uint32_t round = 0; round < round_count; round++) {
+        for (Handle<T> handle : handles) {
+            sum += lookup(handle);
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    *sink += sum;
+    return (double)round_count * handles.size() / std::chrono::duration<double>(end - start).count();
+}
+
+static void benchmark_lookups(const ReplayResources& resources) {
+    ResourceManager* rm = ResourceManager::get();
+    // Keeps the lookups from being optimized away.
+    uint64_t sink = 0;
+    printf("%-24s %16s %16s\n", "lookup", "by value (M/s)", "hot path (M/s)");
+    auto print_row = [](const char* name, double by_value, double hot_path) {
+        printf("%-24s %16.1f %16.1f\n", name, by_value * 1e-6, hot_path * 1e-6);
+    };
+    print_row(
+        "buffer",
+        measure_lookups(resources.buffers, &sink, [&](Handle<Buffer> h) { return to_u64(rm->get_buffer(h).buffer); }),
+        measure_lookups(resources.buffers, &sink, [&](Handle<Buffer> h) { return to_u64(rm->get_vk_buffer(h)); })
+    );
+    print_row(
+        "texture",
+        measure_lookups(resources.textures, &sink, [&](Handle<Texture> h) { return to_u64(rm->get_texture(h).image_view); }),
+        measure_lookups(resources.textures, &sink, [&](Handle<Texture> h) { return to_u64(rm->get_vk_image_view(h)); })
+    );
+    print_row(
+        "descriptor set",
+        measure_lookups(resources.descriptor_sets, &sink, [&](Handle<DescriptorSet> h) {
+            return to_u64(rm->get_descriptor_set(h).descriptor_set);
+        }),
+        measure_lookups(resources.descriptor_sets, &sink, [&](Handle<DescriptorSet> h) {
+            return to_u64(rm->get_vk_descriptor_set(h));
+        })
+    );
+    // What DrawStream::bind_pipeline resolves.
+    print_row(
+        "pipeline + layout",
+        measure_lookups(resources.pipelines, &sink, [&](Handle<Pipeline> h) {
+            Pipeline pipeline = rm->get_pipeline(h);
+            return to_u64(pipeline.pipeline) ^ to_u64(rm->get_pipeline_layout(pipeline.pipeline_layout).pipeline_layout);
+        }),
+        measure_lookups(resources.pipelines, &sink, [&](Handle<Pipeline> h) {
+            return to_u64(rm->get_vk_pipeline(h)) ^ to_u64(rm->get_vk_pipeline_layout(h));
+        })
+    );
+    print_row(
+        "render pass layout",
+        measure_lookups(resources.render_pass_layouts, &sink, [&](Handle<RenderPassLayout> h) {
+            return to_u64(rm->get_render_pass_layout(h).render_pass);
+        }),
+        measure_lookups(resources.render_pass_layouts, &sink, [&](Handle<RenderPassLayout> h) {
+            return to_u64(rm->get_vk_render_pass(h));
+        })
+    );
+    if (sink == 0) {
+        printf("\n");
+    }
+}
+
+// Streams hold capture ids, returns false if one of them can't be resolved.
+static bool patch_stream(const ReplayResources& resources, std::vector<uint8_t>* stream) {
+    ResourceManager* rm = ResourceManager::get();
+    bool is_resolved = true;
+    DrawStream::remap_handles(stream->data(), stream->size(), [&](DrawStream::HandleType type, uint64_t id) {
+        if (id == 0) {
+            is_resolved &= type == DrawStream::HandleType::BUFFER;
+            return (uint64_t)0;
+        }
+        switch (type) {
+        case DrawStream::HandleType::PIPELINE:
+            return to_u64(rm->get_vk_pipeline(resources.pipelines[id - 1]));
+        case DrawStream::HandleType::PIPELINE_LAYOUT:
+            return to_u64(rm->get_pipeline_layout(resources.pipeline_layouts[id - 1]).pipeline_layout);
+        case DrawStream::HandleType::DESCRIPTOR_SET:
+            return to_u64(rm->get_vk_descriptor_set(resources.descriptor_sets[id - 1]));
+        case DrawStream::HandleType::BUFFER:
+            return to_u64(rm->get_vk_buffer(resources.buffers[id - 1]));
+        }
+        return (uint64_t)0;
+    });
+    return is_resolved;
+}
+
+static bool create_passes(
+    const DrawCapture& capture,
+    const ReplayResources& resources,
+    std::vector<VkClearValue>* clear_values,
+    std::vector<ReplayPass>* passes
+) {
+    ResourceManager* rm = ResourceManager::get();
+    uint32_t clear_value_count = 0;
+    for (const DrawCapture::Pass& captured : capture.passes) {
+        clear_value_count += (uint32_t)captured.clear_values.size();
+    }
+    // Passes point into it.
+    clear_values->reserve(clear_value_count);
+    for (const DrawCapture::Pass& captured : capture.passes) {
+        ReplayPass pass{};
+        pass.name = captured.name.data();
+        const DrawCapture::RenderPass& render_pass = capture.render_passes[captured.render_pass - 1];
+        const DrawCapture::RenderPassLayout& layout = capture.render_pass_layouts[render_pass.layout - 1];
+        VkExtent2D extent = {
+            .width = captured.render_area.offset.x + captured.render_area.extent.width,
+            .height = captured.render_area.offset.y + captured.render_area.extent.height,
+        };
+        pass.framebuffer_info.layout = resources.render_pass_layouts[render_pass.layout - 1];
+        pass.framebuffer_info.extent = extent;
+        for (uint32_t i = 0; i < layout.formats.size(); i++) {
+            bool is_depth = (derive_aspect(layout.formats[i]) & VK_IMAGE_ASPECT_DEPTH_BIT) != 0;
+            VkImageLayout final_layout = render_pass.attachments[i].final_layout;
+            // Attachments start and end in the final layout, see ResourceManager::create_render_pass.
+            if (final_layout == VK_IMAGE_LAYOUT_PRESENT_SRC_KHR) {
+                final_layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+            }
+            pass.framebuffer_info.attachments[pass.framebuffer_info.attachment_count++] = rm->create_texture({
+                .extent = { extent.width, extent.height, 1, },
+                .format = layout.formats[i],
+                .image_usage = is_depth ? VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT : VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+                .initial_layout = final_layout,
+            });
+        }
+        const VkClearValue* pass_clear_values = clear_values->data() + clear_values->size();
+        clear_values->insert(clear_values->end(), captured.clear_values.begin(), captured.clear_values.end());
+        pass.info = {
+            .render_pass = resources.render_passes[captured.render_pass - 1],
+            .render_area = captured.render_area,
+            .global_ds = captured.global_ds != 0
+                ? resources.descriptor_sets[captured.global_ds - 1]
+                : Handle<DescriptorSet>::null(),
+            .clear_values = make_const_span(pass_clear_values, captured.clear_values.size()),
+            .instance_buffer = captured.instance_buffer != 0
+                ? resources.buffers[captured.instance_buffer - 1]
+                : Handle<Buffer>::null(),
+            .instance_buffer_offset = captured.instance_buffer_offset,
+        };
+        pass.streams = captured.streams;
+        for (std::vector<uint8_t>& stream : pass.streams) {
+            pass.stream_size += stream.size();
+            if (!patch_stream(resources, &stream)) {
+                fprintf(stderr, "Pass %s references resources missing from the capture.\n", pass.name);
+                return false;
+            }
+        }
+        pass.indirect_commands.resize(pass.streams.size());
+        if (captured.uses_indirect_commands) {
+            for (uint32_t i = 0; i < pass.streams.size(); i++) {
+                if (pass.streams[i].empty()) {
+                    continue;
+                }
+                DrawStream::Header header;
+                memcpy(&header, pass.streams[i].data(), sizeof(header));
+                uint8_t* mapped = nullptr;
+                Handle<Buffer> buffer = rm->create_buffer(
+                    {
+                        .size = header.draw_count * sizeof(VkDrawIndexedIndirectCommand),
+                        .usage = VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                        .map = BufferMap::PERSISTENTLY_MAPPED,
+                    },
+                    &mapped
+                );
+                pass.indirect_commands[i] = {
+                    .buffer = buffer,
+                    .offset = 0,
+                    .mapped = mapped,
+                    .capacity = header.draw_count,
+                };
+            }
+        }
+        passes->push_back(std::move(pass));
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: Replay <capture> [iteration count]\n");
+        return 1;
+    }
+    uint32_t iteration_count = argc > 2 ? (uint32_t)atoi(argv[2]) : 100;
+    DrawCapture capture;
+    if (!capture.read(argv[1])) {
+        fprintf(stderr, "Unable to read draw capture %s.\n", argv[1]);
+        return 1;
+    }
+
+    Context* context = new Context();
+    context->init(nullptr);
+    context->set_frame_context_count(1);
+    ResourceManager* rm = ResourceManager::get();
+    VkInstance instance;
+    VkPhysicalDevice gpu;
+    VkDevice device;
+    VkQueue queue;
+    uint32_t queue_index;
+    VkDescriptorPool descriptor_pool;
+    context->get_vulkans_guts(&instance, &gpu, &device, &queue, &queue_index, &descriptor_pool);
+
+    ReplayResources resources;
+    std::vector<VkClearValue> clear_values;
+    std::vector<ReplayPass> passes;
+    create_resources(capture, &resources);
+    if (!create_passes(capture, resources, &clear_values, &passes)) {
+        return 1;
+    }
+    rm->commit();
+    context->wait_queue_idle();
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(gpu, &properties);
+    uint32_t queue_family_count;
+    vkGetPhysicalDeviceQueueFamilyProperties(gpu, &queue_family_count, nullptr);
+    std::vector<VkQueueFamilyProperties> queue_families(queue_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(gpu, &queue_family_count, queue_families.data());
+    bool has_timestamps = queue_families[queue_index].timestampValidBits != 0;
+    uint32_t query_count = 2 * (uint32_t)passes.size();
+    VkQueryPool query_pool = VK_NULL_HANDLE;
+    if (has_timestamps && query_count != 0) {
+        VkQueryPoolCreateInfo query_pool_info{ VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+        query_pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        query_pool_info.queryCount = query_count;
+        VK_CHECK(vkCreateQueryPool(device, &query_pool_info, nullptr, &query_pool), "Unable to create query pool.");
+    }
+
+    CmdPool* cmd_pool;
+    context->create_cmd_pool(&cmd_pool);
+    std::vector<CommandBuffer*> secondaries;
+    std::vector<uint64_t> timestamps(query_count);
+    for (uint32_t iteration = 0; iteration < iteration_count; iteration++) {
+        context->begin_frame();
+        rm->next_frame();
+        cmd_pool->next_frame();
+        CommandBuffer* cmd = context->acquire_command_buffer();
+        VkCommandBuffer vk_cmd = cmd->get_vulkan_handle();
+        if (query_pool != VK_NULL_HANDLE) {
+            vkCmdResetQueryPool(vk_cmd, query_pool, 0, query_count);
+        }
+        for (uint32_t pass_index = 0; pass_index < passes.size(); pass_index++) {
+            ReplayPass& pass = passes[pass_index];
+            pass.info.framebuffer = context->acquire_framebuffer(pass.framebuffer_info);
+            secondaries.clear();
+            for (uint32_t i = 0; i < pass.streams.size(); i++) {
+                DrawPassInfo info = pass.info;
+                info.stream = make_const_span(pass.streams[i].data(), pass.streams[i].size());
+                info.indirect_commands = pass.indirect_commands[i];
+                info.stats = iteration == 0 ? &pass.stats : nullptr;
+                CommandBuffer* secondary = cmd_pool->allocate_secondary(info.render_pass, info.framebuffer);
+                auto start = std::chrono::high_resolution_clock::now();
+                secondary->decode_stream_secondary(info);
+                auto end = std::chrono::high_resolution_clock::now();
+                pass.decode_seconds += std::chrono::duration<double>(end - start).count();
+                secondary->end();
+                secondaries.push_back(secondary);
+            }
+            if (query_pool != VK_NULL_HANDLE) {
+                vkCmdWriteTimestamp(vk_cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, query_pool, 2 * pass_index);
+            }
+            cmd->begin_secondary_pass(pass.info);
+            cmd->execute_secondaries(make_const_span(secondaries.data(), secondaries.size()));
+            cmd->end_render_pass();
+            if (query_pool != VK_NULL_HANDLE) {
+                vkCmdWriteTimestamp(vk_cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, query_pool, 2 * pass_index + 1);
+            }
+        }
+        rm->commit();
+        context->submit(cmd);
+        context->end_frame();
+        // Keeps iterations from overlapping on the GPU, so pass timestamps are not skewed.
+        context->wait_queue_idle();
+        if (query_pool != VK_NULL_HANDLE) {
+            vkGetQueryPoolResults(
+                device,
+                query_pool,
+                0,
+                query_count,
+                timestamps.size() * sizeof(uint64_t),
+                timestamps.data(),
+                sizeof(uint64_t),
+                VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT
+            );
+            for (uint32_t i = 0; i < passes.size(); i++) {
+                uint64_t ticks = timestamps[2 * i + 1] - timestamps[2 * i];
+                passes[i].gpu_seconds += ticks * (double)properties.limits.timestampPeriod * 1e-9;
+            }
+        }
+    }
+
+    printf("%s, %u iterations\n", properties.deviceName, iteration_count);
+    printf(
+        "%-24s %8s %8s %12s %12s %12s %12s\n",
+        "pass",
+        "draws",
+        "commands",
+        "bytes/draw",
+        "decode (us)",
+        "ns/draw",
+        "gpu (us)"
+    );
+    auto print_row = [&](
+        const char* name,
+        uint32_t draws,
+        uint32_t commands,
+        uint64_t stream_size,
+        double decode_seconds,
+        double gpu_seconds
+    ) {
+        double decode_us = decode_seconds / iteration_count * 1e6;
+        printf(
+            "%-24s %8u %8u %12.1f %12.2f %12.1f ",
+            name,
+            draws,
+            commands,
+            draws != 0 ? (double)stream_size / draws : 0.0,
+            decode_us,
+            draws != 0 ? decode_us * 1e3 / draws : 0.0
+        );
+        if (query_pool != VK_NULL_HANDLE) {
+            printf("%12.2f\n", gpu_seconds / iteration_count * 1e6);
+        } else {
+            printf("%12s\n", "n/a");
+        }
+    };
+    ReplayPass total{};
+    for (const ReplayPass& pass : passes) {
+        print_row(pass.name, pass.stats.draws, pass.stats.draw_commands, pass.stream_size, pass.decode_seconds, pass.gpu_seconds);
+        total.stats.add(pass.stats);
+        total.stream_size += pass.stream_size;
+        total.decode_seconds += pass.decode_seconds;
+        total.gpu_seconds += pass.gpu_seconds;
+    }
+    print_row("total", total.stats.draws, total.stats.draw_commands, total.stream_size, total.decode_seconds, total.gpu_seconds);
+    if (query_pool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(device, query_pool, nullptr);
+    }
+    printf("\n");
+    benchmark_lookups(resources);
+    context->destroy_cmd_pool(cmd_pool);
+    delete context;
+    return 0;
+}
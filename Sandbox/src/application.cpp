@@ -26,7 +26,9 @@ void traverse_node(
     const tinygltf::Model& model,
     const tinygltf::Node& node,
     const glm::mat4& parent_to_world,
-    FixedSizeAllocator* transforms,
+    ObjectPool* transforms,
+    const uint32_t* mesh_slots,
+    glm::vec3* mesh_positions,
     uint64_t alignment
 ) {
     glm::mat4 local_to_world = glm::mat4(1.0f);
@@ -62,30 +64,35 @@ void traverse_node(
     }
     local_to_world = parent_to_world * local_to_world;
     if (node.mesh >= 0) {
-        ModelUniform* uniform = (ModelUniform*)transforms->get_mapped_ptr(node.mesh);
+        ModelUniform* uniform = (ModelUniform*)transforms->get_mapped_ptr(mesh_slots[node.mesh]);
         uniform->transform = local_to_world;
         uniform->inverse_transpose_transform = glm::transpose(glm::affineInverse(local_to_world));
+        mesh_positions[node.mesh] = glm::vec3(local_to_world[3]);
     }
     for (const auto& child : node.children) {
-        traverse_node(model, model.nodes[child], local_to_world, transforms, alignment);
+        traverse_node(model, model.nodes[child], local_to_world, transforms, mesh_slots, mesh_positions, alignment);
     }
 }
 
 void precalculate_transforms(
     const tinygltf::Model& model,
-    FixedSizeAllocator* transforms,
+    ObjectPool* transforms,
+    const uint32_t* mesh_slots,
+    glm::vec3* mesh_positions,
     uint64_t alignment
 ) {
     for (auto& scene : model.scenes) {
         for (auto& node : scene.nodes) {
             glm::mat4 local_to_world = glm::mat4(1.0f);
-            traverse_node(model, model.nodes[node], local_to_world, transforms, alignment);
+            traverse_node(model, model.nodes[node], local_to_world, transforms, mesh_slots, mesh_positions, alignment);
         }
     }
 }
 
 void Application::init() {
     resource_manager = Morpho::Vulkan::ResourceManager::get();
+    uint32_t hardware_thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    Morpho::JobSystem::init(&job_system, hardware_thread_count - 1);
     Morpho::FramePool<Morpho::DrawStream*>::init(
         &draw_stream_pool,
         {
@@ -218,6 +225,22 @@ void Application::init() {
     bindings[2] = { 2, sizeof(float) * 2, VK_VERTEX_INPUT_RATE_VERTEX, };
     bindings[3] = { 3, sizeof(float) * 4, VK_VERTEX_INPUT_RATE_VERTEX, };
     Morpho::Handle<Shader> shaders[2];
+    // Collected and created at once below. Light shading compiles lazily on top, meanwhile it falls back to no light.
+    struct QueuedPipeline {
+        PipelineInfo info;
+        Morpho::Handle<Shader> shaders[2];
+        Morpho::Handle<Pipeline>* pipeline;
+        Morpho::Handle<Pipeline>* fallback;
+    };
+    std::vector<QueuedPipeline> queued_pipelines;
+    auto add_pipeline = [&](Morpho::Handle<Pipeline>* pipeline, Morpho::Handle<Pipeline>* fallback) {
+        queued_pipelines.push_back({
+            .info = pipeline_info,
+            .shaders = { shaders[0], shaders[1] },
+            .pipeline = pipeline,
+            .fallback = fallback,
+        });
+    };
     pipeline_info.attributes = attributes;
     pipeline_info.bindings = bindings;
     pipeline_info.shaders = shaders;
@@ -250,27 +273,27 @@ void Application::init() {
         pipeline_info.shaders[0] = gltf_spot_light_vertex_shader;
         pipeline_info.shaders[1] = gltf_spot_light_fragment_shader;
         pipeline_info.cull_mode = VK_CULL_MODE_BACK_BIT;
-        spotlight_pipeline = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&spotlight_pipeline, &no_light_pipeline);
         pipeline_info.cull_mode = VK_CULL_MODE_NONE;
-        spotlight_pipeline_double_sided = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&spotlight_pipeline_double_sided, &no_light_pipeline_double_sided);
     }
     {
         // Point light shading.
         pipeline_info.shaders[0] = gltf_point_light_vertex_shader;
         pipeline_info.shaders[1] = gltf_point_light_fragment_shader;
         pipeline_info.cull_mode = VK_CULL_MODE_BACK_BIT;
-        pointlight_pipeline = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&pointlight_pipeline, &no_light_pipeline);
         pipeline_info.cull_mode = VK_CULL_MODE_NONE;
-        pointlight_pipeline_double_sided = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&pointlight_pipeline_double_sided, &no_light_pipeline_double_sided);
     }
     {
         // Directional light shading.
         pipeline_info.shaders[0] = gltf_directional_light_vertex_shader;
         pipeline_info.shaders[1] = gltf_directional_light_fragment_shader;
         pipeline_info.cull_mode = VK_CULL_MODE_BACK_BIT;
-        directional_light_pipeline = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&directional_light_pipeline, &no_light_pipeline);
         pipeline_info.cull_mode = VK_CULL_MODE_NONE;
-        directional_light_pipeline_double_sided = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&directional_light_pipeline_double_sided, &no_light_pipeline_double_sided);
     }
     pipeline_info.blend_state = no_blend;
     {
@@ -278,18 +301,20 @@ void Application::init() {
         pipeline_info.shaders[0] = no_light_vertex_shader;
         pipeline_info.shaders[1] = no_light_fragment_shader;
         pipeline_info.cull_mode = VK_CULL_MODE_BACK_BIT;
-        no_light_pipeline = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&no_light_pipeline, nullptr);
         pipeline_info.cull_mode = VK_CULL_MODE_NONE;
-        no_light_pipeline_double_sided = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&no_light_pipeline_double_sided, nullptr);
     }
     {
-        // Z prepass.
+        // Z prepass. Depth only streams bind positions alone, same for the depth pass below.
+        pipeline_info.attribute_count = 1;
+        pipeline_info.binding_count = 1;
         pipeline_info.shader_count = 1;
         pipeline_info.shaders[0] = z_prepass_shader;
         pipeline_info.cull_mode = VK_CULL_MODE_BACK_BIT;
-        z_prepass_pipeline = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&z_prepass_pipeline, nullptr);
         pipeline_info.cull_mode = VK_CULL_MODE_NONE;
-        z_prepass_pipeline_double_sided = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&z_prepass_pipeline_double_sided, nullptr);
     }
     {
         // Depth pass.
@@ -299,18 +324,18 @@ void Application::init() {
         pipeline_info.shaders[0] = gltf_depth_pass_vertex_shader;
         pipeline_info.cull_mode = VK_CULL_MODE_BACK_BIT;
         pipeline_info.render_pass_layout = depth_pass_layout;
-        depth_pass_pipeline_ccw = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&depth_pass_pipeline_ccw, nullptr);
         pipeline_info.depth_clamp_enabled = true;
-        depth_pass_pipeline_ccw_depth_clamp = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&depth_pass_pipeline_ccw_depth_clamp, nullptr);
         pipeline_info.cull_mode = VK_CULL_MODE_NONE;
-        depth_pass_pipeline_ccw_depth_clamp_double_sided = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&depth_pass_pipeline_ccw_depth_clamp_double_sided, nullptr);
         pipeline_info.depth_clamp_enabled = false;
-        depth_pass_pipeline_ccw_double_sided = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&depth_pass_pipeline_ccw_double_sided, nullptr);
         pipeline_info.front_face = VK_FRONT_FACE_CLOCKWISE;
         pipeline_info.cull_mode = VK_CULL_MODE_BACK_BIT;
-        depth_pass_pipeline_cw = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&depth_pass_pipeline_cw, nullptr);
         pipeline_info.cull_mode = VK_CULL_MODE_NONE;
-        depth_pass_pipeline_cw_double_sided = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&depth_pass_pipeline_cw_double_sided, nullptr);
         pipeline_info.depth_clamp_enabled = false;
     }
 
@@ -327,7 +352,31 @@ void Application::init() {
         pipeline_info.shaders[1] = shadow_map_spot_light_fragment_shader;
         pipeline_info.cull_mode = VK_CULL_MODE_BACK_BIT;
         pipeline_info.pipeline_layout = light_pipeline_layout;
-        shadow_map_visualization_pipeline = resource_manager->create_pipeline(pipeline_info);
+        add_pipeline(&shadow_map_visualization_pipeline, nullptr);
+    }
+
+    std::vector<PipelineInfo> batch_infos;
+    for (QueuedPipeline& queued : queued_pipelines) {
+        queued.info.shaders = queued.shaders;
+        if (queued.fallback == nullptr) {
+            batch_infos.push_back(queued.info);
+        }
+    }
+    std::vector<Morpho::Handle<Pipeline>> batch_pipelines(batch_infos.size());
+    resource_manager->create_pipelines(
+        Morpho::Span<const PipelineInfo>(batch_infos.data(), (uint32_t)batch_infos.size()),
+        batch_pipelines.data()
+    );
+    for (uint32_t i = 0, batch_index = 0; i < queued_pipelines.size(); i++) {
+        const QueuedPipeline& queued = queued_pipelines[i];
+        if (queued.fallback == nullptr) {
+            *queued.pipeline = batch_pipelines[batch_index++];
+        }
+    }
+    for (const QueuedPipeline& queued : queued_pipelines) {
+        if (queued.fallback != nullptr) {
+            *queued.pipeline = resource_manager->create_pipeline_lazy(queued.info, *queued.fallback);
+        }
     }
 
     default_sampler = resource_manager->create_sampler({ .max_anisotropy = 4.0f, });
@@ -337,31 +386,7 @@ void Application::init() {
         .max_anisotropy = 4.0f,
     });
 
-    std::vector<VkBufferUsageFlags> buffer_usages(model.buffers.size(), 0);
-    buffers.resize(model.buffers.size());
-    for (auto& mesh : model.meshes) {
-        for (auto& primitive : mesh.primitives) {
-            if (primitive.indices >= 0) {
-                auto buffer_view_index = model.accessors[primitive.indices].bufferView;
-                auto buffer_index = model.bufferViews[buffer_view_index].buffer;
-                buffer_usages[buffer_index] |= VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
-            }
-            for (auto& key_value : primitive.attributes) {
-                auto buffer_view_index = model.accessors[key_value.second].bufferView;
-                auto buffer_index = model.bufferViews[buffer_view_index].buffer;
-                buffer_usages[buffer_index] |= VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-            }
-        }
-    }
-    for (uint32_t i = 0; i < model.buffers.size(); i++) {
-        auto buffer_size = (VkDeviceSize)model.buffers[i].data.size();
-        buffers[i] = resource_manager->create_buffer({
-            .size = buffer_size,
-            .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | buffer_usages[i],
-            .initial_data = model.buffers[i].data.data(),
-            .initial_data_size = buffer_size
-        });
-    }
+    upload_geometry();
     uint32_t white_pixel = std::numeric_limits<uint32_t>::max();
     white_texture = resource_manager->create_texture({
         .extent = { 1, 1, 1 },
@@ -403,24 +428,7 @@ void Application::init() {
         }
     }
 
-    textures.resize(model.textures.size());
-    for (uint32_t i = 0; i < model.textures.size(); i++) {
-        auto& texture = model.textures[i];
-        auto gltf_image = model.images[texture.source];
-        assert(gltf_image.component == 4);
-        auto image_size = (VkDeviceSize)(gltf_image.width * gltf_image.height * gltf_image.component * (gltf_image.bits / 8));
-        VkFormat format = texture_formats[i];
-        uint32_t mip_level_count = std::bit_width((uint32_t)std::max(gltf_image.width, gltf_image.height));
-        textures[i] = resource_manager->create_texture({
-            .extent = { (uint32_t)gltf_image.width, (uint32_t)gltf_image.height, (uint32_t)1 },
-            .format = format,
-            .image_usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-            .mip_level_count = mip_level_count,
-            .initial_data = gltf_image.image.data(),
-            .initial_data_size = image_size,
-            .initial_layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        });
-    }
+    upload_textures(texture_formats);
     samplers.resize(model.samplers.size());
     for (uint32_t i = 0; i < model.samplers.size(); i++) {
         auto gltf_sampler = model.samplers[i];
@@ -435,22 +443,20 @@ void Application::init() {
     }
     const uint64_t alignment = context->get_uniform_buffer_alignment();
     material_descriptor_sets.resize(model.materials.size());
-    material_buffer = resource_manager->create_buffer({
-        .size = FixedSizeAllocator::compute_buffer_size(sizeof(MaterialParameters), model.materials.size(), alignment),
-        .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-        .map = Morpho::Vulkan::BufferMap::PERSISTENTLY_MAPPED,
-    });
-    material_buffer_allocator = FixedSizeAllocator::create({
-        .resource_manager = resource_manager,
-        .buffer = material_buffer,
-        .item_size = sizeof(MaterialParameters),
-        .offset_alignment = alignment,
-        .max_item_count = model.materials.size(),
-    });
+    ObjectPool::init(
+        {
+            .resource_manager = resource_manager,
+            .item_size = sizeof(MaterialParameters),
+            .offset_alignment = alignment,
+        },
+        &material_pool
+    );
+    material_slots.resize(model.materials.size());
     for (uint32_t material_index = 0; material_index < model.materials.size(); material_index++) {
         auto& material = model.materials[material_index];
         material_descriptor_sets[material_index] = resource_manager->create_descriptor_set(light_pipeline_layout, 2);
-        uint64_t offset = material_buffer_allocator.get_offset(material_index);
+        uint32_t slot = material_pool.allocate();
+        material_slots[material_index] = slot;
         auto base_color_texture_index = material.pbrMetallicRoughness.baseColorTexture.index;
         auto base_color_texture = base_color_texture_index < 0
             ? white_texture : textures[base_color_texture_index];
@@ -475,7 +481,9 @@ void Application::init() {
             {
                 {
                     .binding = 0, .descriptor_type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-                    .buffer_infos = {{ material_buffer, offset, sizeof(MaterialParameters), }}
+                    .buffer_infos = {{
+                        material_pool.get_buffer(slot), material_pool.get_offset(slot), sizeof(MaterialParameters),
+                    }}
                 },
                 {
                     .binding = 1, .descriptor_type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
@@ -501,7 +509,7 @@ void Application::init() {
         material_parameters.base_color_factor = base_color_factor;
         material_parameters.metalness_factor = material.pbrMetallicRoughness.metallicFactor;
         material_parameters.roughness_factor = material.pbrMetallicRoughness.roughnessFactor;
-        memcpy(material_buffer_allocator.get_mapped_ptr(material_index), &material_parameters, sizeof(material_parameters));
+        memcpy(material_pool.get_mapped_ptr(slot), &material_parameters, sizeof(material_parameters));
     }
 
     globals_buffer = resource_manager->create_buffer({
@@ -534,28 +542,32 @@ void Application::init() {
 
     mesh_descriptor_sets.resize(model.meshes.size());
     
-    mesh_uniforms = resource_manager->create_buffer({
-        .size = FixedSizeAllocator::compute_buffer_size(sizeof(ModelUniform), model.meshes.size(), alignment),
-        .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-        .map = BufferMap::CAN_BE_MAPPED,
-    });
-    mesh_uniforms_allocator = FixedSizeAllocator::create({
-        .resource_manager = resource_manager,
-        .buffer = mesh_uniforms,
-        .item_size = sizeof(ModelUniform),
-        .offset_alignment = alignment,
-        .max_item_count = model.meshes.size()
-    });
-    precalculate_transforms(model, &mesh_uniforms_allocator, alignment);
+    ObjectPool::init(
+        {
+            .resource_manager = resource_manager,
+            .item_size = sizeof(ModelUniform),
+            .offset_alignment = alignment,
+            .map = BufferMap::CAN_BE_MAPPED,
+        },
+        &mesh_uniform_pool
+    );
+    mesh_uniform_slots.resize(model.meshes.size());
+    for (uint32_t mesh_index = 0; mesh_index < model.meshes.size(); mesh_index++) {
+        mesh_uniform_slots[mesh_index] = mesh_uniform_pool.allocate();
+    }
+    mesh_positions.resize(model.meshes.size());
+    precalculate_transforms(model, &mesh_uniform_pool, mesh_uniform_slots.data(), mesh_positions.data(), alignment);
     for (uint32_t mesh_index = 0; mesh_index < model.meshes.size(); mesh_index++) {
         mesh_descriptor_sets[mesh_index] = resource_manager->create_descriptor_set(light_pipeline_layout, 3);
-        uint64_t offset = mesh_index * Morpho::align_up_pow2(sizeof(ModelUniform), alignment);
+        uint32_t slot = mesh_uniform_slots[mesh_index];
         resource_manager->update_descriptor_set(
             mesh_descriptor_sets[mesh_index],
             {
                 {
                     .binding = 0, .descriptor_type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-                    .buffer_infos = {{ mesh_uniforms, offset, sizeof(ModelUniform), }}
+                    .buffer_infos = {{
+                        mesh_uniform_pool.get_buffer(slot), mesh_uniform_pool.get_offset(slot), sizeof(ModelUniform),
+                    }}
                 },
             }
         );
@@ -604,21 +616,61 @@ void Application::init() {
             );
         }
     }
-    UniformBufferBumpAllocator::init(
+    cmd_pools.resize(job_system.get_thread_count());
+    for (uint32_t i = 0; i < cmd_pools.size(); i++) {
+        context->create_cmd_pool(&cmd_pools[i]);
+    }
+    RingBufferAllocator::init(
         {
             .resource_manager = resource_manager,
+            .context = context,
+            .size = 1024 * 1024 * 16,
             .alignment = alignment,
             .frames_in_flight_count = frame_in_flight_count,
         },
         &per_frame_uniforms
     );
+    RingBufferAllocator::init(
+        {
+            .resource_manager = resource_manager,
+            .context = context,
+            .size = 1024 * 1024 * 16,
+            .alignment = 4,
+            .frames_in_flight_count = frame_in_flight_count,
+            .usage = VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+            .thread_count = job_system.get_thread_count(),
+        },
+        &per_frame_indirect_commands
+    );
+    for (const auto& scene : model.scenes) {
+        for (const auto node_index : scene.nodes) {
+            collect_draw_items(model.nodes[node_index]);
+        }
+    }
+    // Retained streams only sort within a segment, so neighbouring items should already share most state.
+    std::sort(draw_items.begin(), draw_items.end(), [this](const DrawItem& lhs, const DrawItem& rhs) {
+        int lhs_material = model.meshes[lhs.mesh_index].primitives[lhs.primitive_index].material;
+        int rhs_material = model.meshes[rhs.mesh_index].primitives[rhs.primitive_index].material;
+        bool lhs_double_sided = model.materials[lhs_material].doubleSided;
+        bool rhs_double_sided = model.materials[rhs_material].doubleSided;
+        if (lhs_double_sided != rhs_double_sided) {
+            return lhs_double_sided < rhs_double_sided;
+        }
+        if (lhs_material != rhs_material) {
+            return lhs_material < rhs_material;
+        }
+        return lhs.mesh_index < rhs.mesh_index;
+    });
 }
 
 void Application::run() {
     init_window();
     initialize_key_map();
-    context->init(window);
+    context->init(window, "pipeline_cache.bin");
     context->set_frame_context_count(frame_in_flight_count);
+    if (capture_path != nullptr) {
+        Morpho::Vulkan::ResourceManager::get()->set_capture_recorder(&capture_recorder);
+    }
     auto swapchain_extent = context->get_swapchain_extent();
     camera = Camera(
         90.0f,
@@ -633,6 +685,10 @@ void Application::run() {
     init();
     init_imgui();
     main_loop();
+    context->wait_queue_idle();
+    if (!context->save_pipeline_cache()) {
+        std::cerr << "Can't save pipeline cache." << std::endl;
+    }
 }
 
 void Application::init_window() {
@@ -766,54 +822,51 @@ void Application::set_graphics_context(Morpho::Vulkan::Context* context) {
     this->context = context;
 }
 
+void Application::set_capture_path(const char* path) {
+    capture_path = path;
+}
+
 void Application::render_frame() {
     context->begin_frame();
     resource_manager->next_frame();
     draw_stream_pool.next_frame();
     per_frame_uniforms.next_frame();
+    per_frame_indirect_commands.next_frame();
     calculate_cascades();
     update_light_uniforms();
+    glm::mat4 view = camera.get_view();
+    is_sort_view_changed = view != sort_view;
+    sort_view = view;
     Morpho::Vulkan::CommandBuffer* cmd = context->acquire_command_buffer();
     if (is_first_update) {
+        // Mipmaps are generated from the uploaded top levels.
+        resource_manager->wait_upload(texture_upload_ticket);
         initialize_static_resources(cmd);
         is_first_update = false;
     }
     begin_frame(cmd);
     cmd->bind_descriptor_set(global_descriptor_sets[frame_index]);
-    render_depth_pass_for_directional_light(cmd);
+    for (uint32_t i = 0; i < cmd_pools.size(); i++) {
+        cmd_pools[i]->next_frame();
+    }
+    draw_passes.clear();
+    draw_chunks.clear();
+    add_depth_passes_for_directional_light();
     for (uint32_t i = 0; i < lights.size(); i++) {
         if (lights[i].light_type == LightType::SpotLight) {
-            render_depth_pass_for_spot_light(cmd, lights[i]);
+            add_depth_pass_for_spot_light(lights[i]);
         }
     }
-    transition_shadow_maps(cmd);
-    Morpho::DrawStream* stream = draw_stream_pool.get_or_add();
-    render_z_prepass(stream);
-    render_color_pass_for_directional_light(stream);
-    for (int i = 0; i < lights.size(); i++) {
-        if (lights[i].light_type == LightType::SpotLight) {
-            render_color_pass_for_spotlight(stream, lights[i]);
-        }
+    uint32_t shadow_pass_count = (uint32_t)draw_passes.size();
+    add_color_pass();
+    record_draw_chunks();
+    if (is_capture_requested) {
+        capture_draw_passes();
+        is_capture_requested = false;
     }
-    auto extent = context->get_swapchain_extent();
-    auto framebuffer = context->acquire_framebuffer(Morpho::Vulkan::FramebufferInfoBuilder()
-        .layout(color_pass_layout)
-        .extent(extent)
-        .attachment(depth_buffer)
-        .attachment(context->get_swapchain_texture())
-        .info()
-    );
-    cmd->decode_stream({
-        .render_pass = color_pass,
-        .framebuffer = framebuffer,
-        .render_area = { .offset = { 0, 0 }, .extent = extent },
-        .global_ds = global_descriptor_sets[frame_index],
-        .clear_values = {
-            {1.0f, 0},
-            {0.0f, 0.0f, 0.0f, 0.0f},
-        },
-        .stream = Morpho::make_const_span(stream->get_stream(), stream->get_size()),
-    });
+    execute_draw_passes(cmd, 0, shadow_pass_count);
+    transition_shadow_maps(cmd);
+    execute_draw_passes(cmd, shadow_pass_count, (uint32_t)draw_passes.size());
     render_gui(cmd);
     cmd->barrier(
         {{
@@ -832,6 +885,9 @@ void Application::render_frame() {
     context->end_frame();
     frames_total++;
     frame_index = frames_total % frame_in_flight_count;
+    if (frames_total == frame_growth_warmup_count) {
+        context->expect_no_frame_growth(true);
+    }
 }
 
 void Application::update_light_uniforms() {
@@ -879,74 +935,268 @@ void Application::update_light_uniforms() {
     }
 }
 
-void Application::render_depth_pass_for_spot_light(
-    Morpho::Vulkan::CommandBuffer* cmd,
-    const Light& light
-) {
+static const VkClearValue depth_pass_clear_values[] = { {1.0f, 0}, {0.0f, 0.0f, 0.0f, 0.0f} };
+static const VkClearValue color_pass_clear_values[] = { {1.0f, 0}, {0.0f, 0.0f, 0.0f, 0.0f} };
+
+void Application::add_depth_pass_for_spot_light(const Light& light) {
     auto extent = context->get_swapchain_extent();
-    Morpho::DrawStream* draw_stream = draw_stream_pool.get_or_add();
     auto framebuffer = context->acquire_framebuffer(Morpho::Vulkan::FramebufferInfoBuilder()
         .layout(depth_pass_layout)
         .extent(extent)
         .attachment(light.shadow_map)
         .info()
     );
-    draw_stream->bind_descriptor_set(light_descriptor_sets[light.descriptor_set_start_index + frame_index], 1);
-    draw_model(model, draw_stream, depth_pass_pipeline_ccw, depth_pass_pipeline_ccw_double_sided);
-    cmd->decode_stream({
+    uint32_t pass_index = add_draw_pass("Spot light shadow", {
         .render_pass = depth_pass,
         .framebuffer = framebuffer,
         .render_area = { .offset = { 0, 0 }, .extent = extent },
         .global_ds = global_descriptor_sets[frame_index],
-        .clear_values = {
-            {1.0f, 0},
-            {0.0f, 0.0f, 0.0f, 0.0f},
-        },
-        .stream = Morpho::make_const_span(draw_stream->get_stream(), draw_stream->get_size()),
+        .clear_values = Morpho::make_const_span(depth_pass_clear_values, 2),
     });
+    add_draw_chunks(
+        pass_index,
+        Morpho::DrawStream::SortPolicy::STATE,
+        Morpho::DrawStream::depth_only_fields,
+        light_descriptor_sets[light.descriptor_set_start_index + frame_index],
+        depth_pass_pipeline_ccw,
+        depth_pass_pipeline_ccw_double_sided
+    );
 }
 
-void Application::render_depth_pass_for_directional_light(Morpho::Vulkan::CommandBuffer* cmd) {
-   auto extent = context->get_swapchain_extent();
-   extent.width = extent.height = std::max(extent.width, extent.height);
-   cmd->set_viewport({ 0.0f, 0.0f, (float)extent.width, (float)extent.height, 0.0f, 1.0f });
-   cmd->set_scissor({ {0, 0}, extent });
-   for (uint32_t cascade_index = 0; cascade_index < cascade_count; cascade_index++) {
+void Application::add_depth_passes_for_directional_light() {
+    auto extent = context->get_swapchain_extent();
+    extent.width = extent.height = std::max(extent.width, extent.height);
+    for (uint32_t cascade_index = 0; cascade_index < cascade_count; cascade_index++) {
         auto framebuffer = context->acquire_framebuffer(Morpho::Vulkan::FramebufferInfoBuilder()
            .layout(depth_pass_layout)
            .extent(extent)
            .attachment(directional_shadow_maps[cascade_index])
            .info()
         );
-        Morpho::DrawStream* draw_stream = draw_stream_pool.get_or_add();
-        draw_stream->bind_descriptor_set(directional_shadow_map_descriptor_sets[cascade_index * frame_in_flight_count + frame_index], 1);
-        draw_model(model, draw_stream, depth_pass_pipeline_ccw_depth_clamp, depth_pass_pipeline_ccw_depth_clamp_double_sided);
-        cmd->decode_stream({
+        uint32_t pass_index = add_draw_pass("Cascade shadow", {
             .render_pass = depth_pass,
             .framebuffer = framebuffer,
             .render_area = { .offset = { .x = 0, .y = 0 }, .extent = extent },
             .global_ds = global_descriptor_sets[frame_index],
-            .clear_values = { { 1.0f, 0}, {0.0f, 0.0f, 0.0f, 0.0f} },
-            .stream = Morpho::make_const_span(draw_stream->get_stream(), draw_stream->get_size()),
+            .clear_values = Morpho::make_const_span(depth_pass_clear_values, 2),
         });
+        add_draw_chunks(
+            pass_index,
+            Morpho::DrawStream::SortPolicy::STATE,
+            Morpho::DrawStream::depth_only_fields,
+            directional_shadow_map_descriptor_sets[cascade_index * frame_in_flight_count + frame_index],
+            depth_pass_pipeline_ccw_depth_clamp,
+            depth_pass_pipeline_ccw_depth_clamp_double_sided
+        );
    }
 }
 
-void Application::render_z_prepass(Morpho::DrawStream* draw_stream) {
-    draw_model(model, draw_stream, z_prepass_pipeline, z_prepass_pipeline_double_sided);
+void Application::add_color_pass() {
+    auto extent = context->get_swapchain_extent();
+    auto framebuffer = context->acquire_framebuffer(Morpho::Vulkan::FramebufferInfoBuilder()
+        .layout(color_pass_layout)
+        .extent(extent)
+        .attachment(depth_buffer)
+        .attachment(context->get_swapchain_texture())
+        .info()
+    );
+    uint32_t pass_index = add_draw_pass("Color", {
+        .render_pass = color_pass,
+        .framebuffer = framebuffer,
+        .render_area = { .offset = { 0, 0 }, .extent = extent },
+        .global_ds = global_descriptor_sets[frame_index],
+        .clear_values = Morpho::make_const_span(color_pass_clear_values, 2),
+    });
+    // Chunks execute in the order they are added, so the whole prepass lands before any lighting.
+    add_draw_chunks(
+        pass_index,
+        Morpho::DrawStream::SortPolicy::FRONT_TO_BACK,
+        Morpho::DrawStream::depth_only_fields,
+        Morpho::Handle<Morpho::Vulkan::DescriptorSet>::null(),
+        z_prepass_pipeline,
+        z_prepass_pipeline_double_sided
+    );
+    // Depth is already laid down by the prepass, so minimizing rebinds matters more here.
+    add_draw_chunks(
+        pass_index,
+        Morpho::DrawStream::SortPolicy::STATE,
+        Morpho::DrawStream::all_fields,
+        csm_descriptor_sets[frame_index],
+        directional_light_pipeline,
+        directional_light_pipeline_double_sided
+    );
+    for (uint32_t i = 0; i < lights.size(); i++) {
+        if (lights[i].light_type == LightType::SpotLight) {
+            add_draw_chunks(
+                pass_index,
+                Morpho::DrawStream::SortPolicy::STATE,
+                Morpho::DrawStream::all_fields,
+                light_descriptor_sets[lights[i].descriptor_set_start_index + frame_index],
+                spotlight_pipeline,
+                spotlight_pipeline_double_sided
+            );
+        }
+    }
 }
 
-void Application::render_color_pass_for_directional_light(Morpho::DrawStream* stream) {
-    stream->bind_descriptor_set(csm_descriptor_sets[frame_index], 1);
-    draw_model(model, stream, directional_light_pipeline, directional_light_pipeline_double_sided);
+uint32_t Application::add_draw_pass(const char* name, const Morpho::Vulkan::DrawPassInfo& info) {
+    draw_passes.push_back({ .name = name, .info = info, .first_chunk = (uint32_t)draw_chunks.size(), .chunk_count = 0, });
+    return (uint32_t)draw_passes.size() - 1;
 }
 
-void Application::render_color_pass_for_spotlight(
-    Morpho::DrawStream* stream,
-    const Light& light
+void Application::add_draw_chunks(
+    uint32_t pass_index,
+    Morpho::DrawStream::SortPolicy sort_policy,
+    uint32_t stream_fields,
+    Morpho::Handle<Morpho::Vulkan::DescriptorSet> light_ds,
+    Morpho::Handle<Morpho::Vulkan::Pipeline> normal_pipeline,
+    Morpho::Handle<Morpho::Vulkan::Pipeline> double_sided_pipeline
 ) {
-    stream->bind_descriptor_set(light_descriptor_sets[light.descriptor_set_start_index + frame_index], 1);
-    draw_model(model, stream, spotlight_pipeline, spotlight_pipeline_double_sided);
+    // Chunks of a pass must stay contiguous, they are executed as one range of secondaries.
+    assert(pass_index == draw_passes.size() - 1);
+    uint32_t item_count = (uint32_t)draw_items.size();
+    uint32_t chunk_count = std::min(
+        job_system.get_thread_count(),
+        (item_count + min_draws_per_chunk - 1) / min_draws_per_chunk
+    );
+    for (uint32_t i = 0; i < chunk_count; i++) {
+        uint32_t first_item = (uint64_t)item_count * i / chunk_count;
+        uint32_t last_item = (uint64_t)item_count * (i + 1) / chunk_count;
+        // Passes are added in the same order every frame, so chunk index identifies the same draws across frames.
+        uint32_t retained_index = (uint32_t)draw_chunks.size() * frame_in_flight_count + frame_index;
+        if (retained_index >= retained_chunks.size()) {
+            retained_chunks.resize(retained_index + 1);
+        }
+        RetainedChunk& retained = retained_chunks[retained_index];
+        if (
+            retained.sort_policy != sort_policy
+            || retained.light_ds != light_ds
+            || retained.normal_pipeline != normal_pipeline
+            || retained.double_sided_pipeline != double_sided_pipeline
+            || retained.pipeline_generation != resource_manager->get_pipeline_generation()
+            || retained.first_item != first_item
+            || retained.item_count != last_item - first_item
+        ) {
+            retained.stream.invalidate();
+            retained.sort_policy = sort_policy;
+            retained.light_ds = light_ds;
+            retained.normal_pipeline = normal_pipeline;
+            retained.double_sided_pipeline = double_sided_pipeline;
+            retained.pipeline_generation = resource_manager->get_pipeline_generation();
+            retained.first_item = first_item;
+            retained.item_count = last_item - first_item;
+        } else if (sort_policy == Morpho::DrawStream::SortPolicy::FRONT_TO_BACK && is_sort_view_changed) {
+            retained.stream.invalidate();
+        }
+        draw_chunks.push_back({
+            .pass_index = pass_index,
+            .retained_index = retained_index,
+            .sort_policy = sort_policy,
+            .stream_fields = stream_fields,
+            .light_ds = light_ds,
+            .normal_pipeline = normal_pipeline,
+            .double_sided_pipeline = double_sided_pipeline,
+            .first_item = first_item,
+            .item_count = last_item - first_item,
+        });
+    }
+    draw_passes[pass_index].chunk_count += chunk_count;
+}
+
+void Application::record_draw_chunks() {
+    chunk_secondaries.resize(draw_chunks.size());
+    // Chunks go to whichever thread is free, any pool may have to record all of them.
+    for (Morpho::Vulkan::CmdPool* pool : cmd_pools) {
+        pool->reserve_secondaries((uint32_t)draw_chunks.size());
+    }
+    job_system.parallel_for((uint32_t)draw_chunks.size(), this, record_draw_chunk);
+    for (DrawPass& pass : draw_passes) {
+        pass.stats = {};
+        for (uint32_t i = pass.first_chunk; i < pass.first_chunk + pass.chunk_count; i++) {
+            pass.stats.add(draw_chunks[i].stats);
+        }
+    }
+}
+
+void Application::record_draw_chunk(void* user_data, uint32_t chunk_index, uint32_t thread_index) {
+    Application* app = (Application*)user_data;
+    const DrawChunk& chunk = app->draw_chunks[chunk_index];
+    Morpho::DrawStream* stream = &app->retained_chunks[chunk.retained_index].stream;
+    stream->set_fields(chunk.stream_fields);
+    uint32_t segment_item_count = chunk.sort_policy == Morpho::DrawStream::SortPolicy::NONE
+        ? retained_segment_item_count
+        : chunk.item_count;
+    for (uint32_t first = 0, segment = 0; first < chunk.item_count; first += segment_item_count, segment++) {
+        if (stream->is_segment_valid(segment)) {
+            continue;
+        }
+        stream->begin_segment(segment);
+        stream->set_sort_policy(chunk.sort_policy);
+        if (chunk.light_ds != Morpho::Handle<Morpho::Vulkan::DescriptorSet>::null()) {
+            stream->bind_descriptor_set(chunk.light_ds, 1);
+        }
+        uint32_t last = std::min(first + segment_item_count, chunk.item_count);
+        for (uint32_t i = chunk.first_item + first; i < chunk.first_item + last; i++) {
+            const DrawItem& item = app->draw_items[i];
+            stream->set_sort_depth(-(app->sort_view * glm::vec4(app->mesh_positions[item.mesh_index], 1.0f)).z);
+            app->draw_primitive(
+                app->model,
+                item.mesh_index,
+                item.primitive_index,
+                stream,
+                chunk.normal_pipeline,
+                chunk.double_sided_pipeline
+            );
+        }
+        stream->end_segment();
+    }
+    Morpho::Vulkan::DrawPassInfo info = app->draw_passes[chunk.pass_index].info;
+    app->draw_chunks[chunk_index].stats = {};
+    info.stats = &app->draw_chunks[chunk_index].stats;
+    info.stream = Morpho::make_const_span(stream->get_stream(), stream->get_size());
+    // One command per item, decoder batches runs of draws that differ only by draw parameters.
+    UniformAllocation indirect_allocation = app->per_frame_indirect_commands.allocate(
+        chunk.item_count * sizeof(VkDrawIndexedIndirectCommand),
+        thread_index
+    );
+    info.indirect_commands = {
+        .buffer = indirect_allocation.buffer,
+        .offset = indirect_allocation.offset,
+        .mapped = indirect_allocation.ptr,
+        .capacity = chunk.item_count,
+    };
+    Morpho::Vulkan::CommandBuffer* secondary = app->cmd_pools[thread_index]->allocate_secondary(
+        info.render_pass,
+        info.framebuffer
+    );
+    secondary->decode_stream_secondary(info);
+    secondary->end();
+    app->chunk_secondaries[chunk_index] = secondary;
+}
+
+void Application::capture_draw_passes() {
+    capture_recorder.begin_capture();
+    for (const DrawPass& pass : draw_passes) {
+        uint32_t capture_pass = capture_recorder.add_pass(pass.name, pass.info);
+        for (uint32_t i = pass.first_chunk; i < pass.first_chunk + pass.chunk_count; i++) {
+            Morpho::DrawStream* stream = &retained_chunks[draw_chunks[i].retained_index].stream;
+            capture_recorder.add_stream(capture_pass, Morpho::make_const_span(stream->get_stream(), stream->get_size()));
+        }
+    }
+    if (capture_recorder.end_capture(capture_path)) {
+        std::cout << "Captured draw passes to " << capture_path << std::endl;
+    } else {
+        std::cerr << "Unable to write draw capture to " << capture_path << std::endl;
+    }
+}
+
+void Application::execute_draw_passes(Morpho::Vulkan::CommandBuffer* cmd, uint32_t first_pass, uint32_t last_pass) {
+    for (uint32_t i = first_pass; i < last_pass; i++) {
+        const DrawPass& pass = draw_passes[i];
+        cmd->begin_secondary_pass(pass.info);
+        cmd->execute_secondaries(Morpho::make_const_span(chunk_secondaries.data() + pass.first_chunk, pass.chunk_count));
+        cmd->end_render_pass();
+    }
 }
 
 std::vector<char> Application::read_file(const std::string& filename) {
@@ -1194,6 +1444,10 @@ void Application::update(float delta) {
         debug_mode = !debug_mode;
     }
 
+    if (capture_path != nullptr && input.was_key_pressed(Key::F12)) {
+        is_capture_requested = true;
+    }
+
     bool up_pressed = input.is_key_pressed(Key::UP);
     bool down_pressed = input.is_key_pressed(Key::DOWN);
     bool right_pressed = input.is_key_pressed(Key::RIGHT);
@@ -1270,9 +1524,161 @@ void Application::gui(float delta) {
     ImGui::NewFrame();
     static bool show_demo_window = true;
     ImGui::ShowDemoWindow(&show_demo_window);
+    draw_stats_gui();
+    resource_stats_gui();
     ImGui::Render();
 }
 
+// Shows the passes recorded last frame, gui runs before render_frame.
+void Application::draw_stats_gui() {
+    ImGui::Begin("Draw stats");
+    if (ImGui::BeginTable("draw_stats", 11, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+        const char* columns[] = {
+            "Pass", "Draws", "Commands", "Pipelines", "Set 1", "Set 2", "Set 3",
+            "Index buffers", "Vertex buffers", "Triangles", "Avoided binds",
+        };
+        for (const char* column : columns) {
+            ImGui::TableSetupColumn(column);
+        }
+        ImGui::TableHeadersRow();
+        Morpho::Vulkan::DrawStreamStats total{};
+        for (uint32_t i = 0; i <= draw_passes.size(); i++) {
+            bool is_total = i == draw_passes.size();
+            const Morpho::Vulkan::DrawStreamStats& stats = is_total ? total : draw_passes[i].stats;
+            if (!is_total) {
+                total.add(stats);
+            }
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text("%s", is_total ? "Total" : draw_passes[i].name);
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", stats.draws);
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", stats.draw_commands);
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", stats.pipeline_binds);
+            for (uint32_t set = 0; set < Morpho::DrawStream::descriptor_set_count; set++) {
+                ImGui::TableNextColumn();
+                ImGui::Text("%u", stats.descriptor_set_binds[set]);
+            }
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", stats.index_buffer_binds);
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", stats.vertex_buffer_binds);
+            ImGui::TableNextColumn();
+            ImGui::Text("%llu", (unsigned long long)stats.triangles);
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", stats.redundant_binds_avoided);
+        }
+        ImGui::EndTable();
+    }
+    ImGui::End();
+}
+
+void Application::resource_stats_gui() {
+    ImGui::Begin("Resource stats");
+    bool is_refresh_requested = ImGui::Button("Refresh");
+    if (
+        is_refresh_requested
+        || !has_resource_stats
+        || frames_total - resource_stats_frame >= resource_stats_refresh_frame_count
+    ) {
+        resource_stats = resource_manager->get_stats();
+        resource_stats_frame = frames_total;
+        has_resource_stats = true;
+    }
+    const Morpho::Vulkan::ResourceStats& stats = resource_stats;
+    ImGui::Text("Buffer memory: %.2f MiB", stats.buffer_memory_size / (1024.0 * 1024.0));
+    ImGui::Text("Texture memory: %.2f MiB", stats.texture_memory_size / (1024.0 * 1024.0));
+    if (ImGui::BeginTable("resource_stats", 7, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+        const char* columns[] = {
+            "Type", "Live", "Capacity", "Empty chunks", "Occupancy", "Fragmentation", "Arena KiB",
+        };
+        for (const char* column : columns) {
+            ImGui::TableSetupColumn(column);
+        }
+        ImGui::TableHeadersRow();
+        struct Row {
+            const char* name;
+            const Morpho::ArenaStats& stats;
+        };
+        Row rows[] = {
+            { "Buffers", stats.buffers },
+            { "Textures", stats.textures },
+            { "Shaders", stats.shaders },
+            { "Render pass layouts", stats.render_pass_layouts },
+            { "Render passes", stats.render_passes },
+            { "Pipeline layouts", stats.pipeline_layouts },
+            { "Descriptor sets", stats.descriptor_sets },
+            { "Samplers", stats.samplers },
+            { "Pipelines", stats.pipelines },
+        };
+        for (const Row& row : rows) {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text("%s", row.name);
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", row.stats.live_count);
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", row.stats.capacity);
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", row.stats.empty_chunk_count);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f%%", row.stats.occupancy * 100.0f);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f%%", row.stats.fragmentation * 100.0f);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f", row.stats.memory_size / 1024.0);
+        }
+        ImGui::EndTable();
+    }
+    Morpho::Vulkan::GeometryHeapStats geometry_stats = geometry_heap.get_stats();
+    ImGui::Text(
+        "Geometry heap: %u meshes, %u/%u vertices, %u/%u indices, largest free %u/%u",
+        geometry_stats.vertices.allocation_count,
+        geometry_stats.vertices.size - geometry_stats.vertices.free_size,
+        geometry_stats.vertices.size,
+        geometry_stats.indices.size - geometry_stats.indices.free_size,
+        geometry_stats.indices.size,
+        geometry_stats.vertices.largest_free_size,
+        geometry_stats.indices.largest_free_size
+    );
+    ImGui::Text(
+        "Staging: %.2f/%.2f MiB used, peak %.2f MiB, %u ranges",
+        stats.staging.used_size / (1024.0 * 1024.0),
+        stats.staging.size / (1024.0 * 1024.0),
+        stats.staging.peak_used_size / (1024.0 * 1024.0),
+        stats.staging.range_count
+    );
+    ImGui::Text(
+        "Staged: %.2f MiB in %llu allocations, %llu streamed in chunks",
+        stats.staging.allocated_size / (1024.0 * 1024.0),
+        (unsigned long long)stats.staging.allocation_count,
+        (unsigned long long)stats.staging.partial_allocation_count
+    );
+    const Morpho::Vulkan::PipelineCreationStats& pipeline_stats = stats.pipeline_creation;
+    uint32_t cold_count = pipeline_stats.pipeline_count - pipeline_stats.cache_hit_count;
+    ImGui::Text(
+        "Pipelines: %u created, %u compiling, %u cache hits%s, cold %.2f ms avg, warm %.2f ms avg",
+        pipeline_stats.pipeline_count,
+        pipeline_stats.pending_count,
+        pipeline_stats.cache_hit_count,
+        pipeline_stats.has_feedback ? "" : " (no creation feedback)",
+        cold_count != 0 ? pipeline_stats.cold_duration_ns / 1e6 / cold_count : 0.0,
+        pipeline_stats.cache_hit_count != 0 ? pipeline_stats.warm_duration_ns / 1e6 / pipeline_stats.cache_hit_count : 0.0
+    );
+    ImGui::Text(
+        "Shared: %u samplers (%llu reused), %u render passes (%llu reused), %u pipelines (%llu reused)",
+        stats.sampler_dedup.entry_count,
+        (unsigned long long)stats.sampler_dedup.hit_count,
+        stats.render_pass_dedup.entry_count,
+        (unsigned long long)stats.render_pass_dedup.hit_count,
+        stats.pipeline_dedup.entry_count,
+        (unsigned long long)stats.pipeline_dedup.hit_count
+    );
+    ImGui::End();
+}
+
 void Application::render_gui(Morpho::Vulkan::CommandBuffer* cmd) {
     ImDrawData* draw_data = ImGui::GetDrawData();
     auto extent = context->get_swapchain_extent();
@@ -1423,6 +1829,7 @@ void Application::calculate_cascades() {
 bool Application::load_scene(std::filesystem::path file_path) {
     std::string err;
     std::string warn;
+    loader.SetImageLoader(load_image_header, nullptr);
     if (file_path.extension() == ".gltf") {
         loader.LoadASCIIFromFile(&model, &err, &warn, file_path.string());
     } else {
@@ -1438,12 +1845,145 @@ bool Application::load_scene(std::filesystem::path file_path) {
     return true;
 }
 
+// Keeps the encoded image, decoding is left to upload_textures.
+bool Application::load_image_header(
+    tinygltf::Image* image,
+    const int image_index,
+    std::string* err,
+    std::string* warn,
+    int req_width,
+    int req_height,
+    const unsigned char* bytes,
+    int size,
+    void* user_data
+) {
+    int width, height, component_count;
+    if (!stbi_info_from_memory(bytes, size, &width, &height, &component_count)) {
+        if (err) {
+            *err += "Unable to read image " + std::to_string(image_index) + ": " + stbi_failure_reason() + "\n";
+        }
+        return false;
+    }
+    image->width = width;
+    image->height = height;
+    // Always decoded to RGBA8.
+    image->component = 4;
+    image->bits = 8;
+    image->pixel_type = TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE;
+    image->image.assign(bytes, bytes + size);
+    return true;
+}
+
+// Decodes straight into staging memory on the job system, all textures of a wave go in one upload batch.
+void Application::upload_textures(const std::vector<VkFormat>& texture_formats) {
+    auto get_texture_info = [&] (uint32_t texture_index) {
+        const tinygltf::Image& gltf_image = model.images[model.textures[texture_index].source];
+        return Morpho::Vulkan::TextureInfo{
+            .extent = { (uint32_t)gltf_image.width, (uint32_t)gltf_image.height, (uint32_t)1 },
+            .format = texture_formats[texture_index],
+            .image_usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+            .mip_level_count = (uint32_t)std::bit_width((uint32_t)std::max(gltf_image.width, gltf_image.height)),
+            .initial_data_size = (VkDeviceSize)gltf_image.width * gltf_image.height * 4,
+            .initial_layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        };
+    };
+    textures.resize(model.textures.size());
+    for (uint32_t first = 0; first < model.textures.size();) {
+        image_decode_jobs.clear();
+        uint32_t last = first;
+        for (; last < model.textures.size(); last++) {
+            uint8_t* staging_data;
+            bool is_staged = resource_manager->create_texture_staged(
+                get_texture_info(last),
+                &textures[last],
+                &staging_data,
+                &texture_upload_ticket
+            );
+            if (!is_staged) {
+                break;
+            }
+            image_decode_jobs.push_back({
+                .image = &model.images[model.textures[last].source],
+                .image_index = (uint32_t)model.textures[last].source,
+                .staging_data = staging_data,
+                .is_failed = false,
+            });
+        }
+        if (last != first) {
+            job_system.parallel_for((uint32_t)image_decode_jobs.size(), this, decode_image);
+            for (const ImageDecodeJob& job : image_decode_jobs) {
+                if (job.is_failed) {
+                    // Same as a missing texture.
+                    std::cerr << "Unable to decode image " << job.image_index << ", using white instead." << std::endl;
+                    memset(job.staging_data, 0xFF, (size_t)job.image->width * job.image->height * 4);
+                }
+            }
+            resource_manager->submit_uploads();
+            first = last;
+            continue;
+        }
+        if (!resource_manager->is_upload_complete(texture_upload_ticket)) {
+            // Earlier waves hold the staging ring.
+            resource_manager->wait_upload(texture_upload_ticket);
+            continue;
+        }
+        // Doesn't fit in the staging ring at once, streamed from a decoded copy instead.
+        const tinygltf::Image& gltf_image = model.images[model.textures[first].source];
+        int width, height, component_count;
+        stbi_uc* pixels = stbi_load_from_memory(
+            gltf_image.image.data(),
+            (int)gltf_image.image.size(),
+            &width,
+            &height,
+            &component_count,
+            4
+        );
+        Morpho::Vulkan::TextureInfo texture_info = get_texture_info(first);
+        std::vector<uint8_t> fallback_pixels;
+        if (pixels != nullptr && width == gltf_image.width && height == gltf_image.height) {
+            texture_info.initial_data = pixels;
+        } else {
+            std::cerr << "Unable to decode image " << model.textures[first].source << ", using white instead." << std::endl;
+            fallback_pixels.assign(texture_info.initial_data_size, 0xFF);
+            texture_info.initial_data = fallback_pixels.data();
+        }
+        textures[first] = resource_manager->create_texture_async(texture_info, &texture_upload_ticket);
+        stbi_image_free(pixels);
+        first++;
+    }
+    image_decode_jobs.clear();
+    for (tinygltf::Image& gltf_image : model.images) {
+        std::vector<unsigned char>().swap(gltf_image.image);
+    }
+}
+
+// NOTE: called from worker threads.
+void Application::decode_image(void* user_data, uint32_t job_index, uint32_t thread_index) {
+    Application* app = (Application*)user_data;
+    ImageDecodeJob& job = app->image_decode_jobs[job_index];
+    int width, height, component_count;
+    stbi_uc* pixels = stbi_load_from_memory(
+        job.image->image.data(),
+        (int)job.image->image.size(),
+        &width,
+        &height,
+        &component_count,
+        4
+    );
+    if (pixels == nullptr || width != job.image->width || height != job.image->height) {
+        job.is_failed = true;
+    } else {
+        memcpy(job.staging_data, pixels, (size_t)width * height * 4);
+    }
+    stbi_image_free(pixels);
+}
+
 void Application::generate_mipmaps(Morpho::Vulkan::CommandBuffer* cmd) {
     texture_barriers.resize(model.textures.size());
     uint32_t max_mip_level = 0;
     for (uint32_t i = 0; i < model.textures.size(); i++) {
         auto& texture = model.textures[i];
-        auto gltf_image = model.images[texture.source];
+        const auto& gltf_image = model.images[texture.source];
         assert(gltf_image.component == 4);
         texture_barriers[i] = {
             .texture = textures[i],
@@ -1463,7 +2003,7 @@ void Application::generate_mipmaps(Morpho::Vulkan::CommandBuffer* cmd) {
     for (uint32_t mip_level = 1; mip_level < max_mip_level; mip_level++) {
         for (uint32_t i = 0; i < model.textures.size(); i++) {
             auto& texture = model.textures[i];
-            auto gltf_image = model.images[texture.source];
+            const auto& gltf_image = model.images[texture.source];
             uint32_t mip_count = (uint32_t)std::bit_width((uint32_t)std::max(gltf_image.width, gltf_image.height));
             if (mip_count <= mip_level) {
                 continue;
@@ -1534,58 +2074,105 @@ void Application::generate_mipmaps(Morpho::Vulkan::CommandBuffer* cmd) {
     texture_barriers.clear();
 }
 
-void Application::draw_model(
-    const tinygltf::Model& model,
-    Morpho::DrawStream* draw_stream,
-    Morpho::Handle<Morpho::Vulkan::Pipeline> normal_pipeline,
-    Morpho::Handle<Morpho::Vulkan::Pipeline> double_sided_pipeline
-) {
-    for (const auto& scene : model.scenes) {
-        draw_scene(model, scene, draw_stream, normal_pipeline, double_sided_pipeline);
-    }
-    currently_bound_pipeline = {};
-    current_material_index = -1;
-}
-
-void Application::draw_scene(
-    const tinygltf::Model& model,
-    const tinygltf::Scene& scene,
-    Morpho::DrawStream* draw_stream,
-    Morpho::Handle<Morpho::Vulkan::Pipeline> normal_pipeline,
-    Morpho::Handle<Morpho::Vulkan::Pipeline> double_sided_pipeline
-) {
-    for (const auto node_index : scene.nodes) {
-        draw_node(model, model.nodes[node_index], draw_stream, normal_pipeline, double_sided_pipeline);
-    }
-}
-
-void Application::draw_node(
-    const tinygltf::Model& model,
-    const tinygltf::Node& node,
-    Morpho::DrawStream* draw_stream,
-    Morpho::Handle<Morpho::Vulkan::Pipeline> normal_pipeline,
-    Morpho::Handle<Morpho::Vulkan::Pipeline> double_sided_pipeline
-) {
+void Application::collect_draw_items(const tinygltf::Node& node) {
     if (node.mesh >= 0) {
-        draw_mesh(model, node.mesh, draw_stream, normal_pipeline, double_sided_pipeline);
+        auto& mesh = model.meshes[node.mesh];
+        for (uint32_t i = 0; i < mesh.primitives.size(); i++) {
+            auto& primitive = mesh.primitives[i];
+            if (primitive.attributes.size() != 4 || primitive.indices < 0) {
+                continue;
+            }
+            if (primitive.material < 0) {
+                std::cout << "Primitive with no material" << std::endl;
+                continue;
+            }
+            draw_items.push_back({ .mesh_index = (uint32_t)node.mesh, .primitive_index = i, });
+        }
     }
     for (uint32_t i = 0; i < node.children.size(); i++) {
-        draw_node(model, model.nodes[node.children[i]], draw_stream, normal_pipeline, double_sided_pipeline);
+        collect_draw_items(model.nodes[node.children[i]]);
     }
 }
 
-void Application::draw_mesh(
-    const tinygltf::Model& model,
-    uint32_t mesh_index,
-    Morpho::DrawStream* draw_stream,
-    Morpho::Handle<Morpho::Vulkan::Pipeline> normal_pipeline,
-    Morpho::Handle<Morpho::Vulkan::Pipeline> double_sided_pipeline
-) {
-    for (uint32_t i = 0; i < model.meshes[mesh_index].primitives.size(); i++) {
-        draw_primitive(model, mesh_index, i, draw_stream, normal_pipeline, double_sided_pipeline);
+void Application::upload_geometry() {
+    // Same strides as the pipelines' vertex bindings, indexed by binding.
+    const uint32_t vertex_strides[] = { sizeof(float) * 3, sizeof(float) * 3, sizeof(float) * 2, sizeof(float) * 4, };
+    auto is_drawable = [](const tinygltf::Primitive& primitive) {
+        return primitive.attributes.size() == 4 && primitive.indices >= 0;
+    };
+    uint32_t vertex_count = 0;
+    uint32_t index_count = 0;
+    uint32_t primitive_count = 0;
+    mesh_first_primitive.resize(model.meshes.size());
+    for (uint32_t i = 0; i < model.meshes.size(); i++) {
+        mesh_first_primitive[i] = primitive_count;
+        for (auto& primitive : model.meshes[i].primitives) {
+            primitive_count++;
+            if (!is_drawable(primitive)) {
+                continue;
+            }
+            vertex_count += (uint32_t)model.accessors[primitive.attributes.begin()->second].count;
+            index_count += (uint32_t)model.accessors[primitive.indices].count;
+        }
+    }
+    primitive_geometry.resize(primitive_count);
+    Morpho::Vulkan::GeometryHeap::init(&geometry_heap, resource_manager, {
+        .vertex_stream_count = 4,
+        .vertex_strides = { vertex_strides[0], vertex_strides[1], vertex_strides[2], vertex_strides[3], },
+        .vertex_capacity = std::max(vertex_count, 1u),
+        .index_capacity = std::max(index_count, 1u),
+        .max_mesh_count = std::max(primitive_count, 1u),
+    });
+
+    std::vector<uint8_t> packed;
+    for (uint32_t mesh_index = 0; mesh_index < model.meshes.size(); mesh_index++) {
+        auto& mesh = model.meshes[mesh_index];
+        for (uint32_t primitive_index = 0; primitive_index < mesh.primitives.size(); primitive_index++) {
+            auto& primitive = mesh.primitives[primitive_index];
+            if (!is_drawable(primitive)) {
+                continue;
+            }
+            auto& index_accessor = model.accessors[primitive.indices];
+            auto& geometry = primitive_geometry[mesh_first_primitive[mesh_index] + primitive_index];
+            bool allocated = geometry_heap.allocate(
+                (uint32_t)model.accessors[primitive.attributes.begin()->second].count,
+                (uint32_t)index_accessor.count,
+                &geometry
+            );
+            assert(allocated);
+            for (auto& key_value : primitive.attributes) {
+                auto binding_it = attribute_name_to_binding.find(key_value.first);
+                if (binding_it == attribute_name_to_binding.end()) {
+                    continue;
+                }
+                auto binding = binding_it->second;
+                auto& accessor = model.accessors[key_value.second];
+                auto& buffer_view = model.bufferViews[accessor.bufferView];
+                assert(accessor.count == geometry.vertex_count);
+                const uint8_t* data = model.buffers[buffer_view.buffer].data.data()
+                    + buffer_view.byteOffset + accessor.byteOffset;
+                uint32_t stride = (uint32_t)accessor.ByteStride(buffer_view);
+                if (stride != vertex_strides[binding]) {
+                    // Interleaved in the file, streams in the heap are tightly packed.
+                    packed.resize(geometry.vertex_count * vertex_strides[binding]);
+                    for (uint32_t i = 0; i < geometry.vertex_count; i++) {
+                        memcpy(&packed[i * vertex_strides[binding]], data + i * stride, vertex_strides[binding]);
+                    }
+                    data = packed.data();
+                }
+                geometry_heap.upload_vertices(geometry, binding, data);
+            }
+            auto& buffer_view = model.bufferViews[index_accessor.bufferView];
+            geometry_heap.upload_indices(
+                geometry,
+                model.buffers[buffer_view.buffer].data.data() + buffer_view.byteOffset + index_accessor.byteOffset,
+                gltf_to_index_type(index_accessor.type, index_accessor.componentType)
+            );
+        }
     }
 }
 
+// NOTE: called from worker threads, must only read Application state.
 void Application::draw_primitive(
     const tinygltf::Model& model,
     uint32_t mesh_index,
@@ -1595,58 +2182,22 @@ void Application::draw_primitive(
     Morpho::Handle<Morpho::Vulkan::Pipeline> double_sided_pipeline
 ) {
     auto& primitive = model.meshes[mesh_index].primitives[primitive_index];
-    if (primitive.attributes.size() != 4) {
-        return;
-    }
-    if (primitive.material < 0) {
-        std::cout << "Primitive with no material" << std::endl;
-        return;
-    }
-    if (primitive.material != current_material_index) {
-        auto& material = model.materials[primitive.material];
-        draw_stream->bind_descriptor_set(material_descriptor_sets[primitive.material], 2);
-        auto& pipeline_to_bind = material.doubleSided ? double_sided_pipeline : normal_pipeline;
-        if (current_material_index < 0 || currently_bound_pipeline != pipeline_to_bind) {
-            draw_stream->bind_pipeline(pipeline_to_bind);
-            if (primitive_index != 0) {
-                draw_stream->bind_descriptor_set(mesh_descriptor_sets[mesh_index], 3);
-            }
-            currently_bound_pipeline = pipeline_to_bind;
-        }
-        current_material_index = primitive.material;
-    }
-    if (primitive_index == 0) {
-        draw_stream->bind_descriptor_set(mesh_descriptor_sets[mesh_index], 3);
-    }
-    for (auto& key_value : primitive.attributes) {
-        if (attribute_name_to_location.find(key_value.first) == attribute_name_to_location.end()) {
-            continue;
-        }
-        auto binding = attribute_name_to_binding.find(key_value.first)->second;
-        auto accessor_index = key_value.second;
-        auto& accessor = model.accessors[accessor_index];
-        auto& buffer_view = model.bufferViews[accessor.bufferView];
-        draw_stream->bind_vertex_buffer(
-            buffers[buffer_view.buffer],
-            binding,
-            accessor.byteOffset + buffer_view.byteOffset
-        );
-    }
-    if (primitive.indices >= 0) {
-        auto& accessor = model.accessors[primitive.indices];
-        auto& buffer_view = model.bufferViews[accessor.bufferView];
-        auto index_type = gltf_to_index_type(accessor.type, accessor.componentType);
-        assert(index_type == VK_INDEX_TYPE_UINT16);
-        auto index_count = (uint32_t)accessor.count;
-        draw_stream->bind_index_buffer(
-            buffers[buffer_view.buffer],
-            accessor.byteOffset + buffer_view.byteOffset
-        );
-        draw_stream->draw_indexed(
-            index_count,
-            0
-        );
+    auto& material = model.materials[primitive.material];
+    auto& geometry = primitive_geometry[mesh_first_primitive[mesh_index] + primitive_index];
+    // DrawStream skips rebinding the same handles, so there is no need to track bound state here.
+    draw_stream->bind_pipeline(material.doubleSided ? double_sided_pipeline : normal_pipeline);
+    draw_stream->bind_descriptor_set(material_descriptor_sets[primitive.material], 2);
+    draw_stream->bind_descriptor_set(mesh_descriptor_sets[mesh_index], 3);
+    // Every primitive lives in the geometry heap, these binds are the same for all draws and the stream drops them.
+    for (uint32_t binding = 0; binding < geometry_heap.get_vertex_stream_count(); binding++) {
+        draw_stream->bind_vertex_buffer(geometry_heap.get_vertex_buffer(binding), binding, 0);
     }
+    draw_stream->bind_index_buffer(geometry_heap.get_index_buffer(), 0, VK_INDEX_TYPE_UINT32);
+    draw_stream->draw_indexed(
+        geometry.index_count,
+        geometry.indices.offset,
+        (int32_t)geometry.vertices.offset
+    );
 }
 
 struct hash_pair {
@@ -17,8 +17,11 @@
 #include <tiny_gltf.h>
 #include <filesystem>
 #include "vulkan/resource_manager.hpp"
+#include "vulkan/draw_capture.hpp"
+#include "vulkan/geometry_heap.hpp"
 #include "common/draw_stream.hpp"
 #include "common/frame_pool.hpp"
+#include "common/job_system.hpp"
 
 struct Vertex {
     glm::vec3 position;
@@ -131,16 +134,80 @@ struct ModelUniform {
     glm::mat4 inverse_transpose_transform;
 };
 
+struct DrawItem {
+    uint32_t mesh_index;
+    uint32_t primitive_index;
+};
+
+// Render pass whose draws are recorded on worker threads, one secondary command buffer per chunk.
+struct DrawPass {
+    const char* name;
+    Morpho::Vulkan::DrawPassInfo info;
+    uint32_t first_chunk;
+    uint32_t chunk_count;
+    // Sum of the chunk stats, filled once the chunks are recorded.
+    Morpho::Vulkan::DrawStreamStats stats;
+};
+
+// Draws of a chunk kept across frames, indexed by chunk and frame in flight.
+// Only invalidated segments are recorded again, the whole stream is dropped when the chunk draws something else.
+// Front to back chunks are dropped whenever the view moves, so they only save recording while it stands still.
+struct RetainedChunk {
+    Morpho::DrawStream stream;
+    Morpho::DrawStream::SortPolicy sort_policy;
+    Morpho::Handle<Morpho::Vulkan::DescriptorSet> light_ds;
+    Morpho::Handle<Morpho::Vulkan::Pipeline> normal_pipeline;
+    Morpho::Handle<Morpho::Vulkan::Pipeline> double_sided_pipeline;
+    // Streams resolve lazily compiled pipelines to their fallbacks until they are ready.
+    uint32_t pipeline_generation;
+    uint32_t first_item;
+    uint32_t item_count;
+};
+
+struct DrawChunk {
+    uint32_t pass_index;
+    uint32_t retained_index;
+    Morpho::DrawStream::SortPolicy sort_policy;
+    // Depth only passes drop material and non-position bindings, so they get the lighter decoder.
+    uint32_t stream_fields;
+    Morpho::Handle<Morpho::Vulkan::DescriptorSet> light_ds;
+    Morpho::Handle<Morpho::Vulkan::Pipeline> normal_pipeline;
+    Morpho::Handle<Morpho::Vulkan::Pipeline> double_sided_pipeline;
+    uint32_t first_item;
+    uint32_t item_count;
+    Morpho::Vulkan::DrawStreamStats stats;
+};
+
+struct ImageDecodeJob {
+    const tinygltf::Image* image;
+    uint32_t image_index;
+    // Mapped staging memory of the texture's mip 0.
+    uint8_t* staging_data;
+    // Headers can be read from corrupt images, so decoding may still fail. Handled on the main thread.
+    bool is_failed;
+};
+
 class Application {
 public:
     void init();
     void run();
     void set_graphics_context(Morpho::Vulkan::Context* context);
     bool load_scene(std::filesystem::path file_path);
+    // F12 writes the draw passes of the next frame there, see DrawCaptureRecorder.
+    void set_capture_path(const char* path);
 
 private:
     static const uint32_t frame_in_flight_count = 2;
+    // Every frame slot has grown its arenas and command buffers by then.
+    static const uint32_t frame_growth_warmup_count = 8;
     static const uint32_t max_light_count = 128;
+    // Smaller chunks cost more in secondary command buffer overhead than they win back in parallelism.
+    static const uint32_t min_draws_per_chunk = 64;
+    // Granularity of retained stream invalidation for unsorted chunks. Draws only sort within a segment,
+    // so sorted chunks are a single segment.
+    static const uint32_t retained_segment_item_count = 32;
+    // get_stats walks every live resource, so the window shows a snapshot taken this often.
+    static const uint32_t resource_stats_refresh_frame_count = 60;
     // Stick with depth only format for now to avoid creating view by aspect.
     // (For depth + stencil format attachment requires both DEPTH and STENCIL even if stencil is not used,
     // but to sample depth texture we need view with only DEPTH aspect,
@@ -195,23 +262,40 @@ private:
     Morpho::Handle<Morpho::Vulkan::Sampler> shadow_sampler;
     Morpho::Handle<Morpho::Vulkan::Texture> white_texture;
     Morpho::Handle<Morpho::Vulkan::Texture> depth_buffer;
-    std::vector<Morpho::Handle<Morpho::Vulkan::Buffer>> buffers;
+    Morpho::Vulkan::GeometryHeap geometry_heap{};
+    // Geometry of model.meshes[i].primitives[j] is primitive_geometry[mesh_first_primitive[i] + j].
+    std::vector<uint32_t> mesh_first_primitive;
+    std::vector<Morpho::Vulkan::GeometryAllocation> primitive_geometry;
     std::vector<Morpho::Handle<Morpho::Vulkan::Texture>> textures;
+    // Uploads are batched, the last ticket covers every texture.
+    Morpho::Vulkan::UploadTicket texture_upload_ticket{};
+    // model.images hold encoded images until upload_textures decodes them.
+    std::vector<ImageDecodeJob> image_decode_jobs;
     std::vector<Morpho::Handle<Morpho::Vulkan::Sampler>> samplers;
     Morpho::Handle<Morpho::Vulkan::Buffer> globals_buffer;
     FixedSizeAllocator globals_allocator;
     Morpho::Handle<Morpho::Vulkan::DescriptorSet> global_descriptor_sets[frame_in_flight_count];
-    Morpho::Handle<Morpho::Vulkan::Buffer> material_buffer;
-    FixedSizeAllocator material_buffer_allocator;
+    ObjectPool material_pool;
+    // ObjectPool slot of every material.
+    std::vector<uint32_t> material_slots;
     std::vector<Morpho::Handle<Morpho::Vulkan::DescriptorSet>> material_descriptor_sets;
     std::vector<Morpho::Handle<Morpho::Vulkan::DescriptorSet>> light_descriptor_sets;
     Morpho::Handle<Morpho::Vulkan::DescriptorSet> shadow_map_visualization_descriptor_set[frame_in_flight_count];
-    Morpho::Handle<Morpho::Vulkan::Buffer> mesh_uniforms;
-    FixedSizeAllocator mesh_uniforms_allocator;
+    ObjectPool mesh_uniform_pool;
+    // ObjectPool slot of every mesh.
+    std::vector<uint32_t> mesh_uniform_slots;
     std::vector<Morpho::Handle<Morpho::Vulkan::DescriptorSet>> mesh_descriptor_sets;
+    // World space origin of every mesh, used for draw sort keys.
+    std::vector<glm::vec3> mesh_positions;
+    glm::mat4 sort_view = glm::mat4(1.0f);
+    // Front to back segments are recorded again whenever the view moves.
+    bool is_sort_view_changed = true;
     std::vector<Morpho::Handle<Morpho::Vulkan::DescriptorSet>> cube_map_face_descriptor_sets;
     uint32_t frames_total = 0;
     uint32_t frame_index = 0;
+    Morpho::Vulkan::ResourceStats resource_stats{};
+    uint32_t resource_stats_frame = 0;
+    bool has_resource_stats = false;
     std::vector<Light> lights;
     DirectionalLight sun { glm::normalize(glm::vec3(0.0f, -1.0f, 0.0f)), glm::vec3(1.0f, 1.0f, 1.0f) };
     Morpho::Handle<Morpho::Vulkan::Texture> cascaded_shadow_maps;
@@ -219,7 +303,19 @@ private:
     Morpho::Handle<Morpho::Vulkan::Texture> directional_shadow_maps[cascade_count];
     Morpho::Handle<Morpho::Vulkan::DescriptorSet> directional_shadow_map_descriptor_sets[frame_in_flight_count * cascade_count];
     Morpho::FramePool<Morpho::DrawStream*> draw_stream_pool;
-    UniformBufferBumpAllocator per_frame_uniforms;
+    Morpho::JobSystem job_system;
+    // One per job system thread, indexed by thread_index.
+    std::vector<Morpho::Vulkan::CmdPool*> cmd_pools;
+    std::vector<DrawItem> draw_items;
+    std::vector<DrawPass> draw_passes;
+    std::vector<DrawChunk> draw_chunks;
+    std::vector<RetainedChunk> retained_chunks;
+    std::vector<Morpho::Vulkan::CommandBuffer*> chunk_secondaries;
+    RingBufferAllocator per_frame_uniforms;
+    RingBufferAllocator per_frame_indirect_commands;
+    Morpho::Vulkan::DrawCaptureRecorder capture_recorder;
+    const char* capture_path = nullptr;
+    bool is_capture_requested = false;
 
     bool debug_mode = false;
     uint32_t current_light_index = 0;
@@ -235,8 +331,6 @@ private:
     bool is_mouse_pressed = false;
     tinygltf::TinyGLTF loader;
     tinygltf::Model model;
-    int current_material_index = -1;
-    Morpho::Handle<Morpho::Vulkan::Pipeline> currently_bound_pipeline = Morpho::Handle<Morpho::Vulkan::Pipeline>::null();
     // Perhaps should be retrieved via reflection.
     std::map<std::string, uint32_t> attribute_name_to_location = {
         {"POSITION", 0},
@@ -268,32 +362,20 @@ private:
     void calculate_cascades();
     Key glfw_key_code_to_key(int code);
     void generate_mipmaps(Morpho::Vulkan::CommandBuffer* cmd);
-    void draw_model(
-        const tinygltf::Model& model,
-        Morpho::DrawStream* draw_stream,
-        Morpho::Handle<Morpho::Vulkan::Pipeline> normal_pipeline,
-        Morpho::Handle<Morpho::Vulkan::Pipeline> double_sided_pipeline
-    );
-    void draw_scene(
-        const tinygltf::Model& model,
-        const tinygltf::Scene& scene,
-        Morpho::DrawStream* draw_stream,
-        Morpho::Handle<Morpho::Vulkan::Pipeline> normal_pipeline,
-        Morpho::Handle<Morpho::Vulkan::Pipeline> double_sided_pipeline
-    );
-    void draw_node(
-        const tinygltf::Model& model,
-        const tinygltf::Node& node,
-        Morpho::DrawStream* draw_stream,
-        Morpho::Handle<Morpho::Vulkan::Pipeline> normal_pipeline,
-        Morpho::Handle<Morpho::Vulkan::Pipeline> double_sided_pipeline
-    );
-    void draw_mesh(
-        const tinygltf::Model& model,
-        uint32_t mesh_index,
-        Morpho::DrawStream* draw_stream,
-        Morpho::Handle<Morpho::Vulkan::Pipeline> normal_pipeline,
-        Morpho::Handle<Morpho::Vulkan::Pipeline> double_sided_pipeline
+    void collect_draw_items(const tinygltf::Node& node);
+    void upload_geometry();
+    void upload_textures(const std::vector<VkFormat>& texture_formats);
+    static void decode_image(void* user_data, uint32_t job_index, uint32_t thread_index);
+    static bool load_image_header(
+        tinygltf::Image* image,
+        const int image_index,
+        std::string* err,
+        std::string* warn,
+        int req_width,
+        int req_height,
+        const unsigned char* bytes,
+        int size,
+        void* user_data
     );
     void draw_primitive(
         const tinygltf::Model& model,
@@ -303,18 +385,25 @@ private:
         Morpho::Handle<Morpho::Vulkan::Pipeline> normal_pipeline,
         Morpho::Handle<Morpho::Vulkan::Pipeline> double_sided_pipeline
     );
-    void render_depth_pass_for_spot_light(
-        Morpho::Vulkan::CommandBuffer* cmd,
-        const Light& spot_ligt
-    );
-    void render_depth_pass_for_directional_light(Morpho::Vulkan::CommandBuffer* cmd);
-    void render_z_prepass(Morpho::DrawStream* draw_stream);
+    void add_depth_pass_for_spot_light(const Light& light);
+    void add_depth_passes_for_directional_light();
     void begin_color_pass(Morpho::Vulkan::CommandBuffer* cmd);
-    void render_color_pass_for_directional_light(Morpho::DrawStream* stream);
-    void render_color_pass_for_spotlight(
-        Morpho::DrawStream* stream,
-        const Light& light
+    void add_color_pass();
+    uint32_t add_draw_pass(const char* name, const Morpho::Vulkan::DrawPassInfo& info);
+    void add_draw_chunks(
+        uint32_t pass_index,
+        Morpho::DrawStream::SortPolicy sort_policy,
+        uint32_t stream_fields,
+        Morpho::Handle<Morpho::Vulkan::DescriptorSet> light_ds,
+        Morpho::Handle<Morpho::Vulkan::Pipeline> normal_pipeline,
+        Morpho::Handle<Morpho::Vulkan::Pipeline> double_sided_pipeline
     );
+    void record_draw_chunks();
+    void capture_draw_passes();
+    void draw_stats_gui();
+    void resource_stats_gui();
+    static void record_draw_chunk(void* user_data, uint32_t chunk_index, uint32_t thread_index);
+    void execute_draw_passes(Morpho::Vulkan::CommandBuffer* cmd, uint32_t first_pass, uint32_t last_pass);
     void add_light(Light light);
     Morpho::Handle<Morpho::Vulkan::Shader> load_shader(const std::string& path);
     static void process_keyboard_input(GLFWwindow* window, int key, int scancode, int action, int mods);
@@ -3,15 +3,37 @@
 #include <filesystem>
 #include <iostream>
 #include <vector>
+#include <cstdlib>
+#include <cstring>
 #include "math.hpp"
 
 int main(int argc, char* argv[]) {
     Application app;
     auto context = new Morpho::Vulkan::Context();
     app.set_graphics_context(context);
-    if (!app.load_scene(argv[1])) {
+    // Sandbox <scene> [draw capture path] [--staging-budget-mib=<size>]
+    // A staging budget smaller than the scene's textures loads them in several waves.
+    const char* staging_budget_option = "--staging-budget-mib=";
+    std::vector<const char*> arguments;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], staging_budget_option, strlen(staging_budget_option)) == 0) {
+            uint64_t size_mib = strtoull(argv[i] + strlen(staging_budget_option), nullptr, 10);
+            context->set_staging_budget(size_mib * 1024 * 1024);
+        } else {
+            arguments.push_back(argv[i]);
+        }
+    }
+    if (arguments.empty()) {
+        std::cerr << "Usage: Sandbox <scene> [draw capture path] [--staging-budget-mib=<size>]" << std::endl;
+        return 1;
+    }
+    if (arguments.size() > 1) {
+        app.set_capture_path(arguments[1]);
+    }
+    if (!app.load_scene(arguments[0])) {
         return 1;
     }
     app.run();
+    delete context;
     return 0;
 }
@@ -1,6 +1,7 @@
 #include "allocators.hpp"
 #include "common/utils.hpp"
 #include "stb_ds.h"
+#include <algorithm>
 
 using namespace Morpho;
 using namespace Morpho::Vulkan;
@@ -38,60 +39,177 @@ uint8_t* FixedSizeAllocator::get_mapped_ptr(uint64_t index) {
     return mapped + get_offset(index);
 }
 
+void ObjectPool::init(const ObjectPoolInfo& info, ObjectPool* pool) {
+    assert(pool != nullptr);
+    assert(info.resource_manager != nullptr);
+    assert(is_pow2(info.offset_alignment));
+    assert(info.page_item_count != 0);
+    assert(info.map != BufferMap::NONE);
+    pool->resource_manager = info.resource_manager;
+    pool->aligned_item_size = align_up_pow2(info.item_size, info.offset_alignment);
+    pool->page_item_count = info.page_item_count;
+    pool->usage = info.usage;
+    pool->map = info.map;
+    pool->pages = nullptr;
+    pool->free_slots = nullptr;
+    pool->next_slot = 0;
+    pool->count = 0;
+}
+
+void ObjectPool::destroy() {
+    for (uint32_t i = 0; i < arrlen(pages); i++) {
+        resource_manager->unmap_buffer(pages[i].buffer);
+    }
+    arrfree(pages);
+    arrfree(free_slots);
+}
+
+uint32_t ObjectPool::allocate() {
+    uint32_t index;
+    if (arrlen(free_slots) > 0) {
+        index = arrpop(free_slots);
+    } else {
+        index = next_slot++;
+        if (index / page_item_count == arrlen(pages)) {
+            Page page{};
+            page.buffer = resource_manager->create_buffer(
+                {
+                    .size = aligned_item_size * page_item_count,
+                    .usage = usage,
+                    .map = map,
+                },
+                &page.mapped
+            );
+            arrput(pages, page);
+        }
+    }
+    count++;
+    memset(get_mapped_ptr(index), 0, aligned_item_size);
+    return index;
+}
+
+void ObjectPool::free(uint32_t index) {
+    assert(index < next_slot);
+    assert(count > 0);
+    arrput(free_slots, index);
+    count--;
+}
+
+Handle<Buffer> ObjectPool::get_buffer(uint32_t index) {
+    assert(index < next_slot);
+    return pages[index / page_item_count].buffer;
+}
+
+uint64_t ObjectPool::get_offset(uint32_t index) {
+    assert(index < next_slot);
+    return (index % page_item_count) * aligned_item_size;
+}
+
+uint8_t* ObjectPool::get_mapped_ptr(uint32_t index) {
+    return pages[index / page_item_count].mapped + get_offset(index);
+}
+
+uint64_t ObjectPool::get_item_size() {
+    return aligned_item_size;
+}
+
+uint32_t ObjectPool::get_count() {
+    return count;
+}
+
+uint32_t ObjectPool::get_page_count() {
+    return (uint32_t)arrlen(pages);
+}
+
 void UniformBufferBumpAllocator::init(
         const UniformBufferBumpAllocatorInfo& info,
         UniformBufferBumpAllocator* allocator
 ) {
     assert(allocator != nullptr);
     assert(info.frames_in_flight_count != 0);
+    assert(info.thread_count != 0);
     assert(is_pow2(info.alignment));
-    memset(allocator, 0, sizeof(UniformBufferBumpAllocator));
     allocator->resource_manager = info.resource_manager;
     allocator->backing_buffer_size = info.backing_buffer_size;
     allocator->alignment = info.alignment;
+    allocator->frame = 0;
     allocator->frames_in_flight_count = info.frames_in_flight_count;
+    allocator->usage = info.usage;
+    allocator->chunk_size = align_up_pow2(info.chunk_size, info.alignment);
+    assert(allocator->chunk_size <= allocator->backing_buffer_size);
+    allocator->thread_count = info.thread_count;
+    allocator->thread_chunks = new ThreadChunk[info.thread_count]{};
+    allocator->frame_buffer_count = 0;
+    // Looks like a full buffer, so the first chunk takes a backing buffer.
+    allocator->cursor.store(allocator->backing_buffer_size, std::memory_order_relaxed);
+    allocator->free_buffers = nullptr;
+    allocator->used_buffers = nullptr;
 }
 
-UniformAllocation UniformBufferBumpAllocator::allocate(uint64_t size) {
-    assert(size <= backing_buffer_size);
-    if (arrlen(used_buffers) > 0) {
-        UsedBuffer* buffer = &arrlast(used_buffers);
-        if (buffer->frame == frame && buffer->used_offset + size <= backing_buffer_size) {
-            UniformAllocation result = {
-                .buffer = buffer->buffer,
-                .offset = buffer->used_offset,
-                .ptr = buffer->base_ptr + buffer->used_offset,
-            };
-            buffer->used_offset += size;
-            buffer->used_offset = align_up_pow2(buffer->used_offset, alignment);
-            return result;
+UniformAllocation UniformBufferBumpAllocator::allocate(uint64_t size, uint32_t thread_index) {
+    assert(thread_index < thread_count);
+    uint64_t aligned_size = align_up_pow2(size, alignment);
+    assert(aligned_size <= backing_buffer_size);
+    ThreadChunk* chunk = &thread_chunks[thread_index];
+    if (chunk->offset + aligned_size > chunk->end) {
+        acquire_chunk(chunk, std::max(aligned_size, chunk_size));
+    }
+    UniformAllocation result = {
+        .buffer = chunk->buffer,
+        .offset = chunk->offset,
+        .ptr = chunk->base_ptr + chunk->offset,
+    };
+    chunk->offset += aligned_size;
+    return result;
+}
+
+void UniformBufferBumpAllocator::acquire_chunk(ThreadChunk* chunk, uint64_t size) {
+    while (true) {
+        uint64_t state = cursor.fetch_add(size, std::memory_order_acquire);
+        uint64_t buffer_index = state >> cursor_offset_bits;
+        uint64_t offset = state & cursor_offset_mask;
+        if (buffer_index != 0 && offset + size <= backing_buffer_size) {
+            const FreeBuffer& buffer = frame_buffers[buffer_index - 1];
+            *chunk = { .buffer = buffer.buffer, .base_ptr = buffer.base_ptr, .offset = offset, .end = offset + size, };
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        // Another thread may have switched buffers while this one waited for the lock.
+        if ((cursor.load(std::memory_order_relaxed) >> cursor_offset_bits) == buffer_index) {
+            assert(frame_buffer_count < max_frame_buffer_count);
+            frame_buffers[frame_buffer_count++] = acquire_buffer();
+            cursor.store((uint64_t)frame_buffer_count << cursor_offset_bits, std::memory_order_release);
         }
     }
+}
+
+UniformBufferBumpAllocator::FreeBuffer UniformBufferBumpAllocator::acquire_buffer() {
     if (arrlen(free_buffers) == 0) {
         Handle<Buffer> handle = resource_manager->create_buffer({
             .size = backing_buffer_size,
-            .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+            .usage = usage,
             .map = BufferMap::PERSISTENTLY_MAPPED,
         });
         FreeBuffer fb { .buffer = handle, .base_ptr = resource_manager->map_buffer(handle), };
         arrput(free_buffers, fb);
     }
-    FreeBuffer fb = arrpop(free_buffers);
-    UsedBuffer used{
-        .frame = frame,
-        .used_offset = align_up_pow2(size, alignment),
-        .buffer = fb.buffer,
-        .base_ptr = fb.base_ptr,
-    };
-    arrput(used_buffers, used);
-    return {
-        .buffer = used.buffer,
-        .offset = 0,
-        .ptr = used.base_ptr
-    };
+    return arrpop(free_buffers);
 }
 
 void UniformBufferBumpAllocator::next_frame() {
+    for (uint32_t i = 0; i < frame_buffer_count; i++) {
+        UsedBuffer used{
+            .frame = frame,
+            .buffer = frame_buffers[i].buffer,
+            .base_ptr = frame_buffers[i].base_ptr,
+        };
+        arrput(used_buffers, used);
+    }
+    frame_buffer_count = 0;
+    cursor.store(backing_buffer_size, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < thread_count; i++) {
+        thread_chunks[i] = {};
+    }
     frame++;
     uint64_t freed_count = 0;
     for (uint64_t i = 0; i < arrlen(used_buffers); i++) {
@@ -105,3 +223,102 @@ void UniformBufferBumpAllocator::next_frame() {
         arrdeln(used_buffers, 0, freed_count);
     }
 }
+
+void RingBufferAllocator::init(const RingBufferAllocatorInfo& info, RingBufferAllocator* allocator) {
+    assert(allocator != nullptr);
+    assert(info.frames_in_flight_count != 0 && info.frames_in_flight_count <= max_frames_in_flight_count);
+    assert(info.thread_count != 0);
+    assert(is_pow2(info.alignment));
+    assert(info.overflow != RingOverflow::WAIT || info.context != nullptr);
+    allocator->context = info.context;
+    allocator->size = align_down(info.size, info.alignment);
+    allocator->alignment = info.alignment;
+    allocator->chunk_size = align_up_pow2(info.chunk_size, info.alignment);
+    assert(allocator->chunk_size <= allocator->size);
+    allocator->frame = 0;
+    allocator->frames_in_flight_count = info.frames_in_flight_count;
+    allocator->overflow = info.overflow;
+    allocator->thread_count = info.thread_count;
+    allocator->thread_chunks = new ThreadChunk[info.thread_count]{};
+    allocator->head.store(0, std::memory_order_relaxed);
+    allocator->tail.store(0, std::memory_order_relaxed);
+    allocator->frame_start = 0;
+    memset(allocator->frame_ends, 0, sizeof(allocator->frame_ends));
+    allocator->buffer = info.resource_manager->create_buffer({
+        .size = allocator->size,
+        .usage = info.usage,
+        .map = BufferMap::PERSISTENTLY_MAPPED,
+    });
+    allocator->base_ptr = info.resource_manager->map_buffer(allocator->buffer);
+}
+
+UniformAllocation RingBufferAllocator::allocate(uint64_t size, uint32_t thread_index) {
+    assert(thread_index < thread_count);
+    uint64_t aligned_size = align_up_pow2(size, alignment);
+    assert(aligned_size <= this->size);
+    ThreadChunk* chunk = &thread_chunks[thread_index];
+    if (chunk->offset + aligned_size > chunk->end && !acquire_chunk(chunk, std::max(aligned_size, chunk_size))) {
+        return { .buffer = Handle<Buffer>::null(), .offset = 0, .ptr = nullptr, };
+    }
+    UniformAllocation result = {
+        .buffer = buffer,
+        .offset = chunk->offset,
+        .ptr = base_ptr + chunk->offset,
+    };
+    chunk->offset += aligned_size;
+    return result;
+}
+
+bool RingBufferAllocator::acquire_chunk(ThreadChunk* chunk, uint64_t size) {
+    uint64_t current = head.load(std::memory_order_relaxed);
+    while (true) {
+        // Chunks never straddle the end of the buffer, the rest of it is skipped.
+        uint64_t offset = current % this->size;
+        uint64_t start = offset + size > this->size ? current + this->size - offset : current;
+        uint64_t end = start + size;
+        if (end - tail.load(std::memory_order_acquire) <= this->size) {
+            if (head.compare_exchange_weak(current, end, std::memory_order_relaxed)) {
+                *chunk = { .offset = start % this->size, .end = start % this->size + size, };
+                return true;
+            }
+            continue;
+        }
+        if (overflow == RingOverflow::FAIL) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(overflow_mutex);
+        if (tail.load(std::memory_order_relaxed) == frame_start) {
+            assert(false && "Ring buffer is too small for a single frame.");
+            return false;
+        }
+        // Every submitted frame is done after this, only the current one still holds memory.
+        context->wait_queue_idle();
+        tail.store(frame_start, std::memory_order_release);
+        current = head.load(std::memory_order_relaxed);
+    }
+}
+
+void RingBufferAllocator::next_frame() {
+    uint64_t current = head.load(std::memory_order_relaxed);
+    frame_ends[frame % frames_in_flight_count] = current;
+    frame_start = current;
+    frame++;
+    // begin_frame waited for the frame that is frames_in_flight_count old now.
+    if (frame >= frames_in_flight_count) {
+        uint64_t retired_end = frame_ends[frame % frames_in_flight_count];
+        if (retired_end > tail.load(std::memory_order_relaxed)) {
+            tail.store(retired_end, std::memory_order_relaxed);
+        }
+    }
+    for (uint32_t i = 0; i < thread_count; i++) {
+        thread_chunks[i] = {};
+    }
+}
+
+Handle<Buffer> RingBufferAllocator::get_buffer() const {
+    return buffer;
+}
+
+uint64_t RingBufferAllocator::get_used_size() const {
+    return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_relaxed);
+}
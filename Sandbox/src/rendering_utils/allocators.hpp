@@ -1,6 +1,9 @@
 #pragma once
 #include "vulkan/resources.hpp"
 #include "vulkan/resource_manager.hpp"
+#include "vulkan/context.hpp"
+#include <atomic>
+#include <mutex>
 
 struct FixedSizeAllocatorInfo {
     Morpho::Vulkan::ResourceManager* resource_manager;
@@ -27,11 +30,64 @@ private:
     uint8_t* mapped;
 };
 
+struct ObjectPoolInfo {
+    Morpho::Vulkan::ResourceManager* resource_manager;
+    uint64_t item_size;
+    uint64_t offset_alignment;
+    // Slots per page, every page is a buffer of its own.
+    uint32_t page_item_count = 256;
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+    Morpho::Vulkan::BufferMap map = Morpho::Vulkan::BufferMap::PERSISTENTLY_MAPPED;
+};
+
+// Fixed size objects in mapped GPU buffers with runtime allocate and free.
+// Grows by chaining pages and never moves allocated objects, so their slot indices,
+// buffer ranges and descriptors pointing at them stay valid for the object's lifetime.
+// Shaders index a page's buffer with index % page_item_count.
+class ObjectPool {
+public:
+    static void init(const ObjectPoolInfo& info, ObjectPool* pool);
+    // Pages' buffers stay alive until ResourceManager is destroyed.
+    void destroy();
+    // Zeroed slot, freed slots are reused before new pages are added.
+    uint32_t allocate();
+    // The slot is handed out again by the next allocate, the GPU must be done with it.
+    void free(uint32_t index);
+    Morpho::Handle<Morpho::Vulkan::Buffer> get_buffer(uint32_t index);
+    uint64_t get_offset(uint32_t index);
+    uint8_t* get_mapped_ptr(uint32_t index);
+    uint64_t get_item_size();
+    uint32_t get_count();
+    uint32_t get_page_count();
+private:
+    struct Page {
+        Morpho::Handle<Morpho::Vulkan::Buffer> buffer;
+        uint8_t* mapped;
+    };
+
+    Morpho::Vulkan::ResourceManager* resource_manager;
+    uint64_t aligned_item_size;
+    uint32_t page_item_count;
+    VkBufferUsageFlags usage;
+    Morpho::Vulkan::BufferMap map;
+    Page* pages;
+    // Freed slots, reused in LIFO order.
+    uint32_t* free_slots;
+    // Slots at and after it were never handed out.
+    uint32_t next_slot;
+    uint32_t count;
+};
+
 struct UniformBufferBumpAllocatorInfo {
     Morpho::Vulkan::ResourceManager* resource_manager;
     uint64_t backing_buffer_size = 1024 * 1024 * 16;
     uint64_t alignment;
     uint64_t frames_in_flight_count;
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+    // Threads allocating at once, each passes its own thread_index below it.
+    uint32_t thread_count = 1;
+    // Threads carve chunks of this size out of backing buffers and bump allocate in them without contention.
+    uint64_t chunk_size = 64 * 1024;
 };
 
 struct UniformAllocation
@@ -48,12 +104,17 @@ public:
         UniformBufferBumpAllocator* allocator
     );
 
-    UniformAllocation allocate(uint64_t size);
+    // Can run on several threads at once as long as each uses its own thread_index.
+    UniformAllocation allocate(uint64_t size, uint32_t thread_index = 0);
+    // Not thread-safe, retires every thread's chunk.
     void next_frame();
 private:
+    static const uint32_t max_frame_buffer_count = 64;
+    static const uint64_t cursor_offset_bits = 48;
+    static const uint64_t cursor_offset_mask = (1ull << cursor_offset_bits) - 1;
+
     struct UsedBuffer {
         uint64_t frame;
-        uint64_t used_offset;
         Morpho::Handle<Morpho::Vulkan::Buffer> buffer;
         uint8_t* base_ptr;
     };
@@ -63,11 +124,101 @@ private:
         uint8_t* base_ptr;
     };
 
+    // Padded so threads bumping their own chunks don't share cache lines.
+    struct alignas(64) ThreadChunk {
+        Morpho::Handle<Morpho::Vulkan::Buffer> buffer;
+        uint8_t* base_ptr;
+        uint64_t offset;
+        uint64_t end;
+    };
+
     Morpho::Vulkan::ResourceManager* resource_manager;
     uint64_t backing_buffer_size;
     uint64_t alignment;
     uint64_t frame;
     uint64_t frames_in_flight_count;
+    VkBufferUsageFlags usage;
+    uint64_t chunk_size;
+    uint32_t thread_count;
+    ThreadChunk* thread_chunks;
+    // Backing buffers chunks were carved from this frame.
+    FreeBuffer frame_buffers[max_frame_buffer_count];
+    uint32_t frame_buffer_count;
+    // Index + 1 of the frame buffer chunks are carved from in the high bits, 0 if there is none yet,
+    // offset of the next chunk in the low bits.
+    std::atomic<uint64_t> cursor;
+    // Guards switching to a new backing buffer and the lists below.
+    std::mutex mutex;
     FreeBuffer* free_buffers;
     UsedBuffer* used_buffers;
+
+    void acquire_chunk(ThreadChunk* chunk, uint64_t size);
+    FreeBuffer acquire_buffer();
+};
+
+enum class RingOverflow {
+    // Waits for the GPU to drain the previous frames, fails if the current frame alone doesn't fit.
+    WAIT,
+    // Returns an allocation with null buffer and ptr.
+    FAIL,
+};
+
+struct RingBufferAllocatorInfo {
+    Morpho::Vulkan::ResourceManager* resource_manager;
+    // Needed for RingOverflow::WAIT.
+    Morpho::Vulkan::Context* context;
+    uint64_t size = 1024 * 1024 * 32;
+    uint64_t alignment;
+    uint64_t frames_in_flight_count;
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+    RingOverflow overflow = RingOverflow::WAIT;
+    // Same as UniformBufferBumpAllocatorInfo.
+    uint32_t thread_count = 1;
+    uint64_t chunk_size = 64 * 1024;
+};
+
+// Per-frame uploads of one usage class in a single persistently mapped buffer of fixed size.
+// Allocations of a frame are freed when the frame is frames_in_flight_count frames old, i.e. once
+// Context::begin_frame waited for its fence, so memory use is capped no matter how large a frame gets.
+// Every allocation lives in the same buffer, so descriptors pointing at it stay valid across frames.
+class RingBufferAllocator {
+public:
+    static void init(const RingBufferAllocatorInfo& info, RingBufferAllocator* allocator);
+
+    // Can run on several threads at once as long as each uses its own thread_index.
+    UniformAllocation allocate(uint64_t size, uint32_t thread_index = 0);
+    // Not thread-safe, call after Context::begin_frame.
+    void next_frame();
+    Morpho::Handle<Morpho::Vulkan::Buffer> get_buffer() const;
+    // Bytes held by frames still in flight, including the current one.
+    uint64_t get_used_size() const;
+private:
+    static const uint32_t max_frames_in_flight_count = 8;
+
+    struct alignas(64) ThreadChunk {
+        uint64_t offset;
+        uint64_t end;
+    };
+
+    Morpho::Vulkan::Context* context;
+    Morpho::Handle<Morpho::Vulkan::Buffer> buffer;
+    uint8_t* base_ptr;
+    uint64_t size;
+    uint64_t alignment;
+    uint64_t chunk_size;
+    uint64_t frame;
+    uint64_t frames_in_flight_count;
+    RingOverflow overflow;
+    uint32_t thread_count;
+    ThreadChunk* thread_chunks;
+    // Positions only grow, the offset into the buffer is position % size.
+    std::atomic<uint64_t> head;
+    // Everything before it was used by frames the GPU is done with.
+    std::atomic<uint64_t> tail;
+    uint64_t frame_start;
+    // Head at the end of each frame in flight, indexed by frame % frames_in_flight_count.
+    uint64_t frame_ends[max_frames_in_flight_count];
+    std::mutex overflow_mutex;
+
+    bool acquire_chunk(ThreadChunk* chunk, uint64_t size);
 };
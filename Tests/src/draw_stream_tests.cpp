@@ -0,0 +1,112 @@
+#include "common/draw_stream.hpp"
+#include "tests.hpp"
+
+namespace Morpho::Tests {
+
+static const uint32_t max_draw_count = 16;
+
+template<typename T>
+static T read(const uint8_t*& it) {
+    T value;
+    memcpy(&value, it, sizeof(value));
+    it += sizeof(value);
+    return value;
+}
+
+template<typename U, typename I>
+static void read_draw_parameters(const uint8_t*& it, uint32_t mask, DrawStream::DrawState* state) {
+    if (mask & DrawStream::INDEX_COUNT) {
+        state->index_count = read<U>(it);
+    }
+    if (mask & DrawStream::FIRST_INDEX) {
+        state->first_index = read<U>(it);
+    }
+    if (mask & DrawStream::VERTEX_OFFSET) {
+        state->vertex_offset = read<I>(it);
+    }
+    if (mask & DrawStream::INSTANCE_COUNT) {
+        state->instance_count = read<U>(it);
+    }
+    if (mask & DrawStream::FIRST_INSTANCE) {
+        state->first_instance = read<U>(it);
+    }
+}
+
+// Decodes a stream recorded without binds, so records carry nothing but draw parameters.
+static uint32_t decode_draws(DrawStream* stream, DrawStream::DrawState* draws) {
+    uint64_t size = stream->get_size();
+    const uint8_t* it = stream->get_stream();
+    const uint8_t* end = it + size;
+    DrawStream::Header header = read<DrawStream::Header>(it);
+    CHECK(header.draw_count <= max_draw_count);
+    DrawStream::DrawState state{};
+    uint32_t draw_count = 0;
+    while (it < end) {
+        uint32_t mask = read<uint32_t>(it);
+        CHECK((mask & ~(DrawStream::draw_parameter_fields | DrawStream::COMPACT_DRAW_PARAMETERS)) == 0);
+        if (mask & DrawStream::COMPACT_DRAW_PARAMETERS) {
+            read_draw_parameters<uint16_t, int16_t>(it, mask, &state);
+        } else {
+            read_draw_parameters<uint32_t, int32_t>(it, mask, &state);
+        }
+        CHECK(draw_count < header.draw_count);
+        draws[draw_count++] = state;
+    }
+    CHECK(it == end);
+    CHECK(draw_count == header.draw_count);
+    return draw_count;
+}
+
+// Identical consecutive instances become one draw, anything in between closes it.
+static void test_merge_instances() {
+    DrawStream stream{};
+    stream.draw_instance(36, 0, 0, 10);
+    stream.draw_instance(36, 0, 0, 11);
+    stream.draw_instance(36, 0, 0, 12);
+    stream.draw_instance(6, 36, 24, 13);
+    stream.draw_instance(6, 36, 24, 14);
+    stream.draw_indexed(36, 0);
+    stream.draw_instance(36, 0, 0, 15);
+
+    DrawStream::DrawState draws[max_draw_count];
+    CHECK(decode_draws(&stream, draws) == 4);
+    CHECK(draws[0].index_count == 36 && draws[0].instance_count == 3 && draws[0].first_instance == 0);
+    CHECK(draws[1].index_count == 6 && draws[1].first_index == 36 && draws[1].vertex_offset == 24);
+    CHECK(draws[1].instance_count == 2 && draws[1].first_instance == 3);
+    CHECK(draws[2].index_count == 36 && draws[2].instance_count == 1 && draws[2].first_instance == 0);
+    CHECK(draws[3].index_count == 36 && draws[3].instance_count == 1 && draws[3].first_instance == 5);
+
+    const uint32_t expected_payloads[] = { 10, 11, 12, 13, 14, 15 };
+    CHECK(stream.get_instance_payload_count() == 6);
+    CHECK(memcmp(stream.get_instance_payloads(), expected_payloads, sizeof(expected_payloads)) == 0);
+    stream.destroy();
+}
+
+// Instances merge after sorting, payloads follow the sorted order so gl_InstanceIndex still finds them.
+static void test_merge_sorted_instances() {
+    DrawStream stream{};
+    stream.set_sort_policy(DrawStream::SortPolicy::FRONT_TO_BACK);
+    const float depths[] = { 4.0f, 3.0f, 2.0f, 1.0f };
+    const uint32_t index_counts[] = { 36, 36, 6, 6 };
+    for (uint32_t i = 0; i < 4; i++) {
+        stream.set_sort_depth(depths[i]);
+        stream.draw_instance(index_counts[i], 0, 0, i);
+    }
+
+    DrawStream::DrawState draws[max_draw_count];
+    CHECK(decode_draws(&stream, draws) == 2);
+    CHECK(draws[0].index_count == 6 && draws[0].instance_count == 2 && draws[0].first_instance == 0);
+    CHECK(draws[1].index_count == 36 && draws[1].instance_count == 2 && draws[1].first_instance == 2);
+
+    const uint32_t expected_payloads[] = { 3, 2, 1, 0 };
+    CHECK(stream.get_instance_payload_count() == 4);
+    CHECK(memcmp(stream.get_instance_payloads(), expected_payloads, sizeof(expected_payloads)) == 0);
+    stream.destroy();
+}
+
+void run_draw_stream_tests() {
+    test_merge_instances();
+    test_merge_sorted_instances();
+}
+
+}
@@ -0,0 +1,96 @@
+#include "common/generational_arena.hpp"
+#include "tests.hpp"
+#include <atomic>
+#include <thread>
+
+namespace Morpho::Tests {
+
+static const uint32_t thread_count = 8;
+static const uint32_t max_live_per_thread = 64;
+static const uint32_t iteration_count = 100000;
+static const uint32_t max_live_count = thread_count * max_live_per_thread;
+
+struct StressState {
+    GenerationalArena<uint32_t>* arena;
+    // Set while the index is live, so an index handed out twice is caught by whoever gets it second.
+    std::atomic<bool> is_index_owned[max_live_count];
+};
+
+static uint32_t next_random(uint32_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// Only the owning thread removes a handle, so its value can't change under it.
+static void remove_owned(StressState* state, Handle<uint32_t> handle) {
+    CHECK(state->is_index_owned[handle.index].exchange(false, std::memory_order_relaxed));
+    state->arena->remove(handle);
+    // The slot may already be live again under another generation.
+    CHECK(!state->arena->is_valid(handle));
+    uint32_t value;
+    CHECK(!state->arena->try_get(handle, &value));
+}
+
+static void stress_thread(StressState* state, uint32_t thread_index) {
+    Handle<uint32_t> handles[max_live_per_thread];
+    uint32_t values[max_live_per_thread];
+    uint32_t live_count = 0;
+    uint32_t random = thread_index * 7919 + 1;
+    for (uint32_t i = 0; i < iteration_count; i++) {
+        bool is_add = live_count == 0 || (live_count < max_live_per_thread && next_random(&random) % 2 == 0);
+        if (is_add) {
+            uint32_t value = thread_index << 24 | i;
+            Handle<uint32_t> handle = state->arena->add(value);
+            CHECK(handle.gen != 0 && handle.index < max_live_count);
+            CHECK(!state->is_index_owned[handle.index].exchange(true, std::memory_order_relaxed));
+            handles[live_count] = handle;
+            values[live_count] = value;
+            live_count++;
+        } else {
+            uint32_t slot = next_random(&random) % live_count;
+            remove_owned(state, handles[slot]);
+            live_count--;
+            handles[slot] = handles[live_count];
+            values[slot] = values[live_count];
+        }
+        // Every handle still owned resolves to its own value.
+        uint32_t slot = next_random(&random) % (live_count + 1);
+        if (slot < live_count) {
+            uint32_t value;
+            CHECK(state->arena->is_valid(handles[slot]));
+            CHECK(state->arena->try_get(handles[slot], &value) && value == values[slot]);
+        }
+    }
+    for (uint32_t i = 0; i < live_count; i++) {
+        remove_owned(state, handles[i]);
+    }
+}
+
+// Threads add, remove and look up at once. Freed indices are reused, so never more are handed out
+// than were live at a time.
+static void test_concurrent_add_remove() {
+    StressState* state = (StressState*)calloc(1, sizeof(StressState));
+    state->arena = (GenerationalArena<uint32_t>*)calloc(1, sizeof(GenerationalArena<uint32_t>));
+    std::thread threads[thread_count];
+    for (uint32_t i = 0; i < thread_count; i++) {
+        threads[i] = std::thread(stress_thread, state, i);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    ArenaStats stats = state->arena->get_stats();
+    CHECK(stats.live_count == 0);
+    CHECK(stats.used_count <= max_live_count);
+    CHECK(state->arena->get_count() == 0);
+    state->arena->destroy();
+    free(state->arena);
+    free(state);
+}
+
+void run_generational_arena_tests() {
+    test_concurrent_add_remove();
+}
+
+}
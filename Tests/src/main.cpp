@@ -0,0 +1,10 @@
+#include "tests.hpp"
+
+int main() {
+    Morpho::Tests::run_draw_stream_tests();
+    Morpho::Tests::run_generational_arena_tests();
+    Morpho::Tests::run_offset_allocator_tests();
+    Morpho::Tests::run_staging_ring_tests();
+    printf("All tests passed.\n");
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include "common/offset_allocator.hpp"
+#include "tests.hpp"
+
+namespace Morpho::Tests {
+
+static void fill_to_capacity(const uint32_t* sizes, uint32_t count) {
+    uint32_t capacity = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        capacity += sizes[i];
+    }
+    OffsetAllocator allocator = {};
+    OffsetAllocator::init(&allocator, capacity);
+    OffsetAllocation allocations[16];
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        allocations[i] = allocator.allocate(sizes[i]);
+        CHECK(allocations[i].node != OffsetAllocator::no_space);
+        CHECK(allocations[i].offset == offset);
+        offset += sizes[i];
+    }
+    OffsetAllocatorStats stats = allocator.get_stats();
+    CHECK(stats.free_size == 0);
+    CHECK(stats.free_range_count == 0);
+    CHECK(allocator.allocate(1).node == OffsetAllocator::no_space);
+
+    // Freed in a different order, everything merges back into one range.
+    for (uint32_t i = 0; i < count; i += 2) {
+        allocator.free(allocations[i]);
+    }
+    for (uint32_t i = 1; i < count; i += 2) {
+        allocator.free(allocations[i]);
+    }
+    stats = allocator.get_stats();
+    CHECK(stats.free_size == capacity);
+    CHECK(stats.free_range_count == 1);
+    CHECK(stats.largest_free_size == capacity);
+    CHECK(allocator.allocate(capacity).node != OffsetAllocator::no_space);
+    allocator.destroy();
+}
+
+// Sizes that aren't a size class exactly, they round up past the range left for them.
+static void test_fill_to_capacity() {
+    const uint32_t single[] = { 1000 };
+    fill_to_capacity(single, 1);
+    const uint32_t mixed[] = { 24, 1000, 36, 5001, 123 };
+    fill_to_capacity(mixed, 5);
+    const uint32_t small[] = { 1, 7, 9, 17, 33, 65 };
+    fill_to_capacity(small, 6);
+}
+
+// A hole of exactly the requested size is found even though it's binned below the request.
+static void test_fill_hole() {
+    OffsetAllocator allocator = {};
+    OffsetAllocator::init(&allocator, 4096, 16);
+    OffsetAllocation first = allocator.allocate(1000);
+    OffsetAllocation second = allocator.allocate(1000);
+    OffsetAllocation rest = allocator.allocate(2096);
+    CHECK(first.node != OffsetAllocator::no_space);
+    CHECK(second.node != OffsetAllocator::no_space);
+    CHECK(rest.node != OffsetAllocator::no_space);
+    allocator.free(first);
+    OffsetAllocation reused = allocator.allocate(1000);
+    CHECK(reused.node != OffsetAllocator::no_space);
+    CHECK(reused.offset == 0);
+    CHECK(allocator.get_stats().free_size == 0);
+    allocator.destroy();
+}
+
+void run_offset_allocator_tests() {
+    test_fill_to_capacity();
+    test_fill_hole();
+}
+
+}
@@ -0,0 +1,91 @@
+#include <stb_ds.h>
+#include "vulkan/staging_ring.hpp"
+#include "tests.hpp"
+
+namespace Morpho::Tests {
+
+using Vulkan::StagingRing;
+using Vulkan::StagingRingStats;
+
+static const uint32_t commit_stream = 0;
+static const uint32_t upload_stream = 1;
+
+// Streams more than the ring holds the way ResourceManager does: when an allocation fails
+// the oldest range's submit is made and waited for, then retired.
+static void test_fill_past_budget_drains() {
+    const uint64_t ring_size = 64 * 1024;
+    StagingRing ring = {};
+    StagingRing::init(&ring, ring_size, 16);
+
+    uint64_t submitted_values[StagingRing::max_stream_count] = {};
+    uint64_t completed_values[StagingRing::max_stream_count] = {};
+    uint64_t total_size = 0;
+    for (uint32_t i = 0; i < 200; i++) {
+        uint32_t stream = i % 3 == 0 ? commit_stream : upload_stream;
+        uint64_t requested_size = 1000 + (i * 7919) % 9000;
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        uint32_t wait_count = 0;
+        while (!ring.allocate(stream, requested_size, requested_size, &offset, &size)) {
+            uint32_t oldest_stream = 0;
+            uint64_t oldest_value = 0;
+            CHECK(ring.get_oldest(&oldest_stream, &oldest_value));
+            if (oldest_value == 0) {
+                oldest_value = ++submitted_values[oldest_stream];
+                ring.submit(oldest_stream, oldest_value);
+            }
+            completed_values[oldest_stream] = oldest_value;
+            ring.retire(completed_values);
+            CHECK(++wait_count < 16);
+        }
+        CHECK(size == requested_size);
+        CHECK(offset + size <= ring_size);
+        total_size += size;
+    }
+    CHECK(total_size > 4 * ring_size);
+
+    for (uint32_t stream = 0; stream < StagingRing::max_stream_count; stream++) {
+        ring.submit(stream, ++submitted_values[stream]);
+        completed_values[stream] = submitted_values[stream];
+    }
+    ring.retire(completed_values);
+    StagingRingStats stats = ring.get_stats();
+    CHECK(stats.used_size == 0);
+    CHECK(stats.range_count == 0);
+    CHECK(stats.peak_used_size <= ring_size);
+    uint32_t oldest_stream = 0;
+    uint64_t oldest_value = 0;
+    CHECK(!ring.get_oldest(&oldest_stream, &oldest_value));
+    ring.destroy();
+}
+
+// A range that was never submitted must not retire, whatever completed.
+static void test_unsubmitted_range_blocks() {
+    StagingRing ring = {};
+    StagingRing::init(&ring, 1024, 16);
+
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    CHECK(ring.allocate(upload_stream, 1024, 1024, &offset, &size));
+    CHECK(!ring.allocate(upload_stream, 16, 16, &offset, &size));
+
+    uint64_t completed_values[StagingRing::max_stream_count] = { 100, 100 };
+    ring.retire(completed_values);
+    CHECK(ring.get_stats().used_size == 1024);
+
+    ring.submit(upload_stream, 101);
+    ring.retire(completed_values);
+    CHECK(ring.get_stats().used_size == 1024);
+    completed_values[upload_stream] = 101;
+    ring.retire(completed_values);
+    CHECK(ring.get_stats().used_size == 0);
+    CHECK(ring.allocate(upload_stream, 1024, 1024, &offset, &size));
+    ring.destroy();
+}
+
+void run_staging_ring_tests() {
+    test_fill_past_budget_drains();
+    test_unsubmitted_range_blocks();
+}
+
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+
+// Unlike assert, stays on in release builds.
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            abort(); \
+        } \
+    } while (false)
+
+namespace Morpho::Tests {
+
+void run_draw_stream_tests();
+void run_generational_arena_tests();
+void run_offset_allocator_tests();
+void run_staging_ring_tests();
+
+}
@@ -107,3 +107,49 @@ project "Sandbox"
     postbuildcommands {
         "{COPYDIR} %[Sandbox/assets] %[build/bin/%{cfg.buildcfg}/assets]"
     }
+
+project "Replay"
+    kind "ConsoleApp"
+    language "C++"
+    targetdir "build/bin/%{cfg.buildcfg}"
+    files { "Replay/**.hpp", "Replay/**.cpp" }
+    location "build"
+    entrypoint "mainCRTStartup"
+    externalincludedirs {
+        os.getenv("VULKAN_SDK") .. "/Include",
+        "ThirdParty/glfw/include",
+        "ThirdParty/VulkanMemoryAllocator/include",
+        "ThirdParty/stb",
+    }
+    includedirs {
+        "Morpho",
+    }
+    libdirs {
+        os.getenv("VULKAN_SDK") .. "/Lib",
+    }
+    dependson { "Morpho", "GLFW" }
+    links {
+        "Morpho",
+        "vulkan-1",
+        "GLFW"
+    }
+    debugdir "build/bin/%{cfg.buildcfg}"
+
+project "Tests"
+    kind "ConsoleApp"
+    language "C++"
+    targetdir "build/bin/%{cfg.buildcfg}"
+    files { "Tests/**.hpp", "Tests/**.cpp" }
+    location "build"
+    entrypoint "mainCRTStartup"
+    externalincludedirs {
+        "ThirdParty/stb",
+    }
+    includedirs {
+        "Morpho",
+        "Tests",
+    }
+    dependson { "Morpho" }
+    links {
+        "Morpho",
+    }